@@ -2,18 +2,32 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
 #include <json-c/json.h>
 
+#include "page_asset.h"
+
 #define DEFAULT_OLLAMA_URL "http://127.0.0.1:11434/api/generate"
 #define SYSTEM_PROMPT                                                                                 \
     "You are a helpful and creative AI assistant in a conversation with other friendly AI "        \
@@ -27,25 +41,277 @@
 #define MAX_MODEL_LENGTH 256
 #define MIN_TURNS 1
 #define MAX_TURNS 12
+#define ARENA_MIN_BLOCK 16384
+#define ARENA_MAX_BLOCK 1048576
+#define ARENA_ALIGNMENT 16
+#define JSON_WRITER_MAX_DEPTH 8
+#define JSON_CHUNK_PREFIX_LENGTH 10
+#define DEFAULT_PAGE_MAX_AGE 86400
+#define MAX_PAGE_MAX_AGE 31536000
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define MAX_KEEPALIVE_TIMEOUT 3600
+#define DEFAULT_KEEPALIVE_REQUESTS 100
+#define MAX_KEEPALIVE_REQUESTS 100000
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+#define MAX_IO_TIMEOUT 3600
+#define DEFAULT_STREAM_BUFFER 262144
+#define MIN_STREAM_BUFFER 4096
+#define MAX_STREAM_BUFFER 67108864
+#define SPILL_READ_CHUNK 65536
 #define DEFAULT_PORT 4000
 #define FALLBACK_PORT_STEPS 3
 #define READ_BUFFER_CHUNK 4096
+#define MAX_HTTP_HEADERS 64
+#define DEFAULT_MAX_HEADER_BYTES 16384
+#define MAX_MAX_HEADER_BYTES 1048576
+#define DEFAULT_MAX_BODY_BYTES 1048576
+#define MAX_MAX_BODY_BYTES 67108864
+#define DEFAULT_WORKER_THREADS 8
+#define MAX_WORKER_THREADS 256
+#define DEFAULT_QUEUE_DEPTH 64
+#define MAX_QUEUE_DEPTH 4096
+#define LISTEN_BACKLOG 64
+#define EVENT_BATCH_SIZE 64
+#define CURL_POOL_CAPACITY 32
+#define SANITIZER_LOOKAHEAD 512
+#define DEFAULT_CONTEXT_BUDGET 3072
+#define MIN_CONTEXT_BUDGET 256
+#define MAX_CONTEXT_BUDGET 1048576
+#define MAX_BUDGET_OVERRIDES 32
+#define DEFAULT_HISTORY_KEEP 6
+#define MAX_HISTORY_KEEP 64
+#define SUMMARY_LINE_LIMIT 160
+#define PRELOAD_QUEUE_CAPACITY 16
+#define DEFAULT_MODELS_TTL 30
+#define MAX_OLLAMA_BACKENDS 16
+#define DEFAULT_BACKEND_POLL 2
+#define MAX_BACKEND_POLL 3600
+#define DEFAULT_TURN_TIMEOUT 300
+#define MAX_TURN_TIMEOUT 86400
+#define DEFAULT_CONNECT_TIMEOUT 5
+#define MAX_CONNECT_TIMEOUT 600
+#define HEDGE_SAMPLES 64
+#define HEDGE_MIN_SAMPLES 8
+#define HEDGE_MIN_DELAY_MS 100
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define DEFAULT_CACHE_ENTRIES 256
+#define MAX_CACHE_ENTRIES 1048576
+#define DEFAULT_CACHE_DISK_MB 64
+#define MAX_CACHE_DISK_MB 65536
+#define DEFAULT_PREFIX_CACHE_ENTRIES 64
+#define MAX_PREFIX_CACHE_ENTRIES 4096
+#define MAX_DIGEST_LENGTH 128
+#define DEFAULT_MODEL_CONCURRENCY 1
+#define MAX_MODEL_CONCURRENCY 64
+#define DEFAULT_SCHEDULER_AGING 30
+#define MAX_SCHEDULER_AGING 3600
+#define SCHEDULER_DISCONNECT_CHECK_MS 1000
+#define KEEPALIVE_IDLE_CHECK_MS 100
+#define MAX_MODELS_TTL 86400
+#define CATALOGUE_WAIT_POLL_MS 50
+#define MATCHER_MAX_STATES 1024
+#define MATCHER_MAX_PATTERNS 64
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+/* Prebuilt heads stop before the Connection line, which is added per response (see connection_header()). */
+#define CORS_PREFLIGHT_HEAD                                                                           \
+    "HTTP/1.1 204 No Content\r\n"                                                                     \
+    "Access-Control-Allow-Origin: *\r\n"                                                              \
+    "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"                                            \
+    "Access-Control-Allow-Headers: Content-Type\r\n"
 
 struct MemoryStruct {
     char *memory;
     size_t size;
 };
 
+/* Region allocator owning everything a conversation builds for itself: the transcript, prompts,
+ * response buffers and reply strings. Memory is only handed out, never returned, and the whole
+ * region is freed with the conversation, so none of it goes through malloc once per object. */
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+};
+
+struct Arena {
+    struct ArenaBlock *blocks;
+    size_t next_block_size;
+    char *last;
+    size_t allocations;
+    size_t bytes;
+    size_t reserved;
+};
+
+/* A growable string. Appends double the capacity when it runs out, so n bytes cost O(n) copying in
+ * total; with an arena the buffer lives there and grows in place while it is the newest allocation. */
+struct TextBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    struct Arena *arena;
+};
+
 struct Participant {
     char name[MAX_NAME_LENGTH];
     char model[MAX_MODEL_LENGTH];
     char display_model[MAX_MODEL_LENGTH];
 };
 
-typedef int (*message_callback)(json_object *message, void *user_data);
+/* Generation settings a /chat request applies to every turn. A seed makes Ollama's sampling repeatable,
+ * which is what lets a turn be answered from the response cache; "cache": false opts a request out. */
+struct GenerateOptions {
+    int has_seed;
+    long long seed;
+    int cacheable;
+};
+
+/* A validated /chat request. topic points into payload, which owns the parsed body. */
+struct ChatRequest {
+    json_object *payload;
+    const char *topic;
+    int turns;
+    struct Participant participants[MAX_PARTICIPANTS];
+    size_t participant_count;
+    int stream_tokens;
+    struct GenerateOptions options;
+};
+
+/* Incremental HTTP/1.x request parser state; see http_request_feed(). Spans are offsets into the
+ * connection's input buffer, which may move between reads. */
+enum http_parse_state {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+    HTTP_PARSE_CHUNK_SIZE,
+    HTTP_PARSE_CHUNK_DATA,
+    HTTP_PARSE_CHUNK_END,
+    HTTP_PARSE_TRAILERS,
+    HTTP_PARSE_COMPLETE,
+    HTTP_PARSE_ERROR
+};
+
+struct HttpSpan {
+    size_t offset;
+    size_t length;
+};
+
+struct HttpHeader {
+    struct HttpSpan name;
+    struct HttpSpan value;
+};
+
+struct HttpRequest {
+    enum http_parse_state state;
+    const char *base;     /* the buffer as of the last feed, valid until it next changes */
+    size_t scan;          /* bytes examined; once complete, the size of the raw request */
+    size_t line_start;    /* start of the line being scanned */
+    size_t header_length; /* request line and headers, including the blank line */
+    size_t body_length;   /* body bytes so far, stored contiguously from header_length */
+    size_t remaining;     /* bytes left of the body or of the current chunk */
+    struct HttpSpan method;
+    struct HttpSpan target;
+    int minor_version;
+    int chunked;
+    int expect_continue;
+    struct HttpHeader headers[MAX_HTTP_HEADERS];
+    size_t header_count;
+    const char *error_status;
+    const char *error_message;
+};
+
+/* Output a slow client has not read yet, beyond what its stream may hold in memory. The file is an
+ * unlinked temporary (tmpfile()) that is read back in order as the client catches up. */
+struct StreamSpill {
+    FILE *file;
+    long read_offset;
+    long write_offset;
+};
+
+enum slow_client_policy { SLOW_CLIENT_DISCONNECT, SLOW_CLIENT_SPILL };
+
+struct ClientQueue;
+
+/* A client socket served by a worker thread. in holds what has been read but not yet answered, so
+ * pipelined requests that arrive together are answered one after another. queue is the pool's queue of
+ * accepted clients, or NULL in serial mode. */
+struct ClientConnection {
+    int fd;
+    struct ClientQueue *queue;
+    int keep_alive;
+    int requests;
+    struct TextBuffer in;
+    struct HttpRequest request;
+};
+
+struct GenerateMetrics;
+
+/* One speaker's turn as reported to a stream: either the finished message ("message", with Ollama's
+ * metrics) or a piece of its text while it is being generated ("delta", without metrics). With several
+ * backends a message also names the one that produced it, and whether that was a hedge; a message
+ * replayed from the response cache is flagged as cached. */
+struct TurnEvent {
+    const char *type;
+    int turn;
+    size_t participant_index;
+    const struct Participant *speaker;
+    const char *text;
+    size_t text_length;
+    const struct GenerateMetrics *metrics;
+    const char *backend;
+    int hedged;
+    int cached;
+};
 
-static void send_http_response(int client_fd, const char *status, const char *content_type, const char *body);
-static void send_http_error(int client_fd, const char *status, const char *message);
+typedef int (*turn_callback)(const struct TurnEvent *event, void *user_data);
+typedef int (*token_callback)(const char *text, size_t length, void *user_data);
+
+/* Default for /chat requests that do not set "streamTokens" (AICHAT_TOKEN_STREAMING). */
+static int token_streaming_default = 0;
+/* Continue each participant from the context Ollama returned for its last turn (AICHAT_CONTEXT_REUSE). */
+static int context_reuse_enabled = 1;
+/* How long Ollama keeps a model loaded after a request (AICHAT_KEEP_ALIVE); NULL leaves Ollama's default. */
+static const char *ollama_keep_alive = NULL;
+/* Seconds a client connection may sit idle waiting for its next request (AICHAT_KEEPALIVE_TIMEOUT); zero
+ * closes every connection after one response. */
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+/* Requests answered on one connection before it is closed (AICHAT_KEEPALIVE_REQUESTS). */
+static int keepalive_max_requests = DEFAULT_KEEPALIVE_REQUESTS;
+/* Limits on a request's header block (431 beyond it) and body (413), from AICHAT_MAX_HEADER_BYTES and
+ * AICHAT_MAX_BODY_BYTES. Chunk framing counts towards the header limit. */
+static size_t http_max_header_bytes = DEFAULT_MAX_HEADER_BYTES;
+static size_t http_max_body_bytes = DEFAULT_MAX_BODY_BYTES;
+/* Seconds a request may take to arrive, counted from its first byte or, for a connection's first
+ * request, from the accept (AICHAT_READ_TIMEOUT). Zero waits forever. */
+static int read_timeout = DEFAULT_READ_TIMEOUT;
+/* Seconds queued output may go without the client reading any of it (AICHAT_WRITE_TIMEOUT). Zero waits
+ * forever. */
+static int write_timeout = DEFAULT_WRITE_TIMEOUT;
+/* Bytes a /chat stream may queue in memory for a client that reads slower than the models write
+ * (AICHAT_STREAM_BUFFER), and what happens beyond that (AICHAT_SLOW_CLIENT). */
+static size_t stream_buffer_limit = DEFAULT_STREAM_BUFFER;
+static enum slow_client_policy slow_client_policy = SLOW_CLIENT_DISCONNECT;
+/* Seconds one turn may take from sending the prompt to the last token (AICHAT_TURN_TIMEOUT), and seconds
+ * any Ollama call may spend connecting (AICHAT_CONNECT_TIMEOUT). Zero waits forever. */
+static int turn_timeout = DEFAULT_TURN_TIMEOUT;
+static int connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+
+static void send_http_response(struct ClientConnection *client, const char *status, const char *content_type,
+                               const char *body);
+static void send_http_error(struct ClientConnection *client, const char *status, const char *message);
+static void stream_chat_conversation(struct ClientConnection *client, struct ChatRequest *request,
+                                     const char *ollama_url);
+static json_object *build_backends_json(void);
+static long long hedge_delay_ms(void);
+static int turn_scheduler_enabled(void);
+static size_t turn_scheduler_waiting(void);
+static int turn_scheduler_admits_preload(const char *ollama_url, const char *model);
+static size_t response_cache_entries(void);
+static size_t prefix_cache_entries(void);
+static size_t client_queue_waiting(struct ClientQueue *queue);
+static char *build_api_url(const char *ollama_url, const char *endpoint);
 
 static const char *get_ollama_url(void) {
     const char *env = getenv("OLLAMA_URL");
@@ -55,6 +321,234 @@ static const char *get_ollama_url(void) {
     return DEFAULT_OLLAMA_URL;
 }
 
+#define ARENA_HEADER_SIZE ((sizeof(struct ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static void *arena_alloc(struct Arena *arena, size_t size) {
+    struct ArenaBlock *block = arena->blocks;
+    size_t rounded = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    char *ptr = NULL;
+
+    if (rounded < size) {
+        return NULL;
+    }
+    if (!block || block->size - block->used < rounded) {
+        size_t block_size = arena->next_block_size ? arena->next_block_size : ARENA_MIN_BLOCK;
+        if (block_size < ARENA_MAX_BLOCK) {
+            arena->next_block_size = block_size * 2;
+        }
+        if (block_size < rounded) {
+            block_size = rounded;
+        }
+        block = malloc(ARENA_HEADER_SIZE + block_size);
+        if (!block) {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+        arena->reserved += ARENA_HEADER_SIZE + block_size;
+    }
+
+    ptr = (char *)block + ARENA_HEADER_SIZE + block->used;
+    block->used += rounded;
+    arena->last = ptr;
+    arena->allocations++;
+    arena->bytes += rounded;
+    return ptr;
+}
+
+/* Resizes ptr (of old_size bytes), in place when it is the newest allocation and its block has room. */
+static void *arena_resize(struct Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    struct ArenaBlock *block = arena->blocks;
+    char *moved = NULL;
+
+    if (ptr && ptr == arena->last) {
+        size_t offset = (size_t)((char *)ptr - ((char *)block + ARENA_HEADER_SIZE));
+        size_t rounded = (new_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        if (rounded >= new_size && rounded <= block->size - offset) {
+            arena->bytes += rounded - (block->used - offset);
+            block->used = offset + rounded;
+            return ptr;
+        }
+    }
+    moved = arena_alloc(arena, new_size);
+    if (moved && ptr) {
+        memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return moved;
+}
+
+static char *arena_strndup(struct Arena *arena, const char *text, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    if (copy) {
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+static void arena_free(struct Arena *arena) {
+    while (arena->blocks) {
+        struct ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+static int text_buffer_append(struct TextBuffer *buffer, const char *text, size_t length) {
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        char *data = NULL;
+        while (capacity < buffer->length + length + 1) {
+            capacity *= 2;
+        }
+        data = buffer->arena ? arena_resize(buffer->arena, buffer->data, buffer->capacity, capacity)
+                             : realloc(buffer->data, capacity);
+        if (!data) {
+            return -1;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+    return 0;
+}
+
+/* Drops the first count bytes, keeping the buffer NUL-terminated. */
+static void text_buffer_consume(struct TextBuffer *buffer, size_t count) {
+    if (count >= buffer->length) {
+        buffer->length = 0;
+    } else {
+        memmove(buffer->data, buffer->data + count, buffer->length - count);
+        buffer->length -= count;
+    }
+    if (buffer->data) {
+        buffer->data[buffer->length] = '\0';
+    }
+}
+
+/* Frees a heap buffer; an arena buffer is only forgotten, the arena reclaims it. */
+static void text_buffer_release(struct TextBuffer *buffer) {
+    if (!buffer->arena) {
+        free(buffer->data);
+    }
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int get_env_int(const char *name, int fallback, int min_value, int max_value) {
+    const char *env = getenv(name);
+    char *endptr = NULL;
+    long parsed = 0;
+
+    if (!env || !*env) {
+        return fallback;
+    }
+
+    parsed = strtol(env, &endptr, 10);
+    if (!endptr || *endptr != '\0' || parsed < min_value || parsed > max_value) {
+        fprintf(stderr, "Warning: invalid %s '%s', using default %d.\n", name, env, fallback);
+        return fallback;
+    }
+    return (int)parsed;
+}
+
+/* Prompt token budgets: AICHAT_CONTEXT_BUDGET for every model, AICHAT_CONTEXT_BUDGETS for
+ * per-model overrides ("llama3:8b=8192,gemma=2048", where an entry without a tag matches every tag).
+ * AICHAT_HISTORY_KEEP is how many recent messages stay verbatim once a transcript no longer fits. */
+struct ContextBudget {
+    char model[MAX_MODEL_LENGTH];
+    int tokens;
+};
+
+static struct ContextBudget context_budgets[MAX_BUDGET_OVERRIDES];
+static size_t context_budget_count = 0;
+static int context_budget_default = DEFAULT_CONTEXT_BUDGET;
+static int history_keep = DEFAULT_HISTORY_KEEP;
+
+static void load_context_budgets(void) {
+    const char *env = getenv("AICHAT_CONTEXT_BUDGETS");
+    const char *cursor = env;
+
+    context_budget_default = get_env_int("AICHAT_CONTEXT_BUDGET", DEFAULT_CONTEXT_BUDGET, MIN_CONTEXT_BUDGET,
+                                         MAX_CONTEXT_BUDGET);
+    history_keep = get_env_int("AICHAT_HISTORY_KEEP", DEFAULT_HISTORY_KEEP, 1, MAX_HISTORY_KEEP);
+
+    while (cursor && *cursor) {
+        const char *end = strchr(cursor, ',');
+        const char *equals = NULL;
+        size_t entry_len = end ? (size_t)(end - cursor) : strlen(cursor);
+        char *endptr = NULL;
+        long tokens = 0;
+
+        equals = memchr(cursor, '=', entry_len);
+        if (equals) {
+            tokens = strtol(equals + 1, &endptr, 10);
+        }
+        if (!equals || equals == cursor || (size_t)(equals - cursor) >= MAX_MODEL_LENGTH ||
+            endptr != cursor + entry_len || tokens < MIN_CONTEXT_BUDGET || tokens > MAX_CONTEXT_BUDGET) {
+            fprintf(stderr, "Warning: ignoring invalid AICHAT_CONTEXT_BUDGETS entry '%.*s'.\n", (int)entry_len,
+                    cursor);
+        } else if (context_budget_count < MAX_BUDGET_OVERRIDES) {
+            struct ContextBudget *budget = &context_budgets[context_budget_count++];
+            memcpy(budget->model, cursor, (size_t)(equals - cursor));
+            budget->model[equals - cursor] = '\0';
+            budget->tokens = (int)tokens;
+        }
+        cursor = end ? end + 1 : NULL;
+    }
+}
+
+static size_t context_budget_for_model(const char *model) {
+    const char *tag = strchr(model, ':');
+    size_t family_len = tag ? (size_t)(tag - model) : strlen(model);
+
+    for (size_t i = 0; i < context_budget_count; ++i) {
+        if (strcasecmp(context_budgets[i].model, model) == 0) {
+            return (size_t)context_budgets[i].tokens;
+        }
+    }
+    for (size_t i = 0; i < context_budget_count; ++i) {
+        if (strlen(context_budgets[i].model) == family_len &&
+            strncasecmp(context_budgets[i].model, model, family_len) == 0) {
+            return (size_t)context_budgets[i].tokens;
+        }
+    }
+    return (size_t)context_budget_default;
+}
+
+/* Approximates how many tokens a model tokenizer produces for text: one per punctuation mark and
+ * one per started five bytes of a word. It errs on the high side for English prose. */
+static size_t estimate_tokens(const char *text, size_t length) {
+    size_t tokens = 0;
+    size_t word = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char ch = (unsigned char)text[i];
+        if (isalnum(ch) || ch >= 0x80) {
+            word++;
+            continue;
+        }
+        tokens += (word + 4) / 5;
+        word = 0;
+        if (!isspace(ch)) {
+            tokens++;
+        }
+    }
+    return tokens + (word + 4) / 5;
+}
+
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
     struct MemoryStruct *mem = (struct MemoryStruct *)userp;
@@ -70,6 +564,326 @@ static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, voi
     return realsize;
 }
 
+/* Process-wide counters reported by GET /stats. */
+struct ServerStats {
+    unsigned long long ollama_requests;
+    unsigned long long ollama_new_connections;
+    unsigned long long turns;
+    unsigned long long prompt_eval_tokens;
+    unsigned long long prompt_tokens_reused;
+    unsigned long long windowed_prompts;
+    unsigned long long load_ns;
+    unsigned long long prompt_eval_ns;
+    unsigned long long eval_ns;
+    unsigned long long abandoned_conversations;
+    unsigned long long abandoned_turns;
+    unsigned long long abandoned_saved_ns;
+    unsigned long long turn_timeouts;
+    unsigned long long backend_routed_resident;
+    unsigned long long backend_routed_cold;
+    unsigned long long hedges_started;
+    unsigned long long hedges_won;
+    unsigned long long scheduler_queued;
+    unsigned long long scheduler_wait_ms;
+    unsigned long long scheduler_max_wait_ms;
+    unsigned long long model_swaps;
+    unsigned long long cache_hits;
+    unsigned long long cache_disk_hits;
+    unsigned long long cache_misses;
+    unsigned long long cache_stores;
+    unsigned long long cache_saved_ns;
+    unsigned long long prefix_hits;
+    unsigned long long prefix_misses;
+    unsigned long long prefix_stores;
+    unsigned long long preload_requests;
+    unsigned long long preload_failures;
+    unsigned long long preload_skipped;
+    unsigned long long preload_load_ns;
+    unsigned long long catalogue_refreshes;
+    unsigned long long catalogue_rebuilds;
+    unsigned long long catalogue_failures;
+    unsigned long long arena_conversations;
+    unsigned long long arena_allocations;
+    unsigned long long arena_bytes;
+    unsigned long long arena_peak_bytes;
+    unsigned long long http_responses;
+    unsigned long long http_bytes;
+    unsigned long long http_writes;
+    unsigned long long http_connections;
+    unsigned long long http_timeouts;
+    unsigned long long http_slow_clients;
+    unsigned long long http_spilled_bytes;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ServerStats server_stats;
+
+/* Idle easy handles plus a share object holding the DNS cache, TLS sessions and the connection
+ * cache, so consecutive Ollama calls reuse keep-alive connections instead of reconnecting. */
+struct CurlHandlePool {
+    pthread_mutex_t lock;
+    CURL *idle[CURL_POOL_CAPACITY];
+    size_t idle_count;
+    CURLSH *share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+};
+
+static struct CurlHandlePool curl_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void curl_pool_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    (void)handle;
+    (void)access;
+    (void)userptr;
+    pthread_mutex_lock(&curl_pool.share_locks[data]);
+}
+
+static void curl_pool_share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    (void)handle;
+    (void)userptr;
+    pthread_mutex_unlock(&curl_pool.share_locks[data]);
+}
+
+static int curl_pool_init(void) {
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+        pthread_mutex_init(&curl_pool.share_locks[i], NULL);
+    }
+
+    curl_pool.share = curl_share_init();
+    if (!curl_pool.share) {
+        return -1;
+    }
+    curl_share_setopt(curl_pool.share, CURLSHOPT_LOCKFUNC, curl_pool_share_lock);
+    curl_share_setopt(curl_pool.share, CURLSHOPT_UNLOCKFUNC, curl_pool_share_unlock);
+    curl_share_setopt(curl_pool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_pool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(curl_pool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    return 0;
+}
+
+/* Returns a handle with default options attached to the shared caches. */
+static CURL *curl_pool_acquire(void) {
+    CURL *curl = NULL;
+
+    pthread_mutex_lock(&curl_pool.lock);
+    if (curl_pool.idle_count > 0) {
+        curl = curl_pool.idle[--curl_pool.idle_count];
+    }
+    pthread_mutex_unlock(&curl_pool.lock);
+
+    if (curl) {
+        curl_easy_reset(curl);
+    } else {
+        curl = curl_easy_init();
+        if (!curl) {
+            return NULL;
+        }
+    }
+
+    if (curl_pool.share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, curl_pool.share);
+    }
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (connect_timeout > 0) {
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)connect_timeout);
+    }
+    return curl;
+}
+
+/* Records whether the finished transfer had to open a connection, then parks the handle. The
+ * handle must no longer be attached to a multi handle. */
+static void curl_pool_release(CURL *curl) {
+    long new_connections = 0;
+
+    if (!curl) {
+        return;
+    }
+
+    if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections) == CURLE_OK) {
+        pthread_mutex_lock(&stats_lock);
+        server_stats.ollama_requests++;
+        server_stats.ollama_new_connections += (unsigned long long)new_connections;
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    pthread_mutex_lock(&curl_pool.lock);
+    if (curl_pool.idle_count < CURL_POOL_CAPACITY) {
+        curl_pool.idle[curl_pool.idle_count++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&curl_pool.lock);
+
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+}
+
+static void curl_pool_cleanup(void) {
+    pthread_mutex_lock(&curl_pool.lock);
+    while (curl_pool.idle_count > 0) {
+        curl_easy_cleanup(curl_pool.idle[--curl_pool.idle_count]);
+    }
+    pthread_mutex_unlock(&curl_pool.lock);
+    if (curl_pool.share) {
+        curl_share_cleanup(curl_pool.share);
+        curl_pool.share = NULL;
+    }
+}
+
+static json_object *build_stats_json(void) {
+    struct ServerStats snapshot;
+    json_object *root = json_object_new_object();
+    json_object *ollama = json_object_new_object();
+    json_object *generation = json_object_new_object();
+    json_object *preload = json_object_new_object();
+    json_object *models = json_object_new_object();
+    json_object *arena = json_object_new_object();
+    json_object *http = json_object_new_object();
+    json_object *backends = NULL;
+    json_object *cache = NULL;
+    json_object *prefix = NULL;
+    json_object *scheduler = NULL;
+    double reuse_rate = 0.0;
+
+    if (!root || !ollama || !generation || !preload || !models || !arena || !http) {
+        if (root) {
+            json_object_put(root);
+        }
+        if (ollama) {
+            json_object_put(ollama);
+        }
+        if (generation) {
+            json_object_put(generation);
+        }
+        if (preload) {
+            json_object_put(preload);
+        }
+        if (models) {
+            json_object_put(models);
+        }
+        if (arena) {
+            json_object_put(arena);
+        }
+        if (http) {
+            json_object_put(http);
+        }
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    snapshot = server_stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (snapshot.ollama_requests > 0) {
+        unsigned long long reused = snapshot.ollama_new_connections < snapshot.ollama_requests
+                                        ? snapshot.ollama_requests - snapshot.ollama_new_connections
+                                        : 0;
+        reuse_rate = (double)reused / (double)snapshot.ollama_requests;
+    }
+
+    json_object_object_add(ollama, "requests", json_object_new_int64((int64_t)snapshot.ollama_requests));
+    json_object_object_add(ollama, "newConnections", json_object_new_int64((int64_t)snapshot.ollama_new_connections));
+    json_object_object_add(ollama, "connectionReuseRate", json_object_new_double(reuse_rate));
+    json_object_object_add(root, "ollama", ollama);
+
+    json_object_object_add(generation, "turns", json_object_new_int64((int64_t)snapshot.turns));
+    json_object_object_add(generation, "promptEvalTokens", json_object_new_int64((int64_t)snapshot.prompt_eval_tokens));
+    json_object_object_add(generation, "promptEvalTokensSaved",
+                           json_object_new_int64((int64_t)snapshot.prompt_tokens_reused));
+    json_object_object_add(generation, "windowedPrompts", json_object_new_int64((int64_t)snapshot.windowed_prompts));
+    json_object_object_add(generation, "loadMs", json_object_new_int64((int64_t)(snapshot.load_ns / 1000000)));
+    json_object_object_add(generation, "promptEvalMs",
+                           json_object_new_int64((int64_t)(snapshot.prompt_eval_ns / 1000000)));
+    json_object_object_add(generation, "generationMs", json_object_new_int64((int64_t)(snapshot.eval_ns / 1000000)));
+    json_object_object_add(generation, "abandonedConversations",
+                           json_object_new_int64((int64_t)snapshot.abandoned_conversations));
+    json_object_object_add(generation, "abandonedTurns", json_object_new_int64((int64_t)snapshot.abandoned_turns));
+    json_object_object_add(generation, "abandonedMsSaved",
+                           json_object_new_int64((int64_t)(snapshot.abandoned_saved_ns / 1000000)));
+    json_object_object_add(generation, "timeouts", json_object_new_int64((int64_t)snapshot.turn_timeouts));
+    json_object_object_add(root, "generation", generation);
+
+    json_object_object_add(preload, "requests", json_object_new_int64((int64_t)snapshot.preload_requests));
+    json_object_object_add(preload, "failures", json_object_new_int64((int64_t)snapshot.preload_failures));
+    json_object_object_add(preload, "skipped", json_object_new_int64((int64_t)snapshot.preload_skipped));
+    json_object_object_add(preload, "loadMs", json_object_new_int64((int64_t)(snapshot.preload_load_ns / 1000000)));
+    json_object_object_add(root, "preload", preload);
+
+    json_object_object_add(models, "refreshes", json_object_new_int64((int64_t)snapshot.catalogue_refreshes));
+    json_object_object_add(models, "rebuilds", json_object_new_int64((int64_t)snapshot.catalogue_rebuilds));
+    json_object_object_add(models, "failures", json_object_new_int64((int64_t)snapshot.catalogue_failures));
+    json_object_object_add(root, "models", models);
+
+    json_object_object_add(arena, "conversations", json_object_new_int64((int64_t)snapshot.arena_conversations));
+    json_object_object_add(arena, "allocations", json_object_new_int64((int64_t)snapshot.arena_allocations));
+    json_object_object_add(arena, "bytes", json_object_new_int64((int64_t)snapshot.arena_bytes));
+    json_object_object_add(arena, "peakBytes", json_object_new_int64((int64_t)snapshot.arena_peak_bytes));
+    json_object_object_add(root, "arena", arena);
+
+    json_object_object_add(http, "responses", json_object_new_int64((int64_t)snapshot.http_responses));
+    json_object_object_add(http, "bytesSent", json_object_new_int64((int64_t)snapshot.http_bytes));
+    json_object_object_add(http, "writes", json_object_new_int64((int64_t)snapshot.http_writes));
+    json_object_object_add(http, "writesPerResponse",
+                           json_object_new_double(snapshot.http_responses > 0 ? (double)snapshot.http_writes /
+                                                                                    (double)snapshot.http_responses
+                                                                              : 0.0));
+    json_object_object_add(http, "connections", json_object_new_int64((int64_t)snapshot.http_connections));
+    json_object_object_add(http, "requestsPerConnection",
+                           json_object_new_double(snapshot.http_connections > 0
+                                                      ? (double)snapshot.http_responses /
+                                                            (double)snapshot.http_connections
+                                                      : 0.0));
+    json_object_object_add(http, "timeouts", json_object_new_int64((int64_t)snapshot.http_timeouts));
+    json_object_object_add(http, "slowClientDrops", json_object_new_int64((int64_t)snapshot.http_slow_clients));
+    json_object_object_add(http, "spilledBytes", json_object_new_int64((int64_t)snapshot.http_spilled_bytes));
+    json_object_object_add(root, "http", http);
+
+    backends = json_object_new_object();
+    if (backends) {
+        json_object_object_add(backends, "routedResident",
+                               json_object_new_int64((int64_t)snapshot.backend_routed_resident));
+        json_object_object_add(backends, "routedCold", json_object_new_int64((int64_t)snapshot.backend_routed_cold));
+        json_object_object_add(backends, "hedgesStarted", json_object_new_int64((int64_t)snapshot.hedges_started));
+        json_object_object_add(backends, "hedgesWon", json_object_new_int64((int64_t)snapshot.hedges_won));
+        json_object_object_add(backends, "hedgeDelayMs", json_object_new_int64(hedge_delay_ms()));
+        json_object_object_add(backends, "servers", build_backends_json());
+        json_object_object_add(root, "backends", backends);
+    }
+
+    cache = json_object_new_object();
+    if (cache) {
+        json_object_object_add(cache, "hits", json_object_new_int64((int64_t)snapshot.cache_hits));
+        json_object_object_add(cache, "diskHits", json_object_new_int64((int64_t)snapshot.cache_disk_hits));
+        json_object_object_add(cache, "misses", json_object_new_int64((int64_t)snapshot.cache_misses));
+        json_object_object_add(cache, "stores", json_object_new_int64((int64_t)snapshot.cache_stores));
+        json_object_object_add(cache, "entries", json_object_new_int64((int64_t)response_cache_entries()));
+        json_object_object_add(cache, "msSaved", json_object_new_int64((int64_t)(snapshot.cache_saved_ns / 1000000)));
+        json_object_object_add(root, "cache", cache);
+    }
+
+    prefix = json_object_new_object();
+    if (prefix) {
+        json_object_object_add(prefix, "hits", json_object_new_int64((int64_t)snapshot.prefix_hits));
+        json_object_object_add(prefix, "misses", json_object_new_int64((int64_t)snapshot.prefix_misses));
+        json_object_object_add(prefix, "stores", json_object_new_int64((int64_t)snapshot.prefix_stores));
+        json_object_object_add(prefix, "entries", json_object_new_int64((int64_t)prefix_cache_entries()));
+        json_object_object_add(root, "prefix", prefix);
+    }
+
+    scheduler = json_object_new_object();
+    if (scheduler) {
+        json_object_object_add(scheduler, "enabled", json_object_new_boolean(turn_scheduler_enabled()));
+        json_object_object_add(scheduler, "waiting", json_object_new_int64((int64_t)turn_scheduler_waiting()));
+        json_object_object_add(scheduler, "queuedTurns", json_object_new_int64((int64_t)snapshot.scheduler_queued));
+        json_object_object_add(scheduler, "waitMs", json_object_new_int64((int64_t)snapshot.scheduler_wait_ms));
+        json_object_object_add(scheduler, "maxWaitMs",
+                               json_object_new_int64((int64_t)snapshot.scheduler_max_wait_ms));
+        json_object_object_add(scheduler, "modelSwaps", json_object_new_int64((int64_t)snapshot.model_swaps));
+        json_object_object_add(root, "scheduler", scheduler);
+    }
+    return root;
+}
+
 static void trim_leading_whitespace(char *text) {
     char *start = NULL;
 
@@ -104,204 +918,344 @@ static void trim_trailing_whitespace(char *text) {
     }
 }
 
-static void remove_tagged_section(char *text, const char *open_tag, const char *close_tag) {
-    size_t open_len = 0;
-    size_t close_len = 0;
+/* Reasoning sections that models sometimes emit and that are never shown to the user. */
+static const struct {
+    const char *open;
+    const char *close;
+} thinking_tags[] = {
+    {"<thinking>", "</thinking>"},     {"<think>", "</think>"},   {"<analysis>", "</analysis>"},
+    {"<scratchpad>", "</scratchpad>"}, {"[thinking]", "[/thinking]"}, {"[think]", "[/think]"},
+    {"{thinking}", "{/thinking}"},     {"{think}", "{/think}"},
+};
 
-    if (!text || !open_tag || !close_tag) {
-        return;
-    }
+/* A reply that opens with one of these prefixes starts with a metadata block, which runs until the
+ * first marker or blank line. */
+static const char *const metadata_prefixes[] = {"thought:",         "thinking:",      "thoughts:",
+                                                "analysis:",        "reasoning:",     "chain of thought:",
+                                                "internal monologue:", "scratchpad:", "plan:"};
+static const char *const metadata_markers[] = {"\nanswer:",      "\nfinal answer:", "\nresponse:",
+                                               "\nreply:",       "\nfinal:",        "\noutput:",
+                                               "\nresult:"};
+static const char *const answer_labels[] = {"answer:",      "final answer:", "response:",
+                                            "final:",       "reply:",        "output:",
+                                            "result:"};
+
+/* Case-insensitive Aho-Corasick automaton over the sanitizer vocabulary: thinking open tags, metadata
+ * markers, blank lines and the speaker's labels. The labels differ per speaker, so a conversation builds
+ * one for each participant and reuses it for all of that participant's replies; the trie is a few
+ * hundred nodes. */
+enum pattern_kind {
+    PATTERN_OPEN_TAG,
+    PATTERN_MARKER,
+    PATTERN_LABEL
+};
 
-    open_len = strlen(open_tag);
-    close_len = strlen(close_tag);
-    if (open_len == 0 || close_len == 0) {
-        return;
-    }
+struct MatcherPattern {
+    enum pattern_kind kind;
+    size_t index;
+    size_t length;
+    size_t skip; /* bytes of a marker that belong to the metadata block */
+};
 
-    while (*text) {
-        char *start = strcasestr(text, open_tag);
-        char *end = NULL;
+struct MatcherNode {
+    unsigned char byte;
+    short first_child;
+    short next_sibling;
+    short fail;
+    short output;
+    short dict; /* nearest state on the fail chain that ends a pattern */
+};
 
-        if (!start) {
-            return;
-        }
+struct PatternMatcher {
+    struct MatcherNode nodes[MATCHER_MAX_STATES];
+    short root_next[256]; /* indexed by the raw byte, both cases filled in */
+    size_t node_count;
+    struct MatcherPattern patterns[MATCHER_MAX_PATTERNS];
+    size_t pattern_count;
+    size_t longest_pattern;
+};
 
-        end = strcasestr(start + open_len, close_tag);
-        if (end) {
-            end += close_len;
-            memmove(start, end, strlen(end) + 1);
-        } else {
-            *start = '\0';
-            return;
+static unsigned char fold_byte(unsigned char byte) {
+    return byte >= 'A' && byte <= 'Z' ? (unsigned char)(byte - 'A' + 'a') : byte;
+}
+
+static short matcher_child(const struct PatternMatcher *matcher, short state, unsigned char byte) {
+    if (state == 0) {
+        return matcher->root_next[byte];
+    }
+    for (short child = matcher->nodes[state].first_child; child > 0; child = matcher->nodes[child].next_sibling) {
+        if (matcher->nodes[child].byte == byte) {
+            return child;
         }
     }
+    return -1;
 }
 
-static void remove_leading_metadata_block(char *text) {
-    static const char *const prefixes[] = {"thought:",         "thinking:",      "thoughts:",
-                                           "analysis:",        "reasoning:",     "chain of thought:",
-                                           "internal monologue:", "scratchpad:", "plan:"};
-    static const char *const markers[] = {"\nanswer:",      "\nfinal answer:", "\nresponse:",
-                                          "\nreply:",       "\nfinal:",        "\noutput:",
-                                          "\nresult:"};
-    char *start = NULL;
+static short matcher_step(const struct PatternMatcher *matcher, short state, unsigned char byte) {
+    short next = -1;
 
-    if (!text) {
-        return;
+    byte = fold_byte(byte);
+    while ((next = matcher_child(matcher, state, byte)) < 0) {
+        if (state == 0) {
+            return 0;
+        }
+        state = matcher->nodes[state].fail;
     }
+    return next;
+}
 
-    trim_leading_whitespace(text);
-    start = text;
-
-    for (size_t i = 0; i < (sizeof(prefixes) / sizeof(prefixes[0])); ++i) {
-        size_t prefix_len = strlen(prefixes[i]);
-        if (strncasecmp(start, prefixes[i], prefix_len) == 0) {
-            char *search_start = start + prefix_len;
-            char *removal_end = NULL;
-
-            for (size_t j = 0; j < (sizeof(markers) / sizeof(markers[0])); ++j) {
-                char *candidate = strcasestr(search_start, markers[j]);
-                if (candidate && (!removal_end || candidate < removal_end)) {
-                    removal_end = candidate + 1; /* retain the newline for trimming */
-                }
-            }
-
-            char *double_newline = strstr(search_start, "\n\n");
-            if (double_newline && (!removal_end || double_newline < removal_end)) {
-                removal_end = double_newline + 2;
-            }
+static void matcher_add(struct PatternMatcher *matcher, const char *text, enum pattern_kind kind, size_t index,
+                        size_t skip) {
+    size_t length = strlen(text);
+    short state = 0;
 
-            char *crlf_double = strstr(search_start, "\r\n\r\n");
-            if (crlf_double && (!removal_end || crlf_double < removal_end)) {
-                removal_end = crlf_double + 4;
-            }
+    if (length == 0 || matcher->pattern_count >= MATCHER_MAX_PATTERNS ||
+        matcher->node_count + length > MATCHER_MAX_STATES) {
+        return;
+    }
 
-            if (removal_end) {
-                memmove(start, removal_end, strlen(removal_end) + 1);
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char byte = fold_byte((unsigned char)text[i]);
+        short next = matcher_child(matcher, state, byte);
+        if (next < 0) {
+            struct MatcherNode *node = &matcher->nodes[matcher->node_count];
+            next = (short)matcher->node_count++;
+            node->byte = byte;
+            node->first_child = 0;
+            node->output = -1;
+            if (state == 0) {
+                node->next_sibling = 0;
+                matcher->root_next[byte] = next;
+                matcher->root_next[toupper(byte)] = next;
             } else {
-                *start = '\0';
+                node->next_sibling = matcher->nodes[state].first_child;
+                matcher->nodes[state].first_child = next;
             }
-            break;
+        }
+        state = next;
+    }
+
+    if (matcher->nodes[state].output < 0) {
+        struct MatcherPattern *pattern = &matcher->patterns[matcher->pattern_count];
+        pattern->kind = kind;
+        pattern->index = index;
+        pattern->length = length;
+        pattern->skip = skip;
+        matcher->nodes[state].output = (short)matcher->pattern_count++;
+        if (length > matcher->longest_pattern) {
+            matcher->longest_pattern = length;
         }
     }
 }
 
-static void strip_leading_labels(char *text) {
-    static const char *const labels[] = {"answer:",      "final answer:", "response:",
-                                         "final:",       "reply:",        "output:",
-                                         "result:"};
-    char *start = NULL;
+/* The fixed part of the vocabulary is compiled once; each speaker's matcher copies it and adds its labels. */
+static struct PatternMatcher base_matcher;
+static pthread_once_t base_matcher_once = PTHREAD_ONCE_INIT;
 
-    if (!text) {
-        return;
+static void matcher_build_base(void) {
+    struct PatternMatcher *matcher = &base_matcher;
+
+    matcher->node_count = 1;
+    matcher->nodes[0].output = -1;
+    matcher->nodes[0].dict = -1;
+    for (size_t i = 0; i < ARRAY_SIZE(matcher->root_next); ++i) {
+        matcher->root_next[i] = -1;
     }
 
-    trim_leading_whitespace(text);
-    start = text;
+    for (size_t i = 0; i < ARRAY_SIZE(thinking_tags); ++i) {
+        matcher_add(matcher, thinking_tags[i].open, PATTERN_OPEN_TAG, i, 0);
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(metadata_markers); ++i) {
+        matcher_add(matcher, metadata_markers[i], PATTERN_MARKER, i, 1); /* keep the label itself */
+    }
+    matcher_add(matcher, "\n\n", PATTERN_MARKER, 0, 2);
+    matcher_add(matcher, "\r\n\r\n", PATTERN_MARKER, 0, 4);
+}
 
-    for (size_t i = 0; i < (sizeof(labels) / sizeof(labels[0])); ++i) {
-        size_t label_len = strlen(labels[i]);
-        if (strncasecmp(start, labels[i], label_len) == 0) {
-            char *after = start + label_len;
-            while (*after && isspace((unsigned char)*after)) {
-                after++;
-            }
-            memmove(start, after, strlen(after) + 1);
-            break;
+static void matcher_build(struct PatternMatcher *matcher, const char *const *labels, size_t label_count) {
+    short queue[MATCHER_MAX_STATES];
+    size_t head = 0;
+    size_t tail = 0;
+
+    pthread_once(&base_matcher_once, matcher_build_base);
+    memcpy(matcher->nodes, base_matcher.nodes, base_matcher.node_count * sizeof(base_matcher.nodes[0]));
+    memcpy(matcher->root_next, base_matcher.root_next, sizeof(matcher->root_next));
+    memcpy(matcher->patterns, base_matcher.patterns, base_matcher.pattern_count * sizeof(base_matcher.patterns[0]));
+    matcher->node_count = base_matcher.node_count;
+    matcher->pattern_count = base_matcher.pattern_count;
+    matcher->longest_pattern = base_matcher.longest_pattern;
+    for (size_t i = 0; i < label_count; ++i) {
+        matcher_add(matcher, labels[i], PATTERN_LABEL, i, 0);
+    }
+
+    /* Labels can change the fail links of the fixed patterns, so they are always recomputed. */
+    for (size_t byte = 0; byte < ARRAY_SIZE(matcher->root_next); ++byte) {
+        short child = matcher->root_next[byte];
+        if (child > 0 && fold_byte((unsigned char)byte) == byte) {
+            matcher->nodes[child].fail = 0;
+            matcher->nodes[child].dict = -1;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        short state = queue[head++];
+        for (short child = matcher->nodes[state].first_child; child > 0; child = matcher->nodes[child].next_sibling) {
+            short fail = matcher_step(matcher, matcher->nodes[state].fail, matcher->nodes[child].byte);
+            matcher->nodes[child].fail = fail;
+            matcher->nodes[child].dict = matcher->nodes[fail].output >= 0 ? fail : matcher->nodes[fail].dict;
+            queue[tail++] = child;
         }
     }
 }
 
-static char *find_name_label(char *text, const char *name, char **after_label) {
-    size_t name_len = 0;
-    char *cursor = NULL;
+/* A label or marker occurrence recorded during the scan, as an offset into the rewritten text. */
+struct MatcherHit {
+    size_t position;
+    short pattern;
+};
 
-    if (after_label) {
-        *after_label = NULL;
-    }
+struct MatcherHits {
+    struct MatcherHit *items;
+    size_t count;
+    size_t capacity;
+};
 
-    if (!text || !name || !*name) {
-        return NULL;
+static void matcher_record_hit(struct MatcherHits *hits, size_t position, short pattern) {
+    if (hits->count == hits->capacity) {
+        size_t capacity = hits->capacity ? hits->capacity * 2 : 16;
+        struct MatcherHit *items = realloc(hits->items, capacity * sizeof(*items));
+        if (!items) {
+            return; /* a dropped hit only means a label or marker is left in place */
+        }
+        hits->items = items;
+        hits->capacity = capacity;
     }
+    hits->items[hits->count].position = position;
+    hits->items[hits->count].pattern = pattern;
+    hits->count++;
+}
 
-    name_len = strlen(name);
-    cursor = text;
+/* Recomputes the automaton state for the text written so far, so a marker or label that spans a
+ * removed section is still found. Only the last longest_pattern - 1 bytes can matter. */
+static short matcher_resume(const struct PatternMatcher *matcher, const char *text, size_t write) {
+    size_t from = write >= matcher->longest_pattern ? write - matcher->longest_pattern + 1 : 0;
+    short state = 0;
 
-    while ((cursor = strcasestr(cursor, name)) != NULL) {
-        char *next = cursor + name_len;
+    for (size_t i = from; i < write; ++i) {
+        state = matcher_step(matcher, state, (unsigned char)text[i]);
+    }
+    return state;
+}
 
-        if (cursor != text) {
-            unsigned char prev = (unsigned char)cursor[-1];
-            if (isalnum(prev) || prev == '_') {
-                cursor += name_len;
+/* Removes every thinking section in one pass, compacting text in place, and records where labels
+ * and markers occur in the compacted text. An unclosed section runs to the end of the reply.
+ * Returns the compacted length. */
+static size_t matcher_strip_sections(const struct PatternMatcher *matcher, char *text, struct MatcherHits *hits) {
+    size_t read = 0;
+    size_t write = 0;
+    short state = 0;
+
+    while (text[read] != '\0') {
+        if (state == 0) {
+            /* Most bytes cannot start a pattern; move them in one go. */
+            size_t run = read;
+            while (text[run] != '\0' && matcher->root_next[(unsigned char)text[run]] < 0) {
+                run++;
+            }
+            if (run != read) {
+                if (write != read) {
+                    memmove(text + write, text + read, run - read);
+                }
+                write += run - read;
+                read = run;
                 continue;
             }
         }
 
-        while (*next && isspace((unsigned char)*next)) {
-            next++;
-        }
-
-        if (*next == '(') {
-            int depth = 1;
-            next++;
-            while (*next && depth > 0) {
-                if (*next == '(') {
-                    depth++;
-                } else if (*next == ')') {
-                    depth--;
+        text[write++] = text[read];
+        state = matcher_step(matcher, state, (unsigned char)text[read++]);
+
+        for (short match = matcher->nodes[state].output >= 0 ? state : matcher->nodes[state].dict; match >= 0;
+             match = matcher->nodes[match].dict) {
+            short id = matcher->nodes[match].output;
+            const struct MatcherPattern *pattern = &matcher->patterns[id];
+
+            if (pattern->kind == PATTERN_OPEN_TAG) {
+                /* Inside a section only its own close tag matters, so jump straight to it. */
+                const char *close = strcasestr(text + read, thinking_tags[pattern->index].close);
+                write -= pattern->length;
+                if (!close) {
+                    text[write] = '\0';
+                    return write;
                 }
-                next++;
+                read = (size_t)(close - text) + strlen(thinking_tags[pattern->index].close);
+                state = matcher_resume(matcher, text, write);
+                break;
             }
-            while (*next && isspace((unsigned char)*next)) {
-                next++;
+            if (pattern->kind == PATTERN_MARKER || pattern->kind == PATTERN_LABEL) {
+                matcher_record_hit(hits, write - pattern->length, id);
             }
         }
+    }
 
-        if (*next == ':') {
-            char *content = next + 1;
-            while (*content && isspace((unsigned char)*content)) {
-                content++;
-            }
-            if (after_label) {
-                *after_label = content;
-            }
-            return cursor;
-        }
+    text[write] = '\0';
+    return write;
+}
 
-        cursor += name_len;
+static size_t skip_whitespace(const char *text, size_t pos, size_t length) {
+    while (pos < length && isspace((unsigned char)text[pos])) {
+        pos++;
     }
-
-    return NULL;
+    return pos;
 }
 
-static void drop_text_before_name_label(char *text, const char *name) {
-    char *after_label = NULL;
-    char *label_start = find_name_label(text, name, &after_label);
+/* Checks the label grammar after a speaker name at name_end: optional "(...)", then ':'.
+ * Returns the offset of the content after the label and its whitespace, or 0 if there is no label. */
+static size_t name_label_end(const char *text, size_t name_end, size_t length) {
+    size_t pos = skip_whitespace(text, name_end, length);
+
+    if (pos < length && text[pos] == '(') {
+        int depth = 1;
+        pos++;
+        while (pos < length && depth > 0) {
+            if (text[pos] == '(') {
+                depth++;
+            } else if (text[pos] == ')') {
+                depth--;
+            }
+            pos++;
+        }
+        pos = skip_whitespace(text, pos, length);
+    }
 
-    if (label_start && label_start != text) {
-        memmove(text, label_start, strlen(label_start) + 1);
+    if (pos < length && text[pos] == ':') {
+        return skip_whitespace(text, pos + 1, length);
     }
+    return 0;
 }
 
-static void strip_leading_name_label(char *text, const char *name) {
-    char *after_label = NULL;
-    char *label_start = find_name_label(text, name, &after_label);
+/* A recorded hit still names the same text after compaction (a later tag may have cut into it). */
+static int matcher_hit_intact(const char *text, size_t length, const struct MatcherHit *hit, const char *pattern,
+                              size_t pattern_length) {
+    return hit->position + pattern_length <= length &&
+           strncasecmp(text + hit->position, pattern, pattern_length) == 0;
+}
 
-    if (label_start == text && after_label) {
-        memmove(text, after_label, strlen(after_label) + 1);
+static const char *matcher_pattern_text(const struct MatcherPattern *pattern, const char *const *labels) {
+    if (pattern->kind == PATTERN_LABEL) {
+        return labels[pattern->index];
     }
+    if (pattern->skip == 1) {
+        return metadata_markers[pattern->index];
+    }
+    return pattern->skip == 2 ? "\n\n" : "\r\n\r\n";
 }
 
-static void sanitize_model_response(char *response, const char *participant_name,
-                                    const char *display_label, const char *model_name) {
-    const char *labels[3];
+/* Collects the distinct, non-empty names a speaker may prefix its reply with. */
+static size_t collect_speaker_labels(const char *labels[3], const char *participant_name, const char *display_label,
+                                     const char *model_name) {
     size_t label_count = 0;
 
-    if (!response) {
-        return;
-    }
-
     if (participant_name && *participant_name) {
         labels[label_count++] = participant_name;
     }
@@ -330,1815 +1284,6984 @@ static void sanitize_model_response(char *response, const char *participant_name
         }
     }
 
-    remove_tagged_section(response, "<thinking>", "</thinking>");
-    remove_tagged_section(response, "<think>", "</think>");
-    remove_tagged_section(response, "<analysis>", "</analysis>");
-    remove_tagged_section(response, "<scratchpad>", "</scratchpad>");
-    remove_tagged_section(response, "[thinking]", "[/thinking]");
-    remove_tagged_section(response, "[think]", "[/think]");
-    remove_tagged_section(response, "{thinking}", "{/thinking}");
-    remove_tagged_section(response, "{think}", "{/think}");
+    return label_count;
+}
 
-    trim_leading_whitespace(response);
-    for (size_t i = 0; i < label_count; ++i) {
-        drop_text_before_name_label(response, labels[i]);
-    }
-    remove_leading_metadata_block(response);
-    trim_leading_whitespace(response);
-    for (size_t i = 0; i < label_count; ++i) {
-        strip_leading_name_label(response, labels[i]);
-        trim_leading_whitespace(response);
-    }
-    strip_leading_labels(response);
-    trim_leading_whitespace(response);
-    trim_trailing_whitespace(response);
+/* A speaker's labels and the automaton built over them. The label strings are borrowed from the
+ * participant. */
+struct SpeakerMatcher {
+    const char *labels[3];
+    size_t label_count;
+    struct PatternMatcher matcher;
+};
+
+static void speaker_matcher_init(struct SpeakerMatcher *speaker, const char *participant_name,
+                                 const char *display_label, const char *model_name) {
+    speaker->label_count = collect_speaker_labels(speaker->labels, participant_name, display_label, model_name);
+    matcher_build(&speaker->matcher, speaker->labels, speaker->label_count);
 }
 
-static char *parse_ollama_response(const char *json_string) {
-    struct json_object *parsed_json = NULL;
-    struct json_object *response_obj = NULL;
-    struct json_object *error_obj = NULL;
-    char *response_text = NULL;
+/* Strips hidden reasoning and the speaker's own label from a complete reply. Thinking sections
+ * are removed by a single automaton pass; the leading label, metadata block and answer label are
+ * then resolved from the recorded hits and removed with one final memmove. */
+static void sanitize_speaker_reply(char *response, const struct SpeakerMatcher *speaker) {
+    const char *const *labels = speaker->labels;
+    size_t label_count = speaker->label_count;
+    const struct PatternMatcher *matcher = &speaker->matcher;
+    struct MatcherHits hits = {0};
+    size_t length = 0;
+    size_t start = 0;
 
-    parsed_json = json_tokener_parse(json_string);
-    if (!parsed_json) {
-        fprintf(stderr, "Error: Could not parse JSON response.\n");
-        return NULL;
+    if (!response) {
+        return;
     }
 
-    if (json_object_object_get_ex(parsed_json, "error", &error_obj)) {
-        const char *error_msg = json_object_get_string(error_obj);
-        if (error_msg) {
-            fprintf(stderr, "Error from AI server: %s\n", error_msg);
-        }
-    } else if (json_object_object_get_ex(parsed_json, "response", &response_obj)) {
-        const char *response_str = json_object_get_string(response_obj);
-        if (response_str) {
-            response_text = strdup(response_str);
+    length = matcher_strip_sections(matcher, response, &hits);
+
+    /* Text before the first occurrence of each label in turn is chatter about the speaker. */
+    start = skip_whitespace(response, 0, length);
+    for (size_t i = 0; i < label_count; ++i) {
+        for (size_t h = 0; h < hits.count; ++h) {
+            const struct MatcherHit *hit = &hits.items[h];
+            const struct MatcherPattern *pattern = &matcher->patterns[hit->pattern];
+
+            if (pattern->kind != PATTERN_LABEL || pattern->index != i || hit->position < start ||
+                !matcher_hit_intact(response, length, hit, labels[i], pattern->length)) {
+                continue;
+            }
+            if (hit->position > start) {
+                unsigned char prev = (unsigned char)response[hit->position - 1];
+                if (isalnum(prev) || prev == '_') {
+                    continue;
+                }
+            }
+            if (name_label_end(response, hit->position + pattern->length, length) != 0) {
+                start = hit->position;
+                break;
+            }
         }
     }
 
-    json_object_put(parsed_json);
-    return response_text;
-}
+    start = skip_whitespace(response, start, length);
+    for (size_t i = 0; i < ARRAY_SIZE(metadata_prefixes); ++i) {
+        size_t prefix_len = strlen(metadata_prefixes[i]);
+        if (strncasecmp(response + start, metadata_prefixes[i], prefix_len) == 0) {
+            size_t search = start + prefix_len;
+            size_t removal_end = length;
+
+            for (size_t h = 0; h < hits.count; ++h) {
+                const struct MatcherHit *hit = &hits.items[h];
+                const struct MatcherPattern *pattern = &matcher->patterns[hit->pattern];
+
+                if (pattern->kind == PATTERN_MARKER && hit->position >= search &&
+                    hit->position + pattern->skip < removal_end &&
+                    matcher_hit_intact(response, length, hit, matcher_pattern_text(pattern, labels),
+                                       pattern->length)) {
+                    removal_end = hit->position + pattern->skip;
+                }
+            }
+            start = removal_end;
+            break;
+        }
+    }
+    free(hits.items);
 
-static char *get_ai_response(const char *full_prompt, const char *model_name,
-                             const char *participant_name, const char *display_label,
-                             const char *ollama_url) {
-    CURL *curl = NULL;
-    char *response = NULL;
-    struct MemoryStruct chunk = {.memory = malloc(1), .size = 0};
+    start = skip_whitespace(response, start, length);
+    for (size_t i = 0; i < label_count; ++i) {
+        size_t label_len = strlen(labels[i]);
+        if (strncasecmp(response + start, labels[i], label_len) == 0) {
+            size_t content = name_label_end(response, start + label_len, length);
+            if (content != 0) {
+                start = content;
+            }
+        }
+    }
 
-    if (!chunk.memory) {
-        fprintf(stderr, "Failed to allocate memory for response buffer.\n");
-        return NULL;
+    for (size_t i = 0; i < ARRAY_SIZE(answer_labels); ++i) {
+        size_t label_len = strlen(answer_labels[i]);
+        if (strncasecmp(response + start, answer_labels[i], label_len) == 0) {
+            start = skip_whitespace(response, start + label_len, length);
+            break;
+        }
     }
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if (curl) {
-        json_object *jobj = json_object_new_object();
-        struct curl_slist *headers = NULL;
+    while (length > start && isspace((unsigned char)response[length - 1])) {
+        length--;
+    }
+    memmove(response, response + start, length - start);
+    response[length - start] = '\0';
+}
 
-        json_object_object_add(jobj, "model", json_object_new_string(model_name));
-        json_object_object_add(jobj, "prompt", json_object_new_string(full_prompt));
-        json_object_object_add(jobj, "stream", json_object_new_boolean(0));
+/* Incremental counterpart of sanitize_speaker_reply() for token streaming. Text is fed in arbitrary
+ * chunks and only text that can no longer turn out to be part of a hidden section or a leading label
+ * is emitted. At most SANITIZER_LOOKAHEAD bytes are held back while a leading construct is
+ * undecided; a partial tag or marker at the end of a chunk is held until the next chunk settles it.
+ * Text before a speaker label in the middle of a reply cannot be dropped without buffering the whole
+ * reply, so the final message is still produced by sanitize_speaker_reply() on the complete text. */
+enum prefix_match {
+    PREFIX_NO_MATCH,
+    PREFIX_MATCH,
+    PREFIX_NEED_MORE
+};
 
-        const char *json_payload = json_object_to_json_string(jobj);
-        headers = curl_slist_append(NULL, "Content-Type: application/json");
+enum sanitizer_phase {
+    SANITIZER_LEADING,
+    SANITIZER_METADATA,
+    SANITIZER_BODY
+};
 
-        curl_easy_setopt(curl, CURLOPT_URL, ollama_url);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+struct StreamSanitizer {
+    const char *labels[3];
+    size_t label_count;
+    struct TextBuffer raw;
+    int in_section;
+    size_t section;
+    enum sanitizer_phase phase;
+    int metadata_checked;
+    int answer_stripped;
+    struct TextBuffer stage;
+    token_callback emit;
+    void *emit_data;
+};
 
-        fprintf(stdout, "Requesting response from model '%s'...\n", model_name);
-        CURLcode res = curl_easy_perform(curl);
-        if (res == CURLE_OK) {
-            response = parse_ollama_response(chunk.memory);
-            sanitize_model_response(response, participant_name, display_label, model_name);
-        } else {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+static const char *find_case_insensitive(const char *haystack, size_t length, const char *needle,
+                                         size_t needle_len) {
+    if (needle_len == 0 || length < needle_len) {
+        return NULL;
+    }
+    for (size_t i = 0; i + needle_len <= length; ++i) {
+        if (strncasecmp(haystack + i, needle, needle_len) == 0) {
+            return haystack + i;
         }
-
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-        json_object_put(jobj);
     }
-    curl_global_cleanup();
-    free(chunk.memory);
-    return response;
+    return NULL;
 }
 
-static char *append_to_history(char *history, const char *text) {
-    size_t old_len = history ? strlen(history) : 0;
-    size_t text_len = strlen(text);
-    char *new_history = realloc(history, old_len + text_len + 1);
-    if (!new_history) {
-        fprintf(stderr, "Failed to reallocate memory for history.\n");
-        free(history);
-        return NULL;
+static enum prefix_match match_prefix(const char *text, size_t length, const char *prefix) {
+    size_t prefix_len = strlen(prefix);
+
+    if (length < prefix_len) {
+        return strncasecmp(text, prefix, length) == 0 ? PREFIX_NEED_MORE : PREFIX_NO_MATCH;
     }
-    memcpy(new_history + old_len, text, text_len + 1);
-    return new_history;
+    return strncasecmp(text, prefix, prefix_len) == 0 ? PREFIX_MATCH : PREFIX_NO_MATCH;
 }
 
-static char *build_models_url(const char *ollama_url) {
-    const char *suffix = "/tags";
-    const char *generate = "generate";
-    size_t url_len = strlen(ollama_url);
-    size_t generate_len = strlen(generate);
-    char *result = NULL;
+/* Streaming version of the name_label_end() grammar anchored at the start of text:
+ * name, optional "(...)", then ':'. */
+static enum prefix_match match_name_label(const char *text, size_t length, const char *name, size_t *consumed) {
+    enum prefix_match name_match = match_prefix(text, length, name);
+    size_t pos = strlen(name);
 
-    if (url_len >= generate_len && strcmp(ollama_url + url_len - generate_len, generate) == 0) {
-        size_t base_len = url_len - generate_len;
-        result = malloc(base_len + strlen(suffix) + 1);
-        if (!result) {
-            return NULL;
+    if (name_match != PREFIX_MATCH) {
+        return name_match;
+    }
+
+    while (pos < length && isspace((unsigned char)text[pos])) {
+        pos++;
+    }
+    if (pos < length && text[pos] == '(') {
+        int depth = 1;
+        pos++;
+        while (pos < length && depth > 0) {
+            if (text[pos] == '(') {
+                depth++;
+            } else if (text[pos] == ')') {
+                depth--;
+            }
+            pos++;
         }
-        memcpy(result, ollama_url, base_len);
-        if (base_len > 0 && result[base_len - 1] == '/') {
-            strcpy(result + base_len, suffix + 1);
-        } else {
-            strcpy(result + base_len, suffix);
+        if (depth > 0) {
+            return PREFIX_NEED_MORE;
+        }
+        while (pos < length && isspace((unsigned char)text[pos])) {
+            pos++;
         }
-        return result;
     }
-
-    int needs_slash = (url_len == 0 || ollama_url[url_len - 1] != '/');
-    result = malloc(url_len + needs_slash + strlen(suffix) + 1);
-    if (!result) {
-        return NULL;
+    if (pos == length) {
+        return PREFIX_NEED_MORE;
     }
-    strcpy(result, ollama_url);
-    if (needs_slash) {
-        strcat(result, "/");
+    if (text[pos] != ':') {
+        return PREFIX_NO_MATCH;
     }
-    strcat(result, suffix + 1); /* suffix starts with '/', avoid duplicating */
-    return result;
+
+    *consumed = pos + 1;
+    return PREFIX_MATCH;
 }
 
-static int fetch_available_models(const char *ollama_url, json_object **out_json, char **error_out) {
-    struct MemoryStruct chunk = {.memory = NULL, .size = 0};
-    CURL *curl = NULL;
-    CURLcode res = CURLE_OK;
-    char *models_url = NULL;
-    json_object *parsed = NULL;
-    json_object *models_array = NULL;
-    json_object *result = NULL;
-    json_object *list = NULL;
+/* Buffers come from arena when one is given, otherwise from the heap. */
+static void stream_sanitizer_init(struct StreamSanitizer *sanitizer, struct Arena *arena, const char *participant_name,
+                                  const char *display_label, const char *model_name, token_callback emit,
+                                  void *emit_data) {
+    memset(sanitizer, 0, sizeof(*sanitizer));
+    sanitizer->raw.arena = arena;
+    sanitizer->stage.arena = arena;
+    sanitizer->label_count = collect_speaker_labels(sanitizer->labels, participant_name, display_label, model_name);
+    sanitizer->emit = emit;
+    sanitizer->emit_data = emit_data;
+}
 
-    *out_json = NULL;
-    if (error_out) {
-        *error_out = NULL;
+static void stream_sanitizer_cleanup(struct StreamSanitizer *sanitizer) {
+    text_buffer_release(&sanitizer->raw);
+    text_buffer_release(&sanitizer->stage);
+    memset(sanitizer, 0, sizeof(*sanitizer));
+}
+
+/* Body text is emitted as-is except for trailing whitespace, which is held in stage until more
+ * visible text follows so the streamed text never ends in whitespace the final reply trims. */
+static int sanitizer_emit_body(struct StreamSanitizer *sanitizer, const char *text, size_t length) {
+    size_t visible = length;
+    int rc = 0;
+
+    while (visible > 0 && isspace((unsigned char)text[visible - 1])) {
+        visible--;
     }
 
-    models_url = build_models_url(ollama_url);
-    if (!models_url) {
-        if (error_out) {
-            *error_out = strdup("Failed to prepare Ollama models URL.");
+    if (visible > 0) {
+        if (sanitizer->stage.length > 0) {
+            rc = sanitizer->emit(sanitizer->stage.data, sanitizer->stage.length, sanitizer->emit_data);
+            sanitizer->stage.length = 0;
+        }
+        if (rc == 0) {
+            rc = sanitizer->emit(text, visible, sanitizer->emit_data);
         }
-        return -1;
     }
 
-    chunk.memory = malloc(1);
-    if (!chunk.memory) {
-        free(models_url);
-        if (error_out) {
-            *error_out = strdup("Failed to allocate response buffer.");
-        }
+    if (visible < length && text_buffer_append(&sanitizer->stage, text + visible, length - visible) != 0) {
         return -1;
     }
-    chunk.size = 0;
+    return rc;
+}
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if (!curl) {
-        free(models_url);
-        free(chunk.memory);
-        if (error_out) {
-            *error_out = strdup("Unable to initialise CURL.");
+/* Drops a metadata block from stage once its end marker is visible. Returns 1 if the block ended. */
+static int sanitizer_skip_metadata(struct StreamSanitizer *sanitizer, int finishing) {
+    static const char *const blank_lines[] = {"\n\n", "\r\n\r\n"};
+    const char *text = sanitizer->stage.data;
+    size_t length = sanitizer->stage.length;
+    size_t cut = 0;
+    size_t longest_marker = 0;
+    int found = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(metadata_markers); ++i) {
+        size_t marker_len = strlen(metadata_markers[i]);
+        const char *candidate = find_case_insensitive(text, length, metadata_markers[i], marker_len);
+        if (marker_len > longest_marker) {
+            longest_marker = marker_len;
+        }
+        if (candidate && (!found || (size_t)(candidate - text) + 1 < cut)) {
+            cut = (size_t)(candidate - text) + 1; /* keep the label so it is stripped as a leading label */
+            found = 1;
+        }
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(blank_lines); ++i) {
+        const char *candidate = length > 0 ? memmem(text, length, blank_lines[i], strlen(blank_lines[i])) : NULL;
+        if (candidate && (!found || (size_t)(candidate - text) + strlen(blank_lines[i]) < cut)) {
+            cut = (size_t)(candidate - text) + strlen(blank_lines[i]);
+            found = 1;
         }
-        curl_global_cleanup();
-        return -1;
     }
 
-    curl_easy_setopt(curl, CURLOPT_URL, models_url);
-    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+    if (found) {
+        text_buffer_consume(&sanitizer->stage, cut);
+        return 1;
+    }
 
-    res = curl_easy_perform(curl);
-    free(models_url);
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
+    if (finishing) {
+        sanitizer->stage.length = 0;
+    } else if (length >= longest_marker) {
+        text_buffer_consume(&sanitizer->stage, length - (longest_marker - 1));
+    }
+    return 0;
+}
 
-    if (res != CURLE_OK) {
-        free(chunk.memory);
-        if (error_out) {
-            *error_out = strdup("Failed to contact Ollama for model list.");
+/* Resolves leading whitespace, name labels, metadata blocks and answer labels held in stage. */
+static int sanitizer_advance(struct StreamSanitizer *sanitizer, int finishing) {
+    while (sanitizer->phase != SANITIZER_BODY) {
+        struct TextBuffer *stage = &sanitizer->stage;
+        size_t skip = 0;
+        int need_more = 0;
+        int matched = 0;
+
+        if (sanitizer->phase == SANITIZER_METADATA) {
+            if (!sanitizer_skip_metadata(sanitizer, finishing)) {
+                return 0;
+            }
+            sanitizer->phase = SANITIZER_LEADING;
+            continue;
         }
-        return -1;
-    }
 
-    parsed = json_tokener_parse(chunk.memory);
-    if (parsed && json_object_is_type(parsed, json_type_object)) {
-        json_object_object_get_ex(parsed, "models", &models_array);
-    } else if (parsed && json_object_is_type(parsed, json_type_array)) {
-        models_array = parsed;
-    }
+        while (skip < stage->length && isspace((unsigned char)stage->data[skip])) {
+            skip++;
+        }
+        text_buffer_consume(stage, skip);
+        if (stage->length == 0) {
+            return 0;
+        }
 
-    if (!models_array || !json_object_is_type(models_array, json_type_array)) {
-        free(chunk.memory);
-        if (parsed) {
-            json_object_put(parsed);
+        if (!sanitizer->metadata_checked) {
+            for (size_t i = 0; i < ARRAY_SIZE(metadata_prefixes) && !matched; ++i) {
+                enum prefix_match match = match_prefix(stage->data, stage->length, metadata_prefixes[i]);
+                if (match == PREFIX_MATCH) {
+                    text_buffer_consume(stage, strlen(metadata_prefixes[i]));
+                    sanitizer->metadata_checked = 1;
+                    sanitizer->phase = SANITIZER_METADATA;
+                    matched = 1;
+                }
+                need_more |= match == PREFIX_NEED_MORE;
+            }
         }
-        if (error_out) {
-            *error_out = strdup("Unexpected response from Ollama while listing models.");
+        for (size_t i = 0; i < sanitizer->label_count && !matched; ++i) {
+            size_t consumed = 0;
+            enum prefix_match match = match_name_label(stage->data, stage->length, sanitizer->labels[i], &consumed);
+            if (match == PREFIX_MATCH) {
+                text_buffer_consume(stage, consumed);
+                matched = 1;
+            }
+            need_more |= match == PREFIX_NEED_MORE;
         }
-        return -1;
+        for (size_t i = 0; i < ARRAY_SIZE(answer_labels) && !matched && !sanitizer->answer_stripped; ++i) {
+            enum prefix_match match = match_prefix(stage->data, stage->length, answer_labels[i]);
+            if (match == PREFIX_MATCH) {
+                text_buffer_consume(stage, strlen(answer_labels[i]));
+                sanitizer->metadata_checked = 1;
+                sanitizer->answer_stripped = 1;
+                sanitizer->label_count = 0;
+                matched = 1;
+            }
+            need_more |= match == PREFIX_NEED_MORE;
+        }
+        if (matched) {
+            continue;
+        }
+        if (need_more && !finishing && stage->length < SANITIZER_LOOKAHEAD) {
+            return 0;
+        }
+
+        /* Nothing else can be stripped from the front: everything held so far becomes body text. */
+        struct TextBuffer pending = *stage;
+        int rc = 0;
+        stage->data = NULL;
+        stage->length = 0;
+        stage->capacity = 0;
+        sanitizer->metadata_checked = 1;
+        sanitizer->phase = SANITIZER_BODY;
+        rc = sanitizer_emit_body(sanitizer, pending.data, pending.length);
+        text_buffer_release(&pending);
+        return rc;
     }
+    return 0;
+}
 
-    list = json_object_new_array();
-    if (!list) {
-        free(chunk.memory);
-        json_object_put(parsed);
-        if (error_out) {
-            *error_out = strdup("Failed to allocate models array.");
-        }
+static int sanitizer_accept_text(struct StreamSanitizer *sanitizer, const char *text, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (sanitizer->phase == SANITIZER_BODY) {
+        return sanitizer_emit_body(sanitizer, text, length);
+    }
+    if (text_buffer_append(&sanitizer->stage, text, length) != 0) {
         return -1;
     }
+    return sanitizer_advance(sanitizer, 0);
+}
 
-    size_t array_len = json_object_array_length(models_array);
-    for (size_t i = 0; i < array_len; ++i) {
-        json_object *item = json_object_array_get_idx(models_array, i);
-        const char *model_value = NULL;
-        const char *name_value = NULL;
-
-        if (!item) {
+/* Removes thinking sections from raw and passes the remaining text on. A possible partial open
+ * or close tag at the end of raw is kept for the next call unless finishing. */
+static int sanitizer_filter_tags(struct StreamSanitizer *sanitizer, int finishing) {
+    const char *data = sanitizer->raw.data;
+    size_t length = sanitizer->raw.length;
+    size_t pos = 0;
+    size_t run_start = 0;
+    size_t keep_from = length;
+    int rc = 0;
+
+    while (pos < length) {
+        if (sanitizer->in_section) {
+            const char *close_tag = thinking_tags[sanitizer->section].close;
+            size_t close_len = strlen(close_tag);
+            const char *found = find_case_insensitive(data + pos, length - pos, close_tag, close_len);
+            if (!found) {
+                size_t tail = length - pos;
+                keep_from = finishing ? length : length - (tail < close_len - 1 ? tail : close_len - 1);
+                run_start = keep_from;
+                break;
+            }
+            pos = (size_t)(found - data) + close_len;
+            sanitizer->in_section = 0;
+            run_start = pos;
             continue;
         }
 
-        if (json_object_is_type(item, json_type_object)) {
-            json_object *field = NULL;
-            if (json_object_object_get_ex(item, "model", &field) && field) {
-                model_value = json_object_get_string(field);
-            }
-            if (json_object_object_get_ex(item, "name", &field) && field) {
-                name_value = json_object_get_string(field);
+        if (data[pos] == '<' || data[pos] == '[' || data[pos] == '{') {
+            int need_more = 0;
+            int opened = 0;
+            for (size_t i = 0; i < ARRAY_SIZE(thinking_tags); ++i) {
+                enum prefix_match match = match_prefix(data + pos, length - pos, thinking_tags[i].open);
+                if (match == PREFIX_MATCH) {
+                    if (rc == 0) {
+                        rc = sanitizer_accept_text(sanitizer, data + run_start, pos - run_start);
+                    }
+                    sanitizer->in_section = 1;
+                    sanitizer->section = i;
+                    pos += strlen(thinking_tags[i].open);
+                    run_start = pos;
+                    opened = 1;
+                    break;
+                }
+                need_more |= match == PREFIX_NEED_MORE;
             }
-        } else if (json_object_is_type(item, json_type_string)) {
-            model_value = json_object_get_string(item);
-        }
-
-        if (!model_value || !*model_value) {
-            if (name_value && *name_value) {
-                model_value = name_value;
-            } else {
+            if (opened) {
                 continue;
             }
-        }
-
-        json_object *entry = json_object_new_object();
-        if (!entry) {
-            json_object_put(list);
-            json_object_put(parsed);
-            free(chunk.memory);
-            if (error_out) {
-                *error_out = strdup("Failed to allocate model entry.");
+            if (need_more && !finishing) {
+                keep_from = pos;
+                break;
             }
-            return -1;
         }
+        pos++;
+    }
 
-        const char *display = (name_value && *name_value) ? name_value : model_value;
-        json_object_object_add(entry, "name", json_object_new_string(display));
-        json_object_object_add(entry, "model", json_object_new_string(model_value));
-        json_object_array_add(list, entry);
+    if (rc == 0 && keep_from > run_start) {
+        rc = sanitizer_accept_text(sanitizer, data + run_start, keep_from - run_start);
     }
+    text_buffer_consume(&sanitizer->raw, keep_from);
+    return rc;
+}
 
-    result = json_object_new_object();
-    if (!result) {
-        json_object_put(list);
-        json_object_put(parsed);
-        free(chunk.memory);
-        if (error_out) {
-            *error_out = strdup("Failed to prepare models payload.");
-        }
+static int stream_sanitizer_feed(struct StreamSanitizer *sanitizer, const char *text, size_t length) {
+    if (text_buffer_append(&sanitizer->raw, text, length) != 0) {
         return -1;
     }
-
-    json_object_object_add(result, "models", list);
-    *out_json = result;
-
-    json_object_put(parsed);
-    free(chunk.memory);
-    return 0;
+    return sanitizer_filter_tags(sanitizer, 0);
 }
 
-static void handle_models_request(int client_fd, const char *ollama_url) {
-    json_object *payload = NULL;
-    char *error_message = NULL;
+/* Flushes whatever is still undecided at the end of the reply. Trailing whitespace is dropped. */
+static int stream_sanitizer_finish(struct StreamSanitizer *sanitizer) {
+    int rc = 0;
 
-    if (fetch_available_models(ollama_url, &payload, &error_message) == 0 && payload) {
-        const char *json_payload = json_object_to_json_string_ext(payload, JSON_C_TO_STRING_PLAIN);
-        send_http_response(client_fd, "200 OK", "application/json", json_payload);
-        json_object_put(payload);
-    } else {
-        const char *message = error_message ? error_message : "Unable to retrieve model list.";
-        send_http_error(client_fd, "502 Bad Gateway", message);
+    if (sanitizer->raw.length > 0) {
+        rc = sanitizer_filter_tags(sanitizer, 1);
     }
-
-    if (error_message) {
-        free(error_message);
+    if (rc == 0 && sanitizer->phase != SANITIZER_BODY) {
+        rc = sanitizer_advance(sanitizer, 1);
     }
+    return rc;
 }
 
-static const char *lookup_display_model(json_object *models_array, const char *identifier) {
-    size_t array_len = 0;
+/* Bookkeeping Ollama sends with the final response object. context is the token array that lets the
+ * next request continue where this one stopped without re-evaluating the prompt. */
+struct GenerateMetrics {
+    json_object *context;
+    long prompt_eval_count;
+    long long load_ns;
+    long long prompt_eval_ns;
+    long long eval_ns;
+};
 
-    if (!models_array || !identifier || !*identifier) {
-        return NULL;
-    }
+/* Replies to deterministic turns, kept so that re-running a seeded conversation replays it instead of
+ * generating it again. A turn is deterministic when its /chat request set a "seed"; the key is a 128-bit
+ * hash of the model's digest, the generation options, the context sent and the exact prompt bytes. The
+ * value is a small JSON object with the raw reply, the context Ollama returned and how long the
+ * generation took. Replies live in an in-memory LRU of AICHAT_CACHE_ENTRIES entries, backed by an
+ * optional memory-mapped file (AICHAT_CACHE_FILE, AICHAT_CACHE_DISK_MB) that survives restarts. The
+ * file is a ring of checksummed records behind a 4-way set-associative index; a record the ring has
+ * overwritten fails its check and reads as a miss. The hash is not cryptographic. */
+struct CacheKey {
+    uint64_t hi;
+    uint64_t lo;
+};
 
-    if (!json_object_is_type(models_array, json_type_array)) {
+struct CacheEntry {
+    struct CacheKey key;
+    char *value;
+    size_t length;
+    struct CacheEntry *newer;
+    struct CacheEntry *older;
+    struct CacheEntry *chain;
+};
+
+struct DiskCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t data_size;
+    uint64_t write_offset;
+    uint64_t sequence;
+};
+
+struct DiskCacheSlot {
+    uint64_t key_hi;
+    uint64_t key_lo;
+    uint64_t offset;
+    uint64_t sequence;
+};
+
+struct DiskCacheRecord {
+    uint64_t key_hi;
+    uint64_t key_lo;
+    uint64_t sequence;
+    uint64_t length;
+    uint64_t checksum;
+};
+
+struct ResponseCache {
+    pthread_mutex_t lock;
+    struct CacheEntry **buckets;
+    size_t bucket_mask;
+    struct CacheEntry *newest;
+    struct CacheEntry *oldest;
+    size_t count;
+    size_t capacity;
+    int disk_fd;
+    unsigned char *map;
+    size_t map_size;
+    struct DiskCacheHeader *header;
+    struct DiskCacheSlot *slots;
+    unsigned char *data;
+};
+
+static struct ResponseCache response_cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .disk_fd = -1};
+
+static const char disk_cache_magic[8] = {'A', 'I', 'C', 'H', 'A', 'T', 'R', 'C'};
+
+static uint64_t cache_mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+/* Folds one length-delimited field into the key, eight bytes at a time. */
+static void cache_key_add(struct CacheKey *key, const char *data, size_t length) {
+    uint64_t hi = key->hi ^ cache_mix(length + 1);
+    uint64_t lo = key->lo ^ length;
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        lo = (lo ^ word) * 0x9e3779b97f4a7c15ULL;
+        lo ^= lo >> 32;
+        hi = (hi ^ word) * 0xc2b2ae3d27d4eb4fULL;
+        hi = (hi << 29) | (hi >> 35);
+    }
+    for (; i < length; ++i) {
+        lo = (lo ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+        hi = (hi ^ (unsigned char)data[i]) * 0xc2b2ae3d27d4eb4fULL;
+    }
+    key->lo = cache_mix(lo);
+    key->hi = cache_mix(hi ^ key->lo);
+}
+
+static uint64_t cache_checksum(const unsigned char *data, size_t length) {
+    struct CacheKey sum = {0, 0};
+
+    cache_key_add(&sum, (const char *)data, length);
+    return sum.lo;
+}
+
+static int cache_key_equal(const struct CacheKey *a, const struct CacheKey *b) {
+    return a->hi == b->hi && a->lo == b->lo;
+}
+
+static int response_cache_enabled(void) {
+    return response_cache.capacity > 0 || response_cache.map != NULL;
+}
+
+static void cache_entry_unlink(struct CacheEntry *entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        response_cache.newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        response_cache.oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void cache_entry_push(struct CacheEntry *entry) {
+    entry->older = response_cache.newest;
+    entry->newer = NULL;
+    if (response_cache.newest) {
+        response_cache.newest->newer = entry;
+    }
+    response_cache.newest = entry;
+    if (!response_cache.oldest) {
+        response_cache.oldest = entry;
+    }
+}
+
+static struct CacheEntry **cache_bucket(const struct CacheKey *key) {
+    return &response_cache.buckets[key->lo & response_cache.bucket_mask];
+}
+
+/* Stores a copy of value in the memory tier, evicting the least recently used entry when it is full.
+ * Called with the cache lock held. */
+static void cache_memory_put_locked(const struct CacheKey *key, const char *value, size_t length) {
+    struct CacheEntry **link = cache_bucket(key);
+    struct CacheEntry *entry = NULL;
+
+    if (response_cache.capacity == 0) {
+        return;
+    }
+    for (entry = *link; entry; entry = entry->chain) {
+        if (cache_key_equal(&entry->key, key)) {
+            cache_entry_unlink(entry);
+            cache_entry_push(entry);
+            return;
+        }
+    }
+
+    if (response_cache.count >= response_cache.capacity) {
+        struct CacheEntry *victim = response_cache.oldest;
+        struct CacheEntry **victim_link = cache_bucket(&victim->key);
+        while (*victim_link != victim) {
+            victim_link = &(*victim_link)->chain;
+        }
+        *victim_link = victim->chain;
+        cache_entry_unlink(victim);
+        free(victim->value);
+        free(victim);
+        response_cache.count--;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->value = malloc(length + 1))) {
+        free(entry);
+        return;
+    }
+    memcpy(entry->value, value, length);
+    entry->value[length] = '\0';
+    entry->length = length;
+    entry->key = *key;
+    entry->chain = *link;
+    *link = entry;
+    cache_entry_push(entry);
+    response_cache.count++;
+}
+
+/* Copies the value stored for key in the file, if the record is still intact. Called with the cache lock held. */
+static char *cache_disk_get_locked(const struct CacheKey *key, size_t *length) {
+    struct DiskCacheSlot *bucket = NULL;
+    uint64_t data_size = 0;
+
+    if (!response_cache.map) {
+        return NULL;
+    }
+    data_size = response_cache.header->data_size;
+    bucket = &response_cache.slots[(key->lo & (response_cache.header->slot_count / 4 - 1)) * 4];
+    for (int way = 0; way < 4; ++way) {
+        const struct DiskCacheSlot *slot = &bucket[way];
+        const struct DiskCacheRecord *record = NULL;
+        char *value = NULL;
+
+        if (slot->sequence == 0 || slot->key_hi != key->hi || slot->key_lo != key->lo ||
+            slot->offset > data_size - sizeof(*record)) {
+            continue;
+        }
+        record = (const struct DiskCacheRecord *)(response_cache.data + slot->offset);
+        if (record->sequence != slot->sequence || record->key_hi != key->hi || record->key_lo != key->lo ||
+            record->length > data_size - slot->offset - sizeof(*record) ||
+            cache_checksum((const unsigned char *)(record + 1), record->length) != record->checksum) {
+            continue;
+        }
+        value = malloc(record->length + 1);
+        if (value) {
+            memcpy(value, record + 1, record->length);
+            value[record->length] = '\0';
+            *length = record->length;
+        }
+        return value;
+    }
+    return NULL;
+}
+
+/* Appends a record to the ring and points the key's index slot at it, reusing the slot already holding
+ * the key, else an empty one, else the oldest in its set. Called with the cache lock held. */
+static void cache_disk_put_locked(const struct CacheKey *key, const char *value, size_t length) {
+    struct DiskCacheHeader *header = response_cache.header;
+    struct DiskCacheSlot *bucket = NULL;
+    struct DiskCacheSlot *slot = NULL;
+    struct DiskCacheRecord *record = NULL;
+    uint64_t need = (sizeof(*record) + length + 7) & ~(uint64_t)7;
+
+    if (!response_cache.map || need > header->data_size / 4) {
+        return;
+    }
+    if (header->write_offset + need > header->data_size) {
+        header->write_offset = 0;
+    }
+    record = (struct DiskCacheRecord *)(response_cache.data + header->write_offset);
+    record->key_hi = key->hi;
+    record->key_lo = key->lo;
+    record->sequence = ++header->sequence;
+    record->length = length;
+    record->checksum = cache_checksum((const unsigned char *)value, length);
+    memcpy(record + 1, value, length);
+
+    bucket = &response_cache.slots[(key->lo & (header->slot_count / 4 - 1)) * 4];
+    for (int way = 0; way < 4 && !slot; ++way) {
+        if (bucket[way].key_hi == key->hi && bucket[way].key_lo == key->lo) {
+            slot = &bucket[way];
+        }
+    }
+    for (int way = 0; way < 4 && !slot; ++way) {
+        if (bucket[way].sequence == 0) {
+            slot = &bucket[way];
+        }
+    }
+    if (!slot) {
+        slot = &bucket[0];
+        for (int way = 1; way < 4; ++way) {
+            if (bucket[way].sequence < slot->sequence) {
+                slot = &bucket[way];
+            }
+        }
+    }
+    slot->key_hi = key->hi;
+    slot->key_lo = key->lo;
+    slot->offset = header->write_offset;
+    slot->sequence = record->sequence;
+    header->write_offset += need;
+}
+
+/* Returns a copy of the value cached for key (caller frees), looking in memory first and promoting a
+ * reply found only on disk. */
+static char *response_cache_get(const struct CacheKey *key, size_t *length, int *from_disk) {
+    struct CacheEntry *entry = NULL;
+    char *value = NULL;
+
+    *from_disk = 0;
+    pthread_mutex_lock(&response_cache.lock);
+    if (response_cache.capacity > 0) {
+        for (entry = *cache_bucket(key); entry; entry = entry->chain) {
+            if (cache_key_equal(&entry->key, key)) {
+                break;
+            }
+        }
+    }
+    if (entry) {
+        value = malloc(entry->length + 1);
+        if (value) {
+            memcpy(value, entry->value, entry->length + 1);
+            *length = entry->length;
+        }
+        cache_entry_unlink(entry);
+        cache_entry_push(entry);
+    } else if ((value = cache_disk_get_locked(key, length)) != NULL) {
+        *from_disk = 1;
+        cache_memory_put_locked(key, value, *length);
+    }
+    pthread_mutex_unlock(&response_cache.lock);
+    return value;
+}
+
+static size_t response_cache_entries(void) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&response_cache.lock);
+    count = response_cache.count;
+    pthread_mutex_unlock(&response_cache.lock);
+    return count;
+}
+
+static void response_cache_put(const struct CacheKey *key, const char *value, size_t length) {
+    pthread_mutex_lock(&response_cache.lock);
+    cache_memory_put_locked(key, value, length);
+    cache_disk_put_locked(key, value, length);
+    pthread_mutex_unlock(&response_cache.lock);
+}
+
+/* Maps the cache file, starting it afresh when it is missing, has another layout or belongs to a running
+ * server. Returns -1 when the disk tier cannot be used. */
+static int response_cache_open_file(const char *path, size_t data_size) {
+    uint32_t slot_count = 256;
+    size_t index_size = 0;
+    size_t total = 0;
+    struct stat st;
+    int fd = -1;
+    int fresh = 0;
+
+    while ((size_t)slot_count * 1024 < data_size && slot_count < (1u << 24)) {
+        slot_count *= 2;
+    }
+    index_size = sizeof(struct DiskCacheHeader) + (size_t)slot_count * sizeof(struct DiskCacheSlot);
+    total = index_size + data_size;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("open cache file");
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "Response cache file %s is in use by another process.\n", path);
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != total) {
+        fresh = 1;
+    }
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)total) != 0)) {
+        perror("ftruncate cache file");
+        close(fd);
+        return -1;
+    }
+
+    response_cache.map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (response_cache.map == MAP_FAILED) {
+        perror("mmap cache file");
+        response_cache.map = NULL;
+        close(fd);
+        return -1;
+    }
+    response_cache.header = (struct DiskCacheHeader *)response_cache.map;
+    response_cache.slots = (struct DiskCacheSlot *)(response_cache.map + sizeof(struct DiskCacheHeader));
+    response_cache.data = response_cache.map + index_size;
+    response_cache.map_size = total;
+    response_cache.disk_fd = fd;
+
+    if (fresh || memcmp(response_cache.header->magic, disk_cache_magic, sizeof(disk_cache_magic)) != 0 ||
+        response_cache.header->version != 1 || response_cache.header->slot_count != slot_count ||
+        response_cache.header->data_size != data_size || response_cache.header->write_offset > data_size) {
+        memset(response_cache.map, 0, index_size);
+        memcpy(response_cache.header->magic, disk_cache_magic, sizeof(disk_cache_magic));
+        response_cache.header->version = 1;
+        response_cache.header->slot_count = slot_count;
+        response_cache.header->data_size = data_size;
+    }
+    return 0;
+}
+
+static int response_cache_init(size_t capacity, const char *path, size_t disk_bytes) {
+    size_t buckets = 16;
+
+    while (buckets < capacity * 2) {
+        buckets *= 2;
+    }
+    if (capacity > 0) {
+        response_cache.buckets = calloc(buckets, sizeof(*response_cache.buckets));
+        if (!response_cache.buckets) {
+            return -1;
+        }
+        response_cache.bucket_mask = buckets - 1;
+        response_cache.capacity = capacity;
+    }
+    if (path && *path && disk_bytes > 0) {
+        return response_cache_open_file(path, disk_bytes);
+    }
+    return 0;
+}
+
+/* The request body for /api/generate, produced while curl sends it: the serialised payload up to
+ * the prompt field, the prompt escaped on the fly straight from the caller's buffer, then the
+ * closing quote and brace. The prompt is never copied into a JSON string of its own, so it must
+ * stay alive until the transfer is finished. */
+struct PromptUpload {
+    const char *head;
+    size_t head_length;
+    const char *prompt;
+    size_t prompt_length;
+    size_t head_sent;
+    size_t key_sent;
+    size_t prompt_sent;
+    size_t tail_sent;
+    char escape[8];
+    size_t escape_length;
+    size_t escape_sent;
+};
+
+/* A single in-flight call to Ollama's /generate endpoint. The easy handle can either be driven to
+ * completion with curl_easy_perform() or handed to a curl multi handle by the event loop. When
+ * on_token is set the request uses Ollama's NDJSON streaming and reports each fragment as it
+ * arrives; body then only holds the unparsed tail of the stream. */
+struct GenerateRequest {
+    CURL *curl;
+    struct curl_slist *headers;
+    json_object *payload;
+    struct PromptUpload upload;
+    struct Arena *arena;
+    struct TextBuffer body;
+    struct TextBuffer text;
+    char *error;
+    token_callback on_token;
+    void *token_data;
+    struct GenerateMetrics metrics;
+    int client_fd;
+    int abandoned;
+    long long started_ms;
+    long long first_byte_ms;
+    int *race;
+    int race_id;
+    struct CacheKey cache_key;
+    int cache_store;
+    int cached;
+};
+
+static void generate_metrics_release(struct GenerateMetrics *metrics) {
+    if (metrics->context) {
+        json_object_put(metrics->context);
+    }
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+static void generate_request_note_final(struct GenerateRequest *request, json_object *parsed) {
+    json_object *field = NULL;
+    json_object *done = NULL;
+
+    if (!json_object_object_get_ex(parsed, "done", &done) || !json_object_get_boolean(done)) {
+        return;
+    }
+    if (json_object_object_get_ex(parsed, "context", &field) && json_object_is_type(field, json_type_array)) {
+        generate_metrics_release(&request->metrics);
+        request->metrics.context = json_object_get(field);
+    }
+    if (json_object_object_get_ex(parsed, "prompt_eval_count", &field)) {
+        request->metrics.prompt_eval_count = (long)json_object_get_int64(field);
+    }
+    if (json_object_object_get_ex(parsed, "load_duration", &field)) {
+        request->metrics.load_ns = (long long)json_object_get_int64(field);
+    }
+    if (json_object_object_get_ex(parsed, "prompt_eval_duration", &field)) {
+        request->metrics.prompt_eval_ns = (long long)json_object_get_int64(field);
+    }
+    if (json_object_object_get_ex(parsed, "eval_duration", &field)) {
+        request->metrics.eval_ns = (long long)json_object_get_int64(field);
+    }
+}
+
+static char *parse_ollama_response(const char *json_string, struct GenerateRequest *request) {
+    struct json_object *parsed_json = NULL;
+    struct json_object *response_obj = NULL;
+    struct json_object *error_obj = NULL;
+    char *response_text = NULL;
+
+    parsed_json = json_tokener_parse(json_string);
+    if (!parsed_json) {
+        fprintf(stderr, "Error: Could not parse JSON response.\n");
         return NULL;
     }
 
-    array_len = json_object_array_length(models_array);
-    for (size_t i = 0; i < array_len; ++i) {
-        json_object *item = json_object_array_get_idx(models_array, i);
-        const char *model_value = NULL;
-        const char *name_value = NULL;
+    if (json_object_object_get_ex(parsed_json, "error", &error_obj)) {
+        const char *error_msg = json_object_get_string(error_obj);
+        if (error_msg) {
+            fprintf(stderr, "Error from AI server: %s\n", error_msg);
+        }
+    } else if (json_object_object_get_ex(parsed_json, "response", &response_obj)) {
+        const char *response_str = json_object_get_string(response_obj);
+        if (response_str) {
+            response_text = arena_strndup(request->arena, response_str, strlen(response_str));
+        }
+        generate_request_note_final(request, parsed_json);
+    }
+
+    json_object_put(parsed_json);
+    return response_text;
+}
+
+static void generate_request_cleanup(struct GenerateRequest *request) {
+    if (!request) {
+        return;
+    }
+    if (request->curl) {
+        curl_pool_release(request->curl);
+    }
+    if (request->headers) {
+        curl_slist_free_all(request->headers);
+    }
+    if (request->payload) {
+        json_object_put(request->payload);
+    }
+    generate_metrics_release(&request->metrics);
+    memset(request, 0, sizeof(*request));
+}
+
+/* Whether the client on fd has hung up or half-closed its side, without reading anything it sent. */
+static int client_disconnected(int fd) {
+    struct pollfd waiter = {.fd = fd, .events = POLLRDHUP};
+    return poll(&waiter, 1, 0) > 0 && (waiter.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+/* curl calls this at least once a second during a transfer; aborting there stops a generation the
+ * client is no longer waiting for, instead of letting it run to the end. */
+static int GenerateProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                    curl_off_t ulnow) {
+    struct GenerateRequest *request = (struct GenerateRequest *)clientp;
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+
+    if (request->race && *request->race && *request->race != request->race_id) {
+        return 1;
+    }
+    if (request->client_fd >= 0 && client_disconnected(request->client_fd)) {
+        request->abandoned = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void generate_request_watch_progress(struct GenerateRequest *request) {
+    curl_easy_setopt(request->curl, CURLOPT_XFERINFOFUNCTION, GenerateProgressCallback);
+    curl_easy_setopt(request->curl, CURLOPT_XFERINFODATA, (void *)request);
+    curl_easy_setopt(request->curl, CURLOPT_NOPROGRESS, 0L);
+}
+
+/* Aborts the request as soon as the client on client_fd goes away. */
+static void generate_request_watch_client(struct GenerateRequest *request, int client_fd) {
+    request->client_fd = client_fd;
+    generate_request_watch_progress(request);
+}
+
+/* Enters the request in a race decided by *winner: the first entrant to receive data stores its id there,
+ * and every other entrant aborts from its next callback. */
+static void generate_request_join_race(struct GenerateRequest *request, int *winner, int id) {
+    request->race = winner;
+    request->race_id = id;
+    generate_request_watch_progress(request);
+}
+
+/* Notes the first byte of the response and tells whether the request may go on receiving it. */
+static int generate_request_claim(struct GenerateRequest *request) {
+    if (!request->first_byte_ms) {
+        request->first_byte_ms = monotonic_ms();
+    }
+    if (!request->race) {
+        return 1;
+    }
+    if (!*request->race) {
+        *request->race = request->race_id;
+    }
+    return *request->race == request->race_id;
+}
+
+/* Handles one line of Ollama's streaming output. Returns -1 to abort the transfer. */
+static int generate_stream_line(struct GenerateRequest *request, const char *line) {
+    json_object *parsed = NULL;
+    json_object *field = NULL;
+    int rc = 0;
+
+    while (*line && isspace((unsigned char)*line)) {
+        line++;
+    }
+    if (!*line) {
+        return 0;
+    }
+
+    parsed = json_tokener_parse(line);
+    if (!parsed) {
+        fprintf(stderr, "Error: Could not parse streamed JSON line.\n");
+        return 0;
+    }
+
+    if (json_object_object_get_ex(parsed, "error", &field)) {
+        const char *error_msg = json_object_get_string(field);
+        if (error_msg && !request->error) {
+            fprintf(stderr, "Error from AI server: %s\n", error_msg);
+            request->error = arena_strndup(request->arena, error_msg, strlen(error_msg));
+        }
+    } else if (json_object_object_get_ex(parsed, "response", &field)) {
+        const char *fragment = json_object_get_string(field);
+        size_t fragment_len = fragment ? (size_t)json_object_get_string_len(field) : 0;
+        if (fragment_len > 0) {
+            if (text_buffer_append(&request->text, fragment, fragment_len) != 0) {
+                rc = -1;
+            } else if (request->on_token && request->on_token(fragment, fragment_len, request->token_data) != 0) {
+                rc = -1;
+            }
+        }
+        generate_request_note_final(request, parsed);
+    }
+
+    json_object_put(parsed);
+    return rc;
+}
+
+static size_t GenerateStreamCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct GenerateRequest *request = (struct GenerateRequest *)userp;
+    size_t realsize = size * nmemb;
+    size_t consumed = 0;
+
+    if (!generate_request_claim(request)) {
+        return 0;
+    }
+    if (text_buffer_append(&request->body, contents, realsize) != 0) {
+        fprintf(stderr, "Error: not enough memory for streamed response\n");
+        return 0;
+    }
+
+    while (consumed < request->body.length) {
+        char *line = request->body.data + consumed;
+        char *newline = memchr(line, '\n', request->body.length - consumed);
+        if (!newline) {
+            break;
+        }
+        *newline = '\0';
+        consumed = (size_t)(newline - request->body.data) + 1;
+        if (generate_stream_line(request, line) != 0) {
+            return 0;
+        }
+    }
+
+    text_buffer_consume(&request->body, consumed);
+    return realsize;
+}
+
+static size_t GenerateBodyCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct GenerateRequest *request = (struct GenerateRequest *)userp;
+    size_t realsize = size * nmemb;
+
+    if (!generate_request_claim(request)) {
+        return 0;
+    }
+    if (text_buffer_append(&request->body, contents, realsize) != 0) {
+        fprintf(stderr, "Error: not enough memory for response\n");
+        return 0;
+    }
+    return realsize;
+}
+
+/* Ollama takes keep_alive either as seconds or as a duration string such as "10m". */
+static void add_keep_alive(json_object *payload) {
+    const char *cursor = ollama_keep_alive;
+
+    if (!cursor || !*cursor) {
+        return;
+    }
+    if (*cursor == '-') {
+        cursor++;
+    }
+    while (isdigit((unsigned char)*cursor)) {
+        cursor++;
+    }
+    if (*cursor == '\0') {
+        json_object_object_add(payload, "keep_alive", json_object_new_int(atoi(ollama_keep_alive)));
+    } else {
+        json_object_object_add(payload, "keep_alive", json_object_new_string(ollama_keep_alive));
+    }
+}
+
+/* Writes the JSON escape for ch into out and returns its length, or 0 when ch can be sent as is. */
+static size_t json_escape_byte(unsigned char ch, char *out) {
+    static const char hex[] = "0123456789abcdef";
+
+    switch (ch) {
+    case '"':
+    case '\\':
+        out[0] = '\\';
+        out[1] = (char)ch;
+        return 2;
+    case '\n':
+        memcpy(out, "\\n", 2);
+        return 2;
+    case '\r':
+        memcpy(out, "\\r", 2);
+        return 2;
+    case '\t':
+        memcpy(out, "\\t", 2);
+        return 2;
+    default:
+        break;
+    }
+    if (ch >= 0x20) {
+        return 0;
+    }
+    memcpy(out, "\\u00", 4);
+    out[4] = hex[ch >> 4];
+    out[5] = hex[ch & 0x0f];
+    return 6;
+}
+
+static size_t json_escaped_length(const char *text, size_t length) {
+    size_t total = length;
+    char scratch[8];
+
+    for (size_t i = 0; i < length; ++i) {
+        size_t escaped = json_escape_byte((unsigned char)text[i], scratch);
+        if (escaped) {
+            total += escaped - 1;
+        }
+    }
+    return total;
+}
+
+static const char prompt_upload_key[] = ",\"prompt\":\"";
+static const char prompt_upload_tail[] = "\"}";
+
+/* Copies what fits of the unsent part of source into out and returns how much that was. */
+static size_t prompt_upload_copy(const char *source, size_t length, size_t *sent, char *out, size_t room) {
+    size_t chunk = length - *sent < room ? length - *sent : room;
+
+    memcpy(out, source + *sent, chunk);
+    *sent += chunk;
+    return chunk;
+}
+
+static size_t PromptUploadCallback(char *buffer, size_t size, size_t nitems, void *userp) {
+    struct PromptUpload *upload = (struct PromptUpload *)userp;
+    size_t room = size * nitems;
+    size_t written = 0;
+
+    while (written < room) {
+        char *out = buffer + written;
+        size_t left = room - written;
+        if (upload->head_sent < upload->head_length) {
+            written += prompt_upload_copy(upload->head, upload->head_length, &upload->head_sent, out, left);
+        } else if (upload->key_sent < sizeof(prompt_upload_key) - 1) {
+            written += prompt_upload_copy(prompt_upload_key, sizeof(prompt_upload_key) - 1, &upload->key_sent, out,
+                                          left);
+        } else if (upload->escape_sent < upload->escape_length) {
+            written += prompt_upload_copy(upload->escape, upload->escape_length, &upload->escape_sent, out, left);
+        } else if (upload->prompt_sent < upload->prompt_length) {
+            const char *start = upload->prompt + upload->prompt_sent;
+            size_t limit = upload->prompt_length - upload->prompt_sent;
+            size_t chunk = 0;
+            limit = limit < left ? limit : left;
+            while (chunk < limit && !json_escape_byte((unsigned char)start[chunk], upload->escape)) {
+                chunk++;
+            }
+            memcpy(out, start, chunk);
+            upload->prompt_sent += chunk;
+            written += chunk;
+            if (chunk < limit) {
+                upload->escape_length = json_escape_byte((unsigned char)start[chunk], upload->escape);
+                upload->escape_sent = 0;
+                upload->prompt_sent++;
+            }
+        } else if (upload->tail_sent < sizeof(prompt_upload_tail) - 1) {
+            written += prompt_upload_copy(prompt_upload_tail, sizeof(prompt_upload_tail) - 1, &upload->tail_sent, out,
+                                          left);
+        } else {
+            break;
+        }
+    }
+    return written;
+}
+
+/* curl rewinds the body when it has to resend it, for example after a reused connection turned out closed. */
+static int PromptUploadSeek(void *userp, curl_off_t offset, int origin) {
+    struct PromptUpload *upload = (struct PromptUpload *)userp;
+
+    if (offset != 0 || origin != SEEK_SET) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    upload->head_sent = 0;
+    upload->key_sent = 0;
+    upload->prompt_sent = 0;
+    upload->tail_sent = 0;
+    upload->escape_length = 0;
+    upload->escape_sent = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+/* context, if given, is the array a previous request for the same model returned; prompt is then
+ * only the text that follows it. prompt is sent straight from the caller's buffer and must outlive
+ * the transfer. Response buffers, the reply and any error text are allocated from arena. */
+static int generate_request_prepare(struct GenerateRequest *request, struct Arena *arena, const char *prompt,
+                                    size_t prompt_length, json_object *context, const struct GenerateOptions *options,
+                                    const char *model_name, const char *ollama_url, token_callback on_token,
+                                    void *token_data) {
+    size_t body_length = 0;
+
+    memset(request, 0, sizeof(*request));
+    request->arena = arena;
+    request->body.arena = arena;
+    request->text.arena = arena;
+    request->on_token = on_token;
+    request->token_data = token_data;
+    request->client_fd = -1;
+    request->started_ms = monotonic_ms();
+
+    request->curl = curl_pool_acquire();
+    request->payload = json_object_new_object();
+    request->headers = curl_slist_append(NULL, "Content-Type: application/json");
+    if (request->headers) {
+        /* Send large prompts right away instead of waiting on 100-continue. */
+        struct curl_slist *headers = curl_slist_append(request->headers, "Expect:");
+        if (headers) {
+            request->headers = headers;
+        }
+    }
+    if (!request->curl || !request->payload || !request->headers) {
+        generate_request_cleanup(request);
+        return -1;
+    }
+
+    json_object_object_add(request->payload, "model", json_object_new_string(model_name));
+    if (context) {
+        json_object_object_add(request->payload, "context", json_object_get(context));
+    }
+    json_object_object_add(request->payload, "stream", json_object_new_boolean(on_token != NULL));
+    add_keep_alive(request->payload);
+    if (options && options->has_seed) {
+        json_object *sampling = json_object_new_object();
+        if (sampling) {
+            json_object_object_add(sampling, "seed", json_object_new_int64((int64_t)options->seed));
+            json_object_object_add(request->payload, "options", sampling);
+        }
+    }
+
+    /* Everything but the prompt, reopened so the prompt can follow: {"model":...,"prompt":"<prompt>"} */
+    request->upload.head = json_object_to_json_string_length(request->payload, JSON_C_TO_STRING_PLAIN,
+                                                             &request->upload.head_length);
+    if (!request->upload.head || request->upload.head_length < 2) {
+        generate_request_cleanup(request);
+        return -1;
+    }
+    request->upload.head_length--;
+    request->upload.prompt = prompt;
+    request->upload.prompt_length = prompt_length;
+    body_length = request->upload.head_length + sizeof(prompt_upload_key) - 1 +
+                  json_escaped_length(prompt, prompt_length) + sizeof(prompt_upload_tail) - 1;
+
+    curl_easy_setopt(request->curl, CURLOPT_URL, ollama_url);
+    curl_easy_setopt(request->curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(request->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body_length);
+    curl_easy_setopt(request->curl, CURLOPT_READFUNCTION, PromptUploadCallback);
+    curl_easy_setopt(request->curl, CURLOPT_READDATA, (void *)&request->upload);
+    curl_easy_setopt(request->curl, CURLOPT_SEEKFUNCTION, PromptUploadSeek);
+    curl_easy_setopt(request->curl, CURLOPT_SEEKDATA, (void *)&request->upload);
+    curl_easy_setopt(request->curl, CURLOPT_HTTPHEADER, request->headers);
+    if (turn_timeout > 0) {
+        curl_easy_setopt(request->curl, CURLOPT_TIMEOUT_MS, turn_timeout * 1000L);
+    }
+    if (on_token) {
+        curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, GenerateStreamCallback);
+        curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, (void *)request);
+    } else {
+        curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, GenerateBodyCallback);
+        curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, (void *)request);
+    }
+
+    fprintf(stdout, "Requesting response from model '%s'...\n", model_name);
+    return 0;
+}
+
+/* Caches the raw reply of a deterministic request under its key, with the context that followed it. */
+static void generate_request_store(struct GenerateRequest *request, const char *response) {
+    json_object *entry = json_object_new_object();
+    const struct GenerateMetrics *metrics = &request->metrics;
+    const char *value = NULL;
+    size_t length = 0;
+
+    if (!entry) {
+        return;
+    }
+    json_object_object_add(entry, "response", json_object_new_string(response));
+    if (metrics->context) {
+        json_object_object_add(entry, "context", json_object_get(metrics->context));
+    }
+    json_object_object_add(entry, "prompt_eval_count", json_object_new_int64(metrics->prompt_eval_count));
+    json_object_object_add(entry, "saved_ns",
+                           json_object_new_int64(metrics->load_ns + metrics->prompt_eval_ns + metrics->eval_ns));
+    value = json_object_to_json_string_length(entry, JSON_C_TO_STRING_PLAIN, &length);
+    if (value) {
+        response_cache_put(&request->cache_key, value, length);
+        pthread_mutex_lock(&stats_lock);
+        server_stats.cache_stores++;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    json_object_put(entry);
+}
+
+/* Fills request from a cached reply instead of a transfer; generate_request_finish() then treats it as a
+ * transfer that completed with CURLE_OK. Ollama's timings stay zero since no model ran. *saved_ns is how
+ * long the original generation took. */
+static int generate_request_replay(struct GenerateRequest *request, struct Arena *arena, const char *value,
+                                   long long *saved_ns) {
+    json_object *parsed = json_tokener_parse(value);
+    json_object *field = NULL;
+    const char *text = NULL;
+    size_t length = 0;
+    int rc = -1;
+
+    memset(request, 0, sizeof(*request));
+    request->arena = arena;
+    request->body.arena = arena;
+    request->text.arena = arena;
+    request->client_fd = -1;
+    request->cached = 1;
+    *saved_ns = 0;
+
+    if (parsed && json_object_object_get_ex(parsed, "response", &field)) {
+        text = json_object_get_string(field);
+        length = (size_t)json_object_get_string_len(field);
+        if (text_buffer_append(&request->text, text ? text : "", length) == 0) {
+            rc = 0;
+        }
+    }
+    if (rc == 0 && json_object_object_get_ex(parsed, "context", &field) &&
+        json_object_is_type(field, json_type_array)) {
+        request->metrics.context = json_object_get(field);
+    }
+    if (rc == 0 && json_object_object_get_ex(parsed, "prompt_eval_count", &field)) {
+        request->metrics.prompt_eval_count = (long)json_object_get_int64(field);
+    }
+    if (rc == 0 && json_object_object_get_ex(parsed, "saved_ns", &field)) {
+        *saved_ns = (long long)json_object_get_int64(field);
+    }
+
+    if (parsed) {
+        json_object_put(parsed);
+    }
+    if (rc != 0) {
+        generate_request_cleanup(request);
+    }
+    return rc;
+}
+
+/* Consumes the transfer result and returns the reply, sanitised in place for speaker, or NULL on failure.
+ * Like the request's buffers the reply belongs to the request's arena. On success the final metrics are
+ * moved to metrics_out when it is set. */
+static char *generate_request_finish(struct GenerateRequest *request, CURLcode res, const char *model_name,
+                                     const struct SpeakerMatcher *speaker, struct GenerateMetrics *metrics_out) {
+    char *response = NULL;
+
+    if (res == CURLE_OK && (request->on_token || request->cached)) {
+        if (request->body.length > 0) {
+            generate_stream_line(request, request->body.data);
+        }
+        if (!request->error) {
+            response = request->text.data ? request->text.data : arena_strndup(request->arena, "", 0);
+        }
+    } else if (res == CURLE_OK) {
+        response = parse_ollama_response(request->body.data ? request->body.data : "", request);
+    } else if (request->abandoned) {
+        fprintf(stderr, "Ollama request for '%s' abandoned: the client disconnected.\n", model_name);
+    } else if (res == CURLE_OPERATION_TIMEDOUT) {
+        fprintf(stderr, "Ollama request for '%s' timed out after %lld ms.\n", model_name,
+                monotonic_ms() - request->started_ms);
+    } else {
+        fprintf(stderr, "Ollama request failed: %s\n", curl_easy_strerror(res));
+    }
+
+    if (response && request->cache_store) {
+        generate_request_store(request, response);
+    }
+    sanitize_speaker_reply(response, speaker);
+    if (response && metrics_out) {
+        *metrics_out = request->metrics;
+        memset(&request->metrics, 0, sizeof(request->metrics));
+    }
+    generate_request_cleanup(request);
+    return response;
+}
+
+/* Ollama state for the prompt prefixes every conversation starts with: the system prompt alone, and the
+ * system prompt followed by the topic. Each entry holds the context Ollama returned after evaluating one
+ * prefix with one model, keyed by the model's digest and the prefix bytes, so a participant's first turn
+ * can continue from it and only send the rest of the transcript. Entries are filled by the preloader and
+ * shared between conversations; the least recently used is replaced once AICHAT_PREFIX_CACHE entries are
+ * held. Context arrays are only ever read once stored, so callers share them by reference. */
+struct PrefixEntry {
+    struct CacheKey key;
+    json_object *context;
+    unsigned long long used;
+};
+
+struct PrefixCache {
+    pthread_mutex_t lock;
+    struct PrefixEntry *entries;
+    size_t count;
+    size_t capacity;
+    unsigned long long clock;
+};
+
+static struct PrefixCache prefix_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static const char system_prefix[] = SYSTEM_PROMPT;
+static const char topic_prefix[] = SYSTEM_PROMPT "USER: ";
+
+static int prefix_cache_enabled(void) {
+    return prefix_cache.capacity > 0;
+}
+
+/* The key for the prefix made of head followed by topic (NULL for the system prompt alone). */
+static void prefix_cache_key(struct CacheKey *key, const char *model, const char *digest, const char *topic) {
+    key->hi = 0;
+    key->lo = 0;
+    cache_key_add(key, digest, strlen(digest));
+    cache_key_add(key, model, strlen(model));
+    if (topic) {
+        cache_key_add(key, topic_prefix, strlen(topic_prefix));
+        cache_key_add(key, topic, strlen(topic));
+    } else {
+        cache_key_add(key, system_prefix, strlen(system_prefix));
+    }
+}
+
+/* Returns a new reference to the saved context for key, or NULL. */
+static json_object *prefix_cache_get(const struct CacheKey *key) {
+    json_object *context = NULL;
+
+    pthread_mutex_lock(&prefix_cache.lock);
+    for (size_t i = 0; i < prefix_cache.count; ++i) {
+        struct PrefixEntry *entry = &prefix_cache.entries[i];
+        if (cache_key_equal(&entry->key, key)) {
+            entry->used = ++prefix_cache.clock;
+            context = json_object_get(entry->context);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prefix_cache.lock);
+    return context;
+}
+
+static int prefix_cache_contains(const struct CacheKey *key) {
+    json_object *context = prefix_cache_get(key);
+
+    if (!context) {
+        return 0;
+    }
+    json_object_put(context);
+    return 1;
+}
+
+/* Stores context under key, taking over the caller's reference. */
+static void prefix_cache_put(const struct CacheKey *key, json_object *context) {
+    struct PrefixEntry *slot = NULL;
+
+    if (!prefix_cache_enabled()) {
+        json_object_put(context);
+        return;
+    }
+    pthread_mutex_lock(&prefix_cache.lock);
+    for (size_t i = 0; i < prefix_cache.count && !slot; ++i) {
+        if (cache_key_equal(&prefix_cache.entries[i].key, key)) {
+            slot = &prefix_cache.entries[i];
+        }
+    }
+    if (!slot && prefix_cache.count < prefix_cache.capacity) {
+        slot = &prefix_cache.entries[prefix_cache.count++];
+        slot->context = NULL;
+    }
+    if (!slot) {
+        slot = &prefix_cache.entries[0];
+        for (size_t i = 1; i < prefix_cache.count; ++i) {
+            if (prefix_cache.entries[i].used < slot->used) {
+                slot = &prefix_cache.entries[i];
+            }
+        }
+    }
+    if (slot->context) {
+        json_object_put(slot->context);
+    }
+    slot->key = *key;
+    slot->context = context;
+    slot->used = ++prefix_cache.clock;
+    pthread_mutex_unlock(&prefix_cache.lock);
+
+    pthread_mutex_lock(&stats_lock);
+    server_stats.prefix_stores++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static size_t prefix_cache_entries(void) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&prefix_cache.lock);
+    count = prefix_cache.count;
+    pthread_mutex_unlock(&prefix_cache.lock);
+    return count;
+}
+
+static int prefix_cache_init(size_t capacity) {
+    if (capacity == 0) {
+        return 0;
+    }
+    prefix_cache.entries = calloc(capacity, sizeof(*prefix_cache.entries));
+    if (!prefix_cache.entries) {
+        return -1;
+    }
+    prefix_cache.capacity = capacity;
+    return 0;
+}
+
+/* Loads models into Ollama ahead of their turn so that a model swap overlaps with the previous
+ * speaker's generation instead of stalling the next turn. Requests are queued to one background
+ * thread, which sends an empty-prompt generate for each model; duplicates already waiting in the
+ * queue are dropped. A job with a topic instead evaluates whichever of its conversation's prefixes
+ * the prefix cache is missing, which loads the model as well. Both I/O modes share it. AICHAT_PRELOAD=0
+ * turns warming off, leaving the thread to the prefix jobs while the prefix cache is on. */
+struct PreloadJob {
+    char model[MAX_MODEL_LENGTH];
+    const char *ollama_url;
+    char digest[MAX_DIGEST_LENGTH];
+    char *topic;
+    int warm;
+};
+
+struct Preloader {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct PreloadJob jobs[PRELOAD_QUEUE_CAPACITY];
+    size_t head;
+    size_t count;
+    int running;
+    int warming;
+};
+
+static struct Preloader preloader = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+static int preload_same_prefix(const struct PreloadJob *job, const char *topic) {
+    if (!job->topic || !topic) {
+        return job->topic == topic;
+    }
+    return strcmp(job->topic, topic) == 0;
+}
+
+static void preload_enqueue(const char *model, const char *ollama_url, const char *digest, const char *topic,
+                            int warm) {
+    int queued = 0;
+
+    if (!model || !*model) {
+        return;
+    }
+
+    pthread_mutex_lock(&preloader.lock);
+    warm = warm && preloader.warming;
+    if (preloader.running && preloader.count < PRELOAD_QUEUE_CAPACITY && (topic || warm)) {
+        struct PreloadJob *duplicate = NULL;
+        for (size_t i = 0; i < preloader.count; ++i) {
+            struct PreloadJob *job = &preloader.jobs[(preloader.head + i) % PRELOAD_QUEUE_CAPACITY];
+            if (strcmp(job->model, model) == 0 && strcmp(job->ollama_url, ollama_url) == 0 &&
+                (!topic || preload_same_prefix(job, topic))) {
+                duplicate = job;
+                break;
+            }
+        }
+        if (duplicate) {
+            duplicate->warm |= warm;
+        } else {
+            struct PreloadJob *job = &preloader.jobs[(preloader.head + preloader.count) % PRELOAD_QUEUE_CAPACITY];
+            job->topic = topic ? strdup(topic) : NULL;
+            if (!topic || job->topic) {
+                strncpy(job->model, model, MAX_MODEL_LENGTH - 1);
+                job->model[MAX_MODEL_LENGTH - 1] = '\0';
+                snprintf(job->digest, sizeof(job->digest), "%s", digest ? digest : "");
+                job->ollama_url = ollama_url;
+                job->warm = warm;
+                preloader.count++;
+                queued = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&preloader.lock);
+
+    if (queued) {
+        pthread_cond_signal(&preloader.ready);
+    }
+}
+
+static void preload_model(const char *model, const char *ollama_url) {
+    preload_enqueue(model, ollama_url, NULL, NULL, 1);
+}
+
+/* Queues evaluation of a conversation's prompt prefixes for model, unless both are cached already.
+ * warm also loads the model when nothing needs evaluating. */
+static void preload_prefixes(const char *model, const char *ollama_url, const char *digest, const char *topic,
+                             int warm) {
+    struct CacheKey system_key;
+    struct CacheKey topic_key;
+
+    prefix_cache_key(&system_key, model, digest, NULL);
+    prefix_cache_key(&topic_key, model, digest, topic);
+    if (prefix_cache_contains(&system_key) && prefix_cache_contains(&topic_key)) {
+        if (warm) {
+            preload_model(model, ollama_url);
+        }
+        return;
+    }
+    preload_enqueue(model, ollama_url, digest, topic, warm);
+}
+
+/* The context Ollama returned for a prompt, without the generated tokens it ends with, so that it
+ * covers the prompt alone. NULL when eval_count does not say how many there are. */
+static json_object *preload_prompt_context(json_object *context, int64_t generated) {
+    size_t length = json_object_array_length(context);
+    json_object *prompt_context = NULL;
+
+    if (generated < 0 || (size_t)generated >= length || (prompt_context = json_object_new_array()) == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < length - (size_t)generated; ++i) {
+        if (json_object_array_add(prompt_context, json_object_get(json_object_array_get_idx(context, i))) != 0) {
+            json_object_put(prompt_context);
+            return NULL;
+        }
+    }
+    return prompt_context;
+}
+
+/* Sends one generate for job. An empty prompt only loads the model; any other prompt is evaluated with
+ * a single token of output, and the context covering just the prompt is handed to *context_out. */
+static int preload_send(const struct PreloadJob *job, const char *prompt, json_object **context_out) {
+    CURL *curl = curl_pool_acquire();
+    json_object *payload = json_object_new_object();
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+    struct MemoryStruct body = {0};
+    long long load_ns = 0;
+    int ok = 0;
+
+    if (curl && payload && headers) {
+        CURLcode res;
+        long status = 0;
+
+        json_object_object_add(payload, "model", json_object_new_string(job->model));
+        json_object_object_add(payload, "prompt", json_object_new_string(prompt));
+        json_object_object_add(payload, "stream", json_object_new_boolean(0));
+        if (*prompt) {
+            json_object *sampling = json_object_new_object();
+            if (sampling) {
+                json_object_object_add(sampling, "num_predict", json_object_new_int(1));
+                json_object_object_add(payload, "options", sampling);
+            }
+        }
+        add_keep_alive(payload);
+
+        curl_easy_setopt(curl, CURLOPT_URL, job->ollama_url);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_object_to_json_string(payload));
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+        res = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+        if (res == CURLE_OK && status == 200 && body.memory) {
+            json_object *parsed = json_tokener_parse(body.memory);
+            json_object *field = NULL;
+            if (parsed && !json_object_object_get_ex(parsed, "error", &field)) {
+                ok = 1;
+                if (json_object_object_get_ex(parsed, "load_duration", &field)) {
+                    load_ns = (long long)json_object_get_int64(field);
+                }
+                if (context_out && json_object_object_get_ex(parsed, "context", &field) &&
+                    json_object_get_type(field) == json_type_array) {
+                    json_object *generated = NULL;
+                    json_object_object_get_ex(parsed, "eval_count", &generated);
+                    *context_out = preload_prompt_context(field, generated ? json_object_get_int64(generated) : -1);
+                }
+            }
+            if (parsed) {
+                json_object_put(parsed);
+            }
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Warning: preloading model '%s' failed.\n", job->model);
+    }
+    pthread_mutex_lock(&stats_lock);
+    server_stats.preload_requests++;
+    if (ok) {
+        server_stats.preload_load_ns += (unsigned long long)(load_ns > 0 ? load_ns : 0);
+    } else {
+        server_stats.preload_failures++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    free(body.memory);
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+    if (payload) {
+        json_object_put(payload);
+    }
+    if (curl) {
+        curl_pool_release(curl);
+    }
+    return ok ? 0 : -1;
+}
+
+/* Whether a model's template hands the prompt over as it is: empty, or just {{ .Prompt }}. */
+static int template_is_plain(const char *template) {
+    const char *start = template;
+    const char *end = template + strlen(template);
+
+    while (start < end && isspace((unsigned char)*start)) {
+        start++;
+    }
+    while (end > start && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    if (start == end) {
+        return 1;
+    }
+    if (end - start < 4 || strncmp(start, "{{", 2) != 0 || strncmp(end - 2, "}}", 2) != 0) {
+        return 0;
+    }
+    start += 2;
+    end -= 2;
+    if (*start == '-') {
+        start++;
+    }
+    if (end > start && end[-1] == '-') {
+        end--;
+    }
+    while (start < end && isspace((unsigned char)*start)) {
+        start++;
+    }
+    while (end > start && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    return end - start == 7 && strncmp(start, ".Prompt", 7) == 0;
+}
+
+/* Asks Ollama's /show for the job's model template. A prefix state can only stand in for the start of a
+ * prompt when the template is plain: Ollama templates the text sent after a context on its own, so any
+ * other template would wrap the prefix and the rest of the transcript separately, and a turn continuing
+ * from the state would see different input than the same turn sent whole. */
+static int preload_template_is_plain(const struct PreloadJob *job) {
+    char *show_url = build_api_url(job->ollama_url, "show");
+    CURL *curl = show_url ? curl_pool_acquire() : NULL;
+    json_object *payload = json_object_new_object();
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+    struct MemoryStruct body = {0};
+    int plain = 0;
+
+    if (curl && payload && headers) {
+        long status = 0;
+        CURLcode res;
+
+        json_object_object_add(payload, "model", json_object_new_string(job->model));
+        curl_easy_setopt(curl, CURLOPT_URL, show_url);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_object_to_json_string(payload));
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+        res = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        if (res == CURLE_OK && status == 200 && body.memory) {
+            json_object *parsed = json_tokener_parse(body.memory);
+            json_object *field = NULL;
+            if (parsed && json_object_object_get_ex(parsed, "template", &field) &&
+                json_object_is_type(field, json_type_string)) {
+                plain = template_is_plain(json_object_get_string(field));
+            }
+            if (parsed) {
+                json_object_put(parsed);
+            }
+        }
+    }
+
+    free(body.memory);
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+    if (payload) {
+        json_object_put(payload);
+    }
+    if (curl) {
+        curl_pool_release(curl);
+    }
+    free(show_url);
+    return plain;
+}
+
+/* Evaluates the system prompt alone and then with the job's topic, skipping whichever is cached, for a
+ * model whose template is plain. The saved state stops where the prompt does: the token the model
+ * produced is cut off, so a turn continuing from it with the rest of the transcript sends Ollama the same
+ * bytes as the uncached turn would, and nothing is saved when Ollama does not say how many tokens it
+ * produced. */
+static int preload_run_prefixes(const struct PreloadJob *job) {
+    const char *topics[2] = {NULL, job->topic};
+    int checked = 0;
+    int sent = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(topics); ++i) {
+        struct CacheKey key;
+        json_object *context = NULL;
+        char *prompt = NULL;
+
+        prefix_cache_key(&key, job->model, job->digest, topics[i]);
+        if (prefix_cache_contains(&key)) {
+            continue;
+        }
+        if (!checked++ && !preload_template_is_plain(job)) {
+            break;
+        }
+        if (topics[i]) {
+            size_t length = strlen(topic_prefix) + strlen(topics[i]) + 1;
+            prompt = malloc(length);
+            if (!prompt) {
+                break;
+            }
+            snprintf(prompt, length, "%s%s", topic_prefix, topics[i]);
+        }
+        sent = 1;
+        if (preload_send(job, prompt ? prompt : system_prefix, &context) != 0) {
+            free(prompt);
+            break;
+        }
+        free(prompt);
+        if (context) {
+            prefix_cache_put(&key, context);
+        }
+    }
+    return sent;
+}
+
+static void preload_run_job(const struct PreloadJob *job) {
+    if (!turn_scheduler_admits_preload(job->ollama_url, job->model)) {
+        pthread_mutex_lock(&stats_lock);
+        server_stats.preload_skipped++;
+        pthread_mutex_unlock(&stats_lock);
+        return;
+    }
+    if (job->topic && preload_run_prefixes(job)) {
+        return;
+    }
+    if (job->warm) {
+        preload_send(job, "", NULL);
+    }
+}
+
+static void *preloader_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        struct PreloadJob job;
+
+        pthread_mutex_lock(&preloader.lock);
+        while (preloader.count == 0) {
+            pthread_cond_wait(&preloader.ready, &preloader.lock);
+        }
+        job = preloader.jobs[preloader.head];
+        preloader.head = (preloader.head + 1) % PRELOAD_QUEUE_CAPACITY;
+        preloader.count--;
+        pthread_mutex_unlock(&preloader.lock);
+
+        preload_run_job(&job);
+        free(job.topic);
+    }
+    return NULL;
+}
+
+static int preloader_start(int warming) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, preloader_main, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+
+    pthread_mutex_lock(&preloader.lock);
+    preloader.running = 1;
+    preloader.warming = warming;
+    pthread_mutex_unlock(&preloader.lock);
+    return 0;
+}
+
+/* The URL of another Ollama API endpoint next to the configured generate URL, e.g. .../api/tags. */
+static char *build_api_url(const char *ollama_url, const char *endpoint) {
+    const char *generate = "generate";
+    size_t url_len = strlen(ollama_url);
+    size_t generate_len = strlen(generate);
+    size_t base_len = url_len;
+    int needs_slash = 0;
+    char *result = NULL;
+
+    if (url_len >= generate_len && strcmp(ollama_url + url_len - generate_len, generate) == 0) {
+        base_len = url_len - generate_len;
+    }
+    needs_slash = base_len == 0 || ollama_url[base_len - 1] != '/';
+    result = malloc(base_len + (size_t)needs_slash + strlen(endpoint) + 1);
+    if (!result) {
+        return NULL;
+    }
+    memcpy(result, ollama_url, base_len);
+    if (needs_slash) {
+        result[base_len++] = '/';
+    }
+    strcpy(result + base_len, endpoint);
+    return result;
+}
+
+static char *build_models_url(const char *ollama_url) {
+    return build_api_url(ollama_url, "tags");
+}
+
+static void set_error(char **error_out, const char *message) {
+    if (error_out) {
+        *error_out = strdup(message);
+    }
+}
+
+/* Prepares a GET of Ollama's model list into chunk. Returns the easy handle to run. */
+static CURL *prepare_models_request(const char *ollama_url, struct MemoryStruct *chunk, char **error_out) {
+    CURL *curl = NULL;
+    char *models_url = build_models_url(ollama_url);
+
+    if (!models_url) {
+        set_error(error_out, "Failed to prepare Ollama models URL.");
+        return NULL;
+    }
+
+    chunk->memory = malloc(1);
+    if (!chunk->memory) {
+        free(models_url);
+        set_error(error_out, "Failed to allocate response buffer.");
+        return NULL;
+    }
+    chunk->memory[0] = '\0';
+    chunk->size = 0;
+
+    curl = curl_pool_acquire();
+    if (!curl) {
+        free(models_url);
+        free(chunk->memory);
+        chunk->memory = NULL;
+        set_error(error_out, "Unable to initialise CURL.");
+        return NULL;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, models_url);
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)chunk);
+    free(models_url); /* libcurl keeps its own copy of the URL */
+    return curl;
+}
+
+/* Converts Ollama's /tags payload into {"models": [{name, model}, ...]}. */
+static int parse_models_response(const char *json_text, json_object **out_json, char **error_out) {
+    json_object *parsed = NULL;
+    json_object *models_array = NULL;
+    json_object *result = NULL;
+    json_object *list = NULL;
+
+    *out_json = NULL;
+
+    parsed = json_tokener_parse(json_text);
+    if (parsed && json_object_is_type(parsed, json_type_object)) {
+        json_object_object_get_ex(parsed, "models", &models_array);
+    } else if (parsed && json_object_is_type(parsed, json_type_array)) {
+        models_array = parsed;
+    }
+
+    if (!models_array || !json_object_is_type(models_array, json_type_array)) {
+        if (parsed) {
+            json_object_put(parsed);
+        }
+        if (error_out) {
+            *error_out = strdup("Unexpected response from Ollama while listing models.");
+        }
+        return -1;
+    }
+
+    list = json_object_new_array();
+    if (!list) {
+        json_object_put(parsed);
+        if (error_out) {
+            *error_out = strdup("Failed to allocate models array.");
+        }
+        return -1;
+    }
+
+    size_t array_len = json_object_array_length(models_array);
+    for (size_t i = 0; i < array_len; ++i) {
+        json_object *item = json_object_array_get_idx(models_array, i);
+        const char *model_value = NULL;
+        const char *name_value = NULL;
+        const char *digest_value = NULL;
+
+        if (!item) {
+            continue;
+        }
+
+        if (json_object_is_type(item, json_type_object)) {
+            json_object *field = NULL;
+            if (json_object_object_get_ex(item, "model", &field) && field) {
+                model_value = json_object_get_string(field);
+            }
+            if (json_object_object_get_ex(item, "name", &field) && field) {
+                name_value = json_object_get_string(field);
+            }
+            if (json_object_object_get_ex(item, "digest", &field) && field) {
+                digest_value = json_object_get_string(field);
+            }
+        } else if (json_object_is_type(item, json_type_string)) {
+            model_value = json_object_get_string(item);
+        }
+
+        if (!model_value || !*model_value) {
+            if (name_value && *name_value) {
+                model_value = name_value;
+            } else {
+                continue;
+            }
+        }
+
+        json_object *entry = json_object_new_object();
+        if (!entry) {
+            json_object_put(list);
+            json_object_put(parsed);
+            if (error_out) {
+                *error_out = strdup("Failed to allocate model entry.");
+            }
+            return -1;
+        }
+
+        const char *display = (name_value && *name_value) ? name_value : model_value;
+        json_object_object_add(entry, "name", json_object_new_string(display));
+        json_object_object_add(entry, "model", json_object_new_string(model_value));
+        if (digest_value && *digest_value) {
+            json_object_object_add(entry, "digest", json_object_new_string(digest_value));
+        }
+        json_object_array_add(list, entry);
+    }
+
+    result = json_object_new_object();
+    if (!result) {
+        json_object_put(list);
+        json_object_put(parsed);
+        if (error_out) {
+            *error_out = strdup("Failed to prepare models payload.");
+        }
+        return -1;
+    }
+
+    json_object_object_add(result, "models", list);
+    *out_json = result;
+
+    json_object_put(parsed);
+    return 0;
+}
+
+static int fetch_available_models(const char *ollama_url, json_object **out_json, char **error_out) {
+    struct MemoryStruct chunk = {.memory = NULL, .size = 0};
+    CURL *curl = NULL;
+    CURLcode res = CURLE_OK;
+    int rc = 0;
+
+    *out_json = NULL;
+    if (error_out) {
+        *error_out = NULL;
+    }
+
+    curl = prepare_models_request(ollama_url, &chunk, error_out);
+    if (!curl) {
+        return -1;
+    }
+
+    res = curl_easy_perform(curl);
+    curl_pool_release(curl);
+
+    if (res != CURLE_OK) {
+        free(chunk.memory);
+        set_error(error_out, "Failed to contact Ollama for model list.");
+        return -1;
+    }
+
+    rc = parse_models_response(chunk.memory, out_json, error_out);
+    free(chunk.memory);
+    return rc;
+}
+
+/* The Ollama servers turns are spread over: OLLAMA_URL, or a comma-separated list of generate URLs.
+ * With more than one, a poller thread asks each for its loaded models (/api/ps) every
+ * AICHAT_BACKEND_POLL seconds. A turn then goes to the least busy backend that already holds the
+ * speaker's model, or failing that to the least busy one that has the model installed, preferring one
+ * with fewer models loaded since loading there is least likely to evict a model another conversation
+ * is using. A single backend skips the bookkeeping. */
+struct OllamaBackend {
+    char *url;
+    char **resident;
+    size_t resident_count;
+    char **installed;
+    size_t installed_count;
+    int installed_known;
+    int healthy;
+    int in_flight;
+    unsigned long long requests;
+};
+
+struct BackendPool {
+    pthread_mutex_t lock;
+    struct OllamaBackend backends[MAX_OLLAMA_BACKENDS];
+    size_t count;
+    int poll_interval;
+};
+
+static struct BackendPool backend_pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .poll_interval = DEFAULT_BACKEND_POLL};
+
+/* Splits the configured URL list into the pool. Returns the number of backends. */
+static size_t backend_pool_init(const char *spec) {
+    const char *cursor = spec;
+
+    while (*cursor && backend_pool.count < MAX_OLLAMA_BACKENDS) {
+        const char *end = strchr(cursor, ',');
+        size_t length = end ? (size_t)(end - cursor) : strlen(cursor);
+        const char *start = cursor;
+
+        cursor += length + (end ? 1 : 0);
+        while (length > 0 && isspace((unsigned char)*start)) {
+            start++;
+            length--;
+        }
+        while (length > 0 && isspace((unsigned char)start[length - 1])) {
+            length--;
+        }
+        if (length == 0) {
+            continue;
+        }
+        backend_pool.backends[backend_pool.count].url = strndup(start, length);
+        if (!backend_pool.backends[backend_pool.count].url) {
+            break;
+        }
+        backend_pool.backends[backend_pool.count].healthy = 1;
+        backend_pool.count++;
+    }
+    if (backend_pool.count == 0) {
+        backend_pool.backends[0].url = strdup(DEFAULT_OLLAMA_URL);
+        backend_pool.backends[0].healthy = 1;
+        backend_pool.count = backend_pool.backends[0].url ? 1 : 0;
+    }
+    return backend_pool.count;
+}
+
+static const char *backend_url(int backend) {
+    return backend_pool.backends[backend].url;
+}
+
+/* Ollama lists untagged models as name:latest. */
+static int model_names_match(const char *a, const char *b) {
+    size_t a_length = strlen(a);
+    size_t b_length = strlen(b);
+
+    if (a_length == b_length) {
+        return strcmp(a, b) == 0;
+    }
+    if (a_length > b_length) {
+        const char *swap = a;
+        a = b;
+        b = swap;
+        a_length = b_length;
+    }
+    return !strchr(a, ':') && strncmp(a, b, a_length) == 0 && strcmp(b + a_length, ":latest") == 0;
+}
+
+static int model_list_contains(char *const *list, size_t count, const char *model) {
+    for (size_t i = 0; i < count; ++i) {
+        if (model_names_match(list[i], model)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void model_list_free(char **list, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        free(list[i]);
+    }
+    free(list);
+}
+
+/* Copies the "model" (or "name") fields of a {"models": [...]} payload into a new list. */
+static char **model_list_from_payload(json_object *payload, size_t *count) {
+    json_object *models = NULL;
+    char **list = NULL;
+    size_t length = 0;
+
+    *count = 0;
+    if (!json_object_object_get_ex(payload, "models", &models) || !json_object_is_type(models, json_type_array)) {
+        return NULL;
+    }
+    length = json_object_array_length(models);
+    list = calloc(length ? length : 1, sizeof(*list));
+    if (!list) {
+        return NULL;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        json_object *item = json_object_array_get_idx(models, i);
+        json_object *field = NULL;
+        const char *model = NULL;
+
+        if (json_object_object_get_ex(item, "model", &field) || json_object_object_get_ex(item, "name", &field)) {
+            model = json_object_get_string(field);
+        }
+        if (model && *model && (list[*count] = strdup(model)) != NULL) {
+            (*count)++;
+        }
+    }
+    return list;
+}
+
+/* The backend a turn of model should go to; *resident tells whether it already holds the model. A tie
+ * goes to preferred, the backend that served the speaker's previous turn and may still hold its cache.
+ * exclude, when not -1, is never chosen, and then -1 is returned if no other backend is known to be
+ * able to serve the model. Called with the pool lock held. */
+static int backend_choose_locked(const char *model, int preferred, int exclude, int *resident_out) {
+    int best = -1;
+    int best_resident = 0;
+
+    for (size_t i = 0; i < backend_pool.count; ++i) {
+        const struct OllamaBackend *backend = &backend_pool.backends[i];
+        const struct OllamaBackend *current = best >= 0 ? &backend_pool.backends[best] : NULL;
+        int resident = model_list_contains(backend->resident, backend->resident_count, model);
+
+        if ((int)i == exclude || !backend->healthy ||
+            (!resident && backend->installed_known &&
+             !model_list_contains(backend->installed, backend->installed_count, model))) {
+            continue;
+        }
+        if (!current || resident > best_resident ||
+            (resident == best_resident &&
+             (backend->in_flight < current->in_flight ||
+              (backend->in_flight == current->in_flight &&
+               ((int)i == preferred ||
+                (!resident && best != preferred && backend->resident_count < current->resident_count)))))) {
+            best = (int)i;
+            best_resident = resident;
+        }
+    }
+    if (best < 0 && exclude >= 0) {
+        return -1;
+    }
+    if (best < 0) {
+        /* Nothing known to hold or have the model: let the least busy backend try. */
+        best = 0;
+        for (size_t i = 1; i < backend_pool.count; ++i) {
+            if (backend_pool.backends[i].in_flight < backend_pool.backends[best].in_flight) {
+                best = (int)i;
+            }
+        }
+    }
+    *resident_out = best_resident;
+    return best;
+}
+
+/* Picks the backend for a turn of model, other than exclude, and counts the turn against it until
+ * backend_release(). The chosen backend is assumed to hold the model from now on, until its next poll
+ * says otherwise. Returns -1 when exclude leaves no backend for the model. */
+static int backend_acquire(const char *model, int preferred, int exclude) {
+    struct OllamaBackend *chosen = NULL;
+    int best = 0;
+    int resident = 0;
+
+    pthread_mutex_lock(&backend_pool.lock);
+    if (backend_pool.count <= 1) {
+        backend_pool.backends[0].in_flight++;
+        backend_pool.backends[0].requests++;
+        pthread_mutex_unlock(&backend_pool.lock);
+        return 0;
+    }
+
+    best = backend_choose_locked(model, preferred, exclude, &resident);
+    if (best < 0) {
+        pthread_mutex_unlock(&backend_pool.lock);
+        return -1;
+    }
+    chosen = &backend_pool.backends[best];
+    chosen->in_flight++;
+    chosen->requests++;
+    if (!resident) {
+        char **grown = realloc(chosen->resident, (chosen->resident_count + 1) * sizeof(*grown));
+        if (grown) {
+            chosen->resident = grown;
+            if ((grown[chosen->resident_count] = strdup(model)) != NULL) {
+                chosen->resident_count++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&backend_pool.lock);
+
+    pthread_mutex_lock(&stats_lock);
+    if (resident) {
+        server_stats.backend_routed_resident++;
+    } else {
+        server_stats.backend_routed_cold++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return best;
+}
+
+static void backend_release(int backend) {
+    if (backend < 0) {
+        return;
+    }
+    pthread_mutex_lock(&backend_pool.lock);
+    backend_pool.backends[backend].in_flight--;
+    pthread_mutex_unlock(&backend_pool.lock);
+}
+
+/* Takes a backend that refused a connection out of routing until its next successful poll. */
+static void backend_mark_down(int backend) {
+    pthread_mutex_lock(&backend_pool.lock);
+    if (backend >= 0 && backend_pool.count > 1) {
+        backend_pool.backends[backend].healthy = 0;
+    }
+    pthread_mutex_unlock(&backend_pool.lock);
+}
+
+/* The backend a preload for model should go to: the one its turn would be routed to now. */
+static const char *backend_url_for_model(const char *model) {
+    int backend = 0;
+    int resident = 0;
+
+    pthread_mutex_lock(&backend_pool.lock);
+    if (backend_pool.count > 1) {
+        backend = backend_choose_locked(model, -1, -1, &resident);
+    }
+    pthread_mutex_unlock(&backend_pool.lock);
+    return backend_url(backend);
+}
+
+/* Hedged turns (AICHAT_HEDGE, with more than one backend): a turn whose first byte takes longer than
+ * AICHAT_HEDGE_PERCENTILE of recent turns took is sent to a second backend as well. Whichever answers
+ * first is kept and the other is cancelled, so a slow or hung server costs the turn that delay rather
+ * than its whole stall. The delay comes from the last HEDGE_SAMPLES first-byte times; until there are
+ * HEDGE_MIN_SAMPLES of them no turn is hedged. */
+struct HedgeTracker {
+    pthread_mutex_t lock;
+    long long samples[HEDGE_SAMPLES];
+    size_t count;
+    size_t next;
+    int enabled;
+    int percentile;
+};
+
+static struct HedgeTracker hedge_tracker = {.lock = PTHREAD_MUTEX_INITIALIZER, .percentile = DEFAULT_HEDGE_PERCENTILE};
+
+static int hedging_enabled(void) {
+    return hedge_tracker.enabled && backend_pool.count > 1;
+}
+
+static void hedge_record(long long first_byte_ms) {
+    pthread_mutex_lock(&hedge_tracker.lock);
+    hedge_tracker.samples[hedge_tracker.next] = first_byte_ms;
+    hedge_tracker.next = (hedge_tracker.next + 1) % HEDGE_SAMPLES;
+    if (hedge_tracker.count < HEDGE_SAMPLES) {
+        hedge_tracker.count++;
+    }
+    pthread_mutex_unlock(&hedge_tracker.lock);
+}
+
+/* How long a turn may wait for its first byte before it is hedged, or -1 while it is not. */
+static long long hedge_delay_ms(void) {
+    long long sorted[HEDGE_SAMPLES];
+    size_t count = 0;
+    size_t rank = 0;
+
+    if (!hedging_enabled()) {
+        return -1;
+    }
+    pthread_mutex_lock(&hedge_tracker.lock);
+    count = hedge_tracker.count;
+    memcpy(sorted, hedge_tracker.samples, count * sizeof(sorted[0]));
+    pthread_mutex_unlock(&hedge_tracker.lock);
+    if (count < HEDGE_MIN_SAMPLES) {
+        return -1;
+    }
+
+    for (size_t i = 1; i < count; ++i) {
+        long long sample = sorted[i];
+        size_t j = i;
+        for (; j > 0 && sorted[j - 1] > sample; --j) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = sample;
+    }
+    rank = (count * (size_t)hedge_tracker.percentile + 99) / 100;
+    rank = rank > 0 ? rank - 1 : 0;
+    return sorted[rank] > HEDGE_MIN_DELAY_MS ? sorted[rank] : HEDGE_MIN_DELAY_MS;
+}
+
+/* Model-affinity turn scheduling. Every turn that goes to Ollama holds a ticket for its backend while
+ * it generates. Each backend remembers its active model, the one its latest turn used, and how many
+ * turns of it are running; a turn for a different model counts as a model swap. With AICHAT_SCHEDULER=1
+ * a backend runs one model at a time, so concurrent conversations take their turns in batches per model
+ * instead of making Ollama swap models on every turn. A turn for the active model starts while fewer
+ * than AICHAT_MODEL_CONCURRENCY are running. A turn for another model waits until the backend is idle,
+ * and then the oldest waiting turn for the active model still goes first. Once a turn has waited
+ * AICHAT_SCHEDULER_AGING seconds, no more turns of the active model start ahead of it, so no conversation
+ * starves. Without AICHAT_SCHEDULER tickets are granted at once and only the swaps are counted. */
+enum ticket_state {
+    TICKET_IDLE,
+    TICKET_WAITING,
+    TICKET_GRANTED
+};
+
+struct TurnTicket {
+    struct TurnTicket *next;
+    const char *model;
+    int backend;
+    long long queued_ms;
+    enum ticket_state state;
+};
+
+struct ModelSlot {
+    char model[MAX_MODEL_LENGTH];
+    int running;
+};
+
+/* Counters gathered under the scheduler lock and added to server_stats after it is released. */
+struct SchedulerTally {
+    unsigned long long queued;
+    unsigned long long wait_ms;
+    unsigned long long max_wait_ms;
+    unsigned long long swaps;
+};
+
+struct TurnScheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t granted;
+    clockid_t clock;
+    struct TurnTicket *head;
+    struct TurnTicket *tail;
+    size_t waiting;
+    struct ModelSlot slots[MAX_OLLAMA_BACKENDS];
+    int enabled;
+    int model_concurrency;
+    long long aging_ms;
+};
+
+static struct TurnScheduler turn_scheduler = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                              .granted = PTHREAD_COND_INITIALIZER,
+                                              .clock = CLOCK_REALTIME,
+                                              .model_concurrency = DEFAULT_MODEL_CONCURRENCY,
+                                              .aging_ms = DEFAULT_SCHEDULER_AGING * 1000LL};
+
+/* Moves the grant condition onto the monotonic clock, so a wait for a grant is not stretched or cut
+ * short when the wall clock is set. */
+static int turn_scheduler_init(void) {
+    pthread_condattr_t attributes;
+    int rc = -1;
+
+    if (pthread_condattr_init(&attributes) != 0) {
+        return -1;
+    }
+    if (pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC) == 0) {
+        pthread_cond_destroy(&turn_scheduler.granted);
+        if (pthread_cond_init(&turn_scheduler.granted, &attributes) == 0) {
+            turn_scheduler.clock = CLOCK_MONOTONIC;
+            rc = 0;
+        } else {
+            pthread_cond_init(&turn_scheduler.granted, NULL);
+        }
+    }
+    pthread_condattr_destroy(&attributes);
+    return rc;
+}
+
+static int turn_scheduler_enabled(void) {
+    return turn_scheduler.enabled;
+}
+
+static size_t turn_scheduler_waiting(void) {
+    size_t waiting = 0;
+
+    pthread_mutex_lock(&turn_scheduler.lock);
+    waiting = turn_scheduler.waiting;
+    pthread_mutex_unlock(&turn_scheduler.lock);
+    return waiting;
+}
+
+static void turn_scheduler_unlink_locked(struct TurnTicket *ticket) {
+    struct TurnTicket **link = &turn_scheduler.head;
+    struct TurnTicket *previous = NULL;
+
+    while (*link && *link != ticket) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        return;
+    }
+    *link = ticket->next;
+    if (turn_scheduler.tail == ticket) {
+        turn_scheduler.tail = previous;
+    }
+    ticket->next = NULL;
+    turn_scheduler.waiting--;
+}
+
+/* Lets ticket's turn start. Its wait is tallied unless it was granted as it was submitted. */
+static void turn_scheduler_grant_locked(struct TurnTicket *ticket, long long now, int waited_in_queue,
+                                        struct SchedulerTally *tally) {
+    struct ModelSlot *slot = &turn_scheduler.slots[ticket->backend];
+
+    if (strcmp(slot->model, ticket->model) != 0) {
+        tally->swaps += slot->model[0] ? 1 : 0;
+        snprintf(slot->model, sizeof(slot->model), "%s", ticket->model);
+    }
+    slot->running++;
+    if (waited_in_queue) {
+        unsigned long long waited = now > ticket->queued_ms ? (unsigned long long)(now - ticket->queued_ms) : 0;
+        tally->queued++;
+        tally->wait_ms += waited;
+        tally->max_wait_ms = waited > tally->max_wait_ms ? waited : tally->max_wait_ms;
+    }
+    ticket->state = TICKET_GRANTED;
+}
+
+/* Finds the oldest turn waiting for backend and the oldest waiting for its active model. *starving is set
+ * when the oldest is for another model and has waited past the aging limit. */
+static struct TurnTicket *turn_scheduler_oldest_locked(int backend, long long now, struct TurnTicket **affine,
+                                                       int *starving) {
+    const struct ModelSlot *slot = &turn_scheduler.slots[backend];
+    struct TurnTicket *oldest = NULL;
+
+    *affine = NULL;
+    for (struct TurnTicket *ticket = turn_scheduler.head; ticket; ticket = ticket->next) {
+        if (ticket->backend != backend) {
+            continue;
+        }
+        oldest = oldest ? oldest : ticket;
+        if (strcmp(ticket->model, slot->model) == 0) {
+            *affine = ticket;
+            break;
+        }
+    }
+    *starving = oldest && oldest != *affine && now - oldest->queued_ms >= turn_scheduler.aging_ms;
+    return oldest;
+}
+
+/* The waiting turn backend should start next, or NULL while none may start. */
+static struct TurnTicket *turn_scheduler_pick_locked(int backend, long long now) {
+    const struct ModelSlot *slot = &turn_scheduler.slots[backend];
+    struct TurnTicket *affine = NULL;
+    int starving = 0;
+    struct TurnTicket *oldest = turn_scheduler_oldest_locked(backend, now, &affine, &starving);
+
+    if (!oldest) {
+        return NULL;
+    }
+    if (slot->running == 0) {
+        return affine && !starving ? affine : oldest;
+    }
+    if (affine && !starving && slot->running < turn_scheduler.model_concurrency) {
+        return affine;
+    }
+    return NULL;
+}
+
+static void turn_scheduler_dispatch_locked(int backend, const struct TurnTicket *submitted,
+                                           struct SchedulerTally *tally) {
+    long long now = monotonic_ms();
+    struct TurnTicket *ticket = NULL;
+    int granted = 0;
+
+    while ((ticket = turn_scheduler_pick_locked(backend, now)) != NULL) {
+        turn_scheduler_unlink_locked(ticket);
+        turn_scheduler_grant_locked(ticket, now, ticket != submitted, tally);
+        granted = 1;
+    }
+    if (granted) {
+        pthread_cond_broadcast(&turn_scheduler.granted);
+    }
+}
+
+static void turn_scheduler_commit(const struct SchedulerTally *tally) {
+    if (!tally->queued && !tally->swaps) {
+        return;
+    }
+    pthread_mutex_lock(&stats_lock);
+    server_stats.scheduler_queued += tally->queued;
+    server_stats.scheduler_wait_ms += tally->wait_ms;
+    if (tally->max_wait_ms > server_stats.scheduler_max_wait_ms) {
+        server_stats.scheduler_max_wait_ms = tally->max_wait_ms;
+    }
+    server_stats.model_swaps += tally->swaps;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Gives back a ticket, whether it is still waiting or its turn has finished, and starts whichever turns
+ * that lets through. */
+static void turn_scheduler_leave(struct TurnTicket *ticket) {
+    struct SchedulerTally tally = {0, 0, 0, 0};
+
+    if (ticket->state == TICKET_IDLE) {
+        return;
+    }
+    pthread_mutex_lock(&turn_scheduler.lock);
+    if (ticket->state == TICKET_WAITING) {
+        turn_scheduler_unlink_locked(ticket);
+    } else {
+        turn_scheduler.slots[ticket->backend].running--;
+    }
+    ticket->state = TICKET_IDLE;
+    if (turn_scheduler.enabled) {
+        turn_scheduler_dispatch_locked(ticket->backend, NULL, &tally);
+    }
+    pthread_mutex_unlock(&turn_scheduler.lock);
+
+    turn_scheduler_commit(&tally);
+}
+
+/* Asks to run a turn of model on backend. Returns 1 when it may start now; otherwise the ticket waits
+ * until turn_scheduler_granted() says so. Either way it must be given back with turn_scheduler_leave().
+ * A ticket still granted from the conversation's previous turn keeps its slot when this turn is for the
+ * same backend and model and no other turn is waiting to use the slot; otherwise it queues again. */
+static int turn_scheduler_submit(struct TurnTicket *ticket, const char *model, int backend) {
+    struct SchedulerTally tally = {0, 0, 0, 0};
+    int granted = 0;
+
+    if (ticket->state == TICKET_GRANTED) {
+        struct TurnTicket *affine = NULL;
+        int starving = 0;
+        int keep = 0;
+
+        pthread_mutex_lock(&turn_scheduler.lock);
+        if (turn_scheduler.enabled && ticket->backend == backend &&
+            strcmp(turn_scheduler.slots[backend].model, model) == 0) {
+            turn_scheduler_oldest_locked(backend, monotonic_ms(), &affine, &starving);
+            keep = !affine && !starving;
+        }
+        if (keep) {
+            ticket->model = model;
+        }
+        pthread_mutex_unlock(&turn_scheduler.lock);
+        if (keep) {
+            return 1;
+        }
+        turn_scheduler_leave(ticket);
+    }
+
+    ticket->next = NULL;
+    ticket->model = model;
+    ticket->backend = backend;
+    ticket->queued_ms = monotonic_ms();
+
+    pthread_mutex_lock(&turn_scheduler.lock);
+    if (!turn_scheduler.enabled) {
+        turn_scheduler_grant_locked(ticket, ticket->queued_ms, 0, &tally);
+    } else {
+        ticket->state = TICKET_WAITING;
+        if (turn_scheduler.tail) {
+            turn_scheduler.tail->next = ticket;
+        } else {
+            turn_scheduler.head = ticket;
+        }
+        turn_scheduler.tail = ticket;
+        turn_scheduler.waiting++;
+        turn_scheduler_dispatch_locked(backend, ticket, &tally);
+    }
+    granted = ticket->state == TICKET_GRANTED;
+    pthread_mutex_unlock(&turn_scheduler.lock);
+
+    turn_scheduler_commit(&tally);
+    return granted;
+}
+
+static int turn_scheduler_granted(struct TurnTicket *ticket) {
+    int granted = 0;
+
+    pthread_mutex_lock(&turn_scheduler.lock);
+    granted = ticket->state == TICKET_GRANTED;
+    pthread_mutex_unlock(&turn_scheduler.lock);
+    return granted;
+}
+
+/* Blocks until ticket is granted; the turn that releases its slot wakes it. Returns -1 if client_fd
+ * (when >= 0) disconnects first, which is checked as often as curl checks during a transfer. */
+static int turn_scheduler_wait(struct TurnTicket *ticket, int client_fd) {
+    pthread_mutex_lock(&turn_scheduler.lock);
+    while (ticket->state != TICKET_GRANTED) {
+        struct timespec until;
+
+        if (client_fd < 0) {
+            pthread_cond_wait(&turn_scheduler.granted, &turn_scheduler.lock);
+            continue;
+        }
+        clock_gettime(turn_scheduler.clock, &until);
+        until.tv_sec += SCHEDULER_DISCONNECT_CHECK_MS / 1000;
+        until.tv_nsec += (SCHEDULER_DISCONNECT_CHECK_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&turn_scheduler.granted, &turn_scheduler.lock, &until) == ETIMEDOUT &&
+            ticket->state != TICKET_GRANTED) {
+            pthread_mutex_unlock(&turn_scheduler.lock);
+            if (client_disconnected(client_fd)) {
+                return -1;
+            }
+            pthread_mutex_lock(&turn_scheduler.lock);
+        }
+    }
+    pthread_mutex_unlock(&turn_scheduler.lock);
+    return 0;
+}
+
+/* Whether model may be preloaded on the backend at ollama_url. With the scheduler on, only its active
+ * model may, since loading any other would be a model swap the scheduler did not ask for; before the
+ * first turn nothing is, as the first turn decides which model loads. */
+static int turn_scheduler_admits_preload(const char *ollama_url, const char *model) {
+    int admitted = 1;
+
+    if (!turn_scheduler.enabled) {
+        return 1;
+    }
+    pthread_mutex_lock(&turn_scheduler.lock);
+    for (size_t i = 0; i < backend_pool.count; ++i) {
+        const struct ModelSlot *slot = &turn_scheduler.slots[i];
+        if (strcmp(backend_url((int)i), ollama_url) == 0) {
+            admitted = strcmp(slot->model, model) == 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&turn_scheduler.lock);
+    return admitted;
+}
+
+static void backend_set_installed(size_t backend, json_object *payload) {
+    size_t count = 0;
+    char **list = model_list_from_payload(payload, &count);
+    char **previous = NULL;
+    size_t previous_count = 0;
+
+    if (!list) {
+        return;
+    }
+    pthread_mutex_lock(&backend_pool.lock);
+    previous = backend_pool.backends[backend].installed;
+    previous_count = backend_pool.backends[backend].installed_count;
+    backend_pool.backends[backend].installed = list;
+    backend_pool.backends[backend].installed_count = count;
+    backend_pool.backends[backend].installed_known = 1;
+    pthread_mutex_unlock(&backend_pool.lock);
+    model_list_free(previous, previous_count);
+}
+
+/* Fetches every backend's model list, records what each has installed, and returns the union (by model
+ * identifier, in backend order). Succeeds when at least one backend answers. */
+static int fetch_pool_models(const char *ollama_url, json_object **out_json, char **error_out) {
+    json_object *merged = NULL;
+    json_object *list = NULL;
+    int answered = 0;
+
+    if (backend_pool.count <= 1) {
+        return fetch_available_models(ollama_url, out_json, error_out);
+    }
+
+    *out_json = NULL;
+    merged = json_object_new_object();
+    list = json_object_new_array();
+    if (!merged || !list) {
+        if (merged) {
+            json_object_put(merged);
+        }
+        if (list) {
+            json_object_put(list);
+        }
+        set_error(error_out, "Failed to allocate models array.");
+        return -1;
+    }
+    json_object_object_add(merged, "models", list);
+
+    for (size_t i = 0; i < backend_pool.count; ++i) {
+        json_object *payload = NULL;
+        json_object *models = NULL;
+
+        if (fetch_available_models(backend_pool.backends[i].url, &payload, NULL) != 0 || !payload) {
+            continue;
+        }
+        answered = 1;
+        backend_set_installed(i, payload);
+        json_object_object_get_ex(payload, "models", &models);
+        for (size_t j = 0; models && j < json_object_array_length(models); ++j) {
+            json_object *item = json_object_array_get_idx(models, j);
+            json_object *model = NULL;
+            int duplicate = 0;
+
+            json_object_object_get_ex(item, "model", &model);
+            for (size_t k = 0; k < json_object_array_length(list) && !duplicate; ++k) {
+                json_object *existing = NULL;
+                json_object_object_get_ex(json_object_array_get_idx(list, k), "model", &existing);
+                duplicate = strcmp(json_object_get_string(existing), json_object_get_string(model)) == 0;
+            }
+            if (!duplicate) {
+                json_object_array_add(list, json_object_get(item));
+            }
+        }
+        json_object_put(payload);
+    }
+
+    if (!answered) {
+        json_object_put(merged);
+        set_error(error_out, "Failed to contact Ollama for model list.");
+        return -1;
+    }
+    *out_json = merged;
+    return 0;
+}
+
+/* Open-addressing index from a model identifier to its catalogue entry. */
+struct CatalogueSlot {
+    const char *key;
+    size_t entry;
+};
+
+struct CatalogueEntry {
+    char *model;
+    char *name;
+    char *digest;
+};
+
+/* One immutable version of the model list. Readers hold a reference while they use it, so a
+ * refresh can swap in a new version without waiting for them. json is the /models body,
+ * serialised once when the version is built. */
+struct CatalogueSnapshot {
+    int refs;
+    struct CatalogueEntry *entries;
+    size_t entry_count;
+    struct CatalogueSlot *by_model;
+    struct CatalogueSlot *by_name;
+    size_t slot_mask;
+    char *json;
+};
+
+/* In-process copy of Ollama's model list. Once the current version is older than
+ * AICHAT_MODELS_TTL seconds, the next reader starts a background refresh and keeps using the stale
+ * version until the refresh lands. A failed refresh keeps the stale version as well. Only a reader
+ * that finds nothing cached waits for Ollama. */
+struct ModelCatalogue {
+    pthread_mutex_t lock;
+    pthread_cond_t refreshed;
+    struct CatalogueSnapshot *current;
+    long long fetched_ms;
+    long long ttl_ms;
+    int refreshing;
+};
+
+static struct ModelCatalogue model_catalogue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                                .refreshed = PTHREAD_COND_INITIALIZER,
+                                                .ttl_ms = DEFAULT_MODELS_TTL * 1000LL};
+
+static size_t hash_string(const char *text) {
+    size_t hash = 1469598103934665603ULL;
+    while (*text) {
+        hash ^= (unsigned char)*text++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void catalogue_index_insert(struct CatalogueSlot *slots, size_t mask, const char *key, size_t entry) {
+    size_t slot = hash_string(key) & mask;
+
+    while (slots[slot].key) {
+        if (strcmp(slots[slot].key, key) == 0) {
+            return; /* the first entry with this key wins, as in Ollama's own order */
+        }
+        slot = (slot + 1) & mask;
+    }
+    slots[slot].key = key;
+    slots[slot].entry = entry;
+}
+
+static const struct CatalogueEntry *catalogue_index_find(const struct CatalogueSnapshot *snapshot,
+                                                         const struct CatalogueSlot *slots, const char *key) {
+    size_t slot = hash_string(key) & snapshot->slot_mask;
+
+    while (slots[slot].key) {
+        if (strcmp(slots[slot].key, key) == 0) {
+            return &snapshot->entries[slots[slot].entry];
+        }
+        slot = (slot + 1) & snapshot->slot_mask;
+    }
+    return NULL;
+}
+
+static void catalogue_snapshot_free(struct CatalogueSnapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+    for (size_t i = 0; i < snapshot->entry_count; ++i) {
+        free(snapshot->entries[i].model);
+        free(snapshot->entries[i].name);
+        free(snapshot->entries[i].digest);
+    }
+    free(snapshot->entries);
+    free(snapshot->by_model);
+    free(snapshot->by_name);
+    free(snapshot->json);
+    free(snapshot);
+}
+
+/* Builds a snapshot from the {"models": [...]} payload produced by parse_models_response(). */
+static struct CatalogueSnapshot *catalogue_snapshot_build(json_object *payload) {
+    struct CatalogueSnapshot *snapshot = calloc(1, sizeof(*snapshot));
+    json_object *list = NULL;
+    size_t count = 0;
+    size_t slots = 8;
+
+    if (!snapshot) {
+        return NULL;
+    }
+    json_object_object_get_ex(payload, "models", &list);
+    count = list ? json_object_array_length(list) : 0;
+    while (slots < count * 2) {
+        slots *= 2;
+    }
+
+    snapshot->refs = 1;
+    snapshot->slot_mask = slots - 1;
+    snapshot->entries = calloc(count ? count : 1, sizeof(*snapshot->entries));
+    snapshot->by_model = calloc(slots, sizeof(*snapshot->by_model));
+    snapshot->by_name = calloc(slots, sizeof(*snapshot->by_name));
+    snapshot->json = strdup(json_object_to_json_string_ext(payload, JSON_C_TO_STRING_PLAIN));
+    if (!snapshot->entries || !snapshot->by_model || !snapshot->by_name || !snapshot->json) {
+        catalogue_snapshot_free(snapshot);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        json_object *item = json_object_array_get_idx(list, i);
+        json_object *model = NULL;
+        json_object *name = NULL;
+        json_object *digest = NULL;
+        struct CatalogueEntry *entry = &snapshot->entries[snapshot->entry_count];
+
+        json_object_object_get_ex(item, "model", &model);
+        json_object_object_get_ex(item, "name", &name);
+        json_object_object_get_ex(item, "digest", &digest);
+        entry->model = strdup(json_object_get_string(model) ? json_object_get_string(model) : "");
+        entry->name = strdup(json_object_get_string(name) ? json_object_get_string(name) : "");
+        entry->digest = strdup(json_object_get_string(digest) ? json_object_get_string(digest) : "");
+        if (!entry->model || !entry->name || !entry->digest) {
+            free(entry->model);
+            free(entry->name);
+            free(entry->digest);
+            catalogue_snapshot_free(snapshot);
+            return NULL;
+        }
+        catalogue_index_insert(snapshot->by_model, snapshot->slot_mask, entry->model, snapshot->entry_count);
+        catalogue_index_insert(snapshot->by_name, snapshot->slot_mask, entry->name, snapshot->entry_count);
+        snapshot->entry_count++;
+    }
+    return snapshot;
+}
+
+/* Display name for a model identifier, matching either the model or the name Ollama reports. */
+static const char *catalogue_lookup_display(const struct CatalogueSnapshot *snapshot, const char *identifier) {
+    const struct CatalogueEntry *entry = NULL;
+
+    if (!snapshot || !identifier || !*identifier) {
+        return NULL;
+    }
+    entry = catalogue_index_find(snapshot, snapshot->by_model, identifier);
+    if (entry) {
+        return *entry->name ? entry->name : entry->model;
+    }
+    entry = catalogue_index_find(snapshot, snapshot->by_name, identifier);
+    return entry ? entry->name : NULL;
+}
+
+/* The digest Ollama reports for a model, or NULL when it is unknown. */
+static const char *catalogue_lookup_digest(const struct CatalogueSnapshot *snapshot, const char *identifier) {
+    const struct CatalogueEntry *entry = NULL;
+
+    if (!snapshot || !identifier || !*identifier) {
+        return NULL;
+    }
+    entry = catalogue_index_find(snapshot, snapshot->by_model, identifier);
+    if (!entry) {
+        entry = catalogue_index_find(snapshot, snapshot->by_name, identifier);
+    }
+    return entry && *entry->digest ? entry->digest : NULL;
+}
+
+static void catalogue_release(struct CatalogueSnapshot *snapshot) {
+    int last = 0;
+
+    if (!snapshot) {
+        return;
+    }
+    pthread_mutex_lock(&model_catalogue.lock);
+    last = --snapshot->refs == 0;
+    pthread_mutex_unlock(&model_catalogue.lock);
+    if (last) {
+        catalogue_snapshot_free(snapshot);
+    }
+}
+
+/* Installs a freshly fetched list. An unchanged list keeps the current snapshot, so its serialised
+ * JSON and index are only rebuilt when the catalogue actually changes. */
+static void catalogue_install(json_object *payload) {
+    struct CatalogueSnapshot *snapshot = NULL;
+    struct CatalogueSnapshot *previous = NULL;
+    const char *json = json_object_to_json_string_ext(payload, JSON_C_TO_STRING_PLAIN);
+
+    pthread_mutex_lock(&stats_lock);
+    server_stats.catalogue_refreshes++;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    model_catalogue.fetched_ms = monotonic_ms();
+    if (model_catalogue.current && strcmp(model_catalogue.current->json, json) == 0) {
+        pthread_mutex_unlock(&model_catalogue.lock);
+        return;
+    }
+    pthread_mutex_unlock(&model_catalogue.lock);
+
+    snapshot = catalogue_snapshot_build(payload);
+    if (!snapshot) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    server_stats.catalogue_rebuilds++;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    previous = model_catalogue.current;
+    model_catalogue.current = snapshot;
+    if (previous && --previous->refs > 0) {
+        previous = NULL;
+    }
+    pthread_mutex_unlock(&model_catalogue.lock);
+    catalogue_snapshot_free(previous);
+}
+
+static void catalogue_refresh_failed(void) {
+    pthread_mutex_lock(&stats_lock);
+    server_stats.catalogue_failures++;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    model_catalogue.fetched_ms = monotonic_ms(); /* retry after another TTL rather than on every read */
+    pthread_mutex_unlock(&model_catalogue.lock);
+}
+
+/* Fetches the list from Ollama into the catalogue. Returns 0 on success. */
+static int catalogue_fetch(const char *ollama_url, char **error_out) {
+    json_object *payload = NULL;
+    int rc = fetch_pool_models(ollama_url, &payload, error_out);
+
+    if (rc == 0 && payload) {
+        catalogue_install(payload);
+        json_object_put(payload);
+    } else {
+        catalogue_refresh_failed();
+        rc = -1;
+    }
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    model_catalogue.refreshing = 0;
+    pthread_cond_broadcast(&model_catalogue.refreshed);
+    pthread_mutex_unlock(&model_catalogue.lock);
+    return rc;
+}
+
+static void *catalogue_refresh_main(void *arg) {
+    catalogue_fetch((const char *)arg, NULL);
+    return NULL;
+}
+
+/* Starts a background refresh when the catalogue is stale and none is running. Called with the
+ * catalogue lock held. */
+static void catalogue_maybe_refresh_locked(const char *ollama_url) {
+    pthread_t thread;
+
+    if (model_catalogue.refreshing ||
+        (model_catalogue.current && monotonic_ms() - model_catalogue.fetched_ms < model_catalogue.ttl_ms)) {
+        return;
+    }
+
+    model_catalogue.refreshing = 1;
+    if (pthread_create(&thread, NULL, catalogue_refresh_main, (void *)ollama_url) != 0) {
+        model_catalogue.refreshing = 0;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* Returns the cached model list (release it with catalogue_release()), or NULL if none is cached
+ * yet. Never blocks on Ollama; a stale or missing list is refreshed in the background. */
+static struct CatalogueSnapshot *catalogue_peek(const char *ollama_url) {
+    struct CatalogueSnapshot *snapshot = NULL;
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    catalogue_maybe_refresh_locked(ollama_url);
+    snapshot = model_catalogue.current;
+    if (snapshot) {
+        snapshot->refs++;
+    }
+    pthread_mutex_unlock(&model_catalogue.lock);
+    return snapshot;
+}
+
+/* For the event loop, which cannot wait in catalogue_acquire(): returns the cached list like
+ * catalogue_peek(), or NULL with *refreshing set while a fetch for a cold catalogue is still running. */
+static struct CatalogueSnapshot *catalogue_poll(int *refreshing) {
+    struct CatalogueSnapshot *snapshot = NULL;
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    snapshot = model_catalogue.current;
+    if (snapshot) {
+        snapshot->refs++;
+    }
+    *refreshing = model_catalogue.refreshing;
+    pthread_mutex_unlock(&model_catalogue.lock);
+    return snapshot;
+}
+
+/* Like catalogue_peek(), but when nothing is cached yet waits for Ollama's answer. */
+static struct CatalogueSnapshot *catalogue_acquire(const char *ollama_url, char **error_out) {
+    struct CatalogueSnapshot *snapshot = NULL;
+    int fetch_here = 0;
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    if (!model_catalogue.current && !model_catalogue.refreshing) {
+        model_catalogue.refreshing = 1;
+        fetch_here = 1;
+    }
+    pthread_mutex_unlock(&model_catalogue.lock);
+
+    if (fetch_here && catalogue_fetch(ollama_url, error_out) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&model_catalogue.lock);
+    while (!model_catalogue.current && model_catalogue.refreshing) {
+        pthread_cond_wait(&model_catalogue.refreshed, &model_catalogue.lock);
+    }
+    catalogue_maybe_refresh_locked(ollama_url);
+    snapshot = model_catalogue.current;
+    if (snapshot) {
+        snapshot->refs++;
+    } else {
+        set_error(error_out, "Failed to contact Ollama for model list.");
+    }
+    pthread_mutex_unlock(&model_catalogue.lock);
+    return snapshot;
+}
+
+/* Asks one backend which models it has loaded. A backend that does not answer within a poll interval
+ * is skipped by routing until it does again; waiting longer would only hold up the next round. */
+static void backend_poll(size_t index) {
+    struct OllamaBackend *backend = &backend_pool.backends[index];
+    char *ps_url = build_api_url(backend->url, "ps");
+    struct MemoryStruct body = {0};
+    json_object *parsed = NULL;
+    char **list = NULL;
+    size_t count = 0;
+    CURL *curl = curl_pool_acquire();
+    int ok = 0;
+
+    if (curl && ps_url) {
+        long status = 0;
+
+        curl_easy_setopt(curl, CURLOPT_URL, ps_url);
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)backend_pool.poll_interval);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+        if (curl_easy_perform(curl) == CURLE_OK &&
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK && status == 200 &&
+            body.memory && (parsed = json_tokener_parse(body.memory)) != NULL) {
+            list = model_list_from_payload(parsed, &count);
+            ok = list != NULL;
+            json_object_put(parsed);
+        }
+    }
+    if (curl) {
+        curl_pool_release(curl);
+    }
+    free(ps_url);
+    free(body.memory);
+
+    pthread_mutex_lock(&backend_pool.lock);
+    backend->healthy = ok;
+    if (ok) {
+        char **previous = backend->resident;
+        size_t previous_count = backend->resident_count;
+        backend->resident = list;
+        backend->resident_count = count;
+        list = previous;
+        count = previous_count;
+    }
+    pthread_mutex_unlock(&backend_pool.lock);
+    model_list_free(list, count);
+}
+
+static void *backend_poller_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        for (size_t i = 0; i < backend_pool.count; ++i) {
+            backend_poll(i);
+        }
+        /* Keeps every backend's installed list current, on the catalogue's own TTL. */
+        catalogue_release(catalogue_peek(backend_url(0)));
+        sleep((unsigned int)backend_pool.poll_interval);
+    }
+    return NULL;
+}
+
+static int backend_poller_start(void) {
+    pthread_t thread;
+
+    if (backend_pool.count <= 1) {
+        return 0;
+    }
+    if (pthread_create(&thread, NULL, backend_poller_main, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* Per-backend view for /stats. */
+static json_object *build_backends_json(void) {
+    json_object *list = json_object_new_array();
+
+    if (!list) {
+        return NULL;
+    }
+    pthread_mutex_lock(&backend_pool.lock);
+    for (size_t i = 0; i < backend_pool.count; ++i) {
+        const struct OllamaBackend *backend = &backend_pool.backends[i];
+        json_object *item = json_object_new_object();
+        json_object *resident = json_object_new_array();
+
+        if (!item || !resident) {
+            if (item) {
+                json_object_put(item);
+            }
+            if (resident) {
+                json_object_put(resident);
+            }
+            continue;
+        }
+        for (size_t j = 0; j < backend->resident_count; ++j) {
+            json_object_array_add(resident, json_object_new_string(backend->resident[j]));
+        }
+        json_object_object_add(item, "url", json_object_new_string(backend->url));
+        json_object_object_add(item, "healthy", json_object_new_boolean(backend->healthy));
+        json_object_object_add(item, "inFlight", json_object_new_int(backend->in_flight));
+        json_object_object_add(item, "requests", json_object_new_int64((int64_t)backend->requests));
+        json_object_object_add(item, "resident", resident);
+        json_object_array_add(list, item);
+    }
+    pthread_mutex_unlock(&backend_pool.lock);
+    return list;
+}
+
+static void handle_models_request(struct ClientConnection *client, const char *ollama_url) {
+    char *error_message = NULL;
+    struct CatalogueSnapshot *snapshot = catalogue_acquire(ollama_url, &error_message);
+
+    if (snapshot) {
+        send_http_response(client, "200 OK", "application/json", snapshot->json);
+        catalogue_release(snapshot);
+    } else {
+        const char *message = error_message ? error_message : "Unable to retrieve model list.";
+        send_http_error(client, "502 Bad Gateway", message);
+    }
+
+    if (error_message) {
+        free(error_message);
+    }
+}
+
+static void handle_stats_request(struct ClientConnection *client) {
+    json_object *stats = build_stats_json();
+
+    if (!stats) {
+        send_http_error(client, "500 Internal Server Error", "Unable to collect statistics.");
+        return;
+    }
+
+    send_http_response(client, "200 OK", "application/json",
+                       json_object_to_json_string_ext(stats, JSON_C_TO_STRING_PLAIN));
+    json_object_put(stats);
+}
+
+static void ensure_participant_display_models(struct Participant *participants, size_t participant_count,
+                                              const struct CatalogueSnapshot *catalogue) {
+    if (!participants || participant_count == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < participant_count; ++i) {
+        trim_leading_whitespace(participants[i].display_model);
+        trim_trailing_whitespace(participants[i].display_model);
+        if (participants[i].display_model[0] != '\0') {
+            continue;
+        }
+
+        const char *display = catalogue_lookup_display(catalogue, participants[i].model);
+        if (!display || !*display) {
+            display = participants[i].model;
+        }
+
+        strncpy(participants[i].display_model, display, MAX_MODEL_LENGTH - 1);
+        participants[i].display_model[MAX_MODEL_LENGTH - 1] = '\0';
+        trim_leading_whitespace(participants[i].display_model);
+        trim_trailing_whitespace(participants[i].display_model);
+    }
+}
+
+enum turn_status {
+    TURN_FAILED = -1,
+    TURN_CONTINUE = 0,
+    TURN_COMPLETE = 1
+};
+
+/* What Ollama already holds for one participant: the context returned by its last turn, which
+ * covers the transcript up to history_covered bytes, and the backend that produced it. matcher
+ * sanitises the participant's replies and is allocated from the conversation's arena. */
+struct ParticipantSession {
+    json_object *context;
+    size_t history_covered;
+    int backend;
+    struct SpeakerMatcher *matcher;
+};
+
+/* Resumable conversation state. Each turn is split into conversation_begin_turn(), which prepares
+ * the Ollama request for the next speaker, and conversation_finish_turn(), which consumes its
+ * result, so the same state machine can be driven by a blocking loop or by the event loop. */
+struct Conversation {
+    const char *topic;
+    int turns;
+    struct Participant *participants;
+    size_t participant_count;
+    const char *ollama_url;
+    turn_callback on_message;
+    turn_callback on_delta;
+    void *callback_data;
+    struct Arena arena;
+    struct TextBuffer history;
+    size_t history_tokens;
+    size_t head_tokens;
+    struct TextBuffer summary;
+    size_t summarized;
+    json_object *messages;
+    json_object *participants_json;
+    int turn;
+    size_t speaker;
+    struct GenerateRequest request;
+    struct GenerateRequest hedge;
+    struct StreamSanitizer sanitizer;
+    struct ParticipantSession sessions[MAX_PARTICIPANTS];
+    size_t context_tokens_sent;
+    int backend;
+    int hedge_backend;
+    int race_winner;
+    int hedged;
+    long long turn_started_ms;
+    long long hedge_at_ms;
+    struct TurnTicket ticket;
+    int queued;
+    const char *pending_prompt;
+    size_t pending_length;
+    struct CacheKey pending_key;
+    int pending_store;
+    struct GenerateOptions options;
+    int client_fd;
+    char *error;
+};
+
+static void conversation_set_error(struct Conversation *conv, const char *message) {
+    if (!conv->error) {
+        conv->error = strdup(message);
+    }
+}
+
+static void conversation_cleanup(struct Conversation *conv) {
+    turn_scheduler_leave(&conv->ticket);
+    generate_request_cleanup(&conv->request);
+    backend_release(conv->backend);
+    generate_request_cleanup(&conv->hedge);
+    backend_release(conv->hedge_backend);
+    stream_sanitizer_cleanup(&conv->sanitizer);
+    for (size_t i = 0; i < ARRAY_SIZE(conv->sessions); ++i) {
+        if (conv->sessions[i].context) {
+            json_object_put(conv->sessions[i].context);
+        }
+    }
+    if (conv->messages) {
+        json_object_put(conv->messages);
+    }
+    if (conv->participants_json) {
+        json_object_put(conv->participants_json);
+    }
+    if (conv->arena.allocations > 0) {
+        pthread_mutex_lock(&stats_lock);
+        server_stats.arena_conversations++;
+        server_stats.arena_allocations += conv->arena.allocations;
+        server_stats.arena_bytes += conv->arena.bytes;
+        if (conv->arena.reserved > server_stats.arena_peak_bytes) {
+            server_stats.arena_peak_bytes = conv->arena.reserved;
+        }
+        pthread_mutex_unlock(&stats_lock);
+    }
+    arena_free(&conv->arena);
+    free(conv->error);
+    memset(conv, 0, sizeof(*conv));
+}
+
+/* Copies the digest of model into digest, returning -1 when the catalogue does not know it. */
+static int conversation_model_digest(struct Conversation *conv, const char *model, char *digest, size_t size) {
+    struct CatalogueSnapshot *catalogue = catalogue_peek(conv->ollama_url);
+    const char *found = catalogue_lookup_digest(catalogue, model);
+    int rc = found && strlen(found) < size ? 0 : -1;
+
+    if (rc == 0) {
+        memcpy(digest, found, strlen(found) + 1);
+    }
+    catalogue_release(catalogue);
+    return rc;
+}
+
+/* Whether participants may start from a shared prefix state. Seeded conversations do not, so that a seed
+ * reproduces the same conversation whatever the prefix cache holds. */
+static int conversation_uses_prefixes(const struct Conversation *conv) {
+    return prefix_cache_enabled() && context_reuse_enabled && !conv->options.has_seed;
+}
+
+/* Queues model's prompt prefixes for evaluation, or with warm set just loads it when they cannot be
+ * cached. */
+static void conversation_preload(struct Conversation *conv, const char *model, int warm) {
+    char digest[MAX_DIGEST_LENGTH];
+
+    if (conversation_uses_prefixes(conv) && conversation_model_digest(conv, model, digest, sizeof(digest)) == 0) {
+        preload_prefixes(model, backend_url_for_model(model), digest, conv->topic, warm);
+    } else if (warm) {
+        preload_model(model, backend_url_for_model(model));
+    }
+}
+
+static int conversation_init(struct Conversation *conv, const char *topic, int turns,
+                             struct Participant *participants, size_t participant_count,
+                             const struct GenerateOptions *options, const char *ollama_url,
+                             turn_callback on_message, turn_callback on_delta, void *callback_data) {
+    memset(conv, 0, sizeof(*conv));
+    conv->topic = topic;
+    conv->turns = turns;
+    conv->participants = participants;
+    conv->participant_count = participant_count;
+    conv->ollama_url = ollama_url;
+    conv->on_message = on_message;
+    conv->on_delta = on_delta;
+    conv->callback_data = callback_data;
+    conv->options = *options;
+    conv->client_fd = -1;
+    conv->backend = -1;
+    conv->hedge_backend = -1;
+    for (size_t i = 0; i < ARRAY_SIZE(conv->sessions); ++i) {
+        conv->sessions[i].backend = -1;
+    }
+    conv->history.arena = &conv->arena;
+    conv->summary.arena = &conv->arena;
+
+    if (text_buffer_append(&conv->history, SYSTEM_PROMPT "USER: ", strlen(SYSTEM_PROMPT "USER: ")) != 0 ||
+        text_buffer_append(&conv->history, topic, strlen(topic)) != 0) {
+        conversation_set_error(conv, "Failed to build conversation history.");
+        return -1;
+    }
+    conv->head_tokens = estimate_tokens(conv->history.data, conv->history.length);
+    conv->history_tokens = conv->head_tokens;
+
+    conv->messages = json_object_new_array();
+    conv->participants_json = json_object_new_array();
+    if (!conv->messages || !conv->participants_json) {
+        conversation_set_error(conv, "Failed to allocate JSON structures.");
+        return -1;
+    }
+
+    for (size_t p = 0; p < participant_count; ++p) {
+        json_object *participant_obj = json_object_new_object();
+        if (!participant_obj) {
+            conversation_set_error(conv, "Failed to allocate participant JSON.");
+            return -1;
+        }
+        json_object_object_add(participant_obj, "name", json_object_new_string(participants[p].name));
+        json_object_object_add(participant_obj, "model", json_object_new_string(participants[p].model));
+        if (participants[p].display_model[0] != '\0') {
+            json_object_object_add(participant_obj, "displayModel",
+                                   json_object_new_string(participants[p].display_model));
+        }
+        json_object_array_add(conv->participants_json, participant_obj);
+
+        conv->sessions[p].matcher = arena_alloc(&conv->arena, sizeof(*conv->sessions[p].matcher));
+        if (!conv->sessions[p].matcher) {
+            conversation_set_error(conv, "Failed to allocate the reply sanitiser.");
+            return -1;
+        }
+        speaker_matcher_init(conv->sessions[p].matcher, participants[p].name, participants[p].display_model,
+                             participants[p].model);
+    }
+
+    /* Warm the rest of the roster while the first speaker's model loads, evaluating the shared prefixes
+     * on the way. The first speaker's prefixes are evaluated last, for later conversations. */
+    for (size_t p = 1; p < participant_count; ++p) {
+        conversation_preload(conv, participants[p].model, 1);
+    }
+    if (participant_count > 0) {
+        conversation_preload(conv, participants[0].model, 0);
+    }
+
+    return 0;
+}
+
+static int conversation_is_finished(const struct Conversation *conv) {
+    return conv->turn >= conv->turns || conv->participant_count == 0;
+}
+
+/* Forwards sanitised text of the current speaker's reply as a "delta" event. */
+static int conversation_emit_delta(const char *text, size_t length, void *user_data) {
+    struct Conversation *conv = (struct Conversation *)user_data;
+    struct TurnEvent event = {
+        .type = "delta",
+        .turn = conv->turn + 1,
+        .participant_index = conv->speaker,
+        .speaker = &conv->participants[conv->speaker],
+        .text = text,
+        .text_length = length,
+    };
+
+    return conv->on_delta(&event, conv->callback_data);
+}
+
+/* Raw model tokens go through the streaming sanitizer so hidden reasoning never reaches a delta. */
+static int conversation_token_callback(const char *text, size_t length, void *user_data) {
+    struct Conversation *conv = (struct Conversation *)user_data;
+    return stream_sanitizer_feed(&conv->sanitizer, text, length);
+}
+
+static size_t message_tokens(json_object *message) {
+    json_object *name = NULL;
+    json_object *text = NULL;
+
+    json_object_object_get_ex(message, "name", &name);
+    json_object_object_get_ex(message, "text", &text);
+    return 3 + estimate_tokens(json_object_get_string(name), (size_t)json_object_get_string_len(name)) +
+           estimate_tokens(json_object_get_string(text), (size_t)json_object_get_string_len(text));
+}
+
+/* Adds one line for message to the rolling summary: the speaker and the first sentence of what it said. */
+static int summary_append_message(struct TextBuffer *summary, json_object *message) {
+    json_object *name = NULL;
+    json_object *text = NULL;
+    const char *body = NULL;
+    size_t length = 0;
+    size_t cut = 0;
+
+    json_object_object_get_ex(message, "name", &name);
+    json_object_object_get_ex(message, "text", &text);
+    body = json_object_get_string(text);
+    length = body ? strlen(body) : 0;
+
+    while (cut < length && cut < SUMMARY_LINE_LIMIT) {
+        char ch = body[cut++];
+        if ((ch == '.' || ch == '!' || ch == '?') && (cut == length || isspace((unsigned char)body[cut]))) {
+            break;
+        }
+        if (ch == '\n') {
+            cut--;
+            break;
+        }
+    }
+    if (cut == SUMMARY_LINE_LIMIT && cut < length) {
+        while (cut > 0 && !isspace((unsigned char)body[cut - 1])) {
+            cut--;
+        }
+    }
+
+    if (text_buffer_append(summary, "- ", 2) != 0 ||
+        text_buffer_append(summary, json_object_get_string(name), (size_t)json_object_get_string_len(name)) != 0 ||
+        text_buffer_append(summary, ": ", 2) != 0 || text_buffer_append(summary, body ? body : "", cut) != 0) {
+        return -1;
+    }
+    if (cut < length && text_buffer_append(summary, " ...", 4) != 0) {
+        return -1;
+    }
+    return text_buffer_append(summary, "\n", 1);
+}
+
+/* Builds a prompt of at most budget estimated tokens for a transcript that no longer fits: the
+ * system prompt and topic, a summary of older messages and the most recent messages verbatim,
+ * followed by label. Messages leave the verbatim window oldest first and are folded into the
+ * summary once; the summary itself loses its oldest lines when it would crowd out the window. */
+static char *conversation_build_window(struct Conversation *conv, size_t budget, const char *label) {
+    size_t count = json_object_array_length(conv->messages);
+    size_t start = count > (size_t)history_keep ? count - (size_t)history_keep : 0;
+    size_t fixed = conv->head_tokens + estimate_tokens(label, strlen(label));
+    size_t recent = 0;
+    struct TextBuffer prompt = {.arena = &conv->arena};
+
+    if (start < conv->summarized) {
+        start = conv->summarized;
+    }
+    for (size_t i = start; i < count; ++i) {
+        recent += message_tokens(json_object_array_get_idx(conv->messages, i));
+    }
+    while (start + 1 < count && fixed + recent > budget) {
+        recent -= message_tokens(json_object_array_get_idx(conv->messages, start));
+        start++;
+    }
+
+    for (; conv->summarized < start; conv->summarized++) {
+        if (summary_append_message(&conv->summary, json_object_array_get_idx(conv->messages, conv->summarized)) != 0) {
+            return NULL;
+        }
+    }
+    while (conv->summary.length > 0 &&
+           fixed + recent + estimate_tokens(conv->summary.data, conv->summary.length) > budget) {
+        char *newline = memchr(conv->summary.data, '\n', conv->summary.length);
+        size_t drop = newline ? (size_t)(newline - conv->summary.data) + 1 : conv->summary.length;
+        memmove(conv->summary.data, conv->summary.data + drop, conv->summary.length - drop + 1);
+        conv->summary.length -= drop;
+    }
+
+    if (text_buffer_append(&prompt, SYSTEM_PROMPT "USER: ", strlen(SYSTEM_PROMPT "USER: ")) != 0 ||
+        text_buffer_append(&prompt, conv->topic, strlen(conv->topic)) != 0) {
+        return NULL;
+    }
+    if (conv->summary.length > 0) {
+        static const char summary_heading[] = "\n\nSummary of the earlier conversation:\n";
+        if (text_buffer_append(&prompt, summary_heading, sizeof(summary_heading) - 1) != 0 ||
+            text_buffer_append(&prompt, conv->summary.data, conv->summary.length - 1) != 0) {
+            return NULL;
+        }
+    }
+    for (size_t i = start; i < count; ++i) {
+        json_object *message = json_object_array_get_idx(conv->messages, i);
+        json_object *name = NULL;
+        json_object *text = NULL;
+        json_object_object_get_ex(message, "name", &name);
+        json_object_object_get_ex(message, "text", &text);
+        if (text_buffer_append(&prompt, "\n\n", 2) != 0 ||
+            text_buffer_append(&prompt, json_object_get_string(name), (size_t)json_object_get_string_len(name)) != 0 ||
+            text_buffer_append(&prompt, ":", 1) != 0 ||
+            text_buffer_append(&prompt, json_object_get_string(text), (size_t)json_object_get_string_len(text)) != 0) {
+            return NULL;
+        }
+    }
+    if (text_buffer_append(&prompt, label, strlen(label)) != 0) {
+        return NULL;
+    }
+    return prompt.data;
+}
+
+/* Gives a participant without saved context the state of the longest cached prefix of the transcript:
+ * the system prompt and topic, or else the system prompt alone. */
+static void conversation_use_prefix(struct Conversation *conv, struct ParticipantSession *session,
+                                    const char *model) {
+    char digest[MAX_DIGEST_LENGTH];
+    struct CacheKey key;
+
+    if (!conversation_uses_prefixes(conv) || conversation_model_digest(conv, model, digest, sizeof(digest)) != 0) {
+        return;
+    }
+    prefix_cache_key(&key, model, digest, conv->topic);
+    session->context = prefix_cache_get(&key);
+    session->history_covered = strlen(topic_prefix) + strlen(conv->topic);
+    if (!session->context) {
+        prefix_cache_key(&key, model, digest, NULL);
+        session->context = prefix_cache_get(&key);
+        session->history_covered = strlen(system_prefix);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (session->context) {
+        server_stats.prefix_hits++;
+    } else {
+        server_stats.prefix_misses++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Looks the turn up in the response cache when it is deterministic. Returns 1 when conv->request was
+ * answered from the cache, 0 on a miss with *key set for storing the reply, and -1 when the turn cannot be
+ * cached: no seed, opted out, or the model's digest is unknown. */
+static int conversation_cache_lookup(struct Conversation *conv, const char *prompt, size_t prompt_length,
+                                     json_object *context, struct CacheKey *key) {
+    const char *model = conv->participants[conv->speaker].model;
+    struct CatalogueSnapshot *catalogue = NULL;
+    const char *digest = NULL;
+    const char *context_json = NULL;
+    char seed[32];
+    char *value = NULL;
+    size_t length = 0;
+    long long saved_ns = 0;
+    int from_disk = 0;
+    int rc = -1;
+
+    if (!conv->options.has_seed || !conv->options.cacheable || !response_cache_enabled()) {
+        return -1;
+    }
+    catalogue = catalogue_peek(conv->ollama_url);
+    digest = catalogue_lookup_digest(catalogue, model);
+    if (digest) {
+        key->hi = 0;
+        key->lo = 0;
+        cache_key_add(key, digest, strlen(digest));
+        cache_key_add(key, model, strlen(model));
+        rc = 0;
+    }
+    catalogue_release(catalogue);
+    if (rc != 0) {
+        return -1;
+    }
+
+    snprintf(seed, sizeof(seed), "%lld", conv->options.seed);
+    context_json = context ? json_object_to_json_string_ext(context, JSON_C_TO_STRING_PLAIN) : "";
+    cache_key_add(key, seed, strlen(seed));
+    cache_key_add(key, context_json, strlen(context_json));
+    cache_key_add(key, prompt, prompt_length);
+
+    value = response_cache_get(key, &length, &from_disk);
+    if (value && generate_request_replay(&conv->request, &conv->arena, value, &saved_ns) == 0) {
+        rc = 1;
+    }
+    free(value);
+
+    pthread_mutex_lock(&stats_lock);
+    if (rc == 1) {
+        server_stats.cache_hits++;
+        server_stats.cache_disk_hits += from_disk ? 1 : 0;
+        server_stats.cache_saved_ns += saved_ns > 0 ? (unsigned long long)saved_ns : 0;
+    } else {
+        server_stats.cache_misses++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return rc;
+}
+
+/* Prepares the request for the turn conversation_begin_turn() set up, once the scheduler has let it
+ * start. Returns the easy handle to run, or NULL on failure. */
+static CURL *conversation_dispatch_turn(struct Conversation *conv) {
+    struct Participant *speaker = &conv->participants[conv->speaker];
+    struct ParticipantSession *session = &conv->sessions[conv->speaker];
+    int rc = 0;
+
+    conv->queued = 0;
+    rc = generate_request_prepare(&conv->request, &conv->arena, conv->pending_prompt, conv->pending_length,
+                                  session->context, &conv->options, speaker->model, backend_url(conv->backend),
+                                  conv->on_delta ? conversation_token_callback : NULL, conv);
+    if (rc != 0) {
+        turn_scheduler_leave(&conv->ticket);
+        conversation_set_error(conv, "Failed to prepare model request.");
+        return NULL;
+    }
+    conv->request.cache_key = conv->pending_key;
+    conv->request.cache_store = conv->pending_store;
+    if (conv->client_fd >= 0) {
+        generate_request_watch_client(&conv->request, conv->client_fd);
+    }
+    conv->turn_started_ms = conv->request.started_ms;
+    if (hedging_enabled()) {
+        long long delay = hedge_delay_ms();
+        generate_request_join_race(&conv->request, &conv->race_winner, 1);
+        conv->hedge_at_ms = delay >= 0 ? conv->turn_started_ms + delay : 0;
+    }
+
+    if (conv->participant_count > 1 &&
+        (conv->speaker + 1 < conv->participant_count || conv->turn + 1 < conv->turns)) {
+        const char *next_model = conv->participants[(conv->speaker + 1) % conv->participant_count].model;
+        if (strcmp(next_model, speaker->model) != 0) {
+            preload_model(next_model, backend_url_for_model(next_model));
+        }
+    }
+
+    return conv->request.curl;
+}
+
+/* Appends the next speaker's label and prepares its request. Returns the easy handle to run, or NULL
+ * with conv->request.cached set when the reply came from the response cache and the turn can be finished
+ * straight away, or NULL with conv->queued set when the scheduler holds the turn back; it is then
+ * started with conversation_dispatch_turn() once its ticket is granted. */
+static CURL *conversation_begin_turn(struct Conversation *conv) {
+    struct Participant *speaker = NULL;
+    struct ParticipantSession *session = NULL;
+    const char *prompt = NULL;
+    size_t prompt_length = 0;
+    size_t budget = 0;
+    int cache_rc = 0;
+    struct CacheKey cache_key = {0, 0};
+    char label[128];
+
+    if (conversation_is_finished(conv)) {
+        return NULL;
+    }
+
+    speaker = &conv->participants[conv->speaker];
+    snprintf(label, sizeof(label), "\n\n%s:", speaker->name);
+    if (text_buffer_append(&conv->history, label, strlen(label)) != 0) {
+        conversation_set_error(conv, "Failed to build conversation history.");
+        return NULL;
+    }
+    conv->history_tokens += estimate_tokens(label, strlen(label));
+
+    if (conv->on_delta) {
+        stream_sanitizer_cleanup(&conv->sanitizer);
+        stream_sanitizer_init(&conv->sanitizer, &conv->arena, speaker->name, speaker->display_model, speaker->model,
+                              conversation_emit_delta, conv);
+    }
+
+    /* A participant with a saved context only needs what was said since it last spoke, as long as the
+     * context plus that delta stays within the model's budget. Otherwise it starts over from the full
+     * transcript, or from a summarised window of it once the transcript itself is over budget. */
+    budget = context_budget_for_model(speaker->model);
+    session = &conv->sessions[conv->speaker];
+    if (!session->context && conv->history_tokens <= budget) {
+        conversation_use_prefix(conv, session, speaker->model);
+    }
+    prompt = conv->history.data;
+    prompt_length = conv->history.length;
+    conv->context_tokens_sent = 0;
+    if (session->context) {
+        const char *delta = conv->history.data + session->history_covered;
+        size_t delta_length = conv->history.length - session->history_covered;
+        size_t context_tokens = json_object_array_length(session->context);
+        if (context_tokens + estimate_tokens(delta, delta_length) <= budget) {
+            prompt = delta;
+            prompt_length = delta_length;
+            conv->context_tokens_sent = context_tokens;
+        } else {
+            json_object_put(session->context);
+            session->context = NULL;
+        }
+    }
+    if (!session->context && conv->history_tokens > budget) {
+        /* Leave a quarter of the budget free so the next few turns can reuse the new context. */
+        prompt = conversation_build_window(conv, budget - budget / 4, label);
+        if (!prompt) {
+            conversation_set_error(conv, "Failed to build conversation window.");
+            return NULL;
+        }
+        prompt_length = strlen(prompt);
+        pthread_mutex_lock(&stats_lock);
+        server_stats.windowed_prompts++;
+        pthread_mutex_unlock(&stats_lock);
+    }
+
+    conv->turn_started_ms = monotonic_ms();
+    conv->race_winner = 0;
+    conv->hedged = 0;
+    conv->hedge_at_ms = 0;
+    cache_rc = conversation_cache_lookup(conv, prompt, prompt_length, session->context, &cache_key);
+    if (cache_rc == 1) {
+        turn_scheduler_leave(&conv->ticket);
+        if (conv->on_delta && conv->request.text.length > 0 &&
+            conversation_token_callback(conv->request.text.data, conv->request.text.length, conv) != 0) {
+            generate_request_cleanup(&conv->request);
+            conversation_set_error(conv, "Failed to stream message.");
+        }
+        return NULL;
+    }
+
+    /* The transcript is not appended to again until the turn finishes, so it can be sent in place. */
+    conv->pending_prompt = prompt;
+    conv->pending_length = prompt_length;
+    conv->pending_key = cache_key;
+    conv->pending_store = cache_rc == 0;
+    conv->backend = backend_acquire(speaker->model, session->backend, -1);
+    if (!turn_scheduler_submit(&conv->ticket, speaker->model, conv->backend)) {
+        conv->queued = 1;
+        return NULL;
+    }
+    return conversation_dispatch_turn(conv);
+}
+
+/* Sends the current turn's request to a second backend as well, once the first has kept it waiting past
+ * the hedge delay. The hedge shares the prompt and context of the first request and only gets what is
+ * left of the turn's deadline. Returns its easy handle, or NULL when the turn cannot be hedged. */
+static CURL *conversation_begin_hedge(struct Conversation *conv) {
+    struct Participant *speaker = &conv->participants[conv->speaker];
+    struct ParticipantSession *session = &conv->sessions[conv->speaker];
+    int backend = -1;
+
+    conv->hedge_at_ms = 0;
+    if (conv->race_winner || !conv->request.curl || conv->hedge.curl) {
+        return NULL;
+    }
+    backend = backend_acquire(speaker->model, session->backend, conv->backend);
+    if (backend < 0) {
+        return NULL;
+    }
+    if (generate_request_prepare(&conv->hedge, &conv->arena, conv->request.upload.prompt,
+                                 conv->request.upload.prompt_length, session->context, &conv->options,
+                                 speaker->model, backend_url(backend),
+                                 conv->on_delta ? conversation_token_callback : NULL, conv) != 0) {
+        backend_release(backend);
+        return NULL;
+    }
+    conv->hedge_backend = backend;
+    conv->hedge.cache_key = conv->request.cache_key;
+    conv->hedge.cache_store = conv->request.cache_store;
+    conv->hedge.client_fd = conv->client_fd;
+    generate_request_join_race(&conv->hedge, &conv->race_winner, 2);
+    if (turn_timeout > 0) {
+        long long left = conv->turn_started_ms + turn_timeout * 1000LL - conv->hedge.started_ms;
+        curl_easy_setopt(conv->hedge.curl, CURLOPT_TIMEOUT_MS, (long)(left > 1 ? left : 1));
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    server_stats.hedges_started++;
+    pthread_mutex_unlock(&stats_lock);
+    return conv->hedge.curl;
+}
+
+/* Whether a transfer that ended with res never reached its backend, as opposed to getting a slow or
+ * failed reply from it. */
+static int backend_unreachable(CURL *curl, CURLcode res) {
+    long request_bytes = 0;
+
+    if (res == CURLE_COULDNT_CONNECT) {
+        return 1;
+    }
+    return res == CURLE_OPERATION_TIMEDOUT && curl &&
+           curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_bytes) == CURLE_OK && request_bytes == 0;
+}
+
+/* Discards a racer that lost or failed, along with its claim on its backend. */
+static void conversation_drop_racer(struct GenerateRequest *request, int *backend, CURLcode res) {
+    if (backend_unreachable(request->curl, res)) {
+        backend_mark_down(*backend);
+    }
+    generate_request_cleanup(request);
+    backend_release(*backend);
+    *backend = -1;
+}
+
+/* Called when one racer of a hedged turn has finished and been removed from multi. A racer that failed
+ * before receiving anything while the other is still running is dropped, and 0 returned to wait for the
+ * other. Otherwise the turn is decided: the other racer is cancelled, the finished one moved into
+ * conv->request with *res its result, and 1 returned. */
+static int conversation_settle_race(struct Conversation *conv, CURLM *multi, CURL *easy, CURLcode *res) {
+    int from_hedge = conv->hedge.curl && conv->hedge.curl == easy;
+    struct GenerateRequest *done = from_hedge ? &conv->hedge : &conv->request;
+    struct GenerateRequest *other = from_hedge ? &conv->request : &conv->hedge;
+
+    conv->hedge_at_ms = 0;
+    if (other->curl && *res != CURLE_OK && conv->race_winner != done->race_id) {
+        conversation_drop_racer(done, from_hedge ? &conv->hedge_backend : &conv->backend, *res);
+        return 0;
+    }
+    if (other->curl) {
+        curl_multi_remove_handle(multi, other->curl);
+        conversation_drop_racer(other, from_hedge ? &conv->backend : &conv->hedge_backend, CURLE_OK);
+    }
+    if (from_hedge) {
+        conv->request = conv->hedge;
+        memset(&conv->hedge, 0, sizeof(conv->hedge));
+        conv->backend = conv->hedge_backend;
+        conv->hedge_backend = -1;
+        conv->hedged = 1;
+        pthread_mutex_lock(&stats_lock);
+        server_stats.hedges_won++;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return 1;
+}
+
+/* Updates the server counters and keeps the speaker's new context for its next turn. Without a
+ * context the participant falls back to receiving the full transcript. */
+static void conversation_record_turn(struct Conversation *conv, struct GenerateMetrics *metrics) {
+    struct ParticipantSession *session = &conv->sessions[conv->speaker];
+
+    pthread_mutex_lock(&stats_lock);
+    server_stats.turns++;
+    server_stats.load_ns += (unsigned long long)(metrics->load_ns > 0 ? metrics->load_ns : 0);
+    server_stats.prompt_eval_ns += (unsigned long long)(metrics->prompt_eval_ns > 0 ? metrics->prompt_eval_ns : 0);
+    server_stats.eval_ns += (unsigned long long)(metrics->eval_ns > 0 ? metrics->eval_ns : 0);
+    if (metrics->prompt_eval_count > 0) {
+        server_stats.prompt_eval_tokens += (unsigned long long)metrics->prompt_eval_count;
+    }
+    server_stats.prompt_tokens_reused += (unsigned long long)conv->context_tokens_sent;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (session->context) {
+        json_object_put(session->context);
+        session->context = NULL;
+    }
+    if (context_reuse_enabled && metrics->context) {
+        session->context = metrics->context;
+        session->history_covered = conv->history.length;
+        metrics->context = NULL;
+    }
+}
+
+/* Records a conversation its client left: the turns it will not generate, and roughly how much model
+ * time that saves, taking the average turn so far as the cost of each and crediting the part of the
+ * in-flight turn (if any) that had not run yet. */
+static void conversation_note_abandoned(struct Conversation *conv, CURL *in_flight) {
+    unsigned long long remaining = 0;
+    unsigned long long average_ns = 0;
+    unsigned long long saved_ns = 0;
+    curl_off_t elapsed_us = 0;
+
+    if (conversation_is_finished(conv)) {
+        return;
+    }
+    remaining = (unsigned long long)(conv->turns - conv->turn) * conv->participant_count - conv->speaker;
+    if (in_flight) {
+        curl_easy_getinfo(in_flight, CURLINFO_TOTAL_TIME_T, &elapsed_us);
+    }
+    conversation_set_error(conv, "Client disconnected.");
+
+    pthread_mutex_lock(&stats_lock);
+    if (server_stats.turns > 0) {
+        average_ns = (server_stats.load_ns + server_stats.prompt_eval_ns + server_stats.eval_ns) / server_stats.turns;
+    }
+    saved_ns = remaining * average_ns;
+    saved_ns = saved_ns > (unsigned long long)elapsed_us * 1000ULL ? saved_ns - (unsigned long long)elapsed_us * 1000ULL
+                                                                    : 0;
+    server_stats.abandoned_conversations++;
+    server_stats.abandoned_turns += remaining;
+    server_stats.abandoned_saved_ns += saved_ns;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Where the turn's time went according to Ollama: loading the model, reading the prompt, generating. */
+static json_object *build_timing_json(const struct GenerateMetrics *metrics) {
+    json_object *timing = json_object_new_object();
+
+    if (!timing) {
+        return NULL;
+    }
+    json_object_object_add(timing, "loadMs", json_object_new_int64(metrics->load_ns / 1000000));
+    json_object_object_add(timing, "promptEvalMs", json_object_new_int64(metrics->prompt_eval_ns / 1000000));
+    json_object_object_add(timing, "generationMs", json_object_new_int64(metrics->eval_ns / 1000000));
+    return timing;
+}
+
+static enum turn_status conversation_finish_turn(struct Conversation *conv, CURLcode res) {
+    struct Participant *speaker = &conv->participants[conv->speaker];
+    struct GenerateMetrics metrics = {0};
+    char *response = NULL;
+    json_object *message = NULL;
+    json_object *timing = NULL;
+    const char *served_by = NULL;
+    long long first_byte_ms = conv->request.first_byte_ms;
+    int unreachable = backend_unreachable(conv->request.curl, res);
+    int cached = conv->request.cached;
+
+    if (conv->on_delta && res == CURLE_OK && stream_sanitizer_finish(&conv->sanitizer) != 0) {
+        conversation_set_error(conv, "Failed to stream message.");
+        return TURN_FAILED;
+    }
+
+    response = generate_request_finish(&conv->request, res, speaker->model, conv->sessions[conv->speaker].matcher,
+                                       &metrics);
+    if (unreachable) {
+        backend_mark_down(conv->backend);
+    }
+    if (backend_pool.count > 1 && conv->backend >= 0) {
+        served_by = backend_url(conv->backend);
+    }
+    if (conv->backend >= 0) {
+        conv->sessions[conv->speaker].backend = conv->backend;
+    }
+    backend_release(conv->backend);
+    conv->backend = -1;
+    if (!response) {
+        char buffer[256];
+        turn_scheduler_leave(&conv->ticket);
+        if (res == CURLE_OPERATION_TIMEDOUT && !unreachable) {
+            pthread_mutex_lock(&stats_lock);
+            server_stats.turn_timeouts++;
+            pthread_mutex_unlock(&stats_lock);
+            snprintf(buffer, sizeof(buffer), "Model '%.*s' did not finish within %d seconds.",
+                     (int)(sizeof(buffer) - 64), speaker->model, turn_timeout);
+        } else {
+            snprintf(buffer, sizeof(buffer), "Model '%.*s' failed to respond.", (int)(sizeof(buffer) - 40),
+                     speaker->model);
+        }
+        conversation_set_error(conv, buffer);
+        return TURN_FAILED;
+    }
+    if (first_byte_ms > 0 && hedging_enabled()) {
+        hedge_record(first_byte_ms - conv->turn_started_ms);
+    }
+
+    if (text_buffer_append(&conv->history, response, strlen(response)) != 0) {
+        generate_metrics_release(&metrics);
+        conversation_set_error(conv, "Failed to build conversation history.");
+        return TURN_FAILED;
+    }
+    conv->history_tokens += estimate_tokens(response, strlen(response));
+    conversation_record_turn(conv, &metrics);
+    timing = build_timing_json(&metrics);
+
+    message = json_object_new_object();
+    if (!message) {
+        if (timing) {
+            json_object_put(timing);
+        }
+        generate_metrics_release(&metrics);
+        conversation_set_error(conv, "Failed to allocate message JSON.");
+        return TURN_FAILED;
+    }
+
+    json_object_object_add(message, "turn", json_object_new_int(conv->turn + 1));
+    json_object_object_add(message, "participantIndex", json_object_new_int((int)conv->speaker));
+    json_object_object_add(message, "name", json_object_new_string(speaker->name));
+    json_object_object_add(message, "model", json_object_new_string(speaker->model));
+    if (speaker->display_model[0] != '\0') {
+        json_object_object_add(message, "displayModel", json_object_new_string(speaker->display_model));
+    }
+    json_object_object_add(message, "text", json_object_new_string(response));
+    if (timing) {
+        json_object_object_add(message, "timing", timing);
+    }
+    if (served_by) {
+        json_object_object_add(message, "backend", json_object_new_string(served_by));
+        json_object_object_add(message, "hedged", json_object_new_boolean(conv->hedged));
+    }
+    if (cached) {
+        json_object_object_add(message, "cached", json_object_new_boolean(1));
+    }
+    json_object_array_add(conv->messages, message);
+
+    if (conv->on_message) {
+        struct TurnEvent event = {
+            .type = "message",
+            .turn = conv->turn + 1,
+            .participant_index = conv->speaker,
+            .speaker = speaker,
+            .text = response,
+            .text_length = strlen(response),
+            .metrics = &metrics,
+            .backend = served_by,
+            .hedged = conv->hedged,
+            .cached = cached,
+        };
+        if (conv->on_message(&event, conv->callback_data) != 0) {
+            generate_metrics_release(&metrics);
+            conversation_set_error(conv, "Failed to stream message.");
+            return TURN_FAILED;
+        }
+    }
+    generate_metrics_release(&metrics);
+
+    conv->speaker++;
+    if (conv->speaker >= conv->participant_count) {
+        conv->speaker = 0;
+        conv->turn++;
+    }
+
+    /* The scheduler ticket is kept for the next turn, which may carry on with the same model. */
+    if (conversation_is_finished(conv)) {
+        turn_scheduler_leave(&conv->ticket);
+        return TURN_COMPLETE;
+    }
+    return TURN_CONTINUE;
+}
+
+static json_object *conversation_build_result(struct Conversation *conv) {
+    json_object *result = json_object_new_object();
+
+    if (!result) {
+        conversation_set_error(conv, "Failed to allocate result JSON.");
+        return NULL;
+    }
+
+    json_object_object_add(result, "topic", json_object_new_string(conv->topic));
+    json_object_object_add(result, "turns", json_object_new_int(conv->turns));
+    json_object_object_add(result, "participants", conv->participants_json);
+    json_object_object_add(result, "messages", conv->messages);
+    json_object_object_add(result, "history",
+                           json_object_new_string_len(conv->history.data, (int)conv->history.length));
+    conv->participants_json = NULL;
+    conv->messages = NULL;
+    return result;
+}
+
+/* Runs the current turn's request to completion on the calling thread and returns its result. A turn
+ * that may be hedged runs on a multi handle of its own, so the hedge can join it once the delay passes. */
+static CURLcode conversation_perform_turn(struct Conversation *conv) {
+    CURLM *multi = NULL;
+    CURLcode res = CURLE_OK;
+    int decided = 0;
+
+    if (conv->hedge_at_ms <= 0 || (multi = curl_multi_init()) == NULL) {
+        return curl_easy_perform(conv->request.curl);
+    }
+
+    curl_multi_add_handle(multi, conv->request.curl);
+    while (!decided) {
+        CURLMsg *msg = NULL;
+        int running = 0;
+        int pending = 0;
+        int wait_ms = 1000;
+
+        if (curl_multi_perform(multi, &running) != CURLM_OK) {
+            res = CURLE_OUT_OF_MEMORY;
+            break;
+        }
+        while (!decided && (msg = curl_multi_info_read(multi, &pending)) != NULL) {
+            if (msg->msg == CURLMSG_DONE) {
+                CURL *easy = msg->easy_handle;
+                res = msg->data.result;
+                curl_multi_remove_handle(multi, easy);
+                decided = conversation_settle_race(conv, multi, easy, &res);
+            }
+        }
+        if (decided) {
+            break;
+        }
+        if (conv->hedge_at_ms > 0) {
+            long long left = conv->hedge_at_ms - monotonic_ms();
+            if (left <= 0) {
+                CURL *hedge = conversation_begin_hedge(conv);
+                if (hedge) {
+                    curl_multi_add_handle(multi, hedge);
+                }
+                continue;
+            }
+            wait_ms = left < wait_ms ? (int)left : wait_ms;
+        }
+        curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+    }
+
+    if (!decided) {
+        if (conv->request.curl) {
+            curl_multi_remove_handle(multi, conv->request.curl);
+        }
+        if (conv->hedge.curl) {
+            curl_multi_remove_handle(multi, conv->hedge.curl);
+        }
+    }
+    curl_multi_cleanup(multi);
+    return res;
+}
+
+/* Runs a whole conversation on the calling thread. With client_fd >= 0 the conversation stops as soon
+ * as that client disconnects, mid-generation or between turns. */
+static int run_conversation(const char *topic, int turns, struct Participant *participants,
+                            size_t participant_count, const char *ollama_url, int client_fd,
+                            const struct GenerateOptions *options, turn_callback on_message, turn_callback on_delta,
+                            void *callback_data, json_object **out_json, char **error_out) {
+    struct Conversation conv;
+    enum turn_status status = TURN_CONTINUE;
+
+    *out_json = NULL;
+    if (error_out) {
+        *error_out = NULL;
+    }
+
+    if (conversation_init(&conv, topic, turns, participants, participant_count, options, ollama_url, on_message,
+                          on_delta, callback_data) != 0) {
+        goto fail;
+    }
+    conv.client_fd = client_fd;
+
+    while (status == TURN_CONTINUE && !conversation_is_finished(&conv)) {
+        CURL *curl = NULL;
+        CURLcode res = CURLE_OK;
+
+        if (client_fd >= 0 && client_disconnected(client_fd)) {
+            conversation_note_abandoned(&conv, NULL);
+            goto fail;
+        }
+        curl = conversation_begin_turn(&conv);
+        if (!curl && conv.queued) {
+            if (turn_scheduler_wait(&conv.ticket, client_fd) != 0) {
+                conversation_note_abandoned(&conv, NULL);
+                goto fail;
+            }
+            curl = conversation_dispatch_turn(&conv);
+        }
+        if (!curl && !conv.request.cached) {
+            goto fail;
+        }
+        res = curl ? conversation_perform_turn(&conv) : CURLE_OK;
+        if (conv.request.abandoned) {
+            conversation_note_abandoned(&conv, conv.request.curl);
+        }
+        status = conversation_finish_turn(&conv, res);
+    }
+    if (status == TURN_FAILED) {
+        goto fail;
+    }
+
+    *out_json = conversation_build_result(&conv);
+    if (!*out_json) {
+        goto fail;
+    }
+    conversation_cleanup(&conv);
+    return 0;
+
+fail:
+    if (error_out && conv.error) {
+        *error_out = conv.error;
+        conv.error = NULL;
+    }
+    conversation_cleanup(&conv);
+    return -1;
+}
+
+/* The line that ends every response head: whether the connection stays open for another request. */
+static const char *connection_header(int keep_alive) {
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+/* Writes the response head into header and returns its length, or -1 if it does not fit. */
+static int format_http_header(char *header, size_t size, const char *status, const char *content_type,
+                              size_t body_length, int keep_alive) {
+    int header_len = snprintf(header, size,
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "%s",
+                              status, content_type, body_length, connection_header(keep_alive));
+    return header_len < 0 || (size_t)header_len >= size ? -1 : header_len;
+}
+
+static int format_http_response(struct TextBuffer *out, const char *status, const char *content_type,
+                                const char *body, int keep_alive) {
+    char header[512];
+    size_t body_length = body ? strlen(body) : 0;
+    int header_len = format_http_header(header, sizeof(header), status, content_type, body_length, keep_alive);
+
+    if (header_len < 0 || text_buffer_append(out, header, (size_t)header_len) != 0) {
+        return -1;
+    }
+    return body_length > 0 ? text_buffer_append(out, body, body_length) : 0;
+}
+
+static int format_http_error(struct TextBuffer *out, const char *status, const char *message, int keep_alive) {
+    json_object *obj = json_object_new_object();
+    int rc = -1;
+
+    if (!obj) {
+        return format_http_response(out, status, "text/plain; charset=UTF-8", message, keep_alive);
+    }
+
+    json_object_object_add(obj, "error", json_object_new_string(message));
+    rc = format_http_response(out, status, "application/json", json_object_to_json_string(obj), keep_alive);
+    json_object_put(obj);
+    return rc;
+}
+
+static int format_chunked_header(struct TextBuffer *out, const char *status, const char *content_type,
+                                 int keep_alive) {
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Transfer-Encoding: chunked\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "%s",
+                              status, content_type, connection_header(keep_alive));
+
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        return -1;
+    }
+
+    return text_buffer_append(out, header, (size_t)header_len);
+}
+
+static int format_finish_chunked_response(struct TextBuffer *out) {
+    return text_buffer_append(out, "0\r\n\r\n", 5);
+}
+
+/* Writes JSON straight into an output buffer, without building a json-c tree first. Errors are
+ * sticky: once an append fails every later call is a no-op and the final check reports it. */
+struct JsonWriter {
+    struct TextBuffer *out;
+    size_t chunk_start;
+    size_t depth;
+    unsigned char has_items[JSON_WRITER_MAX_DEPTH];
+    int after_key;
+    int failed;
+};
+
+static void json_writer_raw(struct JsonWriter *writer, const char *text, size_t length) {
+    if (!writer->failed && text_buffer_append(writer->out, text, length) != 0) {
+        writer->failed = 1;
+    }
+}
+
+/* Emits the comma that separates this value from the previous one, unless it follows a key. */
+static void json_writer_value(struct JsonWriter *writer) {
+    if (writer->after_key) {
+        writer->after_key = 0;
+        return;
+    }
+    if (writer->depth > 0) {
+        if (writer->has_items[writer->depth - 1]) {
+            json_writer_raw(writer, ",", 1);
+        }
+        writer->has_items[writer->depth - 1] = 1;
+    }
+}
+
+static void json_writer_open(struct JsonWriter *writer, const char *bracket) {
+    json_writer_value(writer);
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH) {
+        writer->failed = 1;
+        return;
+    }
+    json_writer_raw(writer, bracket, 1);
+    writer->has_items[writer->depth++] = 0;
+}
+
+static void json_writer_close(struct JsonWriter *writer, const char *bracket) {
+    if (writer->depth > 0) {
+        writer->depth--;
+    }
+    json_writer_raw(writer, bracket, 1);
+}
+
+static void json_writer_string(struct JsonWriter *writer, const char *text, size_t length) {
+    size_t run = 0;
+    char escape[8];
+
+    json_writer_value(writer);
+    json_writer_raw(writer, "\"", 1);
+    for (size_t i = 0; i < length; ++i) {
+        size_t escaped = json_escape_byte((unsigned char)text[i], escape);
+        if (escaped) {
+            json_writer_raw(writer, text + run, i - run);
+            json_writer_raw(writer, escape, escaped);
+            run = i + 1;
+        }
+    }
+    json_writer_raw(writer, text + run, length - run);
+    json_writer_raw(writer, "\"", 1);
+}
+
+static void json_writer_key(struct JsonWriter *writer, const char *key) {
+    json_writer_string(writer, key, strlen(key));
+    json_writer_raw(writer, ":", 1);
+    writer->after_key = 1;
+}
+
+static void json_writer_int(struct JsonWriter *writer, long long value) {
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%lld", value);
+
+    json_writer_value(writer);
+    json_writer_raw(writer, digits, (size_t)length);
+}
+
+static void json_writer_string_field(struct JsonWriter *writer, const char *key, const char *value) {
+    json_writer_key(writer, key);
+    json_writer_string(writer, value, strlen(value));
+}
+
+static void json_writer_int_field(struct JsonWriter *writer, const char *key, long long value) {
+    json_writer_key(writer, key);
+    json_writer_int(writer, value);
+}
+
+static void json_writer_bool_field(struct JsonWriter *writer, const char *key, int value) {
+    json_writer_key(writer, key);
+    json_writer_value(writer);
+    json_writer_raw(writer, value ? "true" : "false", value ? 4 : 5);
+}
+
+/* Starts an HTTP chunk holding one NDJSON line. The chunk size is not known yet, so a fixed-width
+ * placeholder is written and patched by json_writer_end_chunk (chunk sizes may have leading zeros). */
+static void json_writer_begin_chunk(struct JsonWriter *writer, struct TextBuffer *out) {
+    memset(writer, 0, sizeof(*writer));
+    writer->out = out;
+    writer->chunk_start = out->length;
+    json_writer_raw(writer, "00000000\r\n", JSON_CHUNK_PREFIX_LENGTH);
+}
+
+/* Ends the line and the chunk. On failure the partial chunk is dropped from the buffer. */
+static int json_writer_end_chunk(struct JsonWriter *writer) {
+    char size_digits[16];
+    size_t payload = 0;
+
+    json_writer_raw(writer, "\n\r\n", 3);
+    if (writer->failed || writer->depth != 0) {
+        writer->out->length = writer->chunk_start < writer->out->length ? writer->chunk_start : writer->out->length;
+        if (writer->out->data) {
+            writer->out->data[writer->out->length] = '\0';
+        }
+        return -1;
+    }
+
+    payload = writer->out->length - writer->chunk_start - JSON_CHUNK_PREFIX_LENGTH - 2;
+    snprintf(size_digits, sizeof(size_digits), "%08zx", payload);
+    memcpy(writer->out->data + writer->chunk_start, size_digits, JSON_CHUNK_PREFIX_LENGTH - 2);
+    return 0;
+}
+
+static int format_error_event(struct TextBuffer *out, const char *message) {
+    struct JsonWriter writer;
+
+    json_writer_begin_chunk(&writer, out);
+    json_writer_open(&writer, "{");
+    json_writer_string_field(&writer, "type", "error");
+    json_writer_string_field(&writer, "message", message ? message : "Conversation failed.");
+    json_writer_close(&writer, "}");
+    return json_writer_end_chunk(&writer);
+}
+
+static int format_start_event(struct TextBuffer *out, const char *topic, int turns,
+                              const struct Participant *participants, size_t participant_count) {
+    struct JsonWriter writer;
+
+    json_writer_begin_chunk(&writer, out);
+    json_writer_open(&writer, "{");
+    json_writer_string_field(&writer, "type", "start");
+    json_writer_string_field(&writer, "topic", topic);
+    json_writer_int_field(&writer, "turns", turns);
+    json_writer_key(&writer, "participants");
+    json_writer_open(&writer, "[");
+    for (size_t i = 0; i < participant_count; ++i) {
+        json_writer_open(&writer, "{");
+        json_writer_string_field(&writer, "name", participants[i].name);
+        json_writer_string_field(&writer, "model", participants[i].model);
+        if (participants[i].display_model[0] != '\0') {
+            json_writer_string_field(&writer, "displayModel", participants[i].display_model);
+        }
+        json_writer_close(&writer, "}");
+    }
+    json_writer_close(&writer, "]");
+    json_writer_close(&writer, "}");
+    return json_writer_end_chunk(&writer);
+}
+
+/* A "message" event carries the finished turn as a nested object; a "delta" carries its fields inline. */
+static int format_turn_event(struct TextBuffer *out, const struct TurnEvent *event) {
+    const struct Participant *speaker = event->speaker;
+    int is_message = event->metrics != NULL;
+    struct JsonWriter writer;
+
+    json_writer_begin_chunk(&writer, out);
+    json_writer_open(&writer, "{");
+    json_writer_string_field(&writer, "type", event->type);
+    if (is_message) {
+        json_writer_key(&writer, "message");
+        json_writer_open(&writer, "{");
+    }
+    json_writer_int_field(&writer, "turn", event->turn);
+    json_writer_int_field(&writer, "participantIndex", (long long)event->participant_index);
+    json_writer_string_field(&writer, "name", speaker->name);
+    if (is_message) {
+        json_writer_string_field(&writer, "model", speaker->model);
+        if (speaker->display_model[0] != '\0') {
+            json_writer_string_field(&writer, "displayModel", speaker->display_model);
+        }
+    }
+    json_writer_key(&writer, "text");
+    json_writer_string(&writer, event->text, event->text_length);
+    if (is_message) {
+        json_writer_key(&writer, "timing");
+        json_writer_open(&writer, "{");
+        json_writer_int_field(&writer, "loadMs", event->metrics->load_ns / 1000000);
+        json_writer_int_field(&writer, "promptEvalMs", event->metrics->prompt_eval_ns / 1000000);
+        json_writer_int_field(&writer, "generationMs", event->metrics->eval_ns / 1000000);
+        json_writer_close(&writer, "}");
+        if (event->backend) {
+            json_writer_string_field(&writer, "backend", event->backend);
+            json_writer_bool_field(&writer, "hedged", event->hedged);
+        }
+        if (event->cached) {
+            json_writer_bool_field(&writer, "cached", 1);
+        }
+        json_writer_close(&writer, "}");
+    }
+    json_writer_close(&writer, "}");
+    return json_writer_end_chunk(&writer);
+}
+
+static int format_complete_event(struct TextBuffer *out, const char *topic, int turns) {
+    struct JsonWriter writer;
+
+    json_writer_begin_chunk(&writer, out);
+    json_writer_open(&writer, "{");
+    json_writer_string_field(&writer, "type", "complete");
+    json_writer_string_field(&writer, "topic", topic);
+    json_writer_int_field(&writer, "turns", turns);
+    json_writer_close(&writer, "}");
+    return json_writer_end_chunk(&writer);
+}
+
+static void note_socket_writes(size_t bytes, size_t writes) {
+    pthread_mutex_lock(&stats_lock);
+    server_stats.http_bytes += bytes;
+    server_stats.http_writes += writes;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Drops the first written bytes from an iovec array, as after a short write. */
+static void iov_advance(struct iovec **iov, int *count, size_t written) {
+    while (*count > 0 && written >= (*iov)->iov_len) {
+        written -= (*iov)->iov_len;
+        (*iov)++;
+        (*count)--;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + written;
+        (*iov)->iov_len -= written;
+    }
+}
+
+/* Sends every buffer in iov, gathered into one sendmsg call unless the socket takes less at a time. */
+static int send_iov(int client_fd, struct iovec *iov, int count) {
+    size_t bytes = 0;
+    size_t writes = 0;
+    int rc = 0;
+
+    while (count > 0 && iov->iov_len == 0) {
+        iov++;
+        count--;
+    }
+    while (count > 0) {
+        struct msghdr message = {.msg_iov = iov, .msg_iovlen = (size_t)count};
+        ssize_t written = sendmsg(client_fd, &message, MSG_NOSIGNAL);
+        writes++;
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            rc = -1;
+            break;
+        }
+        bytes += (size_t)written;
+        iov_advance(&iov, &count, (size_t)written);
+    }
+
+    note_socket_writes(bytes, writes);
+    return rc;
+}
+
+static int send_all(int client_fd, const char *data, size_t length) {
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = length};
+    return send_iov(client_fd, &iov, 1);
+}
+
+/* Streamed output the client has not read yet lives in out from sent onwards, then in the spill file. */
+static int output_pending(const struct TextBuffer *out, size_t sent, const struct StreamSpill *spill) {
+    return sent < out->length || (spill->file && spill->read_offset < spill->write_offset);
+}
+
+static void stream_spill_close(struct StreamSpill *spill) {
+    if (spill->file) {
+        fclose(spill->file);
+    }
+    memset(spill, 0, sizeof(*spill));
+}
+
+/* Admits the event formatted into out from mark onwards. Once more than stream_buffer_limit bytes are
+ * waiting for the client, the event (and every later one, to keep them in order) either goes to the
+ * spill file or, under the disconnect policy, fails the stream. */
+static int output_admit(struct TextBuffer *out, size_t sent, size_t mark, struct StreamSpill *spill) {
+    size_t length = out->length - mark;
+
+    if (!spill->file && out->length - sent <= stream_buffer_limit) {
+        return 0;
+    }
+    if (slow_client_policy == SLOW_CLIENT_DISCONNECT) {
+        pthread_mutex_lock(&stats_lock);
+        server_stats.http_slow_clients++;
+        pthread_mutex_unlock(&stats_lock);
+        return -1;
+    }
+    if (!spill->file && !(spill->file = tmpfile())) {
+        return -1;
+    }
+    if (fseek(spill->file, spill->write_offset, SEEK_SET) != 0 ||
+        fwrite(out->data + mark, 1, length, spill->file) != length || fflush(spill->file) != 0) {
+        return -1;
+    }
+    spill->write_offset += (long)length;
+    out->length = mark;
+    out->data[mark] = '\0';
+
+    pthread_mutex_lock(&stats_lock);
+    server_stats.http_spilled_bytes += length;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
+
+/* Called once out has been written in full: reloads it with the oldest spilled output. Returns 1 when
+ * there is more to send, 0 when the spill is empty and -1 when it cannot be read. */
+static int output_refill(struct TextBuffer *out, size_t *sent, struct StreamSpill *spill) {
+    char chunk[SPILL_READ_CHUNK];
+    size_t wanted = 0;
+
+    out->length = 0;
+    *sent = 0;
+    if (!spill->file || spill->read_offset >= spill->write_offset) {
+        return 0;
+    }
+    wanted = (size_t)(spill->write_offset - spill->read_offset);
+    wanted = wanted < sizeof(chunk) ? wanted : sizeof(chunk);
+    if (fseek(spill->file, spill->read_offset, SEEK_SET) != 0 || fread(chunk, 1, wanted, spill->file) != wanted ||
+        text_buffer_append(out, chunk, wanted) != 0) {
+        return -1;
+    }
+    spill->read_offset += (long)wanted;
+    if (spill->read_offset == spill->write_offset) {
+        spill->read_offset = 0;
+        spill->write_offset = 0;
+    }
+    return 1;
+}
+
+/* Drops the bytes the client has already read from the front of out. */
+static void output_compact(struct TextBuffer *out, size_t *sent) {
+    if (*sent > 0) {
+        text_buffer_consume(out, *sent);
+        *sent = 0;
+    }
+}
+
+static void note_timeout(void) {
+    pthread_mutex_lock(&stats_lock);
+    server_stats.http_timeouts++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Responses are written as whole frames, so there is nothing for Nagle's algorithm to merge: it would
+ * only hold the last segment of each streamed event back until the client acknowledged the previous one.
+ * The send timeout bounds every blocking write to a client that has stopped reading. */
+static void configure_client_socket(int client_fd) {
+    int on = 1;
+    struct timeval timeout = {.tv_sec = write_timeout};
+
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (write_timeout > 0) {
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+}
+
+static int send_buffer(int client_fd, struct TextBuffer *buffer) {
+    int rc = send_all(client_fd, buffer->data, buffer->length);
+    text_buffer_release(buffer);
+    return rc;
+}
+
+/* The head and body go out in one gathered write; the body is sent from the caller's memory. */
+static void send_http_response(struct ClientConnection *client, const char *status, const char *content_type,
+                               const char *body) {
+    char header[512];
+    size_t body_length = body ? strlen(body) : 0;
+    int header_len =
+        format_http_header(header, sizeof(header), status, content_type, body_length, client->keep_alive);
+    struct iovec iov[2] = {{.iov_base = header, .iov_len = header_len > 0 ? (size_t)header_len : 0},
+                           {.iov_base = (void *)body, .iov_len = body_length}};
+
+    if (header_len > 0) {
+        send_iov(client->fd, iov, 2);
+    }
+}
+
+static void send_http_error(struct ClientConnection *client, const char *status, const char *message) {
+    struct TextBuffer out = {0};
+
+    if (format_http_error(&out, status, message, client->keep_alive) == 0) {
+        send_buffer(client->fd, &out);
+    }
+    text_buffer_release(&out);
+}
+
+/* Sends a prebuilt head (without its Connection line) and body from static storage in one gathered write. */
+static void send_prebuilt_response(struct ClientConnection *client, const char *head, size_t head_length,
+                                   const void *body, size_t body_length) {
+    const char *connection = connection_header(client->keep_alive);
+    struct iovec iov[3] = {{.iov_base = (void *)head, .iov_len = head_length},
+                           {.iov_base = (void *)connection, .iov_len = strlen(connection)},
+                           {.iov_base = (void *)body, .iov_len = body_length}};
+
+    send_iov(client->fd, iov, body_length > 0 ? 3 : 2);
+}
+
+/* A streamed /chat response. Events are formatted into out and written without blocking, so a client
+ * that reads slowly never holds up the conversation; what it has not read yet waits in out (and in the
+ * spill file beyond stream_buffer_limit). progress_ms is when the client last read any of it. */
+struct StreamContext {
+    struct ClientConnection *client;
+    int failed;
+    struct TextBuffer out;
+    size_t sent;
+    struct StreamSpill spill;
+    long long progress_ms;
+};
+
+/* Writes as much pending output as the socket takes right now. Fails once output has waited
+ * write_timeout seconds without the client reading any of it. */
+static int stream_drain(struct StreamContext *ctx) {
+    long long now = monotonic_ms();
+    size_t bytes = 0;
+    size_t writes = 0;
+    int rc = 0;
+
+    while (ctx->sent < ctx->out.length || output_refill(&ctx->out, &ctx->sent, &ctx->spill) > 0) {
+        ssize_t written = send(ctx->client->fd, ctx->out.data + ctx->sent, ctx->out.length - ctx->sent,
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+        writes++;
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (written <= 0) {
+            rc = -1;
+            break;
+        }
+        bytes += (size_t)written;
+        ctx->sent += (size_t)written;
+        ctx->progress_ms = now;
+    }
+    note_socket_writes(bytes, writes);
+
+    output_compact(&ctx->out, &ctx->sent);
+    if (rc == 0 && write_timeout > 0 && output_pending(&ctx->out, ctx->sent, &ctx->spill) &&
+        now - ctx->progress_ms >= write_timeout * 1000LL) {
+        note_timeout();
+        rc = -1;
+    }
+    return rc;
+}
+
+/* Queues the event formatted into ctx->out from mark onwards and sends what the client will take. */
+static int stream_send(struct StreamContext *ctx, size_t mark, int format_rc) {
+    if (ctx->failed) {
+        return -1;
+    }
+    /* Nothing was waiting before this event, so the client has not fallen behind yet. */
+    if (ctx->sent >= mark && !(ctx->spill.file && ctx->spill.read_offset < ctx->spill.write_offset)) {
+        ctx->progress_ms = monotonic_ms();
+    }
+    if (format_rc != 0 || output_admit(&ctx->out, ctx->sent, mark, &ctx->spill) != 0 || stream_drain(ctx) != 0) {
+        ctx->failed = 1;
+    }
+    return ctx->failed ? -1 : 0;
+}
+
+/* Waits for the client to read the rest of the stream, up to write_timeout without progress. */
+static void stream_flush(struct StreamContext *ctx) {
+    while (!ctx->failed && output_pending(&ctx->out, ctx->sent, &ctx->spill)) {
+        struct pollfd waiter = {.fd = ctx->client->fd, .events = POLLOUT};
+        int wait_ms = -1;
+
+        if (write_timeout > 0) {
+            long long remaining = ctx->progress_ms + write_timeout * 1000LL - monotonic_ms();
+            wait_ms = remaining > 0 ? (int)remaining : 0;
+        }
+        if (poll(&waiter, 1, wait_ms) < 0 && errno != EINTR) {
+            ctx->failed = 1;
+        } else if (stream_drain(ctx) != 0) {
+            ctx->failed = 1;
+        }
+    }
+}
+
+/* Streams message and delta events as they arrive from the conversation. */
+static int stream_turn_callback(const struct TurnEvent *event, void *user_data) {
+    struct StreamContext *ctx = (struct StreamContext *)user_data;
+    size_t mark = 0;
+
+    if (!ctx || ctx->failed) {
+        return -1;
+    }
+    mark = ctx->out.length;
+    return stream_send(ctx, mark, format_turn_event(&ctx->out, event));
+}
+
+/* The page comes from assets/page.html through the generated page_asset.h (see the Makefile). */
+static const char *get_html_page(void) {
+    return (const char *)page_html;
+}
+
+/* The UI page as prebuilt HTTP responses, built once at startup: a head for each encoding pointing at
+ * the embedded body, plus the matching 304. The heads stop before the Connection line, which depends on
+ * the connection, so GET / costs a header lookup and a single gathered write. */
+enum page_encoding { PAGE_IDENTITY, PAGE_GZIP, PAGE_BROTLI, PAGE_ENCODING_COUNT };
+
+struct PageVariant {
+    char *head;
+    size_t head_length;
+    const void *body;
+    size_t body_length;
+    char *not_modified;
+    size_t not_modified_length;
+    char etag[32];
+};
+
+/* A prebuilt response picked by page_response_for(); body is NULL for a 304. */
+struct PrebuiltResponse {
+    const char *head;
+    size_t head_length;
+    const void *body;
+    size_t body_length;
+};
+
+static struct PageVariant page_variants[PAGE_ENCODING_COUNT];
+/* Seconds browsers may reuse the page before revalidating it with If-None-Match (AICHAT_PAGE_MAX_AGE). */
+static int page_max_age = DEFAULT_PAGE_MAX_AGE;
+
+static void page_variant_free(struct PageVariant *variant) {
+    free(variant->head);
+    free(variant->not_modified);
+    memset(variant, 0, sizeof(*variant));
+}
+
+/* Fills in one variant; on failure it frees whatever was built and leaves the variant empty. */
+static int page_variant_build(struct PageVariant *variant, const char *encoding, const void *body, size_t length,
+                              const char *etag) {
+    char header[512];
+    char encoding_header[64] = "";
+    int header_len = 0;
+
+    if (encoding) {
+        snprintf(encoding_header, sizeof(encoding_header), "Content-Encoding: %s\r\n", encoding);
+    }
+    snprintf(variant->etag, sizeof(variant->etag), "%s", etag);
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 304 Not Modified\r\n"
+                          "ETag: %s\r\n"
+                          "Cache-Control: public, max-age=%d\r\n"
+                          "Vary: Accept-Encoding\r\n"
+                          "Access-Control-Allow-Origin: *\r\n",
+                          etag, page_max_age);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        page_variant_free(variant);
+        return -1;
+    }
+    variant->not_modified = strdup(header);
+    variant->not_modified_length = (size_t)header_len;
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/html; charset=UTF-8\r\n"
+                          "Content-Length: %zu\r\n"
+                          "%s"
+                          "ETag: %s\r\n"
+                          "Cache-Control: public, max-age=%d\r\n"
+                          "Vary: Accept-Encoding\r\n"
+                          "Access-Control-Allow-Origin: *\r\n",
+                          length, encoding_header, etag, page_max_age);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        page_variant_free(variant);
+        return -1;
+    }
+    variant->head = strdup(header);
+    if (!variant->not_modified || !variant->head) {
+        page_variant_free(variant);
+        return -1;
+    }
+    variant->head_length = (size_t)header_len;
+    variant->body = body;
+    variant->body_length = length;
+    return 0;
+}
+
+/* Builds every variant of GET / from the page compressed at build time. The ETag is the build's hash of
+ * the page, with a suffix per encoding because the representations differ byte for byte. Encodings the
+ * build left out (PAGE_COMPRESS=0) are not offered. If any variant fails, none are kept and the page is
+ * served uncached. */
+static int page_cache_init(void) {
+    page_max_age = get_env_int("AICHAT_PAGE_MAX_AGE", DEFAULT_PAGE_MAX_AGE, 0, MAX_PAGE_MAX_AGE);
+    if (page_variant_build(&page_variants[PAGE_IDENTITY], NULL, page_html, PAGE_HTML_LENGTH,
+                           "\"" PAGE_CONTENT_HASH "\"") != 0 ||
+        (PAGE_GZIP_LENGTH > 0 && page_variant_build(&page_variants[PAGE_GZIP], "gzip", page_gzip, PAGE_GZIP_LENGTH,
+                                                    "\"" PAGE_CONTENT_HASH "-gz\"") != 0) ||
+        (PAGE_BROTLI_LENGTH > 0 && page_variant_build(&page_variants[PAGE_BROTLI], "br", page_brotli,
+                                                      PAGE_BROTLI_LENGTH, "\"" PAGE_CONTENT_HASH "-br\"") != 0)) {
+        for (size_t i = 0; i < PAGE_ENCODING_COUNT; ++i) {
+            page_variant_free(&page_variants[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Walks a comma-separated header value. Returns 1 with the next element (trimmed, parameters included)
+ * in *item and *item_length, or 0 at the end. */
+static int next_list_item(const char **cursor, const char *end, const char **item, size_t *item_length) {
+    const char *start = *cursor;
+    const char *stop = NULL;
+
+    while (start < end && (*start == ' ' || *start == '\t' || *start == ',')) {
+        start++;
+    }
+    if (start >= end) {
+        return 0;
+    }
+    stop = memchr(start, ',', (size_t)(end - start));
+    stop = stop ? stop : end;
+    *cursor = stop;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) {
+        stop--;
+    }
+    *item = start;
+    *item_length = (size_t)(stop - start);
+    return 1;
+}
+
+/* Whether an Accept-Encoding value lists coding with a non-zero q value. */
+static int accepts_encoding(const char *value, size_t length, const char *coding) {
+    const char *cursor = value;
+    const char *item = NULL;
+    size_t item_length = 0;
+    size_t coding_length = strlen(coding);
+
+    while (next_list_item(&cursor, value + length, &item, &item_length)) {
+        const char *params = memchr(item, ';', item_length);
+        size_t name_length = params ? (size_t)(params - item) : item_length;
+        while (name_length > 0 && (item[name_length - 1] == ' ' || item[name_length - 1] == '\t')) {
+            name_length--;
+        }
+        if (name_length != coding_length || strncasecmp(item, coding, coding_length) != 0) {
+            continue;
+        }
+        if (params) {
+            const char *q = strstr(params, "q=");
+            if (q && q < item + item_length && strtod(q + 2, NULL) <= 0.0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int etag_listed(const char *value, size_t length, const char *etag) {
+    const char *cursor = value;
+    const char *item = NULL;
+    size_t item_length = 0;
+    size_t etag_length = strlen(etag);
+
+    while (next_list_item(&cursor, value + length, &item, &item_length)) {
+        if (item_length >= 2 && item[0] == 'W' && item[1] == '/') {
+            item += 2;
+            item_length -= 2;
+        }
+        if ((item_length == 1 && item[0] == '*') ||
+            (item_length == etag_length && memcmp(item, etag, etag_length) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void http_request_reset(struct HttpRequest *request) {
+    memset(request, 0, sizeof(*request));
+}
+
+static int http_request_fail(struct HttpRequest *request, const char *status, const char *message) {
+    request->state = HTTP_PARSE_ERROR;
+    request->error_status = status;
+    request->error_message = message;
+    return -1;
+}
+
+static int http_span_equals(const struct HttpRequest *request, struct HttpSpan span, const char *text) {
+    return span.length == strlen(text) && strncasecmp(request->base + span.offset, text, span.length) == 0;
+}
+
+/* Returns the value of header name (length in *length), or NULL. Valid until the buffer next changes. */
+static const char *http_request_header(const struct HttpRequest *request, const char *name, size_t *length) {
+    for (size_t i = 0; i < request->header_count; ++i) {
+        if (http_span_equals(request, request->headers[i].name, name)) {
+            *length = request->headers[i].value.length;
+            return request->base + request->headers[i].value.offset;
+        }
+    }
+    return NULL;
+}
+
+/* Whether the parsed request is method on exactly target. */
+static int http_request_is(const struct HttpRequest *request, const char *method, const char *target) {
+    return request->method.length == strlen(method) &&
+           memcmp(request->base + request->method.offset, method, request->method.length) == 0 &&
+           request->target.length == strlen(target) &&
+           memcmp(request->base + request->target.offset, target, request->target.length) == 0;
+}
+
+static int http_parse_request_line(struct HttpRequest *request, size_t start, size_t length) {
+    const char *line = request->base + start;
+    const char *space = memchr(line, ' ', length);
+    const char *target_end = NULL;
+    const char *version = NULL;
+
+    if (!space || space == line || space - line > 7) {
+        return http_request_fail(request, "400 Bad Request", "Malformed request line.");
+    }
+    target_end = memchr(space + 1, ' ', length - (size_t)(space + 1 - line));
+    if (!target_end || target_end == space + 1) {
+        return http_request_fail(request, "400 Bad Request", "Malformed request line.");
+    }
+    version = target_end + 1;
+    if ((size_t)(line + length - version) != 8 || memcmp(version, "HTTP/1.", 7) != 0 ||
+        (version[7] != '0' && version[7] != '1')) {
+        return http_request_fail(request, "505 HTTP Version Not Supported",
+                                 "Only HTTP/1.0 and HTTP/1.1 are supported.");
+    }
+
+    request->method.offset = start;
+    request->method.length = (size_t)(space - line);
+    request->target.offset = start + request->method.length + 1;
+    request->target.length = (size_t)(target_end - space - 1);
+    request->minor_version = version[7] - '0';
+    request->state = HTTP_PARSE_HEADERS;
+    return 0;
+}
+
+static int http_parse_header_line(struct HttpRequest *request, size_t start, size_t length) {
+    const char *line = request->base + start;
+    const char *colon = memchr(line, ':', length);
+    size_t value = 0;
+    size_t end = length;
+
+    /* No name, whitespace before the colon, or obsolete line folding. */
+    if (!colon || colon == line || colon[-1] == ' ' || colon[-1] == '\t' || line[0] == ' ' || line[0] == '\t') {
+        return http_request_fail(request, "400 Bad Request", "Malformed request header.");
+    }
+    if (request->header_count >= MAX_HTTP_HEADERS) {
+        return http_request_fail(request, "431 Request Header Fields Too Large", "Too many request headers.");
+    }
+
+    value = (size_t)(colon - line) + 1;
+    while (value < end && (line[value] == ' ' || line[value] == '\t')) {
+        value++;
+    }
+    while (end > value && (line[end - 1] == ' ' || line[end - 1] == '\t')) {
+        end--;
+    }
+    request->headers[request->header_count].name.offset = start;
+    request->headers[request->header_count].name.length = (size_t)(colon - line);
+    request->headers[request->header_count].value.offset = start + value;
+    request->headers[request->header_count].value.length = end - value;
+    request->header_count++;
+    return 0;
+}
+
+/* Decides how the body is framed once the blank line after the headers has been read. */
+static int http_parse_framing(struct HttpRequest *request) {
+    unsigned long long content_length = 0;
+    int has_length = 0;
+
+    for (size_t i = 0; i < request->header_count; ++i) {
+        const struct HttpHeader *header = &request->headers[i];
+        const char *value = request->base + header->value.offset;
+
+        if (http_span_equals(request, header->name, "Transfer-Encoding")) {
+            if (!http_span_equals(request, header->value, "chunked") || request->chunked) {
+                return http_request_fail(request, "501 Not Implemented", "Unsupported transfer encoding.");
+            }
+            request->chunked = 1;
+        } else if (http_span_equals(request, header->name, "Content-Length")) {
+            unsigned long long parsed = 0;
+            if (header->value.length == 0) {
+                return http_request_fail(request, "400 Bad Request", "Invalid Content-Length.");
+            }
+            for (size_t j = 0; j < header->value.length; ++j) {
+                if (value[j] < '0' || value[j] > '9' || parsed > http_max_body_bytes) {
+                    return parsed > http_max_body_bytes
+                               ? http_request_fail(request, "413 Payload Too Large", "Request body too large.")
+                               : http_request_fail(request, "400 Bad Request", "Invalid Content-Length.");
+                }
+                parsed = parsed * 10 + (unsigned long long)(value[j] - '0');
+            }
+            if (has_length && parsed != content_length) {
+                return http_request_fail(request, "400 Bad Request", "Conflicting Content-Length headers.");
+            }
+            content_length = parsed;
+            has_length = 1;
+        } else if (http_span_equals(request, header->name, "Expect")) {
+            request->expect_continue = http_span_equals(request, header->value, "100-continue");
+        }
+    }
+
+    if (request->chunked && has_length) {
+        return http_request_fail(request, "400 Bad Request", "Both Content-Length and chunked encoding given.");
+    }
+    if (content_length > http_max_body_bytes) {
+        return http_request_fail(request, "413 Payload Too Large", "Request body too large.");
+    }
+
+    request->header_length = request->scan;
+    request->remaining = (size_t)content_length;
+    if (request->chunked) {
+        request->state = HTTP_PARSE_CHUNK_SIZE;
+    } else {
+        request->state = request->remaining > 0 ? HTTP_PARSE_BODY : HTTP_PARSE_COMPLETE;
+    }
+    request->expect_continue = request->expect_continue && request->minor_version == 1 &&
+                               request->state != HTTP_PARSE_COMPLETE;
+    return 0;
+}
+
+static int http_parse_chunk_size(struct HttpRequest *request, size_t start, size_t length) {
+    const char *line = request->base + start;
+    size_t size = 0;
+    size_t digits = 0;
+
+    while (digits < length && isxdigit((unsigned char)line[digits])) {
+        int nibble = isdigit((unsigned char)line[digits]) ? line[digits] - '0'
+                                                           : tolower((unsigned char)line[digits]) - 'a' + 10;
+        size = size * 16 + (size_t)nibble;
+        if (size > http_max_body_bytes) {
+            return http_request_fail(request, "413 Payload Too Large", "Request body too large.");
+        }
+        digits++;
+    }
+    /* Chunk extensions after ';' are allowed and ignored. */
+    if (digits == 0 || (digits < length && line[digits] != ';' && line[digits] != ' ' && line[digits] != '\t')) {
+        return http_request_fail(request, "400 Bad Request", "Malformed chunked body.");
+    }
+    if (request->body_length + size > http_max_body_bytes) {
+        return http_request_fail(request, "413 Payload Too Large", "Request body too large.");
+    }
+
+    request->remaining = size;
+    request->state = size > 0 ? HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILERS;
+    return 0;
+}
+
+/* Feeds the connection's input buffer (the first length bytes of buffer) to the parser. Only bytes past
+ * what earlier calls examined are scanned. Returns 1 once a whole request has been read, 0 while more
+ * bytes are needed, and -1 for a request that must be refused with error_status. A chunked body is
+ * decoded in place behind the read position, so the body always sits contiguously at header_length;
+ * anything past scan belongs to the next, pipelined request. */
+static int http_request_feed(struct HttpRequest *request, char *buffer, size_t length) {
+    request->base = buffer;
+
+    while (request->scan < length) {
+        enum http_parse_state state = request->state;
+
+        if (state == HTTP_PARSE_COMPLETE || state == HTTP_PARSE_ERROR) {
+            break;
+        }
+
+        if (state == HTTP_PARSE_BODY || state == HTTP_PARSE_CHUNK_DATA) {
+            size_t count = length - request->scan < request->remaining ? length - request->scan : request->remaining;
+            size_t target = request->header_length + request->body_length;
+            if (target != request->scan) {
+                memmove(buffer + target, buffer + request->scan, count);
+            }
+            request->scan += count;
+            request->body_length += count;
+            request->remaining -= count;
+            if (request->remaining == 0) {
+                request->state = state == HTTP_PARSE_BODY ? HTTP_PARSE_COMPLETE : HTTP_PARSE_CHUNK_END;
+                request->line_start = request->scan;
+            }
+            continue;
+        }
+
+        /* Every other state reads a line. Everything but body bytes counts towards the header limit. */
+        const char *newline = memchr(buffer + request->scan, '\n', length - request->scan);
+        size_t line_end = newline ? (size_t)(newline - buffer) : length;
+        if (line_end - request->body_length > http_max_header_bytes) {
+            return state <= HTTP_PARSE_HEADERS
+                       ? http_request_fail(request, "431 Request Header Fields Too Large",
+                                           "Request headers too large.")
+                       : http_request_fail(request, "413 Payload Too Large", "Chunk framing too large.");
+        }
+        if (!newline) {
+            request->scan = length;
+            break;
+        }
+
+        size_t start = request->line_start;
+        size_t line_length = line_end - start;
+        if (line_length > 0 && buffer[line_end - 1] == '\r') {
+            line_length--;
+        }
+        request->scan = line_end + 1;
+        request->line_start = request->scan;
+
+        switch (state) {
+        case HTTP_PARSE_REQUEST_LINE:
+            /* Stray blank lines before a request (e.g. after a previous body) are ignored. */
+            if (line_length > 0 && http_parse_request_line(request, start, line_length) != 0) {
+                return -1;
+            }
+            break;
+        case HTTP_PARSE_HEADERS:
+            if (line_length == 0 ? http_parse_framing(request) != 0
+                                 : http_parse_header_line(request, start, line_length) != 0) {
+                return -1;
+            }
+            break;
+        case HTTP_PARSE_CHUNK_SIZE:
+            if (http_parse_chunk_size(request, start, line_length) != 0) {
+                return -1;
+            }
+            break;
+        case HTTP_PARSE_CHUNK_END:
+            if (line_length != 0) {
+                return http_request_fail(request, "400 Bad Request", "Malformed chunked body.");
+            }
+            request->state = HTTP_PARSE_CHUNK_SIZE;
+            break;
+        case HTTP_PARSE_TRAILERS:
+            if (line_length == 0) {
+                request->state = HTTP_PARSE_COMPLETE;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (request->state == HTTP_PARSE_ERROR) {
+        return -1;
+    }
+    return request->state == HTTP_PARSE_COMPLETE ? 1 : 0;
+}
+
+/* Picks the prebuilt response for a GET / request: brotli, then gzip, then identity, as the client
+ * accepts them, or the 304 when it already holds that variant. Returns -1 before page_cache_init. */
+static int page_response_for(const struct HttpRequest *request, struct PrebuiltResponse *response) {
+    const struct PageVariant *variant = &page_variants[PAGE_IDENTITY];
+    size_t value_length = 0;
+    const char *value = http_request_header(request, "Accept-Encoding", &value_length);
+
+    if (value && page_variants[PAGE_BROTLI].head && accepts_encoding(value, value_length, "br")) {
+        variant = &page_variants[PAGE_BROTLI];
+    } else if (value && page_variants[PAGE_GZIP].head && accepts_encoding(value, value_length, "gzip")) {
+        variant = &page_variants[PAGE_GZIP];
+    }
+    if (!variant->head) {
+        return -1;
+    }
+
+    value = http_request_header(request, "If-None-Match", &value_length);
+    if (value && etag_listed(value, value_length, variant->etag)) {
+        response->head = variant->not_modified;
+        response->head_length = variant->not_modified_length;
+        response->body = NULL;
+        response->body_length = 0;
+        return 0;
+    }
+    response->head = variant->head;
+    response->head_length = variant->head_length;
+    response->body = variant->body;
+    response->body_length = variant->body_length;
+    return 0;
+}
+
+/* Whether the client wants the connection kept open: HTTP/1.1 does unless it sends "Connection: close",
+ * HTTP/1.0 only when it sends "Connection: keep-alive". */
+static int request_wants_keep_alive(const struct HttpRequest *request) {
+    const char *value = NULL;
+    const char *cursor = NULL;
+    const char *item = NULL;
+    size_t value_length = 0;
+    size_t item_length = 0;
+    int keep_alive = request->minor_version == 1;
+
+    value = http_request_header(request, "Connection", &value_length);
+    cursor = value;
+    while (value && next_list_item(&cursor, value + value_length, &item, &item_length)) {
+        if (item_length == 5 && strncasecmp(item, "close", 5) == 0) {
+            return 0;
+        }
+        if (item_length == 10 && strncasecmp(item, "keep-alive", 10) == 0) {
+            keep_alive = 1;
+        }
+    }
+    return keep_alive;
+}
+
+/* Whether the response to the requests-th request on a connection may leave it open. */
+static int connection_may_persist(const struct HttpRequest *request, int requests) {
+    return keepalive_timeout > 0 && requests < keepalive_max_requests && request_wants_keep_alive(request);
+}
+
+static const char http_continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* Reads until client->request holds a complete request, feeding the parser only what each read adds.
+ * Bytes past the request stay in client->in, so a pipelined request is answered without another read.
+ * A connection's first request must arrive within read_timeout seconds of the accept; later ones may
+ * idle for keepalive_timeout and then have read_timeout from their first byte. An idle connection is
+ * given up as soon as an accepted client is queued for a worker, checked every KEEPALIVE_IDLE_CHECK_MS.
+ * Returns -1 when the client closes the connection, runs out of time or fails, or when the request is
+ * refused or only partly arrived in time (client->request.state is then HTTP_PARSE_ERROR). */
+static int read_http_request(struct ClientConnection *client) {
+    char chunk[READ_BUFFER_CHUNK];
+    int rc = http_request_feed(&client->request, client->in.data, client->in.length);
+    long long deadline_ms = 0;
+
+    if (client->requests == 0 || client->in.length > 0) {
+        deadline_ms = read_timeout > 0 ? monotonic_ms() + read_timeout * 1000LL : 0;
+    } else if (keepalive_timeout > 0) {
+        deadline_ms = monotonic_ms() + keepalive_timeout * 1000LL;
+    }
+
+    while (rc == 0) {
+        struct pollfd waiter = {.fd = client->fd, .events = POLLIN};
+        ssize_t bytes = 0;
+        int wait_ms = -1;
+        int idle = client->requests > 0 && client->in.length == 0;
+        int ready = 0;
+
+        if (client->request.expect_continue) {
+            client->request.expect_continue = 0;
+            send_all(client->fd, http_continue_response, sizeof(http_continue_response) - 1);
+        }
+        if (deadline_ms > 0) {
+            long long remaining = deadline_ms - monotonic_ms();
+            wait_ms = remaining > 0 ? (int)remaining : 0;
+        }
+        if (idle && client->queue && (wait_ms < 0 || wait_ms > KEEPALIVE_IDLE_CHECK_MS)) {
+            ready = poll(&waiter, 1, KEEPALIVE_IDLE_CHECK_MS);
+            if (ready == 0 && client_queue_waiting(client->queue) == 0) {
+                continue;
+            }
+        } else {
+            ready = wait_ms >= 0 ? poll(&waiter, 1, wait_ms) : 1;
+        }
+        if (ready <= 0) {
+            /* An idle keep-alive connection running out is routine; a request that never finished is not. */
+            if (client->requests == 0 || client->in.length > 0) {
+                note_timeout();
+            }
+            if (client->in.length > 0) {
+                http_request_fail(&client->request, "408 Request Timeout", "Request not received in time.");
+            }
+            return -1;
+        }
+        bytes = recv(client->fd, chunk, sizeof(chunk), 0);
+        if (bytes <= 0 || text_buffer_append(&client->in, chunk, (size_t)bytes) != 0) {
+            return -1;
+        }
+        if (client->in.length == (size_t)bytes && client->requests > 0) {
+            deadline_ms = read_timeout > 0 ? monotonic_ms() + read_timeout * 1000LL : 0;
+        }
+        rc = http_request_feed(&client->request, client->in.data, client->in.length);
+    }
+    return rc > 0 ? 0 : -1;
+}
+
+/* Validates a /chat body into request. On failure returns -1 with an HTTP status and message. */
+static int parse_chat_request(const char *body, size_t body_length, struct ChatRequest *request,
+                              const char **status_out, const char **message_out) {
+    json_object *payload = NULL;
+    json_object *topic_obj = NULL;
+    json_object *turns_obj = NULL;
+    json_object *participants_obj = NULL;
+    json_object *stream_obj = NULL;
+    json_object *seed_obj = NULL;
+    json_object *cache_obj = NULL;
+    int turns = 0;
+    struct Participant *participants = request->participants;
+    size_t participant_count = 0;
+
+    memset(request, 0, sizeof(*request));
+    struct json_tokener *tok = json_tokener_new();
+    if (!tok) {
+        *status_out = "500 Internal Server Error";
+        *message_out = "Unable to initialise JSON parser.";
+        return -1;
+    }
+
+    payload = json_tokener_parse_ex(tok, body, (int)body_length);
+    if (json_tokener_get_error(tok) != json_tokener_success || !payload) {
+        json_tokener_free(tok);
+        *status_out = "400 Bad Request";
+        *message_out = "Invalid JSON payload.";
+        return -1;
+    }
+    json_tokener_free(tok);
+
+    if (!json_object_object_get_ex(payload, "topic", &topic_obj) ||
+        json_object_get_type(topic_obj) != json_type_string) {
+        json_object_put(payload);
+        *status_out = "400 Bad Request";
+        *message_out = "Field 'topic' is required.";
+        return -1;
+    }
+    request->topic = json_object_get_string(topic_obj);
+
+    if (!json_object_object_get_ex(payload, "turns", &turns_obj)) {
+        json_object_put(payload);
+        *status_out = "400 Bad Request";
+        *message_out = "Field 'turns' is required.";
+        return -1;
+    }
+    turns = json_object_get_int(turns_obj);
+    if (turns < MIN_TURNS) {
+        turns = MIN_TURNS;
+    }
+    if (turns > MAX_TURNS) {
+        turns = MAX_TURNS;
+    }
+
+    if (!json_object_object_get_ex(payload, "participants", &participants_obj) ||
+        json_object_get_type(participants_obj) != json_type_array) {
+        json_object_put(payload);
+        *status_out = "400 Bad Request";
+        *message_out = "Field 'participants' must be an array.";
+        return -1;
+    }
+
+    size_t array_len = json_object_array_length(participants_obj);
+    if (array_len == 0) {
+        json_object_put(payload);
+        *status_out = "400 Bad Request";
+        *message_out = "Provide at least one participant.";
+        return -1;
+    }
+    if (array_len > MAX_PARTICIPANTS) {
+        array_len = MAX_PARTICIPANTS;
+    }
+
+    for (size_t i = 0; i < array_len; ++i) {
+        json_object *item = json_object_array_get_idx(participants_obj, i);
+        json_object *name_obj = NULL;
+        json_object *model_obj = NULL;
+        json_object *display_obj = NULL;
+        const char *name = NULL;
+        const char *model = NULL;
+        const char *display = NULL;
+
+        if (!item || json_object_get_type(item) != json_type_object) {
+            continue;
+        }
+
+        if (json_object_object_get_ex(item, "model", &model_obj) &&
+            json_object_get_type(model_obj) == json_type_string) {
+            model = json_object_get_string(model_obj);
+        }
+        if (!model || !*model) {
+            continue;
+        }
+
+        if (json_object_object_get_ex(item, "displayModel", &display_obj) &&
+            json_object_get_type(display_obj) == json_type_string && json_object_get_string_len(display_obj) > 0) {
+            display = json_object_get_string(display_obj);
+        }
+
+        if (json_object_object_get_ex(item, "name", &name_obj) &&
+            json_object_get_type(name_obj) == json_type_string && json_object_get_string_len(name_obj) > 0) {
+            name = json_object_get_string(name_obj);
+        }
+        if (!name || !*name) {
+            static const char *fallback_names[] = {"Astra", "Nova", "Cosmo", "Lyric", "Echo", "Muse"};
+            size_t fallback_idx = participant_count < (sizeof(fallback_names) / sizeof(fallback_names[0]))
+                                      ? participant_count
+                                      : participant_count % (sizeof(fallback_names) / sizeof(fallback_names[0]));
+            name = fallback_names[fallback_idx];
+        }
+
+        strncpy(participants[participant_count].name, name, MAX_NAME_LENGTH - 1);
+        participants[participant_count].name[MAX_NAME_LENGTH - 1] = '\0';
+        strncpy(participants[participant_count].model, model, MAX_MODEL_LENGTH - 1);
+        participants[participant_count].model[MAX_MODEL_LENGTH - 1] = '\0';
+        if (display && *display) {
+            strncpy(participants[participant_count].display_model, display, MAX_MODEL_LENGTH - 1);
+            participants[participant_count].display_model[MAX_MODEL_LENGTH - 1] = '\0';
+        }
+        participant_count++;
+    }
+
+    if (participant_count == 0) {
+        json_object_put(payload);
+        *status_out = "400 Bad Request";
+        *message_out = "No valid participants supplied.";
+        return -1;
+    }
+
+    request->stream_tokens = token_streaming_default;
+    if (json_object_object_get_ex(payload, "streamTokens", &stream_obj) &&
+        json_object_get_type(stream_obj) == json_type_boolean) {
+        request->stream_tokens = json_object_get_boolean(stream_obj);
+    }
+
+    request->options.cacheable = 1;
+    if (json_object_object_get_ex(payload, "seed", &seed_obj)) {
+        if (json_object_get_type(seed_obj) != json_type_int) {
+            json_object_put(payload);
+            *status_out = "400 Bad Request";
+            *message_out = "Field 'seed' must be an integer.";
+            return -1;
+        }
+        request->options.has_seed = 1;
+        request->options.seed = (long long)json_object_get_int64(seed_obj);
+    }
+    if (json_object_object_get_ex(payload, "cache", &cache_obj) &&
+        json_object_get_type(cache_obj) == json_type_boolean) {
+        request->options.cacheable = json_object_get_boolean(cache_obj);
+    }
+
+    request->payload = payload;
+    request->turns = turns;
+    request->participant_count = participant_count;
+    return 0;
+}
+
+static void chat_request_release(struct ChatRequest *request) {
+    if (request->payload) {
+        json_object_put(request->payload);
+    }
+    memset(request, 0, sizeof(*request));
+}
+
+static void handle_chat_request(struct ClientConnection *client, const char *body, size_t body_length,
+                                const char *ollama_url) {
+    struct ChatRequest request;
+    const char *status = NULL;
+    const char *message = NULL;
+
+    if (parse_chat_request(body, body_length, &request, &status, &message) != 0) {
+        send_http_error(client, status, message);
+        return;
+    }
+
+    stream_chat_conversation(client, &request, ollama_url);
+    chat_request_release(&request);
+}
+
+static void stream_chat_conversation(struct ClientConnection *client, struct ChatRequest *request,
+                                     const char *ollama_url) {
+    const char *topic = request->topic;
+    int turns = request->turns;
+    struct Participant *participants = request->participants;
+    size_t participant_count = request->participant_count;
+    json_object *result = NULL;
+    char *error_message = NULL;
+    int needs_lookup = 0;
+
+    for (size_t i = 0; i < participant_count; ++i) {
+        if (participants[i].display_model[0] == '\0') {
+            needs_lookup = 1;
+            break;
+        }
+    }
+
+    struct CatalogueSnapshot *catalogue = needs_lookup ? catalogue_acquire(ollama_url, NULL) : NULL;
+    ensure_participant_display_models(participants, participant_count, catalogue);
+    catalogue_release(catalogue);
+
+    struct StreamContext stream_ctx = {.client = client};
+    if (format_chunked_header(&stream_ctx.out, "200 OK", "application/x-ndjson", client->keep_alive) != 0 ||
+        stream_send(&stream_ctx, 0,
+                    format_start_event(&stream_ctx.out, topic, turns, participants, participant_count)) != 0) {
+        client->keep_alive = 0;
+        text_buffer_release(&stream_ctx.out);
+        stream_spill_close(&stream_ctx.spill);
+        return;
+    }
+
+    if (run_conversation(topic, turns, participants, participant_count, ollama_url, client->fd, &request->options,
+                         stream_turn_callback, request->stream_tokens ? stream_turn_callback : NULL, &stream_ctx,
+                         &result, &error_message) != 0) {
+        if (!stream_ctx.failed) {
+            size_t mark = stream_ctx.out.length;
+            int rc = format_error_event(&stream_ctx.out, error_message ? error_message : "Conversation failed.");
+            stream_send(&stream_ctx, mark, rc | format_finish_chunked_response(&stream_ctx.out));
+        }
+    } else if (!stream_ctx.failed) {
+        size_t mark = stream_ctx.out.length;
+        int rc = format_complete_event(&stream_ctx.out, topic, turns);
+        stream_send(&stream_ctx, mark, rc | format_finish_chunked_response(&stream_ctx.out));
+    }
+    stream_flush(&stream_ctx);
+
+    if (stream_ctx.failed) {
+        client->keep_alive = 0;
+    }
+    if (result) {
+        json_object_put(result);
+    }
+    free(error_message);
+    text_buffer_release(&stream_ctx.out);
+    stream_spill_close(&stream_ctx.spill);
+}
+
+/* Conversations are capped below the worker count so that at least one worker is always free to
+ * answer GET / and GET /models while long-running /chat streams occupy the rest. A pool left with a
+ * single worker therefore refuses every /chat (limit zero); a negative limit disables the cap (serial
+ * mode). */
+static pthread_mutex_t conversation_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static int conversation_slots_in_use = 0;
+static int conversation_slots_limit = -1;
+
+static int acquire_conversation_slot(void) {
+    int rc = 0;
+
+    pthread_mutex_lock(&conversation_slots_lock);
+    if (conversation_slots_limit >= 0 && conversation_slots_in_use >= conversation_slots_limit) {
+        rc = -1;
+    } else {
+        conversation_slots_in_use++;
+    }
+    pthread_mutex_unlock(&conversation_slots_lock);
+    return rc;
+}
 
-        if (!item || !json_object_is_type(item, json_type_object)) {
-            continue;
-        }
+static void release_conversation_slot(void) {
+    pthread_mutex_lock(&conversation_slots_lock);
+    if (conversation_slots_in_use > 0) {
+        conversation_slots_in_use--;
+    }
+    pthread_mutex_unlock(&conversation_slots_lock);
+}
 
-        json_object *field = NULL;
-        if (json_object_object_get_ex(item, "model", &field) && field) {
-            model_value = json_object_get_string(field);
-        }
-        if (json_object_object_get_ex(item, "name", &field) && field) {
-            name_value = json_object_get_string(field);
-        }
+/* Answers the request just parsed into client->request. */
+static void handle_client(struct ClientConnection *client, const char *ollama_url) {
+    const struct HttpRequest *request = &client->request;
+    const char *body = request->base + request->header_length;
+    size_t body_length = request->body_length;
 
-        if (model_value && strcmp(model_value, identifier) == 0) {
-            if (name_value && *name_value) {
-                return name_value;
-            }
-            return model_value;
+    if (http_request_is(request, "GET", "/")) {
+        struct PrebuiltResponse page;
+        if (page_response_for(request, &page) == 0) {
+            send_prebuilt_response(client, page.head, page.head_length, page.body, page.body_length);
+        } else {
+            send_http_response(client, "200 OK", "text/html; charset=UTF-8", get_html_page());
         }
-        if (name_value && strcmp(name_value, identifier) == 0) {
-            return name_value;
+    } else if (http_request_is(request, "GET", "/models")) {
+        handle_models_request(client, ollama_url);
+    } else if (http_request_is(request, "GET", "/stats")) {
+        handle_stats_request(client);
+    } else if (http_request_is(request, "POST", "/chat")) {
+        if (body_length == 0) {
+            send_http_error(client, "400 Bad Request", "Missing request body.");
+        } else if (acquire_conversation_slot() != 0) {
+            send_http_error(client, "503 Service Unavailable", "All conversation slots are busy. Try again shortly.");
+        } else {
+            handle_chat_request(client, body, body_length, ollama_url);
+            release_conversation_slot();
         }
+    } else if (http_span_equals(request, request->method, "OPTIONS")) {
+        send_prebuilt_response(client, CORS_PREFLIGHT_HEAD, strlen(CORS_PREFLIGHT_HEAD), NULL, 0);
+    } else {
+        send_http_error(client, "404 Not Found", "Endpoint not found.");
     }
+}
 
-    return NULL;
+/* Bounded hand-off queue between the accept loop and the worker threads. */
+struct ClientQueue {
+    int *fds;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+struct WorkerPool {
+    struct ClientQueue queue;
+    pthread_t *threads;
+    size_t thread_count;
+    const char *ollama_url;
+};
+
+static int client_queue_init(struct ClientQueue *queue, size_t capacity) {
+    memset(queue, 0, sizeof(*queue));
+    queue->fds = calloc(capacity, sizeof(int));
+    if (!queue->fds) {
+        return -1;
+    }
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    return 0;
 }
 
-static void ensure_participant_display_models(struct Participant *participants, size_t participant_count,
-                                              json_object *models_payload) {
-    json_object *models_array = NULL;
+static int client_queue_push(struct ClientQueue *queue, int client_fd) {
+    int rc = -1;
 
-    if (!participants || participant_count == 0) {
-        return;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->capacity) {
+        queue->fds[(queue->head + queue->count) % queue->capacity] = client_fd;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+        rc = 0;
     }
+    pthread_mutex_unlock(&queue->lock);
+    return rc;
+}
 
-    if (models_payload && json_object_is_type(models_payload, json_type_object)) {
-        json_object_object_get_ex(models_payload, "models", &models_array);
+static int client_queue_pop(struct ClientQueue *queue) {
+    int client_fd = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
     }
+    client_fd = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return client_fd;
+}
 
-    for (size_t i = 0; i < participant_count; ++i) {
-        trim_leading_whitespace(participants[i].display_model);
-        trim_trailing_whitespace(participants[i].display_model);
-        if (participants[i].display_model[0] != '\0') {
-            continue;
-        }
+static size_t client_queue_waiting(struct ClientQueue *queue) {
+    size_t count = 0;
 
-        const char *display = lookup_display_model(models_array, participants[i].model);
-        if (!display || !*display) {
-            display = participants[i].model;
+    pthread_mutex_lock(&queue->lock);
+    count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+/* Answers requests on one connection until either side ends it. A worker only holds a connection open
+ * for another request while no accepted client is queued for a worker, and drops it while idle once one
+ * is; serial mode (queue == NULL) closes after every response so the accept loop is never parked on an
+ * idle client. */
+static void serve_connection(int client_fd, const char *ollama_url, struct ClientQueue *queue) {
+    struct ClientConnection client = {.fd = client_fd, .queue = queue};
+
+    configure_client_socket(client_fd);
+    do {
+        if (read_http_request(&client) != 0) {
+            client.keep_alive = 0;
+            if (client.request.state == HTTP_PARSE_ERROR) {
+                client.requests++;
+                send_http_error(&client, client.request.error_status, client.request.error_message);
+                pthread_mutex_lock(&stats_lock);
+                server_stats.http_responses++;
+                pthread_mutex_unlock(&stats_lock);
+            } else if (client.in.length > 0) {
+                send_http_error(&client, "400 Bad Request", "Unable to read request.");
+            }
+            break;
         }
 
-        strncpy(participants[i].display_model, display, MAX_MODEL_LENGTH - 1);
-        participants[i].display_model[MAX_MODEL_LENGTH - 1] = '\0';
-        trim_leading_whitespace(participants[i].display_model);
-        trim_trailing_whitespace(participants[i].display_model);
+        client.requests++;
+        client.keep_alive = queue && client_queue_waiting(queue) == 0 &&
+                            connection_may_persist(&client.request, client.requests);
+        handle_client(&client, ollama_url);
+        text_buffer_consume(&client.in, client.request.scan);
+        http_request_reset(&client.request);
+
+        pthread_mutex_lock(&stats_lock);
+        server_stats.http_responses++;
+        pthread_mutex_unlock(&stats_lock);
+    } while (client.keep_alive);
+
+    if (client.requests > 0) {
+        pthread_mutex_lock(&stats_lock);
+        server_stats.http_connections++;
+        pthread_mutex_unlock(&stats_lock);
     }
+    text_buffer_release(&client.in);
+    shutdown(client_fd, SHUT_RDWR);
+    close(client_fd);
 }
 
-static int run_conversation(const char *topic, int turns, struct Participant *participants,
-                            size_t participant_count, const char *ollama_url, message_callback on_message,
-                            void *callback_data, json_object **out_json, char **error_out) {
-    char *conversation_history = NULL;
-    json_object *messages = NULL;
-    json_object *participants_json = NULL;
-    json_object *result = NULL;
+static void *worker_main(void *arg) {
+    struct WorkerPool *pool = (struct WorkerPool *)arg;
 
-    *out_json = NULL;
-    if (error_out) {
-        *error_out = NULL;
+    while (1) {
+        int client_fd = client_queue_pop(&pool->queue);
+        serve_connection(client_fd, pool->ollama_url, &pool->queue);
     }
+    return NULL;
+}
 
-    conversation_history = strdup(SYSTEM_PROMPT);
-    if (!conversation_history) {
-        if (error_out) {
-            *error_out = strdup("Failed to allocate conversation history.");
-        }
-        return -1;
-    }
+static int worker_pool_start(struct WorkerPool *pool, size_t thread_count, size_t queue_depth,
+                             const char *ollama_url) {
+    memset(pool, 0, sizeof(*pool));
+    pool->ollama_url = ollama_url;
 
-    conversation_history = append_to_history(conversation_history, "USER: ");
-    if (!conversation_history) {
-        if (error_out) {
-            *error_out = strdup("Failed to build conversation history.");
-        }
+    if (client_queue_init(&pool->queue, queue_depth) != 0) {
         return -1;
     }
 
-    conversation_history = append_to_history(conversation_history, topic);
-    if (!conversation_history) {
-        if (error_out) {
-            *error_out = strdup("Failed to build conversation history.");
-        }
+    pool->threads = calloc(thread_count, sizeof(pthread_t));
+    if (!pool->threads) {
         return -1;
     }
 
-    messages = json_object_new_array();
-    participants_json = json_object_new_array();
-    if (!messages || !participants_json) {
-        if (error_out) {
-            *error_out = strdup("Failed to allocate JSON structures.");
+    for (size_t i = 0; i < thread_count; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            fprintf(stderr, "Failed to start worker thread %zu.\n", i);
+            break;
         }
-        goto fail;
+        pthread_detach(pool->threads[i]);
+        pool->thread_count++;
     }
 
-    for (size_t p = 0; p < participant_count; ++p) {
-        json_object *participant_obj = json_object_new_object();
-        if (!participant_obj) {
-            if (error_out) {
-                *error_out = strdup("Failed to allocate participant JSON.");
-            }
-            goto fail;
-        }
-        json_object_object_add(participant_obj, "name", json_object_new_string(participants[p].name));
-        json_object_object_add(participant_obj, "model", json_object_new_string(participants[p].model));
-        if (participants[p].display_model[0] != '\0') {
-            json_object_object_add(participant_obj, "displayModel",
-                                   json_object_new_string(participants[p].display_model));
-        }
-        json_object_array_add(participants_json, participant_obj);
+    return pool->thread_count > 0 ? 0 : -1;
+}
+
+/* Used when the hand-off queue is full: answer without tying up a worker. */
+static void reject_busy_client(int client_fd) {
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "Content-Type: application/json\r\n"
+                                   "Content-Length: 39\r\n"
+                                   "Retry-After: 1\r\n"
+                                   "Access-Control-Allow-Origin: *\r\n"
+                                   "Connection: close\r\n\r\n"
+                                   "{\"error\":\"Server is busy, retry soon.\"}";
+
+    send(client_fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+    shutdown(client_fd, SHUT_RDWR);
+    close(client_fd);
+}
+
+/* Optional single-threaded execution mode (AICHAT_IO_MODE=epoll). Client sockets are nonblocking and
+ * multiplexed with epoll, Ollama requests run through a curl multi handle driven by
+ * curl_multi_socket_action(), and each conversation advances one turn per completed transfer. */
+enum event_source_kind {
+    EVENT_SOURCE_LISTENER,
+    EVENT_SOURCE_CLIENT,
+    EVENT_SOURCE_CURL
+};
+
+/* Every epoll registration points at one of these; owners embed it as their first member. */
+struct EventSource {
+    enum event_source_kind kind;
+    int fd;
+};
+
+/* MODELS and LOOKUP fetch a cold model list for /models or for a conversation's display names. With one
+ * backend they fetch it on the multi handle; with several there is no transfer_handle, and the connection
+ * waits for the background refresh to merge every backend's list. */
+enum event_transfer {
+    EVENT_TRANSFER_NONE,
+    EVENT_TRANSFER_MODELS,
+    EVENT_TRANSFER_LOOKUP,
+    EVENT_TRANSFER_QUEUED,
+    EVENT_TRANSFER_TURN
+};
+
+struct EventLoop;
+
+/* Registration for a socket owned by libcurl. Retired sockets are freed only after the current
+ * epoll batch, since a later event in the same batch may still point at them. */
+struct CurlSocket {
+    struct EventSource source;
+    struct CurlSocket *next_retired;
+};
+
+/* A client socket in the event loop. Requests are answered one at a time: busy is set while a response
+ * is in progress, and bytes that arrive meanwhile (pipelined requests) wait in in. Once the last byte of
+ * a response is queued, response_done is set; when it has been written the connection either closes or,
+ * with keep_alive, becomes idle until its next request. deadline_ms is when the connection is dropped:
+ * read_timeout after the accept or a request's first byte, keepalive_timeout after going idle, and
+ * write_timeout after progress_ms while the client is not reading its response. It is 0 while the
+ * response waits on Ollama. read_closed is set once the client has shut down its side: nothing more is
+ * read, but requests already buffered are still answered before the connection closes. */
+struct EventConnection {
+    struct EventSource source;
+    struct EventLoop *loop;
+    struct EventConnection *next;
+    struct TextBuffer in;
+    struct HttpRequest request;
+    struct TextBuffer out;
+    const char *out_static;
+    size_t out_static_length;
+    size_t out_sent;
+    uint32_t interest;
+    int requests;
+    int busy;
+    int keep_alive;
+    int response_done;
+    int response_sent;
+    long long deadline_ms;
+    long long progress_ms;
+    struct StreamSpill spill;
+    int read_closed;
+    int dead;
+    enum event_transfer transfer;
+    CURL *transfer_handle;
+    struct MemoryStruct transfer_body;
+    struct ChatRequest chat;
+    int chat_active;
+    struct Conversation conv;
+    int conv_active;
+};
+
+struct EventLoop {
+    int epoll_fd;
+    struct EventSource listener;
+    CURLM *multi;
+    long long curl_deadline_ms;
+    long long deadline_ms;
+    const char *ollama_url;
+    struct EventConnection *connections;
+    struct CurlSocket *retired_sockets;
+};
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
     }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    for (int turn = 0; turn < turns; ++turn) {
-        for (size_t idx = 0; idx < participant_count; ++idx) {
-            char label[128];
-            char *response = NULL;
-            json_object *message = NULL;
+/* While a response is in progress, input is buffered only up to one maximal request; reading then
+ * pauses until the response completes. A half-closed client has nothing more to read. */
+static int event_input_full(const struct EventConnection *conn) {
+    return conn->busy && conn->in.length >= http_max_header_bytes + http_max_body_bytes;
+}
 
-            snprintf(label, sizeof(label), "\n\n%s:", participants[idx].name);
-            conversation_history = append_to_history(conversation_history, label);
-            if (!conversation_history) {
-                if (error_out) {
-                    *error_out = strdup("Failed to build conversation history.");
-                }
-                goto fail;
-            }
+static void event_update_interest(struct EventConnection *conn) {
+    struct epoll_event ev;
+    uint32_t interest = event_input_full(conn) || conn->read_closed ? 0 : EPOLLIN | EPOLLRDHUP;
 
-            response = get_ai_response(conversation_history, participants[idx].model,
-                                       participants[idx].name, participants[idx].display_model,
-                                       ollama_url);
-            if (!response) {
-                if (error_out) {
-                    char buffer[256];
-                    snprintf(buffer, sizeof(buffer), "Model '%.*s' failed to respond.",
-                             (int)(sizeof(buffer) - 40), participants[idx].model);
-                    *error_out = strdup(buffer);
-                }
-                goto fail;
-            }
+    if (conn->dead) {
+        return;
+    }
+    if (conn->out_sent < conn->out.length + conn->out_static_length) {
+        interest |= EPOLLOUT;
+    }
+    if (interest == conn->interest) {
+        return;
+    }
 
-            conversation_history = append_to_history(conversation_history, response);
-            if (!conversation_history) {
-                free(response);
-                if (error_out) {
-                    *error_out = strdup("Failed to build conversation history.");
-                }
-                goto fail;
-            }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = interest;
+    ev.data.ptr = &conn->source;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->source.fd, &ev) == 0) {
+        conn->interest = interest;
+    }
+}
 
-            message = json_object_new_object();
-            if (!message) {
-                free(response);
-                if (error_out) {
-                    *error_out = strdup("Failed to allocate message JSON.");
-                }
-                goto fail;
+/* Writes as much pending output as the socket accepts without blocking. out is followed by
+ * out_static (a body with static storage, sent without copying it into out) in one gathered write
+ * per attempt; out_sent counts progress through both. Spilled stream output is reloaded into out as
+ * it empties. */
+static int event_flush(struct EventConnection *conn) {
+    long long now = monotonic_ms();
+    size_t bytes = 0;
+    size_t writes = 0;
+
+    /* Output queued behind none: the client has until write_timeout from now to start reading it. */
+    if (conn->busy && conn->deadline_ms == 0) {
+        conn->progress_ms = now;
+    }
+    while (!conn->dead) {
+        struct iovec iov[2] = {{.iov_base = conn->out.data, .iov_len = conn->out.length},
+                               {.iov_base = (void *)conn->out_static, .iov_len = conn->out_static_length}};
+        struct iovec *pending = iov;
+        int count = 2;
+        struct msghdr message = {0};
+        ssize_t written = 0;
+
+        if (conn->out_sent == conn->out.length + conn->out_static_length) {
+            conn->out_static = NULL;
+            conn->out_static_length = 0;
+            int refilled = output_refill(&conn->out, &conn->out_sent, &conn->spill);
+            if (refilled > 0) {
+                continue;
             }
-
-            json_object_object_add(message, "turn", json_object_new_int(turn + 1));
-            json_object_object_add(message, "participantIndex", json_object_new_int((int)idx));
-            json_object_object_add(message, "name", json_object_new_string(participants[idx].name));
-            json_object_object_add(message, "model", json_object_new_string(participants[idx].model));
-            if (participants[idx].display_model[0] != '\0') {
-                json_object_object_add(message, "displayModel",
-                                       json_object_new_string(participants[idx].display_model));
-            }
-            json_object_object_add(message, "text", json_object_new_string(response));
-            json_object_array_add(messages, message);
-
-            if (on_message) {
-                json_object_get(message);
-                if (on_message(message, callback_data) != 0) {
-                    json_object_put(message);
-                    free(response);
-                    if (error_out && (!*error_out)) {
-                        *error_out = strdup("Failed to stream message.");
-                    }
-                    goto fail;
-                }
-                json_object_put(message);
+            if (refilled < 0) {
+                conn->dead = 1;
+                note_socket_writes(bytes, writes);
+                return -1;
             }
-
-            free(response);
+            break;
+        }
+        iov_advance(&pending, &count, conn->out_sent);
+        message.msg_iov = pending;
+        message.msg_iovlen = (size_t)count;
+        written = sendmsg(conn->source.fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        writes++;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
         }
+        if (written <= 0) {
+            conn->dead = 1;
+            note_socket_writes(bytes, writes);
+            return -1;
+        }
+        bytes += (size_t)written;
+        conn->out_sent += (size_t)written;
+        conn->progress_ms = now;
+    }
+    if (writes > 0) {
+        note_socket_writes(bytes, writes);
     }
 
-    result = json_object_new_object();
-    if (!result) {
-        if (error_out) {
-            *error_out = strdup("Failed to allocate result JSON.");
+    if (conn->out.length == 0) {
+        if (conn->busy) {
+            conn->deadline_ms = 0;
+        }
+        if (conn->response_done && conn->keep_alive) {
+            conn->response_sent = 1;
+        } else if (conn->response_done) {
+            conn->dead = 1;
+            return 0;
+        }
+    } else {
+        if (!conn->out_static) {
+            output_compact(&conn->out, &conn->out_sent);
+        }
+        if (conn->busy) {
+            conn->deadline_ms = write_timeout > 0 ? conn->progress_ms + write_timeout * 1000LL : 0;
         }
-        goto fail;
     }
 
-    json_object_object_add(result, "topic", json_object_new_string(topic));
-    json_object_object_add(result, "turns", json_object_new_int(turns));
-    json_object_object_add(result, "participants", participants_json);
-    json_object_object_add(result, "messages", messages);
-    json_object_object_add(result, "history", json_object_new_string(conversation_history));
-
-    free(conversation_history);
-    *out_json = result;
+    event_update_interest(conn);
     return 0;
+}
 
-fail:
-    if (messages) {
-        json_object_put(messages);
-    }
-    if (participants_json) {
-        json_object_put(participants_json);
-    }
-    if (result) {
-        json_object_put(result);
+/* Queues what a format_*_event() call just wrote into out from mark onwards and sends it, or drops the
+ * connection if formatting failed or the client has fallen too far behind. */
+static int event_queue(struct EventConnection *conn, size_t mark, int format_rc) {
+    if (format_rc != 0 || output_admit(&conn->out, conn->out_sent, mark, &conn->spill) != 0) {
+        conn->dead = 1;
+        return -1;
     }
-    free(conversation_history);
-    return -1;
+    return event_flush(conn);
 }
 
-static void send_http_response(int client_fd, const char *status, const char *content_type,
-                               const char *body) {
-    char header[512];
-    size_t body_length = body ? strlen(body) : 0;
-    int header_len = snprintf(header, sizeof(header),
-                              "HTTP/1.1 %s\r\n"
-                              "Content-Type: %s\r\n"
-                              "Content-Length: %zu\r\n"
-                              "Access-Control-Allow-Origin: *\r\n"
-                              "Connection: close\r\n\r\n",
-                              status, content_type, body_length);
-    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+static void event_respond(struct EventConnection *conn, const char *status, const char *content_type,
+                          const char *body) {
+    if (format_http_response(&conn->out, status, content_type, body, conn->keep_alive) != 0) {
+        conn->dead = 1;
         return;
     }
+    conn->response_done = 1;
+    event_flush(conn);
+}
+
+/* Sends a prebuilt head and a body that lives for the whole process (the page) without copying the body. */
+static void event_respond_prebuilt(struct EventConnection *conn, const char *head, size_t head_length,
+                                   const void *body, size_t body_length) {
+    const char *connection = connection_header(conn->keep_alive);
 
-    send(client_fd, header, (size_t)header_len, 0);
-    if (body_length > 0) {
-        send(client_fd, body, body_length, 0);
+    if (text_buffer_append(&conn->out, head, head_length) != 0 ||
+        text_buffer_append(&conn->out, connection, strlen(connection)) != 0) {
+        conn->dead = 1;
+        return;
     }
+    conn->out_static = body;
+    conn->out_static_length = body_length;
+    conn->response_done = 1;
+    event_flush(conn);
 }
 
-static void send_http_error(int client_fd, const char *status, const char *message) {
-    json_object *obj = json_object_new_object();
-    const char *payload = NULL;
-
-    if (!obj) {
-        send_http_response(client_fd, status, "text/plain; charset=UTF-8", message);
+static void event_respond_error(struct EventConnection *conn, const char *status, const char *message) {
+    if (format_http_error(&conn->out, status, message, conn->keep_alive) != 0) {
+        conn->dead = 1;
         return;
     }
+    conn->response_done = 1;
+    event_flush(conn);
+}
 
-    json_object_object_add(obj, "error", json_object_new_string(message));
-    payload = json_object_to_json_string(obj);
-    send_http_response(client_fd, status, "application/json", payload);
-    json_object_put(obj);
+static int event_turn_callback(const struct TurnEvent *event, void *user_data) {
+    struct EventConnection *conn = (struct EventConnection *)user_data;
+    size_t mark = conn->out.length;
+    return event_queue(conn, mark, format_turn_event(&conn->out, event));
 }
 
-static int send_all(int client_fd, const char *data, size_t length) {
-    size_t total_sent = 0;
+static void event_end_stream(struct EventConnection *conn, const char *error_message) {
+    size_t mark = conn->out.length;
+    int rc = 0;
 
-    while (total_sent < length) {
-        ssize_t written = send(client_fd, data + total_sent, length - total_sent, 0);
-        if (written <= 0) {
-            return -1;
-        }
-        total_sent += (size_t)written;
+    if (conn->dead) {
+        return;
     }
 
-    return 0;
+    if (error_message) {
+        rc = format_error_event(&conn->out, error_message);
+    } else {
+        rc = format_complete_event(&conn->out, conn->chat.topic, conn->chat.turns);
+    }
+    rc |= format_finish_chunked_response(&conn->out);
+    conn->response_done = 1;
+    event_queue(conn, mark, rc);
 }
 
-static int send_chunked_header(int client_fd, const char *status, const char *content_type) {
-    char header[512];
-    int header_len = snprintf(header, sizeof(header),
-                              "HTTP/1.1 %s\r\n"
-                              "Content-Type: %s\r\n"
-                              "Transfer-Encoding: chunked\r\n"
-                              "Cache-Control: no-cache\r\n"
-                              "Access-Control-Allow-Origin: *\r\n"
-                              "Connection: close\r\n\r\n",
-                              status, content_type);
-
-    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
-        return -1;
+static void event_add_turn(struct EventConnection *conn, CURL *curl) {
+    conn->transfer = EVENT_TRANSFER_NONE;
+    if (!curl) {
+        event_end_stream(conn, conn->conv.error ? conn->conv.error : "Conversation failed.");
+        return;
     }
 
-    return send_all(client_fd, header, (size_t)header_len);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, conn);
+    conn->transfer = EVENT_TRANSFER_TURN;
+    if (curl_multi_add_handle(conn->loop->multi, curl) != CURLM_OK) {
+        conn->transfer = EVENT_TRANSFER_NONE;
+        event_end_stream(conn, "Failed to schedule model request.");
+    }
 }
 
-static int send_json_chunk(int client_fd, json_object *obj) {
-    const char *json = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
-    char size_buffer[32];
-    int size_len = 0;
-    size_t json_len = 0;
+/* Starts the next turn's transfer. Turns answered from the response cache finish on the spot, so a replayed
+ * conversation is written out in one pass. A turn the scheduler holds back waits as EVENT_TRANSFER_QUEUED
+ * until event_reap_connections() sees its ticket granted. */
+static void event_start_turn(struct EventConnection *conn) {
+    CURL *curl = conversation_begin_turn(&conn->conv);
 
-    if (!json) {
-        return -1;
+    while (!curl && conn->conv.request.cached && !conn->dead) {
+        switch (conversation_finish_turn(&conn->conv, CURLE_OK)) {
+        case TURN_CONTINUE:
+            curl = conversation_begin_turn(&conn->conv);
+            break;
+        case TURN_COMPLETE:
+            event_end_stream(conn, NULL);
+            return;
+        case TURN_FAILED:
+            event_end_stream(conn, conn->conv.error ? conn->conv.error : "Conversation failed.");
+            return;
+        }
     }
+    if (!curl && conn->conv.queued) {
+        conn->transfer = EVENT_TRANSFER_QUEUED;
+        return;
+    }
+    event_add_turn(conn, curl);
+}
 
-    json_len = strlen(json);
-    size_len = snprintf(size_buffer, sizeof(size_buffer), "%zx\r\n", json_len + 1);
-    if (size_len < 0 || (size_t)size_len >= sizeof(size_buffer)) {
-        return -1;
+/* Sends a turn that has waited past the hedge delay to a second backend as well. */
+static void event_start_hedge(struct EventConnection *conn) {
+    CURL *curl = conversation_begin_hedge(&conn->conv);
+
+    if (!curl) {
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, conn);
+    if (curl_multi_add_handle(conn->loop->multi, curl) != CURLM_OK) {
+        conversation_drop_racer(&conn->conv.hedge, &conn->conv.hedge_backend, CURLE_OK);
     }
+}
 
-    if (send_all(client_fd, size_buffer, (size_t)size_len) != 0) {
-        return -1;
+static void event_begin_conversation(struct EventConnection *conn) {
+    struct ChatRequest *chat = &conn->chat;
+    size_t mark = conn->out.length;
+
+    if (format_chunked_header(&conn->out, "200 OK", "application/x-ndjson", conn->keep_alive) != 0 ||
+        event_queue(conn, mark, format_start_event(&conn->out, chat->topic, chat->turns, chat->participants,
+                                             chat->participant_count)) != 0) {
+        conn->dead = 1;
+        return;
     }
 
-    if (send_all(client_fd, json, json_len) != 0) {
-        return -1;
+    conn->conv_active = 1;
+    if (conversation_init(&conn->conv, chat->topic, chat->turns, chat->participants, chat->participant_count,
+                          &chat->options, conn->loop->ollama_url, event_turn_callback,
+                          chat->stream_tokens ? event_turn_callback : NULL, conn) != 0) {
+        event_end_stream(conn, conn->conv.error ? conn->conv.error : "Conversation failed.");
+        return;
     }
 
-    if (send_all(client_fd, "\n", 1) != 0) {
+    event_start_turn(conn);
+}
+
+static int event_start_models_transfer(struct EventConnection *conn, enum event_transfer kind) {
+    CURL *curl = NULL;
+
+    if (backend_pool.count > 1) {
+        conn->transfer = kind;
+        return 0;
+    }
+    curl = prepare_models_request(conn->loop->ollama_url, &conn->transfer_body, NULL);
+    if (!curl) {
         return -1;
     }
 
-    if (send_all(client_fd, "\r\n", 2) != 0) {
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, conn);
+    if (curl_multi_add_handle(conn->loop->multi, curl) != CURLM_OK) {
+        curl_pool_release(curl);
+        free(conn->transfer_body.memory);
+        conn->transfer_body.memory = NULL;
         return -1;
     }
 
+    conn->transfer = kind;
+    conn->transfer_handle = curl;
     return 0;
 }
 
-static int finish_chunked_response(int client_fd) {
-    return send_all(client_fd, "0\r\n\r\n", 5);
+static void event_release_models_transfer(struct EventConnection *conn) {
+    if (conn->transfer_handle) {
+        curl_multi_remove_handle(conn->loop->multi, conn->transfer_handle);
+        curl_pool_release(conn->transfer_handle);
+        conn->transfer_handle = NULL;
+    }
+    free(conn->transfer_body.memory);
+    conn->transfer_body.memory = NULL;
+    conn->transfer_body.size = 0;
+    conn->transfer = EVENT_TRANSFER_NONE;
 }
 
-static int send_stream_error_event(int client_fd, const char *message) {
-    json_object *event = json_object_new_object();
-    int result = -1;
+static void event_handle_chat(struct EventConnection *conn, const char *body, size_t body_length) {
+    const char *status = NULL;
+    const char *message = NULL;
+    struct CatalogueSnapshot *catalogue = NULL;
 
-    if (!event) {
-        return -1;
+    if (parse_chat_request(body, body_length, &conn->chat, &status, &message) != 0) {
+        event_respond_error(conn, status, message);
+        return;
+    }
+    conn->chat_active = 1;
+
+    for (size_t i = 0; i < conn->chat.participant_count; ++i) {
+        if (conn->chat.participants[i].display_model[0] == '\0') {
+            catalogue = catalogue_peek(conn->loop->ollama_url);
+            /* Only a cold catalogue makes the conversation wait for Ollama's model list. */
+            if (!catalogue && event_start_models_transfer(conn, EVENT_TRANSFER_LOOKUP) == 0) {
+                return;
+            }
+            break;
+        }
     }
 
-    json_object_object_add(event, "type", json_object_new_string("error"));
-    json_object_object_add(event, "message",
-                           json_object_new_string(message ? message : "Conversation failed."));
+    ensure_participant_display_models(conn->chat.participants, conn->chat.participant_count, catalogue);
+    catalogue_release(catalogue);
+    event_begin_conversation(conn);
+}
 
-    result = send_json_chunk(client_fd, event);
-    json_object_put(event);
-    return result;
+/* Starts answering the request just parsed into conn->request. */
+static void event_dispatch_request(struct EventConnection *conn) {
+    const struct HttpRequest *request = &conn->request;
+    const char *body = request->base + request->header_length;
+    size_t body_length = request->body_length;
+
+    conn->requests++;
+    conn->busy = 1;
+    conn->keep_alive = connection_may_persist(request, conn->requests);
+    conn->deadline_ms = 0;
+
+    if (http_request_is(request, "GET", "/")) {
+        struct PrebuiltResponse page;
+        if (page_response_for(request, &page) == 0) {
+            event_respond_prebuilt(conn, page.head, page.head_length, page.body, page.body_length);
+        } else {
+            event_respond(conn, "200 OK", "text/html; charset=UTF-8", get_html_page());
+        }
+    } else if (http_request_is(request, "GET", "/models")) {
+        struct CatalogueSnapshot *catalogue = catalogue_peek(conn->loop->ollama_url);
+        if (catalogue) {
+            event_respond(conn, "200 OK", "application/json", catalogue->json);
+            catalogue_release(catalogue);
+        } else if (event_start_models_transfer(conn, EVENT_TRANSFER_MODELS) != 0) {
+            event_respond_error(conn, "502 Bad Gateway", "Unable to retrieve model list.");
+        }
+    } else if (http_request_is(request, "GET", "/stats")) {
+        json_object *stats = build_stats_json();
+        if (stats) {
+            event_respond(conn, "200 OK", "application/json",
+                          json_object_to_json_string_ext(stats, JSON_C_TO_STRING_PLAIN));
+            json_object_put(stats);
+        } else {
+            event_respond_error(conn, "500 Internal Server Error", "Unable to collect statistics.");
+        }
+    } else if (http_request_is(request, "POST", "/chat")) {
+        if (body_length == 0) {
+            event_respond_error(conn, "400 Bad Request", "Missing request body.");
+        } else {
+            event_handle_chat(conn, body, body_length);
+        }
+    } else if (http_span_equals(request, request->method, "OPTIONS")) {
+        event_respond_prebuilt(conn, CORS_PREFLIGHT_HEAD, strlen(CORS_PREFLIGHT_HEAD), NULL, 0);
+    } else {
+        event_respond_error(conn, "404 Not Found", "Endpoint not found.");
+    }
 }
 
-struct StreamContext {
-    int client_fd;
-    int failed;
-};
+static void event_handle_readable(struct EventConnection *conn) {
+    char chunk[READ_BUFFER_CHUNK];
+
+    while (!conn->dead && !conn->read_closed && !event_input_full(conn)) {
+        ssize_t bytes = recv(conn->source.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (bytes == 0) {
+            conn->read_closed = 1;
+            break;
+        }
+        if (bytes <= 0 || text_buffer_append(&conn->in, chunk, (size_t)bytes) != 0) {
+            conn->dead = 1;
+            return;
+        }
+        /* The first byte of a request on an idle connection starts its read deadline. */
+        if (!conn->busy && conn->requests > 0 && conn->in.length == (size_t)bytes) {
+            conn->deadline_ms = read_timeout > 0 ? monotonic_ms() + read_timeout * 1000LL : 0;
+        }
+    }
+    event_update_interest(conn);
+}
 
-static int stream_message_callback(json_object *message, void *user_data) {
-    struct StreamContext *ctx = (struct StreamContext *)user_data;
-    json_object *event = NULL;
-    int rc = -1;
+/* Leaves the finished response behind: releases its state and makes the connection idle again. */
+static void event_finish_response(struct EventConnection *conn) {
+    pthread_mutex_lock(&stats_lock);
+    server_stats.http_responses++;
+    pthread_mutex_unlock(&stats_lock);
 
-    if (!ctx || ctx->failed) {
-        return -1;
+    if (conn->conv_active) {
+        conversation_cleanup(&conn->conv);
+        conn->conv_active = 0;
     }
-
-    event = json_object_new_object();
-    if (!event) {
-        ctx->failed = 1;
-        return -1;
+    if (conn->chat_active) {
+        chat_request_release(&conn->chat);
+        conn->chat_active = 0;
     }
-
-    json_object_object_add(event, "type", json_object_new_string("message"));
-    json_object_object_add(event, "message", json_object_get(message));
-
-    rc = send_json_chunk(ctx->client_fd, event);
-    if (rc != 0) {
-        ctx->failed = 1;
+    stream_spill_close(&conn->spill);
+    conn->busy = 0;
+    conn->response_done = 0;
+    conn->response_sent = 0;
+    if (conn->in.length > 0) {
+        conn->deadline_ms = read_timeout > 0 ? monotonic_ms() + read_timeout * 1000LL : 0;
+    } else {
+        conn->deadline_ms = monotonic_ms() + keepalive_timeout * 1000LL;
     }
-
-    json_object_put(event);
-    return rc;
+    event_update_interest(conn);
 }
 
-static const char *get_html_page(void) {
-    return "<!DOCTYPE html>\n"
-           "<html lang=\"en\">\n"
-           "<head>\n"
-           "  <meta charset=\"UTF-8\" />\n"
-           "  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\" />\n"
-           "  <title>aiChat Arena</title>\n"
-           "  <style>\n"
-           "    :root { color-scheme: dark; }\n"
-           "    * { box-sizing: border-box; }\n"
-           "    body { margin: 0; padding: clamp(1.5rem, 3vw, 3rem); font-family: 'Segoe UI', 'Orbitron', 'Roboto', sans-serif; background: radial-gradient(circle at 20% 20%, rgba(56, 189, 248, 0.15), transparent 55%), radial-gradient(circle at 80% 0%, rgba(168, 85, 247, 0.12), transparent 45%), #020617; color: #e2e8f0; min-height: 100vh; display: flex; flex-direction: column; align-items: center; gap: 2.5rem; position: relative; overflow-x: hidden; }\n"
-           "    body::before { content: ''; position: fixed; inset: -20vmax; background: conic-gradient(from 180deg at 50% 50%, rgba(56, 189, 248, 0.08), rgba(59, 130, 246, 0.16), rgba(168, 85, 247, 0.12), rgba(56, 189, 248, 0.08)); opacity: 0.65; filter: blur(120px); animation: auroraSpin 48s linear infinite; z-index: -2; pointer-events: none; }\n"
-           "    body::after { content: ''; position: fixed; inset: -18vmax; background: radial-gradient(circle at 15% 25%, rgba(59, 130, 246, 0.22), transparent 55%), radial-gradient(circle at 85% 15%, rgba(168, 85, 247, 0.18), transparent 60%); opacity: 0.45; filter: blur(90px); animation: auroraPulse 32s ease-in-out infinite alternate; z-index: -3; pointer-events: none; }\n"
-           "    @keyframes auroraSpin {\n"
-           "      from { transform: rotate(0deg); }\n"
-           "      to { transform: rotate(360deg); }\n"
-           "    }\n"
-           "    @keyframes auroraPulse {\n"
-           "      0% { opacity: 0.35; transform: scale(0.95); }\n"
-           "      50% { opacity: 0.55; transform: scale(1.05); }\n"
-           "      100% { opacity: 0.35; transform: scale(1); }\n"
-           "    }\n"
-           "    .card { position: relative; width: min(960px, 100%); background: rgba(15, 23, 42, 0.75); border-radius: 24px; padding: clamp(1.5rem, 3vw, 2.5rem); border: 1px solid rgba(148, 163, 184, 0.25); box-shadow: 0 40px 80px rgba(2, 6, 23, 0.6); backdrop-filter: blur(18px); overflow: hidden; transform-style: preserve-3d; transition: transform 0.6s cubic-bezier(0.22, 1, 0.36, 1), box-shadow 0.6s ease; }\n"
-           "    .card::after { content: ''; position: absolute; inset: -40%; background: radial-gradient(circle at 30% 30%, rgba(56, 189, 248, 0.45), transparent 65%), radial-gradient(circle at 70% 10%, rgba(168, 85, 247, 0.35), transparent 60%); opacity: 0; transform: translate3d(0, 40px, 0) scale(0.95); filter: blur(40px); transition: opacity 0.6s ease, transform 0.6s cubic-bezier(0.22, 1, 0.36, 1); pointer-events: none; z-index: 0; }\n"
-           "    .card > * { position: relative; z-index: 1; }\n"
-           "    .card:hover { transform: translateY(-6px); box-shadow: 0 48px 120px rgba(2, 6, 23, 0.75); }\n"
-           "    .card:hover::after { opacity: 1; transform: translate3d(0, 0, 0) scale(1.05); }\n"
-           "    h1 { margin-bottom: 0.25rem; font-size: clamp(1.9rem, 3vw, 2.4rem); letter-spacing: 0.08em; text-transform: uppercase; color: #f8fafc; }\n"
-           "    h2 { margin-top: 0; letter-spacing: 0.06em; text-transform: uppercase; color: #cbd5f5; }\n"
-           "    p { margin-top: 0; color: rgba(226, 232, 240, 0.85); }\n"
-           "    label { display: block; margin-top: 1.25rem; font-weight: 600; letter-spacing: 0.05em; text-transform: uppercase; color: rgba(148, 163, 184, 0.9); }\n"
-           "    input, select { width: 100%; padding: 0.75rem 1rem; margin-top: 0.5rem; border-radius: 12px; border: 1px solid rgba(148, 163, 184, 0.25); background: rgba(15, 23, 42, 0.6); color: #f8fafc; box-shadow: inset 0 0 0 rgba(15, 23, 42, 0.5); transition: border-color 0.2s ease, box-shadow 0.2s ease, transform 0.3s ease; }\n"
-           "    input:focus, select:focus { outline: none; border-color: rgba(94, 234, 212, 0.8); box-shadow: 0 0 0 3px rgba(94, 234, 212, 0.2); transform: translateY(-1px); }\n"
-           "    input::placeholder { color: rgba(148, 163, 184, 0.6); }\n"
-           "    .actions { display: flex; gap: 0.75rem; flex-wrap: wrap; margin-top: 1.5rem; }\n"
-           "    button { position: relative; padding: 0.85rem 1.8rem; border: none; border-radius: 999px; background: linear-gradient(120deg, #22d3ee, #a855f7); background-size: 220% 220%; color: #0b1120; font-weight: 700; text-transform: uppercase; letter-spacing: 0.08em; cursor: pointer; transition: transform 0.25s ease, box-shadow 0.25s ease, background-position 0.4s ease; box-shadow: 0 12px 26px rgba(168, 85, 247, 0.35); }\n"
-           "    button::after { content: ''; position: absolute; inset: -2px; border-radius: inherit; border: 1px solid rgba(255, 255, 255, 0.25); opacity: 0; transition: opacity 0.3s ease, transform 0.3s ease; pointer-events: none; }\n"
-           "    button:hover { transform: translateY(-2px); box-shadow: 0 20px 45px rgba(168, 85, 247, 0.45); background-position: 100% 50%; }\n"
-           "    button:hover::after { opacity: 1; transform: scale(1.03); }\n"
-           "    button:focus-visible { outline: none; box-shadow: 0 0 0 3px rgba(14, 165, 233, 0.35); }\n"
-           "    button:active { transform: translateY(0); }\n"
-           "    .participants { margin-top: 1.5rem; display: grid; gap: 1rem; grid-template-columns: repeat(auto-fit, minmax(260px, 1fr)); perspective: 1200px; }\n"
-           "    .participant { position: relative; border-radius: 18px; padding: 1.25rem; border: 1px solid var(--participant-border, rgba(148, 163, 184, 0.45)); background: var(--participant-surface, rgba(15, 23, 42, 0.6)); color: #e2e8f0; box-shadow: 0 0 32px var(--participant-glow, rgba(15, 23, 42, 0.8)); overflow: hidden; backdrop-filter: blur(12px); transform-style: preserve-3d; background-size: 180% 180%; transition: transform 0.6s cubic-bezier(0.22, 1, 0.36, 1), box-shadow 0.6s ease, border-color 0.3s ease; }\n"
-           "    .participant::before { content: ''; position: absolute; inset: 0; background: var(--participant-pattern, rgba(94, 234, 212, 0.1)); opacity: 0.55; filter: blur(60px); z-index: 0; transition: opacity 0.6s ease, transform 0.6s ease; animation: participantDrift 24s linear infinite; }\n"
-           "    .participant::after { content: ''; position: absolute; inset: 1px; border-radius: 16px; background: radial-gradient(circle at 20% 20%, var(--participant-highlight, rgba(255, 255, 255, 0.35)), transparent 55%); opacity: 0; mix-blend-mode: screen; transition: opacity 0.6s ease; z-index: 0; }\n"
-           "    .participant > * { position: relative; z-index: 1; }\n"
-           "    .participant:hover, .participant:focus-within { transform: translateY(-8px) rotate3d(1, -1, 0, 6deg); box-shadow: 0 32px 80px var(--participant-glow, rgba(15, 23, 42, 0.8)); }\n"
-           "    .participant:hover::before, .participant:focus-within::before { opacity: 0.8; transform: scale(1.08); }\n"
-           "    .participant:hover::after, .participant:focus-within::after { opacity: 0.85; }\n"
-           "    @keyframes participantDrift {\n"
-           "      0% { transform: scale(1) translate3d(0, 0, 0); }\n"
-           "      50% { transform: scale(1.05) translate3d(-6px, 4px, 0); }\n"
-           "      100% { transform: scale(1) translate3d(0, 0, 0); }\n"
-           "    }\n"
-           "    .participant button { margin-top: 1rem; width: fit-content; background: rgba(15, 23, 42, 0.65); color: #f8fafc; border: 1px solid rgba(148, 163, 184, 0.35); border-radius: 12px; padding: 0.5rem 1rem; letter-spacing: 0.05em; text-transform: none; font-size: 0.85rem; transition: transform 0.3s ease, border-color 0.3s ease, box-shadow 0.3s ease; }\n"
-           "    .participant button::after { display: none; }\n"
-           "    .participant button:hover, .participant button:focus-visible { color: #f87171; border-color: rgba(248, 113, 113, 0.8); box-shadow: 0 0 20px rgba(248, 113, 113, 0.25); transform: translateY(-1px); }\n"
-           "    #status { margin-top: 1rem; font-weight: 600; color: #f97316; letter-spacing: 0.05em; opacity: 0; transform: translateY(-0.25rem); transition: opacity 0.35s ease, transform 0.35s ease; text-shadow: none; }\n"
-           "    #status.status-active { opacity: 1; transform: translateY(0); }\n"
-           "    #status.status-flash { animation: statusGlow 1.2s ease-out; }\n"
-           "    @keyframes statusGlow {\n"
-           "      0% { opacity: 0.6; text-shadow: 0 0 0 rgba(249, 115, 22, 0.75); }\n"
-           "      45% { opacity: 1; text-shadow: 0 0 22px rgba(249, 115, 22, 0.85); }\n"
-           "      100% { opacity: 1; text-shadow: none; }\n"
-           "    }\n"
-           "    #status:empty { display: none; }\n"
-           "    #transcript { width: min(960px, 100%); }\n"
-           "    .log { white-space: pre-wrap; background: rgba(15, 23, 42, 0.78); padding: clamp(1.25rem, 3vw, 2rem); border-radius: 24px; border: 1px solid rgba(148, 163, 184, 0.25); box-shadow: 0 24px 60px rgba(2, 6, 23, 0.65); backdrop-filter: blur(16px); }\n"
-           "    .message { padding: 1rem 1.25rem; border-radius: 16px; margin-bottom: 0.85rem; background: var(--message-bg, rgba(56, 189, 248, 0.12)); border-left: 4px solid var(--message-border, #38bdf8); box-shadow: 0 12px 28px var(--message-glow, rgba(15, 23, 42, 0.6)); color: #f8fafc; opacity: 0; transform: translateY(16px); transition: transform 0.55s cubic-bezier(0.23, 1, 0.32, 1), opacity 0.55s ease, box-shadow 0.55s ease; }\n"
-           "    .message.is-visible { opacity: 1; transform: translateY(0); }\n"
-           "    .message.message-summary { background: linear-gradient(135deg, rgba(13, 148, 136, 0.28), rgba(14, 165, 233, 0.3)); border-left-color: #06b6d4; font-style: italic; }\n"
-           "    .message.message-summary strong { letter-spacing: 0.12em; color: #bae6fd; }\n"
-           "    .message.message-enter { animation: messagePulse 1.2s ease-out forwards; }\n"
-           "    @keyframes messagePulse {\n"
-           "      0% { box-shadow: 0 0 0 0 var(--message-glow, rgba(56, 189, 248, 0.35)); }\n"
-           "      55% { box-shadow: 0 0 36px var(--message-glow, rgba(56, 189, 248, 0.55)); }\n"
-           "      100% { box-shadow: 0 12px 28px var(--message-glow, rgba(15, 23, 42, 0.6)); }\n"
-           "    }\n"
-           "    .message strong { display: block; margin-bottom: 0.35rem; letter-spacing: 0.05em; text-transform: uppercase; color: rgba(226, 232, 240, 0.92); }\n"
-           "  </style>\n"
-           "</head>\n"
-           "<body>\n"
-           "  <div class=\"card\">\n"
-           "    <h1>aiChat Arena</h1>\n"
-           "    <p>Configure friendly AI companions, pick their Ollama models, and watch them chat about your topic.</p>\n"
-           "    <label for=\"topic\">Conversation topic</label>\n"
-           "    <input id=\"topic\" placeholder=\"Space exploration strategies\" />\n"
-           "    <label for=\"turns\">Number of turns</label>\n"
-           "    <input id=\"turns\" type=\"number\" min=\"1\" max=\"12\" value=\"3\" />\n"
-           "    <div class=\"actions\">\n"
-           "      <button id=\"addParticipant\">Add participant</button>\n"
-           "      <button id=\"start\">Start conversation</button>\n"
-           "    </div>\n"
-           "    <div id=\"participants\" class=\"participants\"></div>\n"
-           "    <div id=\"status\"></div>\n"
-           "  </div>\n"
-           "  <div id=\"transcript\" class=\"log\" style=\"display:none;\">\n"
-           "    <h2>Conversation transcript</h2>\n"
-           "    <div id=\"messages\"></div>\n"
-           "  </div>\n"
-           "  <script>\n"
-           "    const participantsEl = document.getElementById('participants');\n"
-           "    const statusEl = document.getElementById('status');\n"
-           "    statusEl.addEventListener('animationend', (event) => {\n"
-           "      if (event.animationName === 'statusGlow') {\n"
-           "        statusEl.classList.remove('status-flash');\n"
-           "      }\n"
-           "    });\n"
-           "    function setStatus(message) {\n"
-           "      const text = typeof message === 'string' ? message : (message ? String(message) : '');\n"
-           "      const active = Boolean(text);\n"
-           "      statusEl.textContent = active ? text : '';\n"
-           "      statusEl.classList.toggle('status-active', active);\n"
-           "      if (active) {\n"
-           "        statusEl.classList.remove('status-flash');\n"
-           "        void statusEl.offsetWidth;\n"
-           "        statusEl.classList.add('status-flash');\n"
-           "      } else {\n"
-           "        statusEl.classList.remove('status-flash');\n"
-           "      }\n"
-           "    }\n"
-           "    const messagesEl = document.getElementById('messages');\n"
-           "    const transcriptEl = document.getElementById('transcript');\n"
-           "    const transcriptMessages = [];\n"
-           "    let summaryAppended = false;\n"
-           "    let currentTopic = '';\n"
-           "    let currentTurns = 0;\n"
-           "    let currentParticipants = [];\n"
-           "    let availableModels = [];\n"
-           "    const modelSelects = new Set();\n"
-           "    let modelLoadError = false;\n"
-           "    let missingModelWarning = false;\n"
-           "    const basePalette = [\n"
-           "      {\n"
-           "        messageBackground: 'linear-gradient(135deg, rgba(56, 189, 248, 0.18), rgba(59, 130, 246, 0.45))',\n"
-           "        border: '#38bdf8',\n"
-           "        glow: 'rgba(56, 189, 248, 0.45)',\n"
-           "        cardBackground: 'linear-gradient(160deg, rgba(12, 74, 110, 0.85), rgba(37, 99, 235, 0.75))',\n"
-           "        cardPattern: 'radial-gradient(circle at 20% 20%, rgba(14, 165, 233, 0.35) 0, transparent 45%), radial-gradient(circle at 80% 0%, rgba(59, 130, 246, 0.3) 0, transparent 40%)'\n"
-           "      },\n"
-           "      {\n"
-           "        messageBackground: 'linear-gradient(135deg, rgba(244, 114, 182, 0.2), rgba(236, 72, 153, 0.45))',\n"
-           "        border: '#f472b6',\n"
-           "        glow: 'rgba(244, 114, 182, 0.45)',\n"
-           "        cardBackground: 'linear-gradient(160deg, rgba(88, 28, 135, 0.82), rgba(162, 28, 175, 0.78))',\n"
-           "        cardPattern: 'radial-gradient(circle at 25% 20%, rgba(249, 168, 212, 0.32) 0, transparent 42%), radial-gradient(circle at 80% 10%, rgba(236, 72, 153, 0.28) 0, transparent 38%)'\n"
-           "      },\n"
-           "      {\n"
-           "        messageBackground: 'linear-gradient(135deg, rgba(52, 211, 153, 0.2), rgba(16, 185, 129, 0.45))',\n"
-           "        border: '#34d399',\n"
-           "        glow: 'rgba(16, 185, 129, 0.4)',\n"
-           "        cardBackground: 'linear-gradient(160deg, rgba(4, 47, 46, 0.85), rgba(13, 148, 136, 0.78))',\n"
-           "        cardPattern: 'radial-gradient(circle at 18% 22%, rgba(94, 234, 212, 0.32) 0, transparent 45%), radial-gradient(circle at 82% 12%, rgba(16, 185, 129, 0.3) 0, transparent 40%)'\n"
-           "      },\n"
-           "      {\n"
-           "        messageBackground: 'linear-gradient(135deg, rgba(251, 191, 36, 0.2), rgba(249, 115, 22, 0.45))',\n"
-           "        border: '#f59e0b',\n"
-           "        glow: 'rgba(251, 146, 60, 0.45)',\n"
-           "        cardBackground: 'linear-gradient(160deg, rgba(88, 40, 12, 0.85), rgba(234, 88, 12, 0.75))',\n"
-           "        cardPattern: 'radial-gradient(circle at 24% 16%, rgba(251, 191, 36, 0.32) 0, transparent 44%), radial-gradient(circle at 78% 10%, rgba(249, 115, 22, 0.28) 0, transparent 40%)'\n"
-           "      },\n"
-           "      {\n"
-           "        messageBackground: 'linear-gradient(135deg, rgba(129, 140, 248, 0.2), rgba(99, 102, 241, 0.45))',\n"
-           "        border: '#818cf8',\n"
-           "        glow: 'rgba(129, 140, 248, 0.45)',\n"
-           "        cardBackground: 'linear-gradient(160deg, rgba(30, 41, 102, 0.85), rgba(76, 29, 149, 0.78))',\n"
-           "        cardPattern: 'radial-gradient(circle at 22% 24%, rgba(129, 140, 248, 0.32) 0, transparent 46%), radial-gradient(circle at 84% 14%, rgba(165, 180, 252, 0.28) 0, transparent 40%)'\n"
-           "      },\n"
-           "      {\n"
-           "        messageBackground: 'linear-gradient(135deg, rgba(45, 212, 191, 0.2), rgba(59, 130, 246, 0.42))',\n"
-           "        border: '#5eead4',\n"
-           "        glow: 'rgba(56, 189, 248, 0.38)',\n"
-           "        cardBackground: 'linear-gradient(160deg, rgba(8, 47, 73, 0.85), rgba(30, 64, 175, 0.78))',\n"
-           "        cardPattern: 'radial-gradient(circle at 28% 18%, rgba(56, 189, 248, 0.32) 0, transparent 42%), radial-gradient(circle at 76% 8%, rgba(45, 212, 191, 0.28) 0, transparent 38%)'\n"
-           "      }\n"
-           "    ];\n"
-           "    const participantStyles = new Map();\n"
-           "    function computePaletteEntry(index) {\n"
-           "      const position = Number.isFinite(index) && index >= 0 ? index : 0;\n"
-           "      if (position < basePalette.length) {\n"
-           "        return { ...basePalette[position] };\n"
-           "      }\n"
-           "      const hue = (position * 47) % 360;\n"
-           "      const accent = (hue + 60) % 360;\n"
-           "      return {\n"
-           "        messageBackground: `linear-gradient(135deg, hsla(${hue}, 80%, 22%, 0.55), hsla(${accent}, 85%, 36%, 0.75))`,\n"
-           "        border: `hsla(${accent}, 90%, 65%, 1)`,\n"
-           "        glow: `hsla(${accent}, 90%, 70%, 0.45)`,\n"
-           "        cardBackground: `linear-gradient(160deg, hsla(${hue}, 65%, 16%, 0.9), hsla(${accent}, 70%, 22%, 0.95))`,\n"
-           "        cardPattern: `radial-gradient(circle at 20% 25%, hsla(${accent}, 85%, 60%, 0.35) 0, transparent 42%), radial-gradient(circle at 80% 10%, hsla(${hue}, 85%, 55%, 0.3) 0, transparent 38%)`\n"
-           "      };\n"
-           "    }\n"
-           "    function getPaletteForIndex(index) {\n"
-           "      const palette = computePaletteEntry(index);\n"
-           "      if (!palette.glow) {\n"
-           "        palette.glow = 'rgba(59, 130, 246, 0.35)';\n"
-           "      }\n"
-           "      if (!palette.messageBackground) {\n"
-           "        palette.messageBackground = 'linear-gradient(135deg, rgba(59, 130, 246, 0.18), rgba(129, 140, 248, 0.4))';\n"
-           "      }\n"
-           "      if (!palette.cardBackground) {\n"
-           "        palette.cardBackground = 'linear-gradient(160deg, rgba(15, 23, 42, 0.85), rgba(30, 64, 175, 0.78))';\n"
-           "      }\n"
-           "      return palette;\n"
-           "    }\n"
-           "    function assignParticipantStyles(participants) {\n"
-           "      participantStyles.clear();\n"
-           "      participants.forEach((participant, index) => {\n"
-           "        participantStyles.set(index, getPaletteForIndex(index));\n"
-           "      });\n"
-           "    }\n"
-           "    function normaliseParticipants(list) {\n"
-           "      if (!Array.isArray(list)) {\n"
-           "        return [];\n"
-           "      }\n"
-           "      return list\n"
-           "        .map((participant) => ({\n"
-           "          name: participant && typeof participant.name === 'string' ? participant.name.trim() : '',\n"
-           "          model: participant && typeof participant.model === 'string' ? participant.model.trim() : '',\n"
-           "          displayModel: participant && typeof participant.displayModel === 'string' ? participant.displayModel.trim() : ''\n"
-           "        }))\n"
-           "        .filter((participant) => participant.name || participant.model || participant.displayModel);\n"
-           "    }\n"
-           "    function resetTranscriptState(topic, turns, participants) {\n"
-           "      transcriptMessages.length = 0;\n"
-           "      summaryAppended = false;\n"
-           "      currentTopic = typeof topic === 'string' ? topic : '';\n"
-           "      currentTurns = Number.isFinite(turns) ? turns : 0;\n"
-           "      currentParticipants = normaliseParticipants(participants);\n"
-           "    }\n"
-           "    function recordTranscriptMessage(message) {\n"
-           "      if (!message || message.isSummary) {\n"
-           "        return;\n"
-           "      }\n"
-           "      const entry = {\n"
-           "        name: typeof message.name === 'string' ? message.name : '',\n"
-           "        text: typeof message.text === 'string' ? message.text : ''\n"
-           "      };\n"
-           "      transcriptMessages.push(entry);\n"
-           "    }\n"
-          "    function extractPlainText(html) {\n"
-          "      if (!html) {\n"
-          "        return '';\n"
-          "      }\n"
-          "      const temp = document.createElement('div');\n"
-          "      temp.innerHTML = html;\n"
-          "      const text = temp.textContent || temp.innerText || '';\n"
-          "      return text.replace(/\\s+/g, ' ').trim();\n"
-          "    }\n"
-          "    function selectSentenceSnippet(html, maxLength) {\n"
-          "      const plain = extractPlainText(html);\n"
-          "      if (!plain) {\n"
-          "        return '';\n"
-          "      }\n"
-          "      const sentenceMatch = plain.match(/[^.!?]+[.!?]?/);\n"
-          "      let sentence = sentenceMatch ? sentenceMatch[0].trim() : plain.trim();\n"
-          "      const limit = Number.isFinite(maxLength) && maxLength > 0 ? maxLength : 160;\n"
-          "      if (sentence.length > limit) {\n"
-          "        sentence = `${sentence.slice(0, limit - 3).replace(/\\s+$/g, '')}…`;\n"
-          "      }\n"
-          "      return sentence;\n"
-          "    }\n"
-          "    function formatParticipantSubject(names) {\n"
-          "      if (!Array.isArray(names) || names.length === 0) {\n"
-          "        return 'The participants';\n"
-          "      }\n"
-          "      if (names.length === 1) {\n"
-          "        return names[0];\n"
-          "      }\n"
-          "      if (names.length === 2) {\n"
-          "        return `${names[0]} and ${names[1]}`;\n"
-          "      }\n"
-          "      const allButLast = names.slice(0, -1).join(', ');\n"
-          "      const last = names[names.length - 1];\n"
-          "      return `${allButLast}, and ${last}`;\n"
-          "    }\n"
-          "    function resolveTopicSummary() {\n"
-          "      const trimmedTopic = typeof currentTopic === 'string' ? currentTopic.trim() : '';\n"
-          "      const isoDateTime = /^\\d{4}-\\d{2}-\\d{2}T\\d{2}:\\d{2}:\\d{2}(?:\\.\\d+)?Z$/i;\n"
-          "      const isoDateOnly = /^\\d{4}-\\d{2}-\\d{2}$/;\n"
-          "      if (trimmedTopic && !isoDateTime.test(trimmedTopic) && !isoDateOnly.test(trimmedTopic)) {\n"
-          "        return { text: trimmedTopic, derived: false };\n"
-          "      }\n"
-          "      for (const entry of transcriptMessages) {\n"
-          "        const snippet = selectSentenceSnippet(entry && entry.text, 120);\n"
-          "        if (snippet) {\n"
-          "          return { text: snippet, derived: true };\n"
-          "        }\n"
-          "      }\n"
-          "      return { text: 'their discussion', derived: true };\n"
-          "    }\n"
-          "    function summariseDiscussionIfNeeded() {\n"
-           "      if (summaryAppended || transcriptMessages.length === 0) {\n"
-           "        return;\n"
-           "      }\n"
-           "      const participantsList = Array.isArray(currentParticipants) ? currentParticipants : [];\n"
-          "      const participantNames = participantsList\n"
-          "        .map((participant) => (participant && participant.name ? participant.name : ''))\n"
-          "        .filter((name) => name);\n"
-          "      const subject = formatParticipantSubject(participantNames);\n"
-          "      const topicSummary = resolveTopicSummary();\n"
-           "      const turnsValue = Number.isFinite(currentTurns) && currentTurns > 0 ? currentTurns : transcriptMessages.length;\n"
-           "      const turnsText = turnsValue === 1 ? '1 turn' : `${turnsValue} turns`;\n"
-           "      const latestByParticipant = new Map();\n"
-           "      transcriptMessages.forEach((entry) => {\n"
-           "        if (entry.name) {\n"
-           "          latestByParticipant.set(entry.name, entry.text || '');\n"
-           "        }\n"
-           "      });\n"
-           "      const highlightSnippets = [];\n"
-          "      latestByParticipant.forEach((text, name) => {\n"
-          "        const sentence = selectSentenceSnippet(text, 160);\n"
-          "        if (sentence) {\n"
-          "          highlightSnippets.push(`${name}: ${sentence}`);\n"
-          "        }\n"
-          "      });\n"
-          "      const highlightsText = highlightSnippets.length ? ` Highlights — ${highlightSnippets.join(' | ')}` : '';\n"
-          "      let summaryBody = '';\n"
-          "      if (!topicSummary.text) {\n"
-          "        summaryBody = `${subject} chatted over ${turnsText}.`;\n"
-          "      } else if (topicSummary.text === 'their discussion') {\n"
-          "        summaryBody = `${subject} shared their thoughts over ${turnsText}.`;\n"
-          "      } else if (topicSummary.derived) {\n"
-          "        summaryBody = `${subject} explored ${topicSummary.text} over ${turnsText}.`;\n"
-          "      } else {\n"
-          "        summaryBody = `${subject} discussed \"${topicSummary.text}\" over ${turnsText}.`;\n"
-          "      }\n"
-          "      summaryBody += highlightsText;\n"
-          "      appendMessage({\n"
-           "        participantIndex: -1,\n"
-           "        name: 'Summary',\n"
-           "        model: '',\n"
-           "        displayModel: '',\n"
-           "        text: `<p>${summaryBody}</p>`,\n"
-           "        isSummary: true\n"
-           "      });\n"
-           "      summaryAppended = true;\n"
-           "    }\n"
-           "    function updateParticipantCardThemes() {\n"
-          "      const cards = Array.from(participantsEl.querySelectorAll('.participant'));\n"
-          "      cards.forEach((card, index) => {\n"
-          "        const palette = getPaletteForIndex(index);\n"
-          "        card.style.setProperty('--participant-border', palette.border);\n"
-          "        card.style.setProperty('--participant-pattern', palette.cardPattern || 'rgba(59, 130, 246, 0.25)');\n"
-          "        card.style.setProperty('--participant-surface', palette.cardBackground);\n"
-          "        card.style.setProperty('--participant-glow', palette.glow || 'rgba(59, 130, 246, 0.35)');\n"
-          "        card.style.setProperty('--participant-highlight', palette.border || 'rgba(148, 163, 184, 0.8)');\n"
-          "      });\n"
-          "    }\n"
-           "    function appendMessage(message) {\n"
-           "      if (!message || typeof message !== 'object') {\n"
-           "        return;\n"
-           "      }\n"
-           "      const item = document.createElement('div');\n"
-           "      item.className = 'message message-enter';\n"
-           "      if (message.isSummary) {\n"
-           "        item.classList.add('message-summary');\n"
-           "      }\n"
-           "      const paletteIndex = Number.isFinite(message.participantIndex) && message.participantIndex >= 0\n"
-           "        ? message.participantIndex\n"
-           "        : 0;\n"
-           "      const paletteEntry = participantStyles.get(paletteIndex);\n"
-           "      const palette = paletteEntry || getPaletteForIndex(paletteIndex);\n"
-           "      item.style.setProperty('--message-bg', palette.messageBackground);\n"
-           "      item.style.setProperty('--message-border', palette.border);\n"
-           "      item.style.setProperty('--message-glow', palette.glow || 'rgba(59, 130, 246, 0.35)');\n"
-          "      const displayModel = (message.displayModel && typeof message.displayModel === 'string') ? message.displayModel : '';\n"
-           "      const canonicalModel = (message.model && typeof message.model === 'string') ? message.model : '';\n"
-           "      let modelLabel = displayModel;\n"
-           "      if (displayModel && canonicalModel && displayModel !== canonicalModel) {\n"
-           "        modelLabel = `${displayModel} (${canonicalModel})`;\n"
-           "      } else if (!modelLabel && canonicalModel) {\n"
-           "        modelLabel = canonicalModel;\n"
-           "      }\n"
-           "      const header = modelLabel\n"
-           "        ? `<strong>${message.name} <span style=\"color:#94a3b8; font-weight:400;\">(${modelLabel})</span></strong>`\n"
-           "        : `<strong>${message.name}</strong>`;\n"
-           "      item.innerHTML = `${header}${message.text}`;\n"
-          "      messagesEl.appendChild(item);\n"
-          "      recordTranscriptMessage(message);\n"
-          "      item.addEventListener('animationend', (event) => {\n"
-          "        if (event.animationName === 'messagePulse') {\n"
-          "          item.classList.remove('message-enter');\n"
-          "        }\n"
-          "      });\n"
-          "      requestAnimationFrame(() => {\n"
-          "        requestAnimationFrame(() => {\n"
-          "          item.classList.add('is-visible');\n"
-          "        });\n"
-          "      });\n"
-          "      transcriptEl.style.display = 'block';\n"
-          "      transcriptEl.scrollTop = transcriptEl.scrollHeight;\n"
-          "    }\n"
-          "    function populateModelOptions(select, selectedModel) {\n"
-          "      const datasetValue = (select.dataset.desiredModel || '').trim();\n"
-          "      const datasetDisplay = (select.dataset.displayModel || '').trim();\n"
-          "      const providedValue = (selectedModel && typeof selectedModel === 'string') ? selectedModel.trim() : '';\n"
-          "      const currentValue = (select.value && typeof select.value === 'string') ? select.value.trim() : '';\n"
-          "      const requestedValue = providedValue || datasetValue || currentValue;\n"
-          "      const requestedDisplay = datasetDisplay || requestedValue;\n"
-          "      const suggestedValue = (select.dataset.suggestedModel || '').trim();\n"
-          "      select.innerHTML = '';\n"
-          "      const placeholder = document.createElement('option');\n"
-          "      placeholder.value = '';\n"
-          "      placeholder.textContent = modelLoadError\n"
-           "        ? 'Unable to load models'\n"
-           "        : (availableModels.length ? 'Select a model' : 'Loading models...');\n"
-           "      placeholder.disabled = availableModels.length > 0;\n"
-           "      select.appendChild(placeholder);\n"
-           "      let hasMatch = false;\n"
-           "      let matchedDisplay = '';\n"
-           "      availableModels.forEach((item) => {\n"
-           "        const option = document.createElement('option');\n"
-           "        const canonical = item && typeof item.model === 'string' ? item.model : '';\n"
-           "        const alias = item && typeof item.name === 'string' && item.name ? item.name : canonical;\n"
-           "        option.value = canonical;\n"
-           "        option.dataset.canonicalModel = canonical;\n"
-           "        option.dataset.displayModel = alias;\n"
-           "        option.textContent = alias && canonical && alias !== canonical\n"
-           "          ? `${alias} (${canonical})`\n"
-           "          : (alias || canonical || '');\n"
-           "        if ((canonical && canonical === requestedValue) || (!canonical && alias === requestedValue) || (!hasMatch && alias === requestedValue)) {\n"
-           "          option.selected = true;\n"
-           "          hasMatch = true;\n"
-           "          matchedDisplay = alias || canonical;\n"
-           "        }\n"
-           "        select.appendChild(option);\n"
-           "      });\n"
-          "      if (availableModels.length === 0) {\n"
-          "        placeholder.selected = true;\n"
-          "        if (requestedValue) {\n"
-          "          select.dataset.desiredModel = requestedValue;\n"
-          "        } else {\n"
-           "          delete select.dataset.desiredModel;\n"
-           "        }\n"
-           "        if (requestedDisplay) {\n"
-           "          select.dataset.displayModel = requestedDisplay;\n"
-           "        } else {\n"
-           "          delete select.dataset.displayModel;\n"
-           "        }\n"
-          "      } else if (hasMatch) {\n"
-          "        select.dataset.desiredModel = requestedValue;\n"
-          "        select.dataset.displayModel = matchedDisplay || requestedDisplay || requestedValue;\n"
-          "        if (requestedValue && suggestedValue === requestedValue) {\n"
-          "          delete select.dataset.suggestedModel;\n"
-          "        }\n"
-          "      } else {\n"
-          "        placeholder.selected = true;\n"
-          "        if (requestedValue && !missingModelWarning && requestedValue !== suggestedValue) {\n"
-          "          missingModelWarning = true;\n"
-          "          if (!statusEl.textContent) {\n"
-          "            setStatus('A previously selected model is no longer available.');\n"
-          "          }\n"
-           "        }\n"
-           "        if (requestedValue) {\n"
-           "          select.dataset.desiredModel = requestedValue;\n"
-           "        } else {\n"
-           "          delete select.dataset.desiredModel;\n"
-           "        }\n"
-           "        if (requestedDisplay) {\n"
-           "          select.dataset.displayModel = requestedDisplay;\n"
-           "        } else {\n"
-           "          delete select.dataset.displayModel;\n"
-           "        }\n"
-           "      }\n"
-           "    }\n"
-          "    function registerModelSelect(select, selectedModel, isSuggestion) {\n"
-          "      const suggestion = Boolean(isSuggestion && selectedModel);\n"
-          "      if (selectedModel) {\n"
-          "        select.dataset.desiredModel = selectedModel;\n"
-          "        if (!select.dataset.displayModel) {\n"
-          "          select.dataset.displayModel = selectedModel;\n"
-          "        }\n"
-          "        if (suggestion) {\n"
-          "          select.dataset.suggestedModel = selectedModel;\n"
-          "        } else {\n"
-          "          delete select.dataset.suggestedModel;\n"
-          "        }\n"
-          "      } else {\n"
-          "        delete select.dataset.desiredModel;\n"
-          "        delete select.dataset.displayModel;\n"
-          "        delete select.dataset.suggestedModel;\n"
-          "      }\n"
-          "      select.addEventListener('change', () => {\n"
-          "        if (select.value) {\n"
-          "          select.dataset.desiredModel = select.value;\n"
-           "        } else {\n"
-           "          delete select.dataset.desiredModel;\n"
-           "        }\n"
-           "        const currentOption = select.options[select.selectedIndex];\n"
-           "        if (currentOption && currentOption.dataset && currentOption.dataset.displayModel) {\n"
-           "          select.dataset.displayModel = currentOption.dataset.displayModel;\n"
-           "        } else if (select.value) {\n"
-           "          select.dataset.displayModel = select.value;\n"
-          "        } else {\n"
-          "          delete select.dataset.displayModel;\n"
-          "        }\n"
-          "        delete select.dataset.suggestedModel;\n"
-          "        if (statusEl.textContent === 'A previously selected model is no longer available.') {\n"
-          "          setStatus('');\n"
-          "        }\n"
-          "      });\n"
-          "      modelSelects.add(select);\n"
-          "      populateModelOptions(select, selectedModel);\n"
-          "    }\n"
-           "    function unregisterModelSelect(select) {\n"
-            "      modelSelects.delete(select);\n"
-            "    }\n"
-            "    function refreshModelSelects() {\n"
-            "      modelSelects.forEach((select) => {\n"
-           "        const desired = select.dataset.desiredModel || select.value;\n"
-           "        populateModelOptions(select, desired);\n"
-            "      });\n"
-            "    }\n"
-           "    async function loadModels() {\n"
-           "      missingModelWarning = false;\n"
-          "      if (statusEl.textContent === 'A previously selected model is no longer available.') {\n"
-          "        setStatus('');\n"
-          "      }\n"
-           "      try {\n"
-           "        const response = await fetch('/models');\n"
-           "        if (!response.ok) {\n"
-           "          throw new Error('Request failed');\n"
-           "        }\n"
-           "        const payload = await response.json();\n"
-           "        availableModels = Array.isArray(payload.models) ? payload.models : [];\n"
-           "        modelLoadError = false;\n"
-          "        if (availableModels.length && statusEl.textContent === 'Unable to load models from Ollama.') {\n"
-          "          setStatus('');\n"
-          "        }\n"
-           "      } catch (error) {\n"
-           "        availableModels = [];\n"
-           "        modelLoadError = true;\n"
-          "        if (!statusEl.textContent) {\n"
-          "          setStatus('Unable to load models from Ollama.');\n"
-          "        }\n"
-           "      }\n"
-           "      refreshModelSelects();\n"
-           "    }\n"
-          "    function createParticipant(name, model, isSuggestion) {\n"
-          "      const wrapper = document.createElement('div');\n"
-          "      wrapper.className = 'participant';\n"
-          "      wrapper.innerHTML = `\n"
-          "        <label>Friendly name</label>\n"
-          "        <input name=\"name\" placeholder=\"Astra\" value=\"${name || ''}\" />\n"
-          "        <label>Ollama model</label>\n"
-          "        <select name=\"model\"></select>\n"
-          "        <button type=\"button\" class=\"remove\">Remove</button>\n"
-          "      `;\n"
-          "      const select = wrapper.querySelector('select[name=\"model\"]');\n"
-          "      registerModelSelect(select, model || '', isSuggestion);\n"
-          "      wrapper.querySelector('.remove').addEventListener('click', () => {\n"
-          "        unregisterModelSelect(select);\n"
-          "        participantsEl.removeChild(wrapper);\n"
-          "        updateParticipantCardThemes();\n"
-          "      });\n"
-           "      participantsEl.appendChild(wrapper);\n"
-           "      updateParticipantCardThemes();\n"
-           "    }\n"
-          "    document.getElementById('addParticipant').addEventListener('click', (event) => {\n"
-          "      event.preventDefault();\n"
-          "      createParticipant('', '', false);\n"
-          "    });\n"
-           "    document.getElementById('start').addEventListener('click', async (event) => {\n"
-           "      event.preventDefault();\n"
-          "      setStatus('');\n"
-           "      messagesEl.innerHTML = '';\n"
-           "      participantStyles.clear();\n"
-           "      transcriptEl.style.display = 'none';\n"
-           "      const topic = document.getElementById('topic').value.trim();\n"
-           "      const turns = parseInt(document.getElementById('turns').value, 10);\n"
-           "      const participantDivs = participantsEl.querySelectorAll('.participant');\n"
-           "      const participants = [];\n"
-           "      participantDivs.forEach((div, index) => {\n"
-           "        const name = div.querySelector('input[name=\"name\"]').value.trim();\n"
-           "        const selectEl = div.querySelector('select[name=\"model\"]');\n"
-           "        const rawValue = (selectEl && typeof selectEl.value === 'string') ? selectEl.value.trim() : '';\n"
-           "        const selectedOption = selectEl ? selectEl.options[selectEl.selectedIndex] : null;\n"
-           "        const optionDisplay = (selectedOption && selectedOption.dataset && typeof selectedOption.dataset.displayModel === 'string')\n"
-           "          ? selectedOption.dataset.displayModel.trim()\n"
-           "          : '';\n"
-           "        const optionCanonical = (selectedOption && selectedOption.dataset && typeof selectedOption.dataset.canonicalModel === 'string')\n"
-           "          ? selectedOption.dataset.canonicalModel.trim()\n"
-           "          : '';\n"
-           "        const datasetDisplay = (selectEl && selectEl.dataset && typeof selectEl.dataset.displayModel === 'string')\n"
-           "          ? selectEl.dataset.displayModel.trim()\n"
-           "          : '';\n"
-           "        const canonicalValue = optionCanonical || rawValue;\n"
-           "        const displayValue = optionDisplay || datasetDisplay || canonicalValue;\n"
-           "        if (canonicalValue) {\n"
-           "          participants.push({\n"
-           "            name: name || `Companion ${index + 1}`,\n"
-           "            model: canonicalValue,\n"
-           "            displayModel: displayValue\n"
-           "          });\n"
-           "        }\n"
-           "      });\n"
-          "      if (!topic) {\n"
-          "        setStatus('Please provide a topic.');\n"
-          "        return;\n"
-          "      }\n"
-          "      if (Number.isNaN(turns) || turns < 1) {\n"
-          "        setStatus('Please provide a valid number of turns.');\n"
-          "        return;\n"
-          "      }\n"
-          "      if (participants.length === 0) {\n"
-          "        setStatus('Add at least one participant with a model selected.');\n"
-          "        return;\n"
-          "      }\n"
-          "      resetTranscriptState(topic, turns, participants);\n"
-          "      setStatus('Starting conversation...');\n"
-           "      try {\n"
-           "        const response = await fetch('/chat', {\n"
-           "          method: 'POST',\n"
-           "          headers: { 'Content-Type': 'application/json' },\n"
-           "          body: JSON.stringify({ topic, turns, participants })\n"
-           "        });\n"
-          "        if (!response.ok) {\n"
-          "          let payload = null;\n"
-          "          try {\n"
-          "            payload = await response.json();\n"
-          "          } catch (parseError) {\n"
-          "            // ignore JSON parse errors\n"
-          "          }\n"
-          "          const errorText = payload && typeof payload.error === 'string' && payload.error\n"
-          "            ? payload.error\n"
-          "            : 'The conversation failed.';\n"
-          "          setStatus(errorText);\n"
-          "          return;\n"
-          "        }\n"
-          "        const reader = response.body && response.body.getReader ? response.body.getReader() : null;\n"
-          "        if (!reader) {\n"
-          "          setStatus('Streaming is not supported by this browser.');\n"
-          "          return;\n"
-          "        }\n"
-          "        setStatus('Waiting for responses...');\n"
-           "        transcriptEl.style.display = 'block';\n"
-           "        const decoder = new TextDecoder();\n"
-           "        let buffer = '';\n"
-           "        let stopStreaming = false;\n"
-           "        let encounteredError = false;\n"
-           "        while (!stopStreaming) {\n"
-           "          const { value, done } = await reader.read();\n"
-           "          if (done) {\n"
-           "            break;\n"
-           "          }\n"
-           "          buffer += decoder.decode(value, { stream: true });\n"
-           "          const lines = buffer.split('\\n');\n"
-           "          buffer = lines.pop();\n"
-           "          for (const line of lines) {\n"
-           "            const trimmed = line.trim();\n"
-           "            if (!trimmed) {\n"
-           "              continue;\n"
-           "            }\n"
-           "            let eventPayload;\n"
-           "            try {\n"
-           "              eventPayload = JSON.parse(trimmed);\n"
-           "            } catch (parseError) {\n"
-           "              continue;\n"
-           "            }\n"
-          "            if (eventPayload.type === 'start') {\n"
-          "              const participantsList = Array.isArray(eventPayload.participants) ? eventPayload.participants : [];\n"
-          "              assignParticipantStyles(participantsList);\n"
-          "              currentParticipants = normaliseParticipants(participantsList);\n"
-          "              if (typeof eventPayload.topic === 'string') {\n"
-          "                currentTopic = eventPayload.topic;\n"
-          "              }\n"
-          "              if (Number.isFinite(eventPayload.turns)) {\n"
-          "                currentTurns = eventPayload.turns;\n"
-          "              }\n"
-          "              setStatus('Conversation in progress...');\n"
-          "            } else if (eventPayload.type === 'message' && eventPayload.message) {\n"
-          "              appendMessage(eventPayload.message);\n"
-          "              setStatus(`Responding: ${eventPayload.message.name}`);\n"
-          "            } else if (eventPayload.type === 'error') {\n"
-          "              const errorMessage = eventPayload.message && typeof eventPayload.message === 'string' && eventPayload.message\n"
-          "                ? eventPayload.message\n"
-          "                : 'The conversation failed.';\n"
-          "              encounteredError = true;\n"
-          "              setStatus(errorMessage);\n"
-          "              stopStreaming = true;\n"
-          "              break;\n"
-          "            } else if (eventPayload.type === 'complete') {\n"
-          "              if (typeof eventPayload.topic === 'string') {\n"
-          "                currentTopic = eventPayload.topic;\n"
-          "              }\n"
-          "              if (Number.isFinite(eventPayload.turns)) {\n"
-          "                currentTurns = eventPayload.turns;\n"
-          "              }\n"
-          "              summariseDiscussionIfNeeded();\n"
-          "              setStatus('Conversation complete.');\n"
-          "              stopStreaming = true;\n"
-          "              break;\n"
-          "            }\n"
-           "          }\n"
-           "          if (stopStreaming) {\n"
-           "            await reader.cancel().catch(() => {});\n"
-           "            break;\n"
-           "          }\n"
-           "        }\n"
-           "        if (!stopStreaming) {\n"
-           "          buffer += decoder.decode();\n"
-           "          const trimmed = buffer.trim();\n"
-          "          if (trimmed) {\n"
-          "            try {\n"
-          "              const eventPayload = JSON.parse(trimmed);\n"
-          "              if (eventPayload.type === 'error') {\n"
-          "                const errorMessage = eventPayload.message && typeof eventPayload.message === 'string' && eventPayload.message\n"
-          "                  ? eventPayload.message\n"
-          "                  : 'The conversation failed.';\n"
-          "                encounteredError = true;\n"
-          "                setStatus(errorMessage);\n"
-          "              } else if (eventPayload.type === 'complete') {\n"
-          "                if (typeof eventPayload.topic === 'string') {\n"
-          "                  currentTopic = eventPayload.topic;\n"
-          "                }\n"
-          "                if (Number.isFinite(eventPayload.turns)) {\n"
-          "                  currentTurns = eventPayload.turns;\n"
-          "                }\n"
-          "                summariseDiscussionIfNeeded();\n"
-          "                setStatus('Conversation complete.');\n"
-          "              }\n"
-          "            } catch (parseError) {\n"
-           "              // ignore trailing parse issues\n"
-           "            }\n"
-           "          }\n"
-           "        }\n"
-           "        if (!encounteredError) {\n"
-           "          summariseDiscussionIfNeeded();\n"
-           "        }\n"
-          "      } catch (error) {\n"
-          "        setStatus('Unable to reach the aiChat server.');\n"
-          "      }\n"
-           "    });\n"
-          "    createParticipant('Astra', 'gemma:2b', true);\n"
-          "    createParticipant('Nova', 'llama3:8b', true);\n"
-          "    loadModels();\n"
-           "  </script>\n"
-           "</body>\n"
-           "</html>\n";
-}
-
-static int parse_int_header(const char *headers, const char *key) {
-    const char *location = strcasestr(headers, key);
-    if (!location) {
-        return -1;
-    }
-    location += strlen(key);
-    while (*location && isspace((unsigned char)*location)) {
-        location++;
-    }
-    return atoi(location);
-}
-
-static int read_http_request(int client_fd, char **out_request, size_t *out_length) {
-    size_t capacity = READ_BUFFER_CHUNK;
-    size_t length = 0;
-    char *buffer = malloc(capacity);
-    if (!buffer) {
-        return -1;
-    }
+/* Answers buffered requests in order for as long as each response completes straight away. Called at
+ * the top level after every event on the connection, never from inside a response's own callbacks. */
+static void event_serve_pending(struct EventConnection *conn) {
+    while (!conn->dead) {
+        int rc = 0;
 
-    while (1) {
-        ssize_t bytes = recv(client_fd, buffer + length, capacity - length, 0);
-        if (bytes <= 0) {
-            free(buffer);
-            return -1;
+        if (conn->response_sent) {
+            event_finish_response(conn);
         }
-        length += (size_t)bytes;
-
-        char *header_end = memmem(buffer, length, "\r\n\r\n", 4);
-        if (header_end) {
-            size_t header_length = (size_t)(header_end - buffer) + 4;
-            int content_length = parse_int_header(buffer, "Content-Length:");
-            size_t total_length = header_length + (content_length > 0 ? (size_t)content_length : 0);
-            while (length < total_length) {
-                if (length == capacity) {
-                    capacity *= 2;
-                    char *tmp = realloc(buffer, capacity);
-                    if (!tmp) {
-                        free(buffer);
-                        return -1;
-                    }
-                    buffer = tmp;
-                }
-                bytes = recv(client_fd, buffer + length, capacity - length, 0);
-                if (bytes <= 0) {
-                    free(buffer);
-                    return -1;
-                }
-                length += (size_t)bytes;
-            }
-            *out_request = buffer;
-            *out_length = length;
-            return 0;
+        if (conn->busy) {
+            return;
         }
 
-        if (length == capacity) {
-            capacity *= 2;
-            char *tmp = realloc(buffer, capacity);
-            if (!tmp) {
-                free(buffer);
-                return -1;
+        rc = http_request_feed(&conn->request, conn->in.data, conn->in.length);
+        if (rc < 0) {
+            conn->requests++;
+            conn->busy = 1;
+            conn->keep_alive = 0;
+            conn->deadline_ms = 0;
+            event_respond_error(conn, conn->request.error_status, conn->request.error_message);
+            return;
+        }
+        if (rc == 0 && conn->read_closed) {
+            /* Nothing more will arrive: close once idle, refusing a request that was cut short. */
+            if (conn->in.length == 0) {
+                conn->dead = 1;
+                return;
+            }
+            conn->requests++;
+            conn->busy = 1;
+            conn->keep_alive = 0;
+            conn->deadline_ms = 0;
+            event_respond_error(conn, "400 Bad Request", "Unable to read request.");
+            return;
+        }
+        if (rc == 0) {
+            if (conn->request.expect_continue) {
+                conn->request.expect_continue = 0;
+                event_queue(conn, conn->out.length, text_buffer_append(&conn->out, http_continue_response,
+                                                     sizeof(http_continue_response) - 1));
             }
-            buffer = tmp;
+            return;
         }
+
+        event_dispatch_request(conn);
+        text_buffer_consume(&conn->in, conn->request.scan);
+        http_request_reset(&conn->request);
     }
 }
 
-static void handle_chat_request(int client_fd, const char *body, size_t body_length, const char *ollama_url) {
+static void event_handle_transfer_done(struct EventLoop *loop, CURL *easy, CURLcode result) {
+    struct EventConnection *conn = NULL;
+    struct CatalogueSnapshot *catalogue = NULL;
     json_object *payload = NULL;
-    json_object *topic_obj = NULL;
-    json_object *turns_obj = NULL;
-    json_object *participants_obj = NULL;
-    const char *topic = NULL;
-    int turns = 0;
-    struct Participant participants[MAX_PARTICIPANTS];
-    size_t participant_count = 0;
-    json_object *result = NULL;
     char *error_message = NULL;
 
-    memset(participants, 0, sizeof(participants));
-    struct json_tokener *tok = json_tokener_new();
-    if (!tok) {
-        send_http_error(client_fd, "500 Internal Server Error", "Unable to initialise JSON parser.");
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&conn);
+    curl_multi_remove_handle(loop->multi, easy);
+    if (!conn) {
         return;
     }
 
-    payload = json_tokener_parse_ex(tok, body, (int)body_length);
-    if (json_tokener_get_error(tok) != json_tokener_success || !payload) {
-        json_tokener_free(tok);
-        send_http_error(client_fd, "400 Bad Request", "Invalid JSON payload.");
-        return;
+    switch (conn->transfer) {
+    case EVENT_TRANSFER_MODELS:
+        if (result == CURLE_OK &&
+            parse_models_response(conn->transfer_body.memory, &payload, &error_message) == 0 && payload) {
+            catalogue_install(payload);
+            event_respond(conn, "200 OK", "application/json",
+                          json_object_to_json_string_ext(payload, JSON_C_TO_STRING_PLAIN));
+            json_object_put(payload);
+        } else {
+            event_respond_error(conn, "502 Bad Gateway",
+                                error_message ? error_message : "Failed to contact Ollama for model list.");
+        }
+        free(error_message);
+        event_release_models_transfer(conn);
+        break;
+    case EVENT_TRANSFER_LOOKUP:
+        if (result == CURLE_OK &&
+            parse_models_response(conn->transfer_body.memory, &payload, &error_message) == 0 && payload) {
+            catalogue_install(payload);
+            json_object_put(payload);
+        }
+        free(error_message);
+        event_release_models_transfer(conn);
+        catalogue = catalogue_peek(loop->ollama_url);
+        ensure_participant_display_models(conn->chat.participants, conn->chat.participant_count, catalogue);
+        catalogue_release(catalogue);
+        if (!conn->dead) {
+            event_begin_conversation(conn);
+        }
+        break;
+    case EVENT_TRANSFER_TURN:
+        if (!conversation_settle_race(&conn->conv, loop->multi, easy, &result)) {
+            break;
+        }
+        conn->transfer = EVENT_TRANSFER_NONE;
+        if (conn->dead) {
+            break;
+        }
+        switch (conversation_finish_turn(&conn->conv, result)) {
+        case TURN_CONTINUE:
+            event_start_turn(conn);
+            break;
+        case TURN_COMPLETE:
+            event_end_stream(conn, NULL);
+            break;
+        case TURN_FAILED:
+            event_end_stream(conn, conn->conv.error ? conn->conv.error : "Conversation failed.");
+            break;
+        }
+        break;
+    case EVENT_TRANSFER_QUEUED:
+    case EVENT_TRANSFER_NONE:
+        break;
     }
-    json_tokener_free(tok);
+    event_serve_pending(conn);
+}
 
-    if (!json_object_object_get_ex(payload, "topic", &topic_obj) ||
-        json_object_get_type(topic_obj) != json_type_string) {
-        json_object_put(payload);
-        send_http_error(client_fd, "400 Bad Request", "Field 'topic' is required.");
-        return;
-    }
-    topic = json_object_get_string(topic_obj);
+static void event_check_transfers(struct EventLoop *loop) {
+    CURLMsg *msg = NULL;
+    int pending = 0;
 
-    if (!json_object_object_get_ex(payload, "turns", &turns_obj)) {
-        json_object_put(payload);
-        send_http_error(client_fd, "400 Bad Request", "Field 'turns' is required.");
-        return;
-    }
-    turns = json_object_get_int(turns_obj);
-    if (turns < MIN_TURNS) {
-        turns = MIN_TURNS;
-    }
-    if (turns > MAX_TURNS) {
-        turns = MAX_TURNS;
+    while ((msg = curl_multi_info_read(loop->multi, &pending)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+            event_handle_transfer_done(loop, msg->easy_handle, msg->data.result);
+        }
     }
+}
 
-    if (!json_object_object_get_ex(payload, "participants", &participants_obj) ||
-        json_object_get_type(participants_obj) != json_type_array) {
-        json_object_put(payload);
-        send_http_error(client_fd, "400 Bad Request", "Field 'participants' must be an array.");
-        return;
+static int event_curl_socket_callback(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp) {
+    struct EventLoop *loop = (struct EventLoop *)userp;
+    struct CurlSocket *sock = (struct CurlSocket *)socketp;
+    struct epoll_event ev;
+    int op = EPOLL_CTL_MOD;
+
+    (void)easy;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (sock) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            curl_multi_assign(loop->multi, fd, NULL);
+            sock->source.fd = -1;
+            sock->next_retired = loop->retired_sockets;
+            loop->retired_sockets = sock;
+        }
+        return 0;
     }
 
-    size_t array_len = json_object_array_length(participants_obj);
-    if (array_len == 0) {
-        json_object_put(payload);
-        send_http_error(client_fd, "400 Bad Request", "Provide at least one participant.");
-        return;
+    if (!sock) {
+        sock = calloc(1, sizeof(*sock));
+        if (!sock) {
+            return -1;
+        }
+        sock->source.kind = EVENT_SOURCE_CURL;
+        sock->source.fd = fd;
+        curl_multi_assign(loop->multi, fd, sock);
+        op = EPOLL_CTL_ADD;
     }
-    if (array_len > MAX_PARTICIPANTS) {
-        array_len = MAX_PARTICIPANTS;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    ev.data.ptr = &sock->source;
+    if (epoll_ctl(loop->epoll_fd, op, fd, &ev) != 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
     }
+    return 0;
+}
 
-    for (size_t i = 0; i < array_len; ++i) {
-        json_object *item = json_object_array_get_idx(participants_obj, i);
-        json_object *name_obj = NULL;
-        json_object *model_obj = NULL;
-        json_object *display_obj = NULL;
-        const char *name = NULL;
-        const char *model = NULL;
-        const char *display = NULL;
+static int event_curl_timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+    struct EventLoop *loop = (struct EventLoop *)userp;
 
-        if (!item || json_object_get_type(item) != json_type_object) {
-            continue;
-        }
+    (void)multi;
+    loop->curl_deadline_ms = timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+    return 0;
+}
 
-        if (json_object_object_get_ex(item, "model", &model_obj) &&
-            json_object_get_type(model_obj) == json_type_string) {
-            model = json_object_get_string(model_obj);
-        }
-        if (!model || !*model) {
-            continue;
-        }
+static void event_accept_clients(struct EventLoop *loop) {
+    while (1) {
+        struct EventConnection *conn = NULL;
+        struct epoll_event ev;
+        int client_fd = accept4(loop->listener.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-        if (json_object_object_get_ex(item, "displayModel", &display_obj) &&
-            json_object_get_type(display_obj) == json_type_string && json_object_get_string_len(display_obj) > 0) {
-            display = json_object_get_string(display_obj);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept4");
+            }
+            return;
         }
 
-        if (json_object_object_get_ex(item, "name", &name_obj) &&
-            json_object_get_type(name_obj) == json_type_string && json_object_get_string_len(name_obj) > 0) {
-            name = json_object_get_string(name_obj);
+        conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(client_fd);
+            continue;
         }
-        if (!name || !*name) {
-            static const char *fallback_names[] = {"Astra", "Nova", "Cosmo", "Lyric", "Echo", "Muse"};
-            size_t fallback_idx = participant_count < (sizeof(fallback_names) / sizeof(fallback_names[0]))
-                                      ? participant_count
-                                      : participant_count % (sizeof(fallback_names) / sizeof(fallback_names[0]));
-            name = fallback_names[fallback_idx];
+        configure_client_socket(client_fd);
+        conn->source.kind = EVENT_SOURCE_CLIENT;
+        conn->source.fd = client_fd;
+        conn->loop = loop;
+        conn->interest = EPOLLIN | EPOLLRDHUP;
+        if (read_timeout > 0) {
+            conn->deadline_ms = monotonic_ms() + read_timeout * 1000LL;
         }
 
-        strncpy(participants[participant_count].name, name, MAX_NAME_LENGTH - 1);
-        participants[participant_count].name[MAX_NAME_LENGTH - 1] = '\0';
-        strncpy(participants[participant_count].model, model, MAX_MODEL_LENGTH - 1);
-        participants[participant_count].model[MAX_MODEL_LENGTH - 1] = '\0';
-        if (display && *display) {
-            strncpy(participants[participant_count].display_model, display, MAX_MODEL_LENGTH - 1);
-            participants[participant_count].display_model[MAX_MODEL_LENGTH - 1] = '\0';
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->interest;
+        ev.data.ptr = &conn->source;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+            close(client_fd);
+            free(conn);
+            continue;
         }
-        participant_count++;
+
+        conn->next = loop->connections;
+        loop->connections = conn;
     }
+}
 
-    json_object_put(payload);
+static void event_close_connection(struct EventConnection *conn) {
+    struct EventLoop *loop = conn->loop;
 
-    int needs_lookup = 0;
-    for (size_t i = 0; i < participant_count; ++i) {
-        if (participants[i].display_model[0] == '\0') {
-            needs_lookup = 1;
-            break;
+    if (conn->transfer == EVENT_TRANSFER_QUEUED) {
+        conversation_note_abandoned(&conn->conv, NULL);
+    }
+    if (conn->transfer == EVENT_TRANSFER_TURN) {
+        CURL *in_flight = conn->conv.request.curl ? conn->conv.request.curl : conn->conv.hedge.curl;
+        if (in_flight) {
+            conversation_note_abandoned(&conn->conv, in_flight);
+        }
+        if (conn->conv.request.curl) {
+            curl_multi_remove_handle(loop->multi, conn->conv.request.curl);
+        }
+        if (conn->conv.hedge.curl) {
+            curl_multi_remove_handle(loop->multi, conn->conv.hedge.curl);
         }
     }
-
-    json_object *models_payload = NULL;
-    if (needs_lookup && fetch_available_models(ollama_url, &models_payload, NULL) != 0) {
-        models_payload = NULL;
+    event_release_models_transfer(conn);
+    if (conn->conv_active) {
+        conversation_cleanup(&conn->conv);
     }
-    ensure_participant_display_models(participants, participant_count, models_payload);
-    if (models_payload) {
-        json_object_put(models_payload);
+    if (conn->chat_active) {
+        chat_request_release(&conn->chat);
     }
 
-    if (participant_count == 0) {
-        send_http_error(client_fd, "400 Bad Request", "No valid participants supplied.");
-        return;
+    if (conn->requests > 0) {
+        pthread_mutex_lock(&stats_lock);
+        server_stats.http_responses += conn->busy ? 1 : 0;
+        server_stats.http_connections++;
+        pthread_mutex_unlock(&stats_lock);
     }
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->source.fd, NULL);
+    shutdown(conn->source.fd, SHUT_RDWR);
+    close(conn->source.fd);
+    text_buffer_release(&conn->in);
+    text_buffer_release(&conn->out);
+    stream_spill_close(&conn->spill);
+    free(conn);
+}
 
-    if (send_chunked_header(client_fd, "200 OK", "application/x-ndjson") != 0) {
-        return;
-    }
+/* Answers a connection waiting for the background refresh of a cold model list once it has finished.
+ * Returns 0 while the refresh is still running. */
+static int event_catalogue_settled(struct EventConnection *conn) {
+    int refreshing = 0;
+    struct CatalogueSnapshot *catalogue = catalogue_poll(&refreshing);
+    enum event_transfer kind = conn->transfer;
 
-    json_object *start_event = json_object_new_object();
-    json_object *start_participants = json_object_new_array();
-    if (!start_event || !start_participants) {
-        if (start_event) {
-            json_object_put(start_event);
-        }
-        if (start_participants) {
-            json_object_put(start_participants);
-        }
-        send_stream_error_event(client_fd, "Failed to start stream.");
-        finish_chunked_response(client_fd);
-        return;
+    if (!catalogue && refreshing) {
+        return 0;
+    }
+    conn->transfer = EVENT_TRANSFER_NONE;
+    if (kind == EVENT_TRANSFER_MODELS && catalogue) {
+        event_respond(conn, "200 OK", "application/json", catalogue->json);
+    } else if (kind == EVENT_TRANSFER_MODELS) {
+        event_respond_error(conn, "502 Bad Gateway", "Failed to contact Ollama for model list.");
+    } else {
+        ensure_participant_display_models(conn->chat.participants, conn->chat.participant_count, catalogue);
+        event_begin_conversation(conn);
     }
+    catalogue_release(catalogue);
+    event_serve_pending(conn);
+    return 1;
+}
 
-    for (size_t i = 0; i < participant_count; ++i) {
-        json_object *participant_obj = json_object_new_object();
-        if (!participant_obj) {
-            json_object_put(start_participants);
-            json_object_put(start_event);
-            send_stream_error_event(client_fd, "Failed to start stream.");
-            finish_chunked_response(client_fd);
-            return;
+/* Connections are only freed here, between event batches, so callbacks never see a dangling pointer.
+ * Connections past their deadline are closed too, queued turns the scheduler has let through are started,
+ * turns past their hedge delay are hedged, connections waiting for the model list are answered once it
+ * has been fetched (checked every CATALOGUE_WAIT_POLL_MS), and the nearest remaining deadline is kept in
+ * loop->deadline_ms for the next epoll_wait. */
+static void event_reap_connections(struct EventLoop *loop) {
+    struct EventConnection **link = &loop->connections;
+    long long now = monotonic_ms();
+
+    loop->deadline_ms = -1;
+    while (*link) {
+        struct EventConnection *conn = *link;
+        if (!conn->dead && conn->deadline_ms > 0) {
+            if (now >= conn->deadline_ms) {
+                /* An idle keep-alive connection running out is routine; a stalled request or reader is not. */
+                if (conn->busy || conn->requests == 0 || conn->in.length > 0) {
+                    note_timeout();
+                }
+                /* A request that only partly arrived is answered before closing, as far as the socket takes it. */
+                if (!conn->busy && conn->in.length > 0) {
+                    conn->requests++;
+                    conn->busy = 1;
+                    conn->keep_alive = 0;
+                    event_respond_error(conn, "408 Request Timeout", "Request not received in time.");
+                }
+                conn->dead = 1;
+            } else if (loop->deadline_ms < 0 || conn->deadline_ms < loop->deadline_ms) {
+                loop->deadline_ms = conn->deadline_ms;
+            }
         }
-        json_object_object_add(participant_obj, "name", json_object_new_string(participants[i].name));
-        json_object_object_add(participant_obj, "model", json_object_new_string(participants[i].model));
-        if (participants[i].display_model[0] != '\0') {
-            json_object_object_add(participant_obj, "displayModel",
-                                   json_object_new_string(participants[i].display_model));
+        if (!conn->dead && conn->transfer == EVENT_TRANSFER_QUEUED && turn_scheduler_granted(&conn->conv.ticket)) {
+            event_add_turn(conn, conversation_dispatch_turn(&conn->conv));
+            event_serve_pending(conn);
         }
-        json_object_array_add(start_participants, participant_obj);
-    }
-
-    json_object_object_add(start_event, "type", json_object_new_string("start"));
-    json_object_object_add(start_event, "topic", json_object_new_string(topic));
-    json_object_object_add(start_event, "turns", json_object_new_int(turns));
-    json_object_object_add(start_event, "participants", start_participants);
-
-    if (send_json_chunk(client_fd, start_event) != 0) {
-        json_object_put(start_event);
-        finish_chunked_response(client_fd);
-        return;
-    }
-    json_object_put(start_event);
-
-    struct StreamContext stream_ctx = {client_fd, 0};
-    if (run_conversation(topic, turns, participants, participant_count, ollama_url, stream_message_callback,
-                         &stream_ctx, &result, &error_message) != 0) {
-        if (!stream_ctx.failed) {
-            if (error_message) {
-                send_stream_error_event(client_fd, error_message);
-            } else {
-                send_stream_error_event(client_fd, "Conversation failed.");
+        if (!conn->dead && (conn->transfer == EVENT_TRANSFER_MODELS || conn->transfer == EVENT_TRANSFER_LOOKUP) &&
+            !conn->transfer_handle && !event_catalogue_settled(conn) &&
+            (loop->deadline_ms < 0 || now + CATALOGUE_WAIT_POLL_MS < loop->deadline_ms)) {
+            loop->deadline_ms = now + CATALOGUE_WAIT_POLL_MS;
+        }
+        if (!conn->dead && conn->transfer == EVENT_TRANSFER_TURN && conn->conv.hedge_at_ms > 0) {
+            if (now >= conn->conv.hedge_at_ms) {
+                event_start_hedge(conn);
+            } else if (loop->deadline_ms < 0 || conn->conv.hedge_at_ms < loop->deadline_ms) {
+                loop->deadline_ms = conn->conv.hedge_at_ms;
             }
-            finish_chunked_response(client_fd);
         }
-        if (error_message) {
-            free(error_message);
+        if (conn->dead) {
+            *link = conn->next;
+            event_close_connection(conn);
+        } else {
+            link = &conn->next;
         }
-        if (result) {
-            json_object_put(result);
+    }
+    /* Closing a connection gives back its ticket, which may have let a turn through that was already
+     * passed over above; wake straight away to start it. */
+    for (struct EventConnection *conn = loop->connections; conn; conn = conn->next) {
+        if (conn->transfer == EVENT_TRANSFER_QUEUED && turn_scheduler_granted(&conn->conv.ticket)) {
+            loop->deadline_ms = now;
+            break;
         }
-        return;
     }
+}
 
-    if (!stream_ctx.failed) {
-        json_object *complete_event = json_object_new_object();
-        if (complete_event) {
-            json_object_object_add(complete_event, "type", json_object_new_string("complete"));
-            json_object_object_add(complete_event, "topic", json_object_new_string(topic));
-            json_object_object_add(complete_event, "turns", json_object_new_int(turns));
-            if (send_json_chunk(client_fd, complete_event) != 0) {
-                stream_ctx.failed = 1;
-            }
-            json_object_put(complete_event);
-        }
+static int event_loop_run(int server_fd, const char *ollama_url) {
+    struct EventLoop loop;
+    struct epoll_event events[EVENT_BATCH_SIZE];
+    struct epoll_event ev;
+    int running = 0;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.ollama_url = ollama_url;
+    loop.curl_deadline_ms = -1;
+    loop.deadline_ms = -1;
+    loop.listener.kind = EVENT_SOURCE_LISTENER;
+    loop.listener.fd = server_fd;
+
+    if (set_nonblocking(server_fd) != 0) {
+        perror("fcntl");
+        return -1;
     }
 
-    if (!stream_ctx.failed) {
-        finish_chunked_response(client_fd);
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
     }
 
-    if (result) {
-        json_object_put(result);
+    loop.multi = curl_multi_init();
+    if (!loop.multi) {
+        fprintf(stderr, "Failed to initialise curl multi handle.\n");
+        close(loop.epoll_fd);
+        return -1;
     }
-    if (error_message) {
-        free(error_message);
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETFUNCTION, event_curl_socket_callback);
+    curl_multi_setopt(loop.multi, CURLMOPT_SOCKETDATA, &loop);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERFUNCTION, event_curl_timer_callback);
+    curl_multi_setopt(loop.multi, CURLMOPT_TIMERDATA, &loop);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop.listener;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) != 0) {
+        perror("epoll_ctl");
+        curl_multi_cleanup(loop.multi);
+        close(loop.epoll_fd);
+        return -1;
     }
-}
 
-static void handle_client(int client_fd, const char *ollama_url) {
-    char *request = NULL;
-    size_t request_len = 0;
-    char method[8] = {0};
-    char path[64] = {0};
-    char *body = NULL;
-    size_t body_length = 0;
+    while (1) {
+        int timeout = -1;
+        int count = 0;
+        long long deadline = loop.curl_deadline_ms;
 
-    if (read_http_request(client_fd, &request, &request_len) != 0) {
-        send_http_error(client_fd, "400 Bad Request", "Unable to read request.");
-        return;
-    }
+        if (loop.deadline_ms >= 0 && (deadline < 0 || loop.deadline_ms < deadline)) {
+            deadline = loop.deadline_ms;
+        }
+        if (deadline >= 0) {
+            long long remaining = deadline - monotonic_ms();
+            timeout = remaining > 0 ? (int)remaining : 0;
+        }
 
-    sscanf(request, "%7s %63s", method, path);
+        count = epoll_wait(loop.epoll_fd, events, EVENT_BATCH_SIZE, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
 
-    char *separator = strstr(request, "\r\n\r\n");
-    if (separator) {
-        body = separator + 4;
-        body_length = request_len - (size_t)(body - request);
-    }
+        for (int i = 0; i < count; ++i) {
+            struct EventSource *source = (struct EventSource *)events[i].data.ptr;
+            uint32_t flags = events[i].events;
 
-    if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
-        send_http_response(client_fd, "200 OK", "text/html; charset=UTF-8", get_html_page());
-    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/models") == 0) {
-        handle_models_request(client_fd, ollama_url);
-    } else if (strcmp(method, "POST") == 0 && strcmp(path, "/chat") == 0) {
-        if (!body) {
-            send_http_error(client_fd, "400 Bad Request", "Missing request body.");
-        } else {
-            handle_chat_request(client_fd, body, body_length, ollama_url);
-        }
-    } else if (strcmp(method, "OPTIONS") == 0) {
-        const char *response =
-            "HTTP/1.1 204 No Content\r\n"
-            "Access-Control-Allow-Origin: *\r\n"
-            "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-            "Access-Control-Allow-Headers: Content-Type\r\n"
-            "Connection: close\r\n\r\n";
-        send(client_fd, response, strlen(response), 0);
-    } else {
-        send_http_error(client_fd, "404 Not Found", "Endpoint not found.");
+            if (source->kind == EVENT_SOURCE_LISTENER) {
+                event_accept_clients(&loop);
+            } else if (source->kind == EVENT_SOURCE_CURL) {
+                if (source->fd < 0) {
+                    continue;
+                }
+                int action = ((flags & EPOLLIN) ? CURL_CSELECT_IN : 0) | ((flags & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                             ((flags & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+                curl_multi_socket_action(loop.multi, source->fd, action, &running);
+                event_check_transfers(&loop);
+            } else {
+                struct EventConnection *conn = (struct EventConnection *)source;
+                if (flags & (EPOLLERR | EPOLLHUP)) {
+                    conn->dead = 1;
+                    continue;
+                }
+                /* A half-close is read as end of input; the client may still be reading its responses. */
+                if (flags & (EPOLLIN | EPOLLRDHUP)) {
+                    event_handle_readable(conn);
+                }
+                if ((flags & EPOLLOUT) && !conn->dead) {
+                    event_flush(conn);
+                }
+                event_serve_pending(conn);
+            }
+        }
+
+        if (loop.curl_deadline_ms >= 0 && monotonic_ms() >= loop.curl_deadline_ms) {
+            loop.curl_deadline_ms = -1;
+            curl_multi_socket_action(loop.multi, CURL_SOCKET_TIMEOUT, 0, &running);
+            event_check_transfers(&loop);
+        }
+
+        event_reap_connections(&loop);
+        while (loop.retired_sockets) {
+            struct CurlSocket *sock = loop.retired_sockets;
+            loop.retired_sockets = sock->next_retired;
+            free(sock);
+        }
     }
 
-    free(request);
+    curl_multi_cleanup(loop.multi);
+    close(loop.epoll_fd);
+    return -1;
 }
 
+/* Benchmarks include this file with AICHAT_NO_MAIN to reach the static helpers. */
+#ifndef AICHAT_NO_MAIN
 int main(void) {
     int server_fd = -1;
     struct sockaddr_in address;
@@ -2148,7 +8271,14 @@ int main(void) {
     int fallback_used = 0;
     int port_from_env = 0;
     const char *port_env = getenv("AICHAT_PORT");
-    const char *ollama_url = get_ollama_url();
+    const char *ollama_url = NULL;
+    int worker_count = get_env_int("AICHAT_WORKERS", DEFAULT_WORKER_THREADS, 0, MAX_WORKER_THREADS);
+    int queue_depth = get_env_int("AICHAT_QUEUE_DEPTH", DEFAULT_QUEUE_DEPTH, 1, MAX_QUEUE_DEPTH);
+    const char *io_mode = getenv("AICHAT_IO_MODE");
+    int use_event_loop = io_mode && strcasecmp(io_mode, "epoll") == 0;
+    const char *slow_client_env = getenv("AICHAT_SLOW_CLIENT");
+    int preload = 1;
+    struct WorkerPool pool;
 
     if (port_env && *port_env) {
         char *endptr = NULL;
@@ -2162,6 +8292,78 @@ int main(void) {
     }
     requested_port = port;
 
+    if (io_mode && *io_mode && !use_event_loop && strcasecmp(io_mode, "threads") != 0) {
+        fprintf(stderr, "Warning: unknown AICHAT_IO_MODE '%s', using threads.\n", io_mode);
+    }
+    if (backend_pool_init(get_ollama_url()) == 0) {
+        fprintf(stderr, "Failed to configure the Ollama backends.\n");
+        return EXIT_FAILURE;
+    }
+    ollama_url = backend_url(0);
+    backend_pool.poll_interval = get_env_int("AICHAT_BACKEND_POLL", DEFAULT_BACKEND_POLL, 1, MAX_BACKEND_POLL);
+    hedge_tracker.enabled = get_env_int("AICHAT_HEDGE", 0, 0, 1);
+    hedge_tracker.percentile = get_env_int("AICHAT_HEDGE_PERCENTILE", DEFAULT_HEDGE_PERCENTILE, 1, 100);
+    turn_scheduler.enabled = get_env_int("AICHAT_SCHEDULER", 0, 0, 1);
+    turn_scheduler.model_concurrency =
+        get_env_int("AICHAT_MODEL_CONCURRENCY", DEFAULT_MODEL_CONCURRENCY, 1, MAX_MODEL_CONCURRENCY);
+    turn_scheduler.aging_ms = get_env_int("AICHAT_SCHEDULER_AGING", DEFAULT_SCHEDULER_AGING, 0, MAX_SCHEDULER_AGING) *
+                              1000LL;
+    if (turn_scheduler_init() != 0) {
+        fprintf(stderr, "Warning: failed to set up the turn scheduler clock, using the wall clock.\n");
+    }
+    turn_timeout = get_env_int("AICHAT_TURN_TIMEOUT", DEFAULT_TURN_TIMEOUT, 0, MAX_TURN_TIMEOUT);
+    connect_timeout = get_env_int("AICHAT_CONNECT_TIMEOUT", DEFAULT_CONNECT_TIMEOUT, 0, MAX_CONNECT_TIMEOUT);
+    token_streaming_default = get_env_int("AICHAT_TOKEN_STREAMING", 0, 0, 1);
+    load_context_budgets();
+    model_catalogue.ttl_ms = get_env_int("AICHAT_MODELS_TTL", DEFAULT_MODELS_TTL, 0, MAX_MODELS_TTL) * 1000LL;
+    context_reuse_enabled = get_env_int("AICHAT_CONTEXT_REUSE", 1, 0, 1);
+    keepalive_timeout = get_env_int("AICHAT_KEEPALIVE_TIMEOUT", DEFAULT_KEEPALIVE_TIMEOUT, 0, MAX_KEEPALIVE_TIMEOUT);
+    keepalive_max_requests =
+        get_env_int("AICHAT_KEEPALIVE_REQUESTS", DEFAULT_KEEPALIVE_REQUESTS, 1, MAX_KEEPALIVE_REQUESTS);
+    http_max_header_bytes =
+        (size_t)get_env_int("AICHAT_MAX_HEADER_BYTES", DEFAULT_MAX_HEADER_BYTES, 1024, MAX_MAX_HEADER_BYTES);
+    http_max_body_bytes = (size_t)get_env_int("AICHAT_MAX_BODY_BYTES", DEFAULT_MAX_BODY_BYTES, 0, MAX_MAX_BODY_BYTES);
+    read_timeout = get_env_int("AICHAT_READ_TIMEOUT", DEFAULT_READ_TIMEOUT, 0, MAX_IO_TIMEOUT);
+    write_timeout = get_env_int("AICHAT_WRITE_TIMEOUT", DEFAULT_WRITE_TIMEOUT, 0, MAX_IO_TIMEOUT);
+    stream_buffer_limit =
+        (size_t)get_env_int("AICHAT_STREAM_BUFFER", DEFAULT_STREAM_BUFFER, MIN_STREAM_BUFFER, MAX_STREAM_BUFFER);
+    if (slow_client_env && strcasecmp(slow_client_env, "spill") == 0) {
+        slow_client_policy = SLOW_CLIENT_SPILL;
+    } else if (slow_client_env && *slow_client_env && strcasecmp(slow_client_env, "disconnect") != 0) {
+        fprintf(stderr, "Warning: unknown AICHAT_SLOW_CLIENT '%s', disconnecting slow clients.\n", slow_client_env);
+    }
+    ollama_keep_alive = getenv("AICHAT_KEEP_ALIVE");
+
+    signal(SIGPIPE, SIG_IGN);
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+        fprintf(stderr, "Failed to initialise libcurl.\n");
+        return EXIT_FAILURE;
+    }
+    if (curl_pool_init() != 0) {
+        fprintf(stderr, "Warning: libcurl share unavailable, Ollama connections will not be pooled.\n");
+    }
+    if (prefix_cache_init((size_t)get_env_int("AICHAT_PREFIX_CACHE", DEFAULT_PREFIX_CACHE_ENTRIES, 0,
+                                               MAX_PREFIX_CACHE_ENTRIES)) != 0) {
+        fprintf(stderr, "Warning: failed to allocate the prefix cache, disabling it.\n");
+    }
+    preload = get_env_int("AICHAT_PRELOAD", 1, 0, 1);
+    if ((preload || (prefix_cache_enabled() && context_reuse_enabled)) && preloader_start(preload) != 0) {
+        fprintf(stderr, "Warning: failed to start the model preloader.\n");
+    }
+    if (backend_poller_start() != 0) {
+        fprintf(stderr, "Warning: failed to start the backend poller, routing without residency.\n");
+    }
+    catalogue_release(catalogue_peek(ollama_url)); /* fetch the model list in the background now */
+    if (page_cache_init() != 0) {
+        fprintf(stderr, "Warning: failed to prebuild the page responses, serving them uncached.\n");
+    }
+    if (response_cache_init((size_t)get_env_int("AICHAT_CACHE_ENTRIES", DEFAULT_CACHE_ENTRIES, 0, MAX_CACHE_ENTRIES),
+                            getenv("AICHAT_CACHE_FILE"),
+                            (size_t)get_env_int("AICHAT_CACHE_DISK_MB", DEFAULT_CACHE_DISK_MB, 1, MAX_CACHE_DISK_MB) *
+                                1048576) != 0) {
+        fprintf(stderr, "Warning: response cache file unavailable, caching replies in memory only.\n");
+    }
+
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
         perror("socket");
@@ -2206,7 +8408,7 @@ int main(void) {
     }
     port = ntohs(address.sin_port);
 
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         close(server_fd);
         return EXIT_FAILURE;
@@ -2217,7 +8419,34 @@ int main(void) {
     }
 
     printf("aiChat web server ready on http://127.0.0.1:%d\n", port);
-    printf("Using Ollama endpoint: %s\n", ollama_url);
+    for (size_t i = 0; i < backend_pool.count; ++i) {
+        printf("Using Ollama endpoint: %s\n", backend_url((int)i));
+    }
+
+    if (use_event_loop) {
+        printf("I/O mode: single-threaded epoll event loop.\n");
+        fflush(stdout);
+        event_loop_run(server_fd, ollama_url);
+        close(server_fd);
+        curl_pool_cleanup();
+        curl_global_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (worker_count == 1) {
+        /* One worker is kept free of /chat streams, so a pool that can hold a conversation needs two. */
+        worker_count = 2;
+    }
+    if (worker_count > 0) {
+        if (worker_pool_start(&pool, (size_t)worker_count, (size_t)queue_depth, ollama_url) != 0) {
+            fprintf(stderr, "Failed to start worker pool, falling back to serial mode.\n");
+            worker_count = 0;
+        } else {
+            conversation_slots_limit = (int)pool.thread_count - 1;
+            printf("Worker pool: %zu threads, queue depth %d, %d concurrent conversations.\n",
+                   pool.thread_count, queue_depth, conversation_slots_limit);
+        }
+    }
 
     while (1) {
         int client_fd;
@@ -2231,11 +8460,16 @@ int main(void) {
             break;
         }
 
-        handle_client(client_fd, ollama_url);
-        shutdown(client_fd, SHUT_RDWR);
-        close(client_fd);
+        if (worker_count == 0) {
+            serve_connection(client_fd, ollama_url, NULL);
+        } else if (client_queue_push(&pool.queue, client_fd) != 0) {
+            reject_busy_client(client_fd);
+        }
     }
 
     close(server_fd);
+    curl_pool_cleanup();
+    curl_global_cleanup();
     return EXIT_SUCCESS;
 }
+#endif
@@ -0,0 +1,178 @@
+/* Checks for the response cache's file tier.
+ *
+ * Stores replies in a mapped cache file and reads them back through cache_disk_get_locked(), then damages
+ * the file the ways a crash, a stale index or the ring wrapping around would, and checks that each damaged
+ * record reads as a miss instead of returning garbage or reading past the mapping. Run with `make check`. */
+#define AICHAT_NO_MAIN
+#include "../aichat.c"
+#include "check.h"
+
+#define CHECK_DATA_SIZE 65536
+
+static struct CacheKey key_for(const char *text) {
+    struct CacheKey key = {0, 0};
+
+    cache_key_add(&key, text, strlen(text));
+    return key;
+}
+
+static struct DiskCacheSlot *slot_for(const struct CacheKey *key) {
+    struct DiskCacheSlot *bucket =
+        &response_cache.slots[(key->lo & (response_cache.header->slot_count / 4 - 1)) * 4];
+
+    for (int way = 0; way < 4; ++way) {
+        if (bucket[way].sequence != 0 && bucket[way].key_hi == key->hi && bucket[way].key_lo == key->lo) {
+            return &bucket[way];
+        }
+    }
+    return NULL;
+}
+
+/* Whether the file holds exactly value for key. */
+static int disk_holds(const struct CacheKey *key, const char *value) {
+    size_t length = 0;
+    char *found = cache_disk_get_locked(key, &length);
+    int ok = found && length == strlen(value) && memcmp(found, value, length) == 0;
+
+    free(found);
+    return ok;
+}
+
+static int disk_misses(const struct CacheKey *key) {
+    size_t length = 0;
+    char *found = cache_disk_get_locked(key, &length);
+
+    free(found);
+    return found == NULL;
+}
+
+/* Maps the cache file again in front of an inaccessible page, so a read past the mapping faults instead
+ * of finding whatever happens to be mapped there. Returns the page's offset from the ring's start, or 0
+ * when the file cannot be moved. */
+static uint64_t guard_mapping(void) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t rounded = (response_cache.map_size + page - 1) / page * page;
+    unsigned char *reserve = mmap(NULL, rounded + page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t index_size = (size_t)(response_cache.data - response_cache.map);
+
+    if (reserve == MAP_FAILED) {
+        return 0;
+    }
+    if (mmap(reserve, response_cache.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             response_cache.disk_fd, 0) == MAP_FAILED) {
+        munmap(reserve, rounded + page);
+        return 0;
+    }
+    munmap(response_cache.map, response_cache.map_size);
+    response_cache.map = reserve;
+    response_cache.header = (struct DiskCacheHeader *)reserve;
+    response_cache.slots = (struct DiskCacheSlot *)(reserve + sizeof(struct DiskCacheHeader));
+    response_cache.data = reserve + index_size;
+    response_cache.map_size = rounded + page;
+    return rounded - index_size;
+}
+
+static void close_cache_file(void) {
+    munmap(response_cache.map, response_cache.map_size);
+    close(response_cache.disk_fd);
+    response_cache.map = NULL;
+    response_cache.disk_fd = -1;
+}
+
+int main(void) {
+    char path[] = "/tmp/aichat-cache-check-XXXXXX";
+    int fd = mkstemp(path);
+    struct CacheKey key = key_for("gemma:2b seed 7 prompt");
+    struct CacheKey other = key_for("llama3:8b seed 7 prompt");
+    static const char reply[] = "{\"response\":\"Orbits are ellipses.\"}";
+    struct DiskCacheSlot *slot = NULL;
+    struct DiskCacheRecord *record = NULL;
+    struct DiskCacheSlot saved_slot;
+    struct DiskCacheRecord saved_record;
+    char *large = NULL;
+    uint64_t guard_offset = 0;
+
+    if (fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (response_cache_init(0, path, CHECK_DATA_SIZE) != 0) {
+        fprintf(stderr, "cannot open cache file %s\n", path);
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+    guard_offset = guard_mapping();
+    expect(guard_offset != 0, "cache file maps again in front of a guard page");
+
+    cache_disk_put_locked(&key, reply, strlen(reply));
+    expect(disk_holds(&key, reply), "stored reply reads back");
+    expect(disk_misses(&other), "unknown key misses");
+
+    slot = slot_for(&key);
+    expect(slot != NULL, "stored key has an index slot");
+    if (!slot) {
+        close_cache_file();
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+    record = (struct DiskCacheRecord *)(response_cache.data + slot->offset);
+    saved_slot = *slot;
+    saved_record = *record;
+
+    ((char *)(record + 1))[3] ^= 0x20;
+    expect(disk_misses(&key), "corrupted value fails its checksum");
+    ((char *)(record + 1))[3] ^= 0x20;
+    expect(disk_holds(&key, reply), "restored value reads back");
+
+    slot->offset = CHECK_DATA_SIZE - sizeof(struct DiskCacheRecord) + 1;
+    expect(disk_misses(&key), "slot pointing past the ring misses");
+    if (guard_offset) {
+        slot->offset = guard_offset;
+        expect(disk_misses(&key), "slot pointing past the mapping misses");
+    }
+    slot->offset = UINT64_MAX;
+    expect(disk_misses(&key), "slot with a wrapped-around offset misses");
+    *slot = saved_slot;
+
+    record->length = CHECK_DATA_SIZE;
+    expect(disk_misses(&key), "record longer than the ring misses");
+    record->length = UINT64_MAX - 8;
+    expect(disk_misses(&key), "record length that overflows misses");
+    *record = saved_record;
+
+    record->sequence++;
+    expect(disk_misses(&key), "record from another write misses");
+    *record = saved_record;
+    expect(disk_holds(&key, reply), "repaired record reads back");
+
+    close_cache_file();
+    expect(response_cache_init(0, path, CHECK_DATA_SIZE) == 0, "cache file reopens");
+    expect(response_cache.map && disk_holds(&key, reply), "reply survives reopening the file");
+
+    large = malloc(CHECK_DATA_SIZE / 4 + 1);
+    if (large && response_cache.map) {
+        memset(large, 'x', CHECK_DATA_SIZE / 4);
+        large[CHECK_DATA_SIZE / 4] = '\0';
+        cache_disk_put_locked(&other, large, CHECK_DATA_SIZE / 4);
+        expect(disk_misses(&other), "reply over a quarter of the ring is not stored");
+
+        /* Writing the ring over and over overwrites the first record; its index slot, if it survives,
+         * must no longer match what is stored there. */
+        for (int i = 0; i < 64; ++i) {
+            char name[32];
+            struct CacheKey filler;
+            snprintf(name, sizeof(name), "filler %d", i);
+            filler = key_for(name);
+            cache_disk_put_locked(&filler, large, CHECK_DATA_SIZE / 8);
+        }
+        expect(disk_misses(&key), "record overwritten by the ring misses");
+    }
+    free(large);
+
+    if (response_cache.map) {
+        close_cache_file();
+    }
+    unlink(path);
+    return check_result("cache_check");
+}
@@ -0,0 +1,22 @@
+/* Shared by the checks under bench/, which include aichat.c with AICHAT_NO_MAIN and then this file.
+ * Every failed expectation is reported, and check_result() turns the count into main()'s exit status. */
+#ifndef AICHAT_BENCH_CHECK_H
+#define AICHAT_BENCH_CHECK_H
+
+static int check_failures = 0;
+
+static void expect(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        check_failures++;
+    }
+}
+
+static int check_result(const char *name) {
+    if (check_failures == 0) {
+        printf("%s: all checks passed\n", name);
+    }
+    return check_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
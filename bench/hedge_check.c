@@ -0,0 +1,59 @@
+/* Checks for the hedged-turn delay.
+ *
+ * Records first-byte times and checks the delay hedge_delay_ms() derives from them: none until enough
+ * samples exist or with a single backend, the configured percentile of the recent samples, the minimum
+ * delay for fast backends, and old samples dropping out of the window. Run with `make check`. */
+#define AICHAT_NO_MAIN
+#include "../aichat.c"
+#include "check.h"
+
+static void hedge_reset(int percentile) {
+    hedge_tracker.count = 0;
+    hedge_tracker.next = 0;
+    hedge_tracker.enabled = 1;
+    hedge_tracker.percentile = percentile;
+}
+
+int main(void) {
+    backend_pool.count = 2;
+    hedge_reset(95);
+    for (int i = 1; i < HEDGE_MIN_SAMPLES; ++i) {
+        hedge_record(1000);
+    }
+    expect(hedge_delay_ms() == -1, "no delay before enough samples");
+    hedge_record(1000);
+    expect(hedge_delay_ms() == 1000, "delay once enough samples exist");
+
+    backend_pool.count = 1;
+    expect(hedge_delay_ms() == -1, "no delay with a single backend");
+    backend_pool.count = 2;
+    hedge_tracker.enabled = 0;
+    expect(hedge_delay_ms() == -1, "no delay when hedging is off");
+
+    hedge_reset(95);
+    for (int i = 20; i >= 1; --i) {
+        hedge_record(i * 100LL);
+    }
+    expect(hedge_delay_ms() == 1900, "95th percentile of 20 samples");
+    hedge_tracker.percentile = 50;
+    expect(hedge_delay_ms() == 1000, "median of 20 samples");
+    hedge_tracker.percentile = 100;
+    expect(hedge_delay_ms() == 2000, "100th percentile is the slowest sample");
+
+    hedge_reset(95);
+    for (int i = 0; i < HEDGE_MIN_SAMPLES; ++i) {
+        hedge_record(5);
+    }
+    expect(hedge_delay_ms() == HEDGE_MIN_DELAY_MS, "fast backends are hedged after the minimum delay");
+
+    hedge_reset(95);
+    for (int i = 0; i < HEDGE_SAMPLES; ++i) {
+        hedge_record(30000);
+    }
+    for (int i = 0; i < HEDGE_SAMPLES; ++i) {
+        hedge_record(400);
+    }
+    expect(hedge_tracker.count == HEDGE_SAMPLES && hedge_delay_ms() == 400, "old samples leave the window");
+
+    return check_result("hedge_check");
+}
@@ -0,0 +1,223 @@
+/* Checks for http_request_feed() and the page's header matching.
+ *
+ * Feeds well-formed and hostile requests to the incremental parser, both whole and a few bytes per read,
+ * and checks the framing it finds and the status it refuses each oversized or malformed request with.
+ * The limits are lowered so that the edges can be reached with small requests. Accept-Encoding and
+ * If-None-Match values are matched the way page_response_for() matches them. Run with `make check`. */
+#define AICHAT_NO_MAIN
+#include "../aichat.c"
+#include "check.h"
+
+#define CHECK_HEADER_BYTES 1024
+#define CHECK_BODY_BYTES 4096
+
+/* Feeds the first length bytes of text read_size bytes at a time, as recv() would deliver them, until the
+ * parser finishes or the input runs out. buffer receives the working copy, which the parser rewrites. */
+static int feed(struct HttpRequest *request, char **buffer, const char *text, size_t length, size_t read_size) {
+    size_t fed = 0;
+    int rc = 0;
+
+    http_request_reset(request);
+    *buffer = malloc(length + 1);
+    if (!*buffer) {
+        return -2;
+    }
+    memcpy(*buffer, text, length);
+    (*buffer)[length] = '\0';
+    while (rc == 0 && fed < length) {
+        fed = length - fed < read_size ? length : fed + read_size;
+        rc = http_request_feed(request, *buffer, fed);
+    }
+    return rc;
+}
+
+/* Whether text is refused with a status starting with status, whether fed whole or a byte at a time. */
+static int refused(const char *text, const char *status) {
+    int ok = 1;
+
+    for (size_t read_size = strlen(text); read_size > 0; read_size = read_size > 1 ? 1 : 0) {
+        struct HttpRequest request;
+        char *buffer = NULL;
+        int rc = feed(&request, &buffer, text, strlen(text), read_size);
+        ok = ok && rc == -1 && request.error_status && strncmp(request.error_status, status, strlen(status)) == 0;
+        free(buffer);
+    }
+    return ok;
+}
+
+/* Whether text parses as one complete request of exactly its own length whose body is body. */
+static int complete(const char *text, const char *body) {
+    int ok = 1;
+
+    for (size_t read_size = strlen(text); read_size > 0; read_size = read_size > 1 ? 1 : 0) {
+        struct HttpRequest request;
+        char *buffer = NULL;
+        int rc = feed(&request, &buffer, text, strlen(text), read_size);
+        ok = ok && rc == 1 && request.scan == strlen(text) && request.body_length == strlen(body) &&
+             memcmp(buffer + request.header_length, body, request.body_length) == 0;
+        free(buffer);
+    }
+    return ok;
+}
+
+/* A request whose header block is length bytes long, padded with one X-Pad header. */
+static char *request_with_headers(size_t length) {
+    static const char head[] = "GET / HTTP/1.1\r\nX-Pad: ";
+    char *text = malloc(length + 1);
+    size_t pad = length - (sizeof(head) - 1) - 4;
+
+    if (!text) {
+        return NULL;
+    }
+    memcpy(text, head, sizeof(head) - 1);
+    memset(text + sizeof(head) - 1, 'p', pad);
+    memcpy(text + sizeof(head) - 1 + pad, "\r\n\r\n", 5);
+    return text;
+}
+
+static char *request_with_body(const char *head, size_t length) {
+    char *text = malloc(strlen(head) + 48 + length + 1);
+    size_t header_length = 0;
+
+    if (!text) {
+        return NULL;
+    }
+    header_length = (size_t)sprintf(text, "%sContent-Length: %zu\r\n\r\n", head, length);
+    memset(text + header_length, 'b', length);
+    text[header_length + length] = '\0';
+    return text;
+}
+
+static int accepts(const char *value, const char *coding) {
+    return accepts_encoding(value, strlen(value), coding);
+}
+
+static int listed(const char *value, const char *etag) {
+    return etag_listed(value, strlen(value), etag);
+}
+
+static void check_page_headers(void) {
+    static const char etag[] = "\"0123456789abcdef-br\"";
+
+    expect(accepts("gzip, deflate, br, zstd", "br") && accepts("gzip, deflate, br, zstd", "gzip"),
+           "listed codings are accepted");
+    expect(accepts("BR", "br") && accepts(" br ;q=0.5", "br"), "coding names ignore case and spacing");
+    expect(!accepts("gzip;q=0, br", "gzip") && !accepts("gzip ; q=0.000", "gzip"), "q=0 refuses a coding");
+    expect(accepts("gzip;q=0, br", "br") && accepts("br;level=1, gzip;q=0", "br"),
+           "another coding's q value does not apply");
+    expect(!accepts("brotli, xbr", "br") && !accepts("identity", "br") && !accepts("", "br"),
+           "only a whole coding name matches");
+    expect(!accepts_encoding("gzip, br", 4, "br"), "Accept-Encoding is read only up to its length");
+
+    expect(listed(etag, etag) && listed("W/\"0123456789abcdef-br\"", etag), "strong and weak ETags match");
+    expect(listed("\"old\", \"0123456789abcdef-br\"", etag) && listed("*", etag), "ETag lists and * match");
+    expect(!listed("\"0123456789abcdef\"", etag) && !listed("\"0123456789abcdef-br", etag) && !listed("", etag),
+           "other ETags do not match");
+    expect(!etag_listed("\"old\", \"0123456789abcdef-br\"", 7, etag), "If-None-Match is read only up to its length");
+}
+
+int main(void) {
+    struct HttpRequest request;
+    char *buffer = NULL;
+    char *text = NULL;
+    const char *full_chunk = "POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1000\r\n";
+    int rc = 0;
+
+    http_max_header_bytes = CHECK_HEADER_BYTES;
+    http_max_body_bytes = CHECK_BODY_BYTES;
+
+    expect(complete("GET / HTTP/1.1\r\nHost: x\r\n\r\n", ""), "plain GET completes");
+    expect(complete("GET / HTTP/1.0\n\n", ""), "bare newlines are accepted");
+    expect(complete("\r\n\r\nGET / HTTP/1.1\r\n\r\n", ""), "blank lines before a request are skipped");
+    expect(complete("POST /chat HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello", "hello"), "sized body completes");
+    expect(complete("POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                    "5\r\nhello\r\n6;ext=1\r\n world\r\n0\r\nX-Trailer: t\r\n\r\n",
+                    "hello world"),
+           "chunked body is decoded in place");
+
+    rc = feed(&request, &buffer, "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n", 38, 38);
+    expect(rc == 1 && request.scan == 19 && http_request_is(&request, "GET", "/a"),
+           "pipelined request stops at the first one");
+    free(buffer);
+
+    rc = feed(&request, &buffer, "POST /chat HTTP/1.1\r\nContent-Length: 5\r\n\r\nhel", 45, 45);
+    expect(rc == 0 && request.state == HTTP_PARSE_BODY, "partial body waits for more input");
+    free(buffer);
+
+    text = request_with_headers(CHECK_HEADER_BYTES);
+    expect(text && complete(text, ""), "header block at the limit completes");
+    free(text);
+    text = request_with_headers(CHECK_HEADER_BYTES + 2);
+    expect(text && refused(text, "431"), "header block over the limit is refused");
+    free(text);
+
+    text = request_with_headers(CHECK_HEADER_BYTES * 4);
+    if (text) {
+        rc = feed(&request, &buffer, text, CHECK_HEADER_BYTES + 8, 64);
+        expect(rc == -1 && strncmp(request.error_status, "431", 3) == 0,
+               "unterminated header line is refused before it ends");
+        free(buffer);
+    }
+    free(text);
+
+    text = malloc(32 + (MAX_HTTP_HEADERS + 1) * 6);
+    if (text) {
+        strcpy(text, "GET / HTTP/1.1\r\n");
+        for (int i = 0; i <= MAX_HTTP_HEADERS; ++i) {
+            strcat(text, "A: b\r\n");
+        }
+        strcat(text, "\r\n");
+        expect(refused(text, "431"), "too many headers are refused");
+    }
+    free(text);
+
+    text = request_with_body("POST /chat HTTP/1.1\r\n", CHECK_BODY_BYTES);
+    expect(text && complete(text, text + strlen(text) - CHECK_BODY_BYTES), "body at the limit completes");
+    free(text);
+    expect(refused("POST /chat HTTP/1.1\r\nContent-Length: 4097\r\n\r\n", "413"), "body over the limit is refused");
+    expect(refused("POST /chat HTTP/1.1\r\nContent-Length: 99999999999999999999999999\r\n\r\n", "413"),
+           "Content-Length that overflows is refused");
+    expect(refused("POST /chat HTTP/1.1\r\nContent-Length: 12a\r\n\r\n", "400"), "non-numeric Content-Length");
+    expect(refused("POST /chat HTTP/1.1\r\nContent-Length:\r\n\r\n", "400"), "empty Content-Length");
+    expect(refused("POST /chat HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n", "400"),
+           "conflicting Content-Length headers");
+    expect(refused("POST /chat HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n", "400"),
+           "Content-Length together with chunked");
+    expect(refused("POST /chat HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", "501"), "unsupported transfer coding");
+
+    expect(refused("POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1001\r\n", "413"),
+           "chunk over the body limit is refused");
+    expect(refused("POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nfffffffffffffffffffff\r\n", "413"),
+           "chunk size that overflows is refused");
+    rc = feed(&request, &buffer, full_chunk, strlen(full_chunk), strlen(full_chunk));
+    expect(rc == 0 && request.state == HTTP_PARSE_CHUNK_DATA, "chunk at the body limit waits for its data");
+    free(buffer);
+    text = malloc(CHECK_BODY_BYTES + 128);
+    if (text) {
+        size_t length = (size_t)sprintf(text, "POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n800\r\n");
+        memset(text + length, 'c', CHECK_BODY_BYTES / 2);
+        strcpy(text + length + CHECK_BODY_BYTES / 2, "\r\n801\r\n");
+        expect(refused(text, "413"), "chunks adding up to more than the body limit are refused");
+    }
+    free(text);
+    expect(refused("POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", "400"), "malformed chunk size");
+    expect(refused("POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nabX\r\n", "400"),
+           "chunk data without its line end");
+
+    text = malloc(CHECK_HEADER_BYTES * 2);
+    if (text) {
+        size_t head_length = (size_t)sprintf(text, "POST /chat HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1;");
+        memset(text + head_length, 'e', CHECK_HEADER_BYTES);
+        strcpy(text + head_length + CHECK_HEADER_BYTES, "\r\n");
+        expect(refused(text, "413"), "chunk extension over the header limit is refused");
+    }
+    free(text);
+
+    expect(refused("GET / HTTP/2.0\r\n\r\n", "505"), "HTTP/2.0 request line is refused");
+    expect(refused("GET /\r\n\r\n", "400"), "request line without a version is refused");
+    expect(refused("GET / HTTP/1.1\r\n folded: x\r\n\r\n", "400"), "obsolete line folding is refused");
+
+    check_page_headers();
+
+    return check_result("http_check");
+}
@@ -0,0 +1,202 @@
+/* Microbenchmark for http_request_feed().
+ *
+ * Replays requests into a connection buffer in fixed-size reads, as recv() would deliver them, and
+ * times how long it takes to recognise each complete request. The previous reader searched the whole
+ * buffer for the blank line and for Content-Length after every read; the incremental parser only scans
+ * the bytes each read adds. Both are checked to find the same request size first (the previous reader
+ * cannot frame chunked bodies, so those cases run the parser alone). Run with `make bench`. */
+#define AICHAT_NO_MAIN
+#include "../aichat.c"
+
+/* ---- previous implementation, kept verbatim for comparison ---- */
+
+static int parse_int_header(const char *headers, const char *key) {
+    const char *location = strcasestr(headers, key);
+    if (!location) {
+        return -1;
+    }
+    location += strlen(key);
+    while (*location && isspace((unsigned char)*location)) {
+        location++;
+    }
+    return atoi(location);
+}
+
+static int legacy_http_request_complete(const char *buffer, size_t length, size_t *out_total) {
+    const char *header_end = memmem(buffer, length, "\r\n\r\n", 4);
+    size_t header_length = 0;
+    int content_length = 0;
+
+    if (!header_end) {
+        return 0;
+    }
+
+    header_length = (size_t)(header_end - buffer) + 4;
+    content_length = parse_int_header(buffer, "Content-Length:");
+    *out_total = header_length + (content_length > 0 ? (size_t)content_length : 0);
+    return length >= *out_total;
+}
+
+/* ---- benchmark ---- */
+
+struct BenchCase {
+    const char *name;
+    char *request;
+    size_t length;
+    size_t read_size;
+    int chunked;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static const char browser_headers[] =
+    "Host: 127.0.0.1:4000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-GB,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "If-None-Match: \"0123456789abcdef-br\"\r\n";
+
+#define BODY_HEADERS "Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n"
+
+static char *build_request(const char *head, size_t body_length, int chunked, size_t *length) {
+    struct TextBuffer buffer = {0};
+    /* Room for the body headers with the widest size_t; a truncated line would lose the blank line
+     * that ends the headers and the parser would wait for more input. */
+    char line[sizeof(BODY_HEADERS) + 20];
+
+    text_buffer_append(&buffer, head, strlen(head));
+    text_buffer_append(&buffer, browser_headers, strlen(browser_headers));
+    if (body_length == 0) {
+        text_buffer_append(&buffer, "\r\n", 2);
+    } else if (!chunked) {
+        snprintf(line, sizeof(line), BODY_HEADERS, body_length);
+        text_buffer_append(&buffer, line, strlen(line));
+        for (size_t i = 0; i < body_length; ++i) {
+            text_buffer_append(&buffer, "x", 1);
+        }
+    } else {
+        text_buffer_append(&buffer, "Transfer-Encoding: chunked\r\n\r\n", 30);
+        for (size_t sent = 0; sent < body_length; sent += 4096) {
+            size_t size = body_length - sent < 4096 ? body_length - sent : 4096;
+            snprintf(line, sizeof(line), "%zx\r\n", size);
+            text_buffer_append(&buffer, line, strlen(line));
+            for (size_t i = 0; i < size; ++i) {
+                text_buffer_append(&buffer, "x", 1);
+            }
+            text_buffer_append(&buffer, "\r\n", 2);
+        }
+        text_buffer_append(&buffer, "0\r\n\r\n", 5);
+    }
+    *length = buffer.length;
+    return buffer.data;
+}
+
+/* Delivers the request read_size bytes at a time and returns the size at which it was recognised. */
+static size_t replay_legacy(const struct BenchCase *bench, struct TextBuffer *in) {
+    size_t total = 0;
+
+    in->length = 0;
+    for (size_t offset = 0; offset < bench->length; offset += bench->read_size) {
+        size_t count = bench->length - offset < bench->read_size ? bench->length - offset : bench->read_size;
+        text_buffer_append(in, bench->request + offset, count);
+        if (legacy_http_request_complete(in->data, in->length, &total)) {
+            return total;
+        }
+    }
+    return 0;
+}
+
+static size_t replay_parser(const struct BenchCase *bench, struct TextBuffer *in) {
+    struct HttpRequest request;
+
+    http_request_reset(&request);
+    in->length = 0;
+    for (size_t offset = 0; offset < bench->length; offset += bench->read_size) {
+        size_t count = bench->length - offset < bench->read_size ? bench->length - offset : bench->read_size;
+        text_buffer_append(in, bench->request + offset, count);
+        if (http_request_feed(&request, in->data, in->length) != 0) {
+            return request.state == HTTP_PARSE_COMPLETE ? request.scan : 0;
+        }
+    }
+    return 0;
+}
+
+static double time_replay(size_t (*replay)(const struct BenchCase *, struct TextBuffer *),
+                          const struct BenchCase *bench, size_t iterations) {
+    struct TextBuffer in = {0};
+    volatile size_t sink = 0;
+    double start = now_seconds();
+
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += replay(bench, &in);
+    }
+    start = now_seconds() - start;
+    (void)sink;
+    text_buffer_release(&in);
+    return start;
+}
+
+int main(void) {
+    struct BenchCase cases[] = {
+        {"GET /, one read", NULL, 0, 65536, 0},
+        {"GET /, 16 B reads", NULL, 0, 16, 0},
+        {"POST 2 KB, 1460 B", NULL, 0, 1460, 0},
+        {"POST 64 KB, 1460 B", NULL, 0, 1460, 0},
+        {"POST 64 KB chunked", NULL, 0, 1460, 1},
+    };
+    size_t body_lengths[] = {0, 0, 2048, 65536, 65536};
+    int failures = 0;
+
+    http_max_body_bytes = DEFAULT_MAX_BODY_BYTES;
+    printf("%-20s %10s %14s %14s %8s %10s\n", "case", "bytes", "legacy us/op", "parser us/op", "speedup",
+           "parser MB/s");
+    for (size_t c = 0; c < ARRAY_SIZE(cases); ++c) {
+        struct BenchCase *bench = &cases[c];
+        struct TextBuffer in = {0};
+        size_t iterations = 0;
+        size_t expected = 0;
+        size_t actual = 0;
+        double legacy = 0.0;
+        double parser = 0.0;
+
+        bench->request = build_request(body_lengths[c] > 0 ? "POST /chat HTTP/1.1\r\n" : "GET / HTTP/1.1\r\n",
+                                       body_lengths[c], bench->chunked, &bench->length);
+        iterations = bench->length > 10000 ? 2000 : 200000;
+
+        actual = replay_parser(bench, &in);
+        if (!bench->chunked) {
+            expected = replay_legacy(bench, &in);
+            if (expected != actual) {
+                fprintf(stderr, "%s: request size mismatch (legacy %zu, parser %zu)\n", bench->name, expected,
+                        actual);
+                failures++;
+            }
+        } else if (actual != bench->length) {
+            fprintf(stderr, "%s: parser stopped at %zu of %zu bytes\n", bench->name, actual, bench->length);
+            failures++;
+        }
+        text_buffer_release(&in);
+
+        parser = time_replay(replay_parser, bench, iterations) * 1e6 / (double)iterations;
+        if (bench->chunked) {
+            printf("%-20s %10zu %14s %14.2f %8s %10.0f\n", bench->name, bench->length, "-", parser, "-",
+                   (double)bench->length / parser);
+        } else {
+            legacy = time_replay(replay_legacy, bench, iterations) * 1e6 / (double)iterations;
+            printf("%-20s %10zu %14.2f %14.2f %7.1fx %10.0f\n", bench->name, bench->length, legacy, parser,
+                   legacy / parser, (double)bench->length / parser);
+        }
+        free(bench->request);
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,315 @@
+/* Microbenchmark for sanitize_speaker_reply().
+ *
+ * Compares the single-pass automaton against the previous implementation, which ran
+ * remove_tagged_section() once per tag pair and then rescanned the text for labels and metadata.
+ * The automaton is built once for the speaker, as a conversation does, so each reply only pays for
+ * the scan. Both are checked to produce the same output before timing. Run with `make bench`. */
+#define AICHAT_NO_MAIN
+#include "../aichat.c"
+
+/* ---- previous implementation, kept verbatim for comparison ---- */
+
+static void remove_tagged_section(char *text, const char *open_tag, const char *close_tag) {
+    size_t open_len = 0;
+    size_t close_len = 0;
+
+    if (!text || !open_tag || !close_tag) {
+        return;
+    }
+
+    open_len = strlen(open_tag);
+    close_len = strlen(close_tag);
+    if (open_len == 0 || close_len == 0) {
+        return;
+    }
+
+    while (*text) {
+        char *start = strcasestr(text, open_tag);
+        char *end = NULL;
+
+        if (!start) {
+            return;
+        }
+
+        end = strcasestr(start + open_len, close_tag);
+        if (end) {
+            end += close_len;
+            memmove(start, end, strlen(end) + 1);
+        } else {
+            *start = '\0';
+            return;
+        }
+    }
+}
+
+static void remove_leading_metadata_block(char *text) {
+    char *start = NULL;
+
+    if (!text) {
+        return;
+    }
+
+    trim_leading_whitespace(text);
+    start = text;
+
+    for (size_t i = 0; i < ARRAY_SIZE(metadata_prefixes); ++i) {
+        size_t prefix_len = strlen(metadata_prefixes[i]);
+        if (strncasecmp(start, metadata_prefixes[i], prefix_len) == 0) {
+            char *search_start = start + prefix_len;
+            char *removal_end = NULL;
+
+            for (size_t j = 0; j < ARRAY_SIZE(metadata_markers); ++j) {
+                char *candidate = strcasestr(search_start, metadata_markers[j]);
+                if (candidate && (!removal_end || candidate < removal_end)) {
+                    removal_end = candidate + 1; /* retain the newline for trimming */
+                }
+            }
+
+            char *double_newline = strstr(search_start, "\n\n");
+            if (double_newline && (!removal_end || double_newline < removal_end)) {
+                removal_end = double_newline + 2;
+            }
+
+            char *crlf_double = strstr(search_start, "\r\n\r\n");
+            if (crlf_double && (!removal_end || crlf_double < removal_end)) {
+                removal_end = crlf_double + 4;
+            }
+
+            if (removal_end) {
+                memmove(start, removal_end, strlen(removal_end) + 1);
+            } else {
+                *start = '\0';
+            }
+            break;
+        }
+    }
+}
+
+static void strip_leading_labels(char *text) {
+    char *start = NULL;
+
+    if (!text) {
+        return;
+    }
+
+    trim_leading_whitespace(text);
+    start = text;
+
+    for (size_t i = 0; i < ARRAY_SIZE(answer_labels); ++i) {
+        size_t label_len = strlen(answer_labels[i]);
+        if (strncasecmp(start, answer_labels[i], label_len) == 0) {
+            char *after = start + label_len;
+            while (*after && isspace((unsigned char)*after)) {
+                after++;
+            }
+            memmove(start, after, strlen(after) + 1);
+            break;
+        }
+    }
+}
+
+static char *find_name_label(char *text, const char *name, char **after_label) {
+    size_t name_len = 0;
+    char *cursor = NULL;
+
+    if (after_label) {
+        *after_label = NULL;
+    }
+
+    if (!text || !name || !*name) {
+        return NULL;
+    }
+
+    name_len = strlen(name);
+    cursor = text;
+
+    while ((cursor = strcasestr(cursor, name)) != NULL) {
+        char *next = cursor + name_len;
+
+        if (cursor != text) {
+            unsigned char prev = (unsigned char)cursor[-1];
+            if (isalnum(prev) || prev == '_') {
+                cursor += name_len;
+                continue;
+            }
+        }
+
+        while (*next && isspace((unsigned char)*next)) {
+            next++;
+        }
+
+        if (*next == '(') {
+            int depth = 1;
+            next++;
+            while (*next && depth > 0) {
+                if (*next == '(') {
+                    depth++;
+                } else if (*next == ')') {
+                    depth--;
+                }
+                next++;
+            }
+            while (*next && isspace((unsigned char)*next)) {
+                next++;
+            }
+        }
+
+        if (*next == ':') {
+            char *content = next + 1;
+            while (*content && isspace((unsigned char)*content)) {
+                content++;
+            }
+            if (after_label) {
+                *after_label = content;
+            }
+            return cursor;
+        }
+
+        cursor += name_len;
+    }
+
+    return NULL;
+}
+
+static void drop_text_before_name_label(char *text, const char *name) {
+    char *after_label = NULL;
+    char *label_start = find_name_label(text, name, &after_label);
+
+    if (label_start && label_start != text) {
+        memmove(text, label_start, strlen(label_start) + 1);
+    }
+}
+
+static void strip_leading_name_label(char *text, const char *name) {
+    char *after_label = NULL;
+    char *label_start = find_name_label(text, name, &after_label);
+
+    if (label_start == text && after_label) {
+        memmove(text, after_label, strlen(after_label) + 1);
+    }
+}
+
+static void legacy_sanitize_model_response(char *response, const char *participant_name,
+                                    const char *display_label, const char *model_name) {
+    const char *labels[3];
+    size_t label_count = 0;
+
+    if (!response) {
+        return;
+    }
+
+    label_count = collect_speaker_labels(labels, participant_name, display_label, model_name);
+    for (size_t i = 0; i < ARRAY_SIZE(thinking_tags); ++i) {
+        remove_tagged_section(response, thinking_tags[i].open, thinking_tags[i].close);
+    }
+
+    trim_leading_whitespace(response);
+    for (size_t i = 0; i < label_count; ++i) {
+        drop_text_before_name_label(response, labels[i]);
+    }
+    remove_leading_metadata_block(response);
+    trim_leading_whitespace(response);
+    for (size_t i = 0; i < label_count; ++i) {
+        strip_leading_name_label(response, labels[i]);
+        trim_leading_whitespace(response);
+    }
+    strip_leading_labels(response);
+    trim_leading_whitespace(response);
+    trim_trailing_whitespace(response);
+}
+
+
+/* ---- benchmark driver ---- */
+
+struct BenchCase {
+    const char *name;
+    char *text;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char *repeat_text(const char *head, const char *unit, size_t count, const char *tail) {
+    struct TextBuffer buffer = {0};
+
+    text_buffer_append(&buffer, head, strlen(head));
+    for (size_t i = 0; i < count; ++i) {
+        text_buffer_append(&buffer, unit, strlen(unit));
+    }
+    text_buffer_append(&buffer, tail, strlen(tail));
+    return buffer.data;
+}
+
+typedef void (*sanitize_fn)(char *, const char *, const char *, const char *);
+
+static struct SpeakerMatcher bench_speaker;
+
+static void sanitize_with_speaker(char *response, const char *participant_name, const char *display_label,
+                                  const char *model_name) {
+    (void)participant_name;
+    (void)display_label;
+    (void)model_name;
+    sanitize_speaker_reply(response, &bench_speaker);
+}
+
+static double time_sanitizer(sanitize_fn fn, const char *text, size_t iterations) {
+    size_t length = strlen(text);
+    char *scratch = malloc(length + 1);
+    double start = 0.0;
+
+    start = now_seconds();
+    for (size_t i = 0; i < iterations; ++i) {
+        memcpy(scratch, text, length + 1);
+        fn(scratch, "Astra", "gemma:2b", "gemma:2b");
+    }
+    start = now_seconds() - start;
+    free(scratch);
+    return start;
+}
+
+int main(void) {
+    struct BenchCase cases[] = {
+        {"short reply", repeat_text("Astra: ", "", 0, "The stars are closer than they look.  ")},
+        {"32 KB think block",
+         repeat_text("<think>", "Let me reason about orbital mechanics step by step. ", 640,
+                     "</think>\n\nAstra (gemma:2b): Orbits are ellipses.")},
+        {"500 small tags",
+         repeat_text("", "Point. <think>aside</think> [thinking]more[/thinking] ", 500, "Done.")},
+        {"metadata block",
+         repeat_text("Thought: ", "weighing the options carefully\n", 400, "\nFinal answer: Mars first.")},
+    };
+    int failures = 0;
+
+    speaker_matcher_init(&bench_speaker, "Astra", "gemma:2b", "gemma:2b");
+    printf("%-20s %10s %14s %14s %8s\n", "case", "bytes", "legacy us/op", "single us/op", "speedup");
+    for (size_t c = 0; c < ARRAY_SIZE(cases); ++c) {
+        const char *text = cases[c].text;
+        size_t length = strlen(text);
+        size_t iterations = length > 10000 ? 200 : 20000;
+        char *expected = strdup(text);
+        char *actual = strdup(text);
+        double legacy = 0.0;
+        double single = 0.0;
+
+        legacy_sanitize_model_response(expected, "Astra", "gemma:2b", "gemma:2b");
+        sanitize_with_speaker(actual, "Astra", "gemma:2b", "gemma:2b");
+        if (strcmp(expected, actual) != 0) {
+            fprintf(stderr, "%s: output mismatch\n  legacy: %.80s\n  single: %.80s\n", cases[c].name, expected,
+                    actual);
+            failures++;
+        }
+
+        legacy = time_sanitizer(legacy_sanitize_model_response, text, iterations) * 1e6 / (double)iterations;
+        single = time_sanitizer(sanitize_with_speaker, text, iterations) * 1e6 / (double)iterations;
+        printf("%-20s %10zu %14.2f %14.2f %7.1fx\n", cases[c].name, length, legacy, single, legacy / single);
+
+        free(expected);
+        free(actual);
+        free(cases[c].text);
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/* Checks for the model-affinity turn scheduler.
+ *
+ * Submits and releases tickets for one backend in a fixed order and checks which turns start: turns of
+ * the active model go first, a turn that has waited past the aging limit is not passed over, a renewed
+ * ticket keeps its slot only while no one else wants it, and a thread blocked in turn_scheduler_wait()
+ * is woken by the release that grants it. Run with `make check`. */
+#define AICHAT_NO_MAIN
+#include "../aichat.c"
+#include "check.h"
+
+static struct TurnTicket gemma_first;
+static struct TurnTicket llama;
+static struct TurnTicket gemma_second;
+
+static void scheduler_reset(int concurrency, long long aging_ms) {
+    memset(turn_scheduler.slots, 0, sizeof(turn_scheduler.slots));
+    turn_scheduler.enabled = 1;
+    turn_scheduler.model_concurrency = concurrency;
+    turn_scheduler.aging_ms = aging_ms;
+    memset(&gemma_first, 0, sizeof(gemma_first));
+    memset(&llama, 0, sizeof(llama));
+    memset(&gemma_second, 0, sizeof(gemma_second));
+    server_stats.model_swaps = 0;
+}
+
+static int granted(struct TurnTicket *ticket) {
+    return turn_scheduler_granted(ticket);
+}
+
+static void check_affinity(void) {
+    scheduler_reset(1, 3600000);
+    expect(turn_scheduler_submit(&gemma_first, "gemma:2b", 0) == 1, "first turn starts at once");
+    expect(turn_scheduler_submit(&llama, "llama3:8b", 0) == 0, "other model waits while the backend is busy");
+    expect(turn_scheduler_submit(&gemma_second, "gemma:2b", 0) == 0, "same model waits at concurrency 1");
+    expect(turn_scheduler_waiting() == 2, "two turns are queued");
+
+    turn_scheduler_leave(&gemma_first);
+    expect(granted(&gemma_second) && !granted(&llama), "later turn of the active model goes first");
+    turn_scheduler_leave(&gemma_second);
+    expect(granted(&llama), "other model starts once the backend is idle");
+    expect(server_stats.model_swaps == 1, "one model swap is counted");
+    turn_scheduler_leave(&llama);
+    expect(turn_scheduler_waiting() == 0, "queue is empty");
+}
+
+static void check_concurrency(void) {
+    scheduler_reset(2, 3600000);
+    expect(turn_scheduler_submit(&gemma_first, "gemma:2b", 0) == 1 &&
+               turn_scheduler_submit(&gemma_second, "gemma:2b", 0) == 1,
+           "two turns of the active model run at concurrency 2");
+    expect(turn_scheduler_submit(&llama, "llama3:8b", 0) == 0, "other model waits for both");
+    turn_scheduler_leave(&gemma_first);
+    expect(!granted(&llama), "other model still waits for the second turn");
+    turn_scheduler_leave(&gemma_second);
+    expect(granted(&llama), "other model starts after both finish");
+    turn_scheduler_leave(&llama);
+}
+
+static void check_aging(void) {
+    scheduler_reset(1, 0);
+    turn_scheduler_submit(&gemma_first, "gemma:2b", 0);
+    turn_scheduler_submit(&llama, "llama3:8b", 0);
+    turn_scheduler_submit(&gemma_second, "gemma:2b", 0);
+    turn_scheduler_leave(&gemma_first);
+    expect(granted(&llama) && !granted(&gemma_second), "aged turn is not passed over by the active model");
+    turn_scheduler_leave(&llama);
+    expect(granted(&gemma_second), "passed-over turn starts next");
+    turn_scheduler_leave(&gemma_second);
+}
+
+static void check_renewal(void) {
+    scheduler_reset(1, 3600000);
+    turn_scheduler_submit(&gemma_first, "gemma:2b", 0);
+    expect(turn_scheduler_submit(&gemma_first, "gemma:2b", 0) == 1 && turn_scheduler.slots[0].running == 1,
+           "renewed ticket keeps its slot when no one waits");
+    turn_scheduler_submit(&llama, "llama3:8b", 0);
+    expect(turn_scheduler_submit(&gemma_first, "gemma:2b", 0) == 1, "renewal is not held up by another model");
+    turn_scheduler_submit(&gemma_second, "gemma:2b", 0);
+    expect(turn_scheduler_submit(&gemma_first, "gemma:2b", 0) == 0 && granted(&gemma_second),
+           "renewal queues behind a waiting turn of the same model");
+    turn_scheduler_leave(&llama);
+    expect(turn_scheduler_waiting() == 1, "leaving while queued dequeues the ticket");
+    turn_scheduler_leave(&gemma_second);
+    expect(granted(&gemma_first), "requeued ticket starts next");
+    turn_scheduler_leave(&gemma_first);
+}
+
+static void *wait_for_llama(void *arg) {
+    (void)arg;
+    return (void *)(intptr_t)turn_scheduler_wait(&llama, -1);
+}
+
+static void check_wakeup(void) {
+    pthread_t waiter;
+    void *result = NULL;
+    long long start = 0;
+
+    scheduler_reset(1, 3600000);
+    turn_scheduler_submit(&gemma_first, "gemma:2b", 0);
+    turn_scheduler_submit(&llama, "llama3:8b", 0);
+    if (pthread_create(&waiter, NULL, wait_for_llama, NULL) != 0) {
+        expect(0, "waiter thread starts");
+        return;
+    }
+    usleep(50000);
+    start = monotonic_ms();
+    turn_scheduler_leave(&gemma_first);
+    pthread_join(waiter, &result);
+    expect(result == NULL && granted(&llama), "blocked waiter is granted by the release");
+    expect(monotonic_ms() - start < SCHEDULER_DISCONNECT_CHECK_MS / 2, "blocked waiter wakes without polling");
+    turn_scheduler_leave(&llama);
+}
+
+int main(void) {
+    expect(turn_scheduler_init() == 0, "grant condition uses the monotonic clock");
+    check_affinity();
+    check_concurrency();
+    check_aging();
+    check_renewal();
+    check_wakeup();
+
+    return check_result("scheduler_check");
+}
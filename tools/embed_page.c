@@ -0,0 +1,216 @@
+/* Build step that turns the UI page into a C header (run by `make`).
+ *
+ * Usage: embed_page [--no-compress] input.html output.h
+ *
+ * The page is minified conservatively: every line loses its indentation and trailing whitespace,
+ * blank lines are dropped, and whole-line // comments inside <script> are removed. Line breaks stay,
+ * so automatic semicolon insertion and single-line template literals behave as before. The header
+ * holds the minified page and, unless --no-compress is given, gzip and brotli versions of it as byte
+ * arrays with compile-time lengths, plus an ETag hashed from the minified bytes. The output depends
+ * only on the input, so rebuilding an unchanged page reproduces the same header and ETag. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+struct Bytes {
+    unsigned char *data;
+    size_t length;
+};
+
+static int read_file(const char *path, struct Bytes *out) {
+    FILE *file = fopen(path, "rb");
+    size_t capacity = 65536;
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    out->data = malloc(capacity);
+    out->length = 0;
+    while (out->data) {
+        size_t read = fread(out->data + out->length, 1, capacity - out->length, file);
+        out->length += read;
+        if (out->length < capacity) {
+            break;
+        }
+        capacity *= 2;
+        unsigned char *grown = realloc(out->data, capacity);
+        if (!grown) {
+            free(out->data);
+        }
+        out->data = grown;
+    }
+    if (!out->data || ferror(file)) {
+        fprintf(stderr, "Failed to read %s.\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+static int starts_with(const unsigned char *text, size_t length, const char *prefix) {
+    size_t prefix_length = strlen(prefix);
+    return length >= prefix_length && memcmp(text, prefix, prefix_length) == 0;
+}
+
+static int contains(const unsigned char *text, size_t length, const char *needle) {
+    size_t needle_length = strlen(needle);
+    for (size_t i = 0; i + needle_length <= length; ++i) {
+        if (memcmp(text + i, needle, needle_length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void minify(const struct Bytes *input, struct Bytes *out) {
+    size_t pos = 0;
+    int in_script = 0;
+
+    out->length = 0;
+    while (pos < input->length) {
+        const unsigned char *line = input->data + pos;
+        const unsigned char *newline = memchr(line, '\n', input->length - pos);
+        size_t length = newline ? (size_t)(newline - line) : input->length - pos;
+
+        pos += length + (newline ? 1 : 0);
+        while (length > 0 && (line[0] == ' ' || line[0] == '\t')) {
+            line++;
+            length--;
+        }
+        while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t' || line[length - 1] == '\r')) {
+            length--;
+        }
+        if (length == 0 || (in_script && starts_with(line, length, "//"))) {
+            continue;
+        }
+        if (contains(line, length, "<script")) {
+            in_script = 1;
+        }
+        if (contains(line, length, "</script>")) {
+            in_script = 0;
+        }
+        memcpy(out->data + out->length, line, length);
+        out->length += length;
+        out->data[out->length++] = '\n';
+    }
+}
+
+/* gzip with a zero timestamp and no file name, so the bytes depend only on the input. */
+static int compress_gzip(const struct Bytes *input, struct Bytes *out) {
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    out->length = deflateBound(&stream, (uLong)input->length);
+    out->data = malloc(out->length);
+    if (!out->data) {
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_in = input->data;
+    stream.avail_in = (uInt)input->length;
+    stream.next_out = out->data;
+    stream.avail_out = (uInt)out->length;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        return -1;
+    }
+    out->length = stream.total_out;
+    deflateEnd(&stream);
+    return 0;
+}
+
+static int compress_brotli(const struct Bytes *input, struct Bytes *out) {
+    out->length = BrotliEncoderMaxCompressedSize(input->length);
+    out->data = out->length ? malloc(out->length) : NULL;
+    if (!out->data) {
+        return -1;
+    }
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input->length,
+                               input->data, &out->length, out->data)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes name as a byte array; a trailing NUL (not counted in the length) lets the page double as a string. */
+static void write_array(FILE *out, const char *name, const struct Bytes *bytes) {
+    fprintf(out, "static const unsigned char %s[] = {", name);
+    for (size_t i = 0; i < bytes->length; ++i) {
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", bytes->data[i]);
+    }
+    fprintf(out, "\n    0x00\n};\n\n");
+}
+
+int main(int argc, char **argv) {
+    struct Bytes source = {0};
+    struct Bytes page = {0};
+    struct Bytes gzip = {0};
+    struct Bytes brotli = {0};
+    unsigned long long hash = 1469598103934665603ULL;
+    int compress = 1;
+    const char *input = NULL;
+    const char *output = NULL;
+    char temporary[4096];
+    FILE *out = NULL;
+
+    if (argc == 4 && strcmp(argv[1], "--no-compress") == 0) {
+        compress = 0;
+        input = argv[2];
+        output = argv[3];
+    } else if (argc == 3) {
+        input = argv[1];
+        output = argv[2];
+    } else {
+        fprintf(stderr, "Usage: %s [--no-compress] input.html output.h\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (read_file(input, &source) != 0) {
+        return EXIT_FAILURE;
+    }
+    page.data = malloc(source.length + 1);
+    if (!page.data) {
+        return EXIT_FAILURE;
+    }
+    minify(&source, &page);
+    for (size_t i = 0; i < page.length; ++i) {
+        hash = (hash ^ page.data[i]) * 1099511628211ULL;
+    }
+    if (compress && (compress_gzip(&page, &gzip) != 0 || compress_brotli(&page, &brotli) != 0)) {
+        fprintf(stderr, "Failed to compress %s.\n", input);
+        return EXIT_FAILURE;
+    }
+
+    /* Written next to the target and renamed, so an interrupted build never leaves a partial header. */
+    snprintf(temporary, sizeof(temporary), "%s.tmp", output);
+    out = fopen(temporary, "w");
+    if (!out) {
+        perror(temporary);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "/* Generated from %s by tools/embed_page. Do not edit. */\n\n", input);
+    fprintf(out, "#define PAGE_HTML_LENGTH %zu\n", page.length);
+    fprintf(out, "#define PAGE_GZIP_LENGTH %zu\n", gzip.length);
+    fprintf(out, "#define PAGE_BROTLI_LENGTH %zu\n", brotli.length);
+    fprintf(out, "#define PAGE_CONTENT_HASH \"%016llx\"\n\n", hash);
+    write_array(out, "page_html", &page);
+    write_array(out, "page_gzip", &gzip);
+    write_array(out, "page_brotli", &brotli);
+    if (fclose(out) != 0 || rename(temporary, output) != 0) {
+        perror(output);
+        remove(temporary);
+        return EXIT_FAILURE;
+    }
+
+    printf("Embedded %s: %zu bytes (%zu source, %zu gzip, %zu brotli).\n", input, page.length, source.length,
+           gzip.length, brotli.length);
+    return EXIT_SUCCESS;
+}